@@ -19,13 +19,14 @@
 -- IN THE SOFTWARE.
 
 -- The dxcluster extension for trx-control.  This can also be used for the
--- SOTA cluster.
+-- SOTA cluster, the Reverse Beacon Network, or a local skimmer.  Several
+-- feeds can be used at once, their spots are merged and spots of the same
+-- station from different feeds are notified only once.
 
 local log = require 'linux.sys.log'
 local socket = require 'linux.sys.socket'
 
 local config = ...
-local loggedIn = false;
 
 if trxd.verbose() > 0 then
 	log.syslog('notice', 'initializing the trx-control dxcluster extension')
@@ -33,95 +34,308 @@ end
 
 local cacheTime = config.cacheTime or 3600
 
-local conn = socket.connect(config.host, config.port)
+-- A spot of a station that has been spotted on the same frequency (within
+-- dupeWindow Hz) less than dupeTime seconds ago is not notified again.
+local dupeTime = config.dupeTime or 300
 
--- Spawn a data ready handler thread for the socket, it will call the
--- dataReady function whenever data arrives on the socket
+-- Reconnect after reconnectMin seconds, doubling up to reconnectMax
+local reconnectMin = config.reconnectMin or 5
+local reconnectMax = config.reconnectMax or 300
 
-trxd.signalInput(conn:socket(), 'dataReady')
+-- Connecting blocks the extension, give up after connectTimeout seconds
+local connectTimeout = config.connectTimeout or 5
 
-local login = 'login:'
-local deline = 'DX de ([%w/]+):%s+(%d+%p%d+)%s+([%w/]+) +([%w%s%p-]+)%s+(%d%d)(%d%d)Z'
+local login = { 'login:', 'call:' }
+local deline = 'DX de ([%w/%-#]+):%s+(%d+%p%d+)%s+([%w/]+) +([%w%s%p-]+)%s+(%d%d)(%d%d)Z'
 
--- Keep a cache of spots received, invalid entries that are older than
--- cacheTime.  If cacheTime is not set, if defaults to 3600 seconds, 1 hour.
+-- The feeds, either listed in sources or a single feed
+local sources = config.sources or {
+	{
+		host = config.host,
+		port = config.port,
+		callsign = config.callsign
+	}
+}
+
+-- Sources by file descriptor
+local connected = {}
+
+-- When the reconnect timer is due
+local timerDue
+
+-- Keep a cache of spots received, spots that are older than cacheTime
+-- are expired.  If cacheTime is not set, if defaults to 3600 seconds, 1 hour.
+-- At most cacheSize spots are kept, a spot of the same station within
+-- dupeWindow Hz replaces the earlier spot.
 
-local spots = {}
+local spots = trxd.spots.new(config.cacheSize or 10000, cacheTime,
+    config.dupeWindow or 1000)
 
-local function purgeSpots()
-	for k, v in pairs(spots) do
-		if (v.timestamp + cacheTime) < os.time() then
-			spots[k] = nil
+-- The mode, if the comment mentions it
+local modes = {
+	'CW', 'SSB', 'USB', 'LSB', 'AM', 'FM', 'RTTY', 'PSK31', 'PSK63',
+	'FT8', 'FT4', 'JT65', 'JT9', 'MSK144', 'JS8', 'SSTV', 'DV'
+}
+
+local function spotMode(message)
+	for word in string.gmatch(string.upper(message), '[%w]+') do
+		for _, mode in ipairs(modes) do
+			if word == mode then
+				return mode
+			end
 		end
 	end
 end
 
--- dataReady is called when new data from the cluster arrives
-function dataReady()
-	if not loggedIn then
-		local prompt = conn:readln(1000)
-		if prompt ~= nil and string.sub(prompt, 1, 6) == login then
-			conn:write(config.callsign .. '\n')
-			loggedIn = true
+-- Seconds between the time of the spot (UTC, minutes) and now
+local function spotDelay(hour, minute)
+	local now = os.date('!*t')
+	local delay = (now.hour * 3600 + now.min * 60 + now.sec)
+	    - (tonumber(hour) * 3600 + tonumber(minute) * 60)
+
+	return delay < 0 and delay + 86400 or delay
+end
+
+-- Connect to a source, the connection is retried with backoff if it fails
+local function connect(source)
+	local ok, conn = pcall(socket.connect, source.host, source.port,
+	    connectTimeout * 1000)
+
+	if not ok or conn == nil then
+		source.delay = math.min((source.delay or reconnectMin / 2) * 2,
+		    reconnectMax)
+		source.retry = os.time() + source.delay
+		log.syslog('warning', string.format('dxcluster: connecting to '
+		    .. '%s:%s failed, retrying in %d seconds', source.host,
+		    source.port, source.delay))
+		return false
+	end
+
+	source.conn = conn
+	source.fd = conn:socket()
+	source.loggedIn = false
+	source.buffer = ''
+	source.connects = (source.connects or 0) + 1
+	source.connected = os.time()
+	source.sessionSpots = 0
+	source.retry = nil
+	connected[source.fd] = source
+
+	-- Spawn a data ready handler thread for the socket, it will call the
+	-- dataReady function whenever data arrives on the socket
+	trxd.signalInput(source.fd, 'dataReady')
+	return true
+end
+
+-- Only the earliest reconnect timer is kept, later ones are ignored
+local function schedule(due)
+	if timerDue == nil or due < timerDue then
+		timerDue = due
+		trxd.timer(math.max(due - os.time(), 1), 'reconnect')
+	end
+end
+
+-- Try to reconnect the sources that are due, schedule the next attempt
+function reconnect()
+	local next
+
+	if timerDue ~= nil and os.time() < timerDue then
+		return
+	end
+	timerDue = nil
+
+	for _, source in ipairs(sources) do
+		if source.conn == nil and source.retry ~= nil
+		    and source.retry <= os.time() then
+			connect(source)
 		end
+		if source.retry ~= nil and (next == nil or source.retry < next)
+		    then
+			next = source.retry
+		end
+	end
+	if next ~= nil then
+		schedule(next)
+	end
+end
+
+local function disconnected(source)
+	log.syslog('warning', string.format('dxcluster: connection to %s:%s '
+	    .. 'lost', source.host, source.port))
+	connected[source.fd] = nil
+	source.conn:close()
+	source.conn = nil
+	source.fd = nil
+
+	-- Reconnect at once if the connection was up for a while
+	if os.time() - source.connected > reconnectMax then
+		source.delay = nil
+		source.retry = os.time()
 	else
-		local data = conn:readln()
-		if data ~= nil then
-			for spotter, frequency, spotted, message, hour, minute
-			    in string.gmatch(data, deline) do
-				local spot = {
-					spotter = spotter,
-					frequency = string.format('%d',
-					    (tonumber(frequency) or 0)
-					    * 1000),
-					spotted = spotted,
-					message = message,
-					time = string.format('%s:%s UTC',
-					    hour, minute)
-				}
-				spots[#spots + 1] = {
-					spot = spot,
-					timestamp = os.time()
-				}
-				local notification = {
-					[config.source or 'dxcluster'] = spot
-				}
-				trxd.notify(json.encode(notification))
-				purgeSpots()
+		source.delay = math.min((source.delay or reconnectMin / 2) * 2,
+		    reconnectMax)
+		source.retry = os.time() + source.delay
+	end
+	schedule(source.retry)
+end
+
+local function addSpot(source, spotter, frequency, spotted, message, hour,
+    minute)
+	local spot = {
+		spotter = spotter,
+		frequency = string.format('%d',
+		    (tonumber(frequency) or 0) * 1000),
+		spotted = spotted,
+		message = message,
+		time = string.format('%s:%s UTC', hour, minute),
+		source = source.name or source.host
+	}
+	spot.band = trxd.spots.band(spot.frequency)
+	spot.mode = spotMode(message)
+
+	-- The entity, continent, and position of the station from its prefix
+	local dxcc = trxd.cty.lookup(spotted)
+	if dxcc ~= nil then
+		spot.entity = dxcc.entity
+		spot.continent = dxcc.continent
+		spot.cqZone = dxcc.cqZone
+		spot.latitude = dxcc.latitude
+		spot.longitude = dxcc.longitude
+	end
+	dxcc = trxd.cty.lookup(spotter)
+	if dxcc ~= nil then
+		spot.spotterContinent = dxcc.continent
+	end
+
+	local delay = spotDelay(hour, minute)
+	source.spots = (source.spots or 0) + 1
+	source.sessionSpots = source.sessionSpots + 1
+	source.delayTotal = (source.delayTotal or 0) + delay
+	source.lastSpot = os.time()
+
+	local new, age = spots:add(spot)
+	if not new and age <= dupeTime then
+		source.duplicates = (source.duplicates or 0) + 1
+		return
+	end
+
+	local notification = {
+		[config.source or 'dxcluster'] = spot
+	}
+	trxd.notify(json.encode(notification), spot)
+end
+
+-- dataReady is called when new data from a source arrives.  Returning
+-- false stops the signal input of a connection that has been closed.
+-- The data is read as it is available and collected in a buffer per source,
+-- a partial line is kept until the rest of it arrives.
+function dataReady(fd)
+	local source = connected[fd]
+
+	if source == nil then
+		return false
+	end
+
+	local ok, data = pcall(source.conn.read, source.conn, 4096, 1000)
+	if not ok or data == nil then
+		disconnected(source)
+		return false
+	end
+	source.buffer = source.buffer .. data
+
+	if not source.loggedIn then
+		-- The login prompt is not terminated by a newline
+		for _, p in ipairs(login) do
+			if string.find(source.buffer, p, 1, true) then
+				local ok = pcall(source.conn.write, source.conn,
+				    (source.callsign or config.callsign) .. '\n')
+				if not ok then
+					disconnected(source)
+					return false
+				end
+				source.delay = nil
+				source.loggedIn = true
+				source.buffer = ''
+				return true
 			end
 		end
+		source.buffer = string.match(source.buffer, '[^\n]*$')
+		return true
+	end
+
+	local rest = 1
+	for line, pos in string.gmatch(source.buffer, '([^\n]*)\n()') do
+		for spotter, frequency, spotted, message, hour, minute
+		    in string.gmatch(line, deline) do
+			addSpot(source, spotter, frequency, spotted, message,
+			    hour, minute)
+		end
+		rest = pos
 	end
+	source.buffer = string.sub(source.buffer, rest)
+	return true
 end
 
+for _, source in ipairs(sources) do
+	connect(source)
+end
+reconnect()
+
 -- Return a list of spots in reverse order, i.e. newest spots first.
--- The optional parameter maxSlots can be used to limit the number of spots
--- returned.
+-- The optional parameter maxSpots can be used to limit the number of spots
+-- returned, band, mode, and maxAge (in seconds) to filter them.  With
+-- maxDistance (in km), only spots whose position is known and that are at
+-- most that far from the locator (or latitude and longitude) are returned.
 
 function getSpots(request)
-	local spotList = {}
-	local n = 0
+	return {
+		status = 'Ok',
+		spots = spots:query({
+			maxSpots = tonumber(request.maxSpots),
+			maxAge = tonumber(request.maxAge),
+			band = request.band,
+			mode = request.mode,
+			maxDistance = tonumber(request.maxDistance),
+			locator = request.locator or config.locator,
+			latitude = tonumber(request.latitude),
+			longitude = tonumber(request.longitude)
+		})
+	}
+end
 
-	local count = tonumber(request.maxSpots)
-	purgeSpots()
+-- Return the state of each source, the number of spots received and
+-- suppressed as duplicates, the spots per minute while connected, and the
+-- average delay of the spots in seconds.
 
-	table.sort(spots, function (a, b)
-			if a ~= nil and b ~= nil then
-				return a.timestamp > b.timestamp
-			else
-				return false
-			end
-		end)
+function getSources(request)
+	local list = {}
 
-	for k, v in pairs(spots) do
-		spotList[#spotList + 1] = v.spot
-		n = n + 1
-		if count ~= nil and n == count then
-			break
+	for _, source in ipairs(sources) do
+		local received = source.spots or 0
+		local rate = 0
+
+		if source.conn ~= nil and os.time() > source.connected then
+			rate = source.sessionSpots * 60
+			    / (os.time() - source.connected)
 		end
-	end
 
+		list[#list + 1] = {
+			name = source.name or source.host,
+			host = source.host,
+			port = source.port,
+			connected = source.conn ~= nil,
+			connects = source.connects or 0,
+			spots = received,
+			duplicates = source.duplicates or 0,
+			rate = rate,
+			delay = received > 0 and source.delayTotal / received
+			    or 0,
+			lastSpot = source.lastSpot
+			    and os.date('!%H:%M:%S', source.lastSpot) or nil
+		}
+	end
 	return {
 		status = 'Ok',
-		spots = spotList
+		sources = list
 	}
 end
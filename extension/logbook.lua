@@ -43,14 +43,101 @@ if trxd.verbose() > 0 then
 	log.syslog('notice', 'initializing the trx-control logbook extension')
 end
 
+-- The version of the database schema created by logbook.sql.  Version 2
+-- adds the DXCC entity, continent, and zones of a QSO, a database that has
+-- not been updated yet is used without them.
+local schemaVersion = 2
+local version
+
 local function setupDatabase()
 	if config.datestyle ~= nil then
 		local res <close> = db:exec(string.format(
 		    "set datestyle to '%s'", config.datestyle))
 	end
+
+	local res <close> = db:exec('select version from logbook.version')
+
+	version = 1
+	if res:status() == pgsql.PGRES_TUPLES_OK and res:ntuples() == 1 then
+		version = tonumber(res:getvalue(1, 1)) or 1
+	end
+	if version < schemaVersion then
+		log.syslog('err', string.format('logbook: the database schema '
+		    .. 'is version %d, run logbook.sql to update it to version '
+		    .. '%d, QSOs are logged without their DXCC entity', version,
+		    schemaVersion))
+	end
+end
+
+-- The stations worked are kept in memory so that dupes can be checked
+-- without querying the database.  worked[call][band][mode] is the number
+-- of QSOs, the band is e.g. '20m', or '' if the frequency is not known.
+-- entities holds the DXCC entities worked.  The index is loaded when the
+-- database is connected and updated by logQSO only, QSOs that are added
+-- to or changed in the database by other means are not seen until the
+-- extension reconnects to the database.
+local worked = {}
+local entities = {}
+
+-- Sideband QSOs count as SSB, whichever sideband was used
+local function qsoMode(mode)
+	mode = string.upper(mode or '')
+	if mode == 'USB' or mode == 'LSB' then
+		return 'SSB'
+	end
+	return mode
+end
+
+local function qsoBand(frequency)
+	return trxd.spots.band(tonumber(frequency) or 0) or ''
+end
+
+local function indexQSO(call, frequency, mode)
+	call = string.upper(call)
+
+	local bands = worked[call]
+	if bands == nil then
+		bands = {}
+		worked[call] = bands
+	end
+
+	local band = qsoBand(frequency)
+	local modes = bands[band]
+	if modes == nil then
+		modes = {}
+		bands[band] = modes
+	end
+
+	mode = qsoMode(mode)
+	modes[mode] = (modes[mode] or 0) + 1
+
+	local dxcc = trxd.cty.lookup(call)
+	if dxcc ~= nil then
+		entities[dxcc.entity] = true
+	end
 end
 
 -- Functions used internally by the logbook extension
+local function loadIndex()
+	worked = {}
+	entities = {}
+
+	local res <close> = db:exec([[
+	select call, frequency, mode
+	  from logbook.logbook
+	]])
+
+	if res:status() ~= pgsql.PGRES_TUPLES_OK then
+		log.syslog('err', 'logbook: can not load the QSOs: '
+		    .. res:errorMessage())
+		return
+	end
+	for tuple in res:tuples() do
+		local qso = tuple:copy()
+		indexQSO(qso.call, qso.frequency, qso.mode)
+	end
+end
+
 local function connectDatabase()
 	connStr = config.connStr or
 	    'dbname=trx-control fallback_application_name=logbook'
@@ -61,6 +148,7 @@ local function connectDatabase()
 		print('can not connect to database: ' .. db:errorMessage())
 	else
 		setupDatabase()
+		loadIndex()
 	end
 end
 
@@ -97,17 +185,50 @@ function logQSO(request)
 		}
 	end
 
-	local res <close> = db:execParams([[
+	if type(data.call) ~= 'string' then
+		return {
+			status = 'Failure',
+			reason = 'Invalid callsign'
+		}
+	end
+
+	-- The entity, continent, and zones from the prefix list, unless given
+	local dxcc = trxd.cty.lookup(data.call) or {}
+	local params = {
+		data.call, data.name, data.qsoStart, data.qsoEnd, data.qth,
+		data.locator, data.frequency, data.mode, data.operatorCall,
+		data.remarks, data.entity or dxcc.entity,
+		data.continent or dxcc.continent, data.cqZone or dxcc.cqZone,
+		data.ituZone or dxcc.ituZone
+	}
+	local query = [[
 	insert
 	  into logbook.logbook (call, name, qso_start, qso_end, qth, locator,
-				frequency, mode, operator_call, remarks)
+				frequency, mode, operator_call, remarks,
+				entity, continent, cq_zone, itu_zone)
 	values ($1, $2, $3::timestamptz, $4::timestamptz, $5, $6, $7::bigint,
-		$8, $9, $10)
-	]], data.call, data.name, data.qsoStart, data.qsoEnd, data.qth,
-	    data.locator, data.frequency, data.mode, data.operatorCall,
-	    data.remarks)
+		$8, $9, $10, $11, $12, $13::integer, $14::integer)
+	]]
+	local nparams = 14
+
+	-- A database that has not been updated lacks the DXCC columns
+	if version < 2 then
+		query = [[
+		insert
+		  into logbook.logbook (call, name, qso_start, qso_end, qth,
+					locator, frequency, mode,
+					operator_call, remarks)
+		values ($1, $2, $3::timestamptz, $4::timestamptz, $5, $6,
+			$7::bigint, $8, $9, $10)
+		]]
+		nparams = 10
+	end
+
+	local res <close> = db:execParams(query,
+	    table.unpack(params, 1, nparams))
 
 	if res:status() == pgsql.PGRES_COMMAND_OK then
+		indexQSO(data.call, data.frequency, data.mode)
 		return {
 			status = 'Ok',
 			message = 'QSO logged'
@@ -143,10 +264,18 @@ function lookupCallsign(request)
 		}
 	end
 
+	if type(data.callsign) ~= 'string' then
+		return {
+			status = 'Failure',
+			reason = 'Invalid callsign'
+		}
+	end
+
 	local res <close> = db:execParams([[
 	  select call, name, qso_start as qsoStart, qso_end as qsoEnd, qth,
 		 locator, frequency, mode, operator_call as operatorCall,
-		 remarks
+		 remarks, entity, continent, cq_zone as cqZone,
+		 itu_zone as ituZone
 	    from logbook.logbook
 	   where call ilike $1
 	order by qso_start
@@ -154,6 +283,133 @@ function lookupCallsign(request)
 
 	return {
 		status = 'Ok',
-		data = res:copy()
+		data = res:copy(),
+		dxcc = trxd.cty.lookup(data.callsign)
 	}
 end
+
+-- A QSO, or a spot, is a dupe if the station has been worked on the same
+-- band and mode.  Without a mode any mode counts, without a band or
+-- frequency any band.  QSOs logged without a frequency, or on a frequency
+-- outside the bands, count as worked on any band.
+local function isDupe(qso)
+	local call = qso.call or qso.spotted
+	local bands = type(call) == 'string' and worked[string.upper(call)]
+
+	if not bands then
+		return false
+	end
+
+	local band = qso.band
+	if band == nil and qso.frequency ~= nil then
+		band = qsoBand(qso.frequency)
+	end
+	if band == nil then
+		return true
+	end
+
+	local function workedOn(modes)
+		return modes ~= nil
+		    and (qso.mode == nil or modes[qsoMode(qso.mode)] ~= nil)
+	end
+
+	if band == '' then
+		for _, modes in pairs(bands) do
+			if workedOn(modes) then
+				return true
+			end
+		end
+		return false
+	end
+	return workedOn(bands[band]) or workedOn(bands[''])
+end
+
+local function workedCall(qso)
+	local call = qso.call or qso.spotted
+	if type(call) ~= 'string' then
+		return false
+	end
+	call = string.upper(call)
+
+	local result = {
+		call = call,
+		worked = worked[call] ~= nil,
+		qsos = 0,
+		bands = {},
+		modes = {}
+	}
+
+	local modes = {}
+	for band, bandModes in pairs(worked[call] or {}) do
+		if band ~= '' then
+			result.bands[#result.bands + 1] = band
+		end
+		for mode, count in pairs(bandModes) do
+			result.qsos = result.qsos + count
+			modes[mode] = true
+		end
+	end
+	for mode in pairs(modes) do
+		if mode ~= '' then
+			result.modes[#result.modes + 1] = mode
+		end
+	end
+	table.sort(result.bands)
+	table.sort(result.modes)
+
+	local dxcc = trxd.cty.lookup(call)
+	if dxcc ~= nil then
+		result.entity = dxcc.entity
+		result.newEntity = not entities[dxcc.entity]
+	end
+	return result
+end
+
+-- Apply a check to the request data, which is either a single QSO or a
+-- list of QSOs or spots
+local function check(request, f, single, list)
+	local data = request.data
+
+	if type(data) ~= 'table' then
+		return {
+			status = 'Failure',
+			reason = 'Missing request data'
+		}
+	end
+
+	if data[1] == nil then
+		if data.call == nil and data.spotted == nil then
+			return {
+				status = 'Failure',
+				reason = 'Missing callsign'
+			}
+		end
+		return {
+			status = 'Ok',
+			[single] = f(data)
+		}
+	end
+
+	local results = {}
+	for n, qso in ipairs(data) do
+		results[n] = type(qso) == 'table' and f(qso)
+	end
+	return {
+		status = 'Ok',
+		[list] = results
+	}
+end
+
+-- Check whether a QSO would be a dupe, data is a table with call (or
+-- spotted), band or frequency, and mode, or a list of such tables, e.g. the
+-- spots returned by the dxcluster extension.
+function checkDupe(request)
+	return check(request, isDupe, 'dupe', 'dupes')
+end
+
+-- Return whether, how often, and on which bands and modes stations have
+-- been worked and whether their DXCC entity is new.  The request data is
+-- the same as for checkDupe.
+function workedBefore(request)
+	return check(request, workedCall, 'station', 'stations')
+end
@@ -21,7 +21,7 @@
 -- This must be run by the owner of the logbook database against the logbook
 -- database that is being used.
 
-\set version 1
+\set version 2
 
 create schema if not exists logbook;
 
@@ -44,4 +44,11 @@ create table if not exists logbook.logbook (
 	remarks		text
 );
 
+-- Version 2: the DXCC entity, continent, and zones of the station worked
+alter table logbook.logbook add column if not exists entity text;
+alter table logbook.logbook add column if not exists continent text;
+alter table logbook.logbook add column if not exists cq_zone integer;
+alter table logbook.logbook add column if not exists itu_zone integer;
+
 insert into logbook.version values(:version) on conflict do nothing;
+update logbook.version set version = :version;
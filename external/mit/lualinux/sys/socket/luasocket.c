@@ -111,6 +111,39 @@ asreadln(int fd, char **ret, int ms)
 	return nread;
 }
 
+/* Connect a socket, giving up after ms milliseconds unless ms is negative */
+static int
+to_connect(int fd, const struct sockaddr *addr, socklen_t addrlen, int ms)
+{
+	struct pollfd p;
+	socklen_t len;
+	int flags, error;
+
+	if (ms < 0)
+		return connect(fd, addr, addrlen);
+
+	if ((flags = fcntl(fd, F_GETFL)) == -1
+	    || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+		return -1;
+
+	if (connect(fd, addr, addrlen) == -1) {
+		if (errno != EINPROGRESS)
+			return -1;
+
+		p.fd = fd;
+		p.events = POLLOUT;
+		p.revents = 0;
+		if (poll(&p, 1, ms) != 1)
+			return -1;
+
+		len = sizeof(error);
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len)
+		    || error)
+			return -1;
+	}
+	return fcntl(fd, F_SETFL, flags);
+}
+
 static int
 luanet_accept(lua_State *L)
 {
@@ -209,7 +242,7 @@ luanet_connect(lua_State *L)
 {
 	struct addrinfo hints, *res, *res0;
 	struct sockaddr_un addr;
-	int fd, error, *data;
+	int fd, error, timeout, *data;
 	char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
 	const char *port, *host;
 
@@ -229,6 +262,12 @@ luanet_connect(lua_State *L)
 	} else {
 		port = luaL_checkstring(L, 2);
 
+		/* An optional timeout in milliseconds for each address */
+		if (lua_gettop(L) > 2)
+			timeout = luaL_checkinteger(L, 3);
+		else
+			timeout = -1;
+
 		memset(&hints, 0, sizeof(hints));
 		hints.ai_socktype = SOCK_STREAM;
 		error = getaddrinfo(host, port, &hints, &res0);
@@ -246,13 +285,15 @@ luanet_connect(lua_State *L)
 			    res->ai_protocol);
 			if (fd < 0)
 				continue;
-			if (connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+			if (to_connect(fd, res->ai_addr, res->ai_addrlen,
+			    timeout) < 0) {
 				close(fd);
 				fd = -1;
 				continue;
 			}
 			break;
 		}
+		freeaddrinfo(res0);
 	}
 	if (fd < 0)
 		return luaL_error(L, "connection error");
@@ -300,7 +341,8 @@ luanet_print(lua_State *L)
 static int
 luanet_read(lua_State *L)
 {
-	size_t len, nread;
+	size_t len;
+	ssize_t nread;
 	int sock;
 	int timeout;
 	char *buf;
@@ -0,0 +1,675 @@
+/*
+ * Copyright (c) 2024 Marc Balmer HB9SSB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Convert between JSON and CBOR (RFC 8949).  Only the subset of CBOR that
+ * maps one-to-one to JSON is supported: maps with text keys, arrays, text
+ * strings, integers, floating point numbers, booleans, and null.  Tags are
+ * ignored.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trx-control.h"
+
+#define MAX_DEPTH	64
+
+struct cbuf {
+	unsigned char	*data;
+	size_t		 len;
+	size_t		 size;
+};
+
+static int
+grow(struct cbuf *b, size_t n)
+{
+	unsigned char *data;
+	size_t size;
+
+	if (b->len + n <= b->size)
+		return 0;
+	for (size = b->size ? b->size : 256; size < b->len + n; size *= 2)
+		;
+	if ((data = realloc(b->data, size)) == NULL)
+		return -1;
+	b->data = data;
+	b->size = size;
+	return 0;
+}
+
+static int
+put(struct cbuf *b, const void *data, size_t n)
+{
+	if (n == 0)
+		return 0;
+	if (grow(b, n))
+		return -1;
+	memcpy(b->data + b->len, data, n);
+	b->len += n;
+	return 0;
+}
+
+static int
+putc_(struct cbuf *b, unsigned char c)
+{
+	return put(b, &c, 1);
+}
+
+/* Length of the head of a data item with argument val */
+static size_t
+head_len(uint64_t val)
+{
+	if (val < 24)
+		return 1;
+	if (val <= 0xff)
+		return 2;
+	if (val <= 0xffff)
+		return 3;
+	if (val <= 0xffffffffULL)
+		return 5;
+	return 9;
+}
+
+static void
+encode_head(unsigned char *p, int major, uint64_t val)
+{
+	size_t n, len;
+
+	len = head_len(val);
+	switch (len) {
+	case 1:
+		p[0] = major << 5 | val;
+		return;
+	case 2:
+		p[0] = major << 5 | 24;
+		break;
+	case 3:
+		p[0] = major << 5 | 25;
+		break;
+	case 5:
+		p[0] = major << 5 | 26;
+		break;
+	default:
+		p[0] = major << 5 | 27;
+	}
+	for (n = len - 1; n > 0; n--, val >>= 8)
+		p[n] = val & 0xff;
+}
+
+static int
+put_head(struct cbuf *b, int major, uint64_t val)
+{
+	if (grow(b, 9))
+		return -1;
+	encode_head(b->data + b->len, major, val);
+	b->len += head_len(val);
+	return 0;
+}
+
+/*
+ * JSON to CBOR.  Maps and arrays are encoded with a definite length, the
+ * head is written once the number of elements is known.
+ */
+struct json {
+	const char	*p;
+	int		 depth;
+};
+
+static int json_value(struct json *, struct cbuf *);
+
+static void
+skip_ws(struct json *j)
+{
+	while (*j->p == ' ' || *j->p == '\t' || *j->p == '\n'
+	    || *j->p == '\r')
+		j->p++;
+}
+
+static int
+hex4(const char *p, unsigned int *cp)
+{
+	int n;
+
+	*cp = 0;
+	for (n = 0; n < 4; n++) {
+		*cp <<= 4;
+		if (p[n] >= '0' && p[n] <= '9')
+			*cp |= p[n] - '0';
+		else if (p[n] >= 'a' && p[n] <= 'f')
+			*cp |= p[n] - 'a' + 10;
+		else if (p[n] >= 'A' && p[n] <= 'F')
+			*cp |= p[n] - 'A' + 10;
+		else
+			return -1;
+	}
+	return 0;
+}
+
+static int
+put_utf8(struct cbuf *b, unsigned int cp)
+{
+	unsigned char u[4];
+	size_t n;
+
+	if (cp < 0x80) {
+		u[0] = cp;
+		n = 1;
+	} else if (cp < 0x800) {
+		u[0] = 0xc0 | cp >> 6;
+		u[1] = 0x80 | (cp & 0x3f);
+		n = 2;
+	} else if (cp < 0x10000) {
+		u[0] = 0xe0 | cp >> 12;
+		u[1] = 0x80 | (cp >> 6 & 0x3f);
+		u[2] = 0x80 | (cp & 0x3f);
+		n = 3;
+	} else {
+		u[0] = 0xf0 | cp >> 18;
+		u[1] = 0x80 | (cp >> 12 & 0x3f);
+		u[2] = 0x80 | (cp >> 6 & 0x3f);
+		u[3] = 0x80 | (cp & 0x3f);
+		n = 4;
+	}
+	return put(b, u, n);
+}
+
+/* Unescape a JSON string into a text string data item */
+static int
+json_string(struct json *j, struct cbuf *b)
+{
+	struct cbuf s;
+	unsigned int cp, lo;
+	int rv = -1;
+
+	memset(&s, 0, sizeof(s));
+	for (j->p++; *j->p != '"'; j->p++) {
+		if ((unsigned char)*j->p < 0x20)
+			goto done;
+		if (*j->p != '\\') {
+			if (putc_(&s, *j->p))
+				goto done;
+			continue;
+		}
+		switch (*++j->p) {
+		case '"':
+		case '\\':
+		case '/':
+			cp = *j->p;
+			break;
+		case 'b':
+			cp = '\b';
+			break;
+		case 'f':
+			cp = '\f';
+			break;
+		case 'n':
+			cp = '\n';
+			break;
+		case 'r':
+			cp = '\r';
+			break;
+		case 't':
+			cp = '\t';
+			break;
+		case 'u':
+			if (hex4(j->p + 1, &cp))
+				goto done;
+			j->p += 4;
+			if (cp >= 0xd800 && cp < 0xdc00 && j->p[1] == '\\'
+			    && j->p[2] == 'u' && !hex4(j->p + 3, &lo)
+			    && lo >= 0xdc00 && lo < 0xe000) {
+				cp = 0x10000 + ((cp - 0xd800) << 10)
+				    + (lo - 0xdc00);
+				j->p += 6;
+			}
+			break;
+		default:
+			goto done;
+		}
+		if (put_utf8(&s, cp))
+			goto done;
+	}
+	j->p++;
+	if (put_head(b, 3, s.len) == 0 && put(b, s.data, s.len) == 0)
+		rv = 0;
+done:
+	free(s.data);
+	return rv;
+}
+
+static int
+json_number(struct json *j, struct cbuf *b)
+{
+	const char *p;
+	char *end;
+	long long l;
+	double d;
+	float f;
+	unsigned char u[9];
+	uint64_t bits;
+	uint32_t fbits;
+	int n, integer = 1;
+
+	for (p = j->p; strchr("+-0123456789.eE", *p) != NULL && *p; p++)
+		if (*p == '.' || *p == 'e' || *p == 'E')
+			integer = 0;
+
+	if (integer) {
+		errno = 0;
+		l = strtoll(j->p, &end, 10);
+		if (end == p && errno == 0) {
+			j->p = p;
+			if (l >= 0)
+				return put_head(b, 0, l);
+			return put_head(b, 1, -1 - l);
+		}
+	}
+
+	d = strtod(j->p, &end);
+	if (end != p)
+		return -1;
+	j->p = p;
+
+	/* Use single precision if no precision is lost */
+	f = (float)d;
+	if ((double)f == d) {
+		memcpy(&fbits, &f, sizeof(fbits));
+		u[0] = 0xfa;
+		for (n = 4; n > 0; n--, fbits >>= 8)
+			u[n] = fbits & 0xff;
+		return put(b, u, 5);
+	}
+	memcpy(&bits, &d, sizeof(bits));
+	u[0] = 0xfb;
+	for (n = 8; n > 0; n--, bits >>= 8)
+		u[n] = bits & 0xff;
+	return put(b, u, 9);
+}
+
+/* Encode the elements of a map or array, then insert the head */
+static int
+json_container(struct json *j, struct cbuf *b, int major, char close)
+{
+	size_t start, count = 0, hl;
+
+	if (++j->depth > MAX_DEPTH)
+		return -1;
+
+	start = b->len;
+	j->p++;
+	skip_ws(j);
+	if (*j->p != close) {
+		for (;;) {
+			skip_ws(j);
+			if (major == 5) {
+				if (*j->p != '"' || json_string(j, b))
+					return -1;
+				skip_ws(j);
+				if (*j->p++ != ':')
+					return -1;
+				skip_ws(j);
+			}
+			if (json_value(j, b))
+				return -1;
+			count++;
+			skip_ws(j);
+			if (*j->p == ',') {
+				j->p++;
+				continue;
+			}
+			if (*j->p == close)
+				break;
+			return -1;
+		}
+	}
+	j->p++;
+
+	hl = head_len(count);
+	if (grow(b, hl))
+		return -1;
+	memmove(b->data + start + hl, b->data + start, b->len - start);
+	encode_head(b->data + start, major, count);
+	b->len += hl;
+	j->depth--;
+	return 0;
+}
+
+static int
+json_value(struct json *j, struct cbuf *b)
+{
+	skip_ws(j);
+	switch (*j->p) {
+	case '{':
+		return json_container(j, b, 5, '}');
+	case '[':
+		return json_container(j, b, 4, ']');
+	case '"':
+		return json_string(j, b);
+	case 't':
+		if (strncmp(j->p, "true", 4))
+			return -1;
+		j->p += 4;
+		return putc_(b, 0xf5);
+	case 'f':
+		if (strncmp(j->p, "false", 5))
+			return -1;
+		j->p += 5;
+		return putc_(b, 0xf4);
+	case 'n':
+		if (strncmp(j->p, "null", 4))
+			return -1;
+		j->p += 4;
+		return putc_(b, 0xf6);
+	default:
+		if (*j->p == '-' || (*j->p >= '0' && *j->p <= '9'))
+			return json_number(j, b);
+		return -1;
+	}
+}
+
+/* Returns a malloc'ed CBOR encoding of a JSON text, or NULL on error */
+unsigned char *
+trxd_json_to_cbor(const char *json, size_t *len)
+{
+	struct json j;
+	struct cbuf b;
+
+	j.p = json;
+	j.depth = 0;
+	memset(&b, 0, sizeof(b));
+	if (json_value(&j, &b))
+		goto fail;
+	skip_ws(&j);
+	if (*j.p != '\0')
+		goto fail;
+	*len = b.len;
+	return b.data;
+fail:
+	free(b.data);
+	return NULL;
+}
+
+/* CBOR to JSON */
+struct cbor {
+	const unsigned char	*p;
+	const unsigned char	*end;
+	int			 depth;
+};
+
+static int cbor_value(struct cbor *, struct cbuf *, int);
+
+static int
+puts_(struct cbuf *b, const char *s)
+{
+	return put(b, s, strlen(s));
+}
+
+/*
+ * Read the head of a data item.  Returns the additional information, which
+ * is 31 for indefinite lengths, or -1 on error.
+ */
+static int
+cbor_head(struct cbor *c, int *major, uint64_t *val)
+{
+	int info, n, len;
+
+	if (c->p >= c->end)
+		return -1;
+	*major = *c->p >> 5;
+	info = *c->p++ & 0x1f;
+	*val = info;
+	if (info < 24 || info == 31)
+		return info;
+	if (info > 27)
+		return -1;
+	len = 1 << (info - 24);
+	if (c->end - c->p < len)
+		return -1;
+	for (*val = 0, n = 0; n < len; n++)
+		*val = *val << 8 | *c->p++;
+	return info;
+}
+
+static int
+put_json_string(struct cbuf *b, const unsigned char *s, size_t len)
+{
+	char esc[8];
+	size_t n;
+
+	if (putc_(b, '"'))
+		return -1;
+	for (n = 0; n < len; n++) {
+		switch (s[n]) {
+		case '"':
+			if (puts_(b, "\\\""))
+				return -1;
+			break;
+		case '\\':
+			if (puts_(b, "\\\\"))
+				return -1;
+			break;
+		case '\n':
+			if (puts_(b, "\\n"))
+				return -1;
+			break;
+		case '\r':
+			if (puts_(b, "\\r"))
+				return -1;
+			break;
+		case '\t':
+			if (puts_(b, "\\t"))
+				return -1;
+			break;
+		default:
+			if (s[n] < 0x20) {
+				snprintf(esc, sizeof(esc), "\\u%04x", s[n]);
+				if (puts_(b, esc))
+					return -1;
+			} else if (putc_(b, s[n]))
+				return -1;
+		}
+	}
+	return putc_(b, '"');
+}
+
+/* Text strings, possibly in chunks if the length is indefinite */
+static int
+cbor_text(struct cbor *c, struct cbuf *b, int info, uint64_t len)
+{
+	struct cbuf s;
+	uint64_t chunk;
+	int major, rv = -1;
+
+	if (info != 31) {
+		if ((uint64_t)(c->end - c->p) < len)
+			return -1;
+		c->p += len;
+		return put_json_string(b, c->p - len, len);
+	}
+
+	memset(&s, 0, sizeof(s));
+	for (;;) {
+		if (c->p < c->end && *c->p == 0xff) {
+			c->p++;
+			break;
+		}
+		info = cbor_head(c, &major, &chunk);
+		if (info < 0 || info == 31 || major != 3
+		    || (uint64_t)(c->end - c->p) < chunk
+		    || put(&s, c->p, chunk))
+			goto done;
+		c->p += chunk;
+	}
+	rv = put_json_string(b, s.data, s.len);
+done:
+	free(s.data);
+	return rv;
+}
+
+static int
+put_double(struct cbuf *b, double d)
+{
+	char num[32];
+	int prec;
+
+	if (isnan(d) || isinf(d))
+		return puts_(b, "null");
+
+	/* The shortest representation that reads back as the same value */
+	for (prec = 15; prec <= 17; prec++) {
+		snprintf(num, sizeof(num), "%.*g", prec, d);
+		if (strtod(num, NULL) == d)
+			break;
+	}
+	return puts_(b, num);
+}
+
+static double
+half_to_double(uint16_t h)
+{
+	int exp = h >> 10 & 0x1f, mant = h & 0x3ff;
+	double d;
+
+	if (exp == 0)
+		d = ldexp(mant, -24);
+	else if (exp != 31)
+		d = ldexp(mant + 1024, exp - 25);
+	else
+		d = mant == 0 ? INFINITY : NAN;
+	return h & 0x8000 ? -d : d;
+}
+
+/* Maps and arrays, possibly with indefinite length */
+static int
+cbor_container(struct cbor *c, struct cbuf *b, int major, int info,
+    uint64_t count)
+{
+	uint64_t n;
+
+	if (++c->depth > MAX_DEPTH)
+		return -1;
+	if (putc_(b, major == 5 ? '{' : '['))
+		return -1;
+	for (n = 0; info == 31 || n < count; n++) {
+		if (info == 31) {
+			if (c->p >= c->end)
+				return -1;
+			if (*c->p == 0xff) {
+				c->p++;
+				break;
+			}
+		}
+		if (n > 0 && putc_(b, ','))
+			return -1;
+		if (major == 5) {
+			if (cbor_value(c, b, 1) || putc_(b, ':'))
+				return -1;
+		}
+		if (cbor_value(c, b, 0))
+			return -1;
+	}
+	c->depth--;
+	return putc_(b, major == 5 ? '}' : ']');
+}
+
+static int
+cbor_value(struct cbor *c, struct cbuf *b, int key)
+{
+	uint64_t val;
+	uint32_t fbits;
+	float f;
+	double d;
+	char num[24];
+	int major, info;
+
+	/* Tags, e.g. the self-describe tag, are ignored */
+	do {
+		if ((info = cbor_head(c, &major, &val)) < 0)
+			return -1;
+	} while (major == 6);
+
+	/* Map keys must be text strings */
+	if (key && major != 3)
+		return -1;
+
+	switch (major) {
+	case 0:
+		snprintf(num, sizeof(num), "%llu", (unsigned long long)val);
+		return puts_(b, num);
+	case 1:
+		if (val > INT64_MAX)
+			return put_double(b, -1.0 - (double)val);
+		snprintf(num, sizeof(num), "%lld", -1LL - (long long)val);
+		return puts_(b, num);
+	case 3:
+		return cbor_text(c, b, info, val);
+	case 4:
+	case 5:
+		return cbor_container(c, b, major, info, val);
+	case 7:
+		switch (info) {
+		case 20:
+			return puts_(b, "false");
+		case 21:
+			return puts_(b, "true");
+		case 22:
+		case 23:
+			return puts_(b, "null");
+		case 25:
+			return put_double(b, half_to_double(val));
+		case 26:
+			fbits = val;
+			memcpy(&f, &fbits, sizeof(f));
+			return put_double(b, f);
+		case 27:
+			memcpy(&d, &val, sizeof(d));
+			return put_double(b, d);
+		}
+		return -1;
+	default:
+		/* Byte strings have no JSON equivalent */
+		return -1;
+	}
+}
+
+/* Returns a malloc'ed JSON text for a CBOR data item, or NULL on error */
+char *
+trxd_cbor_to_json(const unsigned char *data, size_t len)
+{
+	struct cbor c;
+	struct cbuf b;
+
+	c.p = data;
+	c.end = data + len;
+	c.depth = 0;
+	memset(&b, 0, sizeof(b));
+	if (cbor_value(&c, &b, 0) || c.p != c.end || putc_(&b, '\0')) {
+		free(b.data);
+		return NULL;
+	}
+	return (char *)b.data;
+}
@@ -24,19 +24,50 @@
 
 #include <sys/socket.h>
 #include <sys/uio.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
 #include <errno.h>
+#include <limits.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <termios.h>
 #include <unistd.h>
 
 #include "trx-control.h"
 
+#ifndef IOV_MAX
+#define IOV_MAX		1024
+#endif
+
+/* Connect to a local trxd(8) over a Unix domain socket */
+static int
+trxd_connect_unix(const char *path)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "%s: path too long\n", path);
+		return -1;
+	}
+	strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* A host that starts with a slash is the path of a Unix domain socket */
 int
 trxd_connect(const char *host, const char *port)
 {
@@ -45,6 +76,9 @@ trxd_connect(const char *host, const char *port)
 	int fd, error;
 	char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
 
+	if (*host == '/')
+		return trxd_connect_unix(host);
+
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_socktype = SOCK_STREAM;
 	error = getaddrinfo(host, port, &hints, &res0);
@@ -120,41 +154,113 @@ trxd_readln(int fd)
 	}
 }
 
+/*
+ * Write all data described by an array of iovecs, the array is modified.
+ * Returns the number of bytes written or -1 on error.
+ */
+ssize_t
+trxd_writev(int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t nwritten, total = 0;
+	int n;
+
+	while (iovcnt > 0) {
+		nwritten = writev(fd, iov, iovcnt > IOV_MAX ? IOV_MAX : iovcnt);
+		if (nwritten == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		total += nwritten;
+		for (n = 0; n < iovcnt && (size_t)nwritten >= iov[n].iov_len;
+		    n++)
+			nwritten -= iov[n].iov_len;
+		iov += n;
+		iovcnt -= n;
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + nwritten;
+			iov->iov_len -= nwritten;
+		}
+	}
+	return total;
+}
+
 int
 trxd_writeln(int fd, char *buf)
 {
 	struct iovec iov[2];
-	ssize_t l, len, nwritten;
-	int nv;
-	char *crlf = "\n";
-
-	l = len = strlen(buf) + strlen(crlf);
 
 	iov[0].iov_base = buf;
 	iov[0].iov_len = strlen(buf);
-	iov[1].iov_base = crlf;
-	iov[1].iov_len = strlen(crlf);
+	iov[1].iov_base = "\n";
+	iov[1].iov_len = 1;
+
+	return trxd_writev(fd, iov, 2);
+}
 
-	nv = 2;
+/*
+ * Binary framing: each frame is a CBOR data item preceded by its length as
+ * a 32 bit unsigned integer in network byte order.
+ */
+static int
+readall(int fd, void *buf, size_t len)
+{
+	ssize_t n;
+	size_t nread;
 
-	do {
-		nwritten = writev(fd, iov, nv);
-		if (nwritten == -1)
+	for (nread = 0; nread < len; nread += n) {
+		n = read(fd, (char *)buf + nread, len - nread);
+		if (n == 0)
 			return -1;
-		if (nwritten < len) {
-			if (nwritten < (len - strlen(crlf))) {
-				iov[0].iov_base = &buf[nwritten];
-				iov[0].iov_len = strlen(iov[0].iov_base);
-			} else {
-				int n = len - nwritten;
-
-				iov[0].iov_base = &crlf[strlen(crlf) - n];
-				iov[0].iov_len = strlen(iov[0].iov_base);
-				nv = 1;
+		if (n == -1) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
 			}
+			return -1;
 		}
-		len -= nwritten;
-	} while (len > 0);
-	tcdrain(fd);
-	return l;
+	}
+	return 0;
+}
+
+void *
+trxd_readframe(int fd, size_t *len)
+{
+	unsigned char hdr[4];
+	void *buf;
+
+	if (readall(fd, hdr, sizeof(hdr)))
+		return NULL;
+	*len = (size_t)hdr[0] << 24 | hdr[1] << 16 | hdr[2] << 8 | hdr[3];
+	if (*len == 0 || *len > TRXD_MAX_FRAME)
+		return NULL;
+	if ((buf = malloc(*len)) == NULL)
+		return NULL;
+	if (readall(fd, buf, *len)) {
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+int
+trxd_writeframe(int fd, const void *buf, size_t len)
+{
+	struct iovec iov[2];
+	unsigned char hdr[4];
+
+	if (len > TRXD_MAX_FRAME)
+		return -1;
+
+	hdr[0] = len >> 24;
+	hdr[1] = len >> 16;
+	hdr[2] = len >> 8;
+	hdr[3] = len;
+
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = (void *)buf;
+	iov[1].iov_len = len;
+
+	return trxd_writev(fd, iov, 2);
 }
@@ -25,8 +25,83 @@
 #ifndef __TRX_CONTROL_H__
 #define __TRX_CONTROL_H__
 
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
 extern int trxd_connect(const char *, const char *);
 extern char *trxd_readln(int);
 extern int trxd_writeln(int, char *);
+extern ssize_t trxd_writev(int, struct iovec *, int);
+
+/*
+ * Binary framing.  A client that sends the CBOR self-describe tag as its
+ * first three bytes switches the connection to length-prefixed CBOR frames,
+ * trxd(8) echoes the tag to confirm.
+ */
+#define TRXD_CBOR_MAGIC		"\xd9\xd9\xf7"
+#define TRXD_CBOR_MAGIC_LEN	3
+#define TRXD_MAX_FRAME		(1024 * 1024)
+
+extern void *trxd_readframe(int, size_t *);
+extern int trxd_writeframe(int, const void *, size_t);
+extern char *trxd_cbor_to_json(const unsigned char *, size_t);
+extern unsigned char *trxd_json_to_cbor(const char *, size_t *);
+
+/*
+ * trxd(8) publishes the last known state of each transceiver in a POSIX
+ * shared memory object that local processes can map read-only.  Each slot
+ * is protected by a sequence counter which is odd while trxd(8) writes to
+ * the slot, readers retry until they got a consistent copy.
+ */
+#define TRXD_SHM_NAME		"/trxd"
+#define TRXD_SHM_MAGIC		0x74727864	/* "trxd" */
+#define TRXD_SHM_VERSION	1
+#define TRXD_SHM_SLOTS		32
+
+#define TRXD_NAMELEN		32
+#define TRXD_MODELEN		16
+
+/* Flags that tell which fields of a slot are valid */
+#define TRXD_STATE_USED		0x0001
+#define TRXD_STATE_FREQUENCY	0x0002
+#define TRXD_STATE_VFO_A	0x0004
+#define TRXD_STATE_VFO_B	0x0008
+#define TRXD_STATE_MODE		0x0010
+#define TRXD_STATE_PTT		0x0020
+#define TRXD_STATE_LOCK		0x0040
+
+typedef struct trxd_state {
+	uint32_t	flags;
+	char		name[TRXD_NAMELEN];
+	int64_t		frequency;	/* Hz */
+	int64_t		vfo_a;
+	int64_t		vfo_b;
+	char		mode[TRXD_MODELEN];
+	int32_t		ptt;
+	int32_t		lock;
+	int64_t		updated;	/* Milliseconds since the epoch */
+} trxd_state_t;
+
+struct trxd_shm_slot {
+	uint32_t	seq;
+	uint32_t	pad;
+	trxd_state_t	state;
+};
+
+typedef struct trxd_shm {
+	uint32_t		magic;
+	uint32_t		version;
+	uint32_t		nslots;
+	int32_t			pid;	/* Of the trxd(8) that writes */
+	struct trxd_shm_slot	slot[TRXD_SHM_SLOTS];
+} trxd_shm_t;
+
+extern trxd_shm_t *trxd_shm_open(void);
+extern void trxd_shm_close(trxd_shm_t *);
+extern int trxd_shm_read(trxd_shm_t *, int, trxd_state_t *);
+extern int trxd_shm_lookup(trxd_shm_t *, const char *, trxd_state_t *);
 
 #endif /* __TRX_CONTROL_H__ */
@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2024 Marc Balmer HB9SSB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Read the transceiver state that trxd(8) publishes in shared memory */
+
+#include <sys/mman.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trx-control.h"
+
+#define MAX_RETRIES	1000
+
+trxd_shm_t *
+trxd_shm_open(void)
+{
+	trxd_shm_t *shm;
+	int fd;
+
+	fd = shm_open(TRXD_SHM_NAME, O_RDONLY, 0);
+	if (fd == -1)
+		return NULL;
+	shm = mmap(NULL, sizeof(trxd_shm_t), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED)
+		return NULL;
+
+	if (shm->magic != TRXD_SHM_MAGIC || shm->version != TRXD_SHM_VERSION) {
+		munmap(shm, sizeof(trxd_shm_t));
+		errno = EPROTO;
+		return NULL;
+	}
+	return shm;
+}
+
+void
+trxd_shm_close(trxd_shm_t *shm)
+{
+	munmap(shm, sizeof(trxd_shm_t));
+}
+
+/*
+ * Copy the state in a slot.  Returns 0 if the slot is in use, -1 if it is
+ * not or if no consistent copy could be made (errno is set to EAGAIN).
+ */
+int
+trxd_shm_read(trxd_shm_t *shm, int n, trxd_state_t *state)
+{
+	struct trxd_shm_slot *slot;
+	uint32_t seq;
+	int retries;
+
+	if (n < 0 || (uint32_t)n >= shm->nslots || n >= TRXD_SHM_SLOTS) {
+		errno = EINVAL;
+		return -1;
+	}
+	slot = &shm->slot[n];
+
+	for (retries = 0; retries < MAX_RETRIES; retries++) {
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+		memcpy(state, &slot->state, sizeof(trxd_state_t));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) {
+			state->name[TRXD_NAMELEN - 1] = '\0';
+			state->mode[TRXD_MODELEN - 1] = '\0';
+			return state->flags & TRXD_STATE_USED ? 0 : -1;
+		}
+	}
+	errno = EAGAIN;
+	return -1;
+}
+
+/* Find the state of a transceiver by name */
+int
+trxd_shm_lookup(trxd_shm_t *shm, const char *name, trxd_state_t *state)
+{
+	int n;
+
+	for (n = 0; (uint32_t)n < shm->nslots && n < TRXD_SHM_SLOTS; n++)
+		if (!trxd_shm_read(shm, n, state)
+		    && !strcmp(state->name, name))
+			return 0;
+	errno = ENOENT;
+	return -1;
+}
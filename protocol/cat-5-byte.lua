@@ -37,9 +37,9 @@ local function setFrequency(driver, request, response)
 	response.frequency = request.frequency
 end
 
-local function getFrequency(driver, request, response)
-	trx.write('\x00\x00\x00\x00\x03')
-	local f = trx.read(5)
+-- The read frequency and mode command returns both in one reply
+local function getStatus(driver, request, response)
+	local f = trx.transact('\x00\x00\x00\x00\x03', { length = 5 })
 	if f ~= nil then
 		local frequency = trx.bcdToString(string.sub(f, 1, 4))
 		local modeCode = string.byte(string.sub(f, 5))
@@ -61,6 +61,10 @@ local function getFrequency(driver, request, response)
 	end
 end
 
+local function getFrequency(driver, request, response)
+	getStatus(driver, request, response)
+end
+
 local function setMode(driver, request, response)
 	local newMode = driver.validModes[request.mode]
 
@@ -75,8 +79,14 @@ local function setMode(driver, request, response)
 end
 
 local function getMode(driver, request, response)
-	trx.write('\x00\x00\x00\x00\x03')
-	local f = trx.read(5)
+	local f = trx.transact('\x00\x00\x00\x00\x03', { length = 5 })
+
+	if f == nil then
+		response.status = 'Failure'
+		response.reason = 'No reply from trx'
+		return
+	end
+
 	local m = string.byte(f, 5)
 
 	for k, v in pairs(driver.validModes) do
@@ -109,5 +119,6 @@ return {
 	setFrequency = setFrequency,
 	getFrequency = getFrequency,
 	getMode = getMode,
-	setMode = setMode
+	setMode = setMode,
+	getStatus = getStatus
 }
@@ -21,8 +21,7 @@
 -- Yaesu character delimited CAT protocol
 
 local function initialize(driver)
-	trx.write('ID;')
-	local reply = trx.read(7)
+	local reply = trx.transact('ID;', { terminator = ';' }) or ''
 
 	if trx.verbose() > 0 then
 		print('transceiver ID:', reply:sub(3, -2))
@@ -145,8 +144,13 @@ local function setFrequency(driver, request, response)
 end
 
 local function getFrequency(driver, request, response)
-	trx.write('FA;')
-	local reply = trx.read(12)
+	local reply = trx.transact('FA;', { terminator = ';' })
+
+	if reply == nil then
+		response.status = 'Failure'
+		response.reason = 'No reply from trx'
+		return
+	end
 	response.frequency = tonumber(string.sub(reply, 3, 11))
 end
 
@@ -176,6 +180,35 @@ local function setMode(driver, request, response)
 	end
 end
 
+-- Query frequency and main band mode in one go
+local function getStatus(driver, request, response)
+	local replies = {
+		trx.transact('FA;MD0;', { terminator = ';', frames = 2 })
+	}
+
+	for _, reply in ipairs(replies) do
+		local command = string.sub(reply, 1, 2)
+
+		if command == 'FA' then
+			response.frequency = tonumber(string.sub(reply, 3, 11))
+		elseif command == 'MD' then
+			local code = string.sub(reply, 4, 4)
+
+			for k, v in pairs(driver.validModes) do
+				if v == code then
+					response.mode = k
+					break
+				end
+			end
+		end
+	end
+
+	if response.frequency == nil then
+		response.status = 'Failure'
+		response.reason = 'No reply from trx'
+	end
+end
+
 local function getMode(driver, request, response, band)
 	local band = request.band
 	local bcode = '0'
@@ -184,8 +217,15 @@ local function getMode(driver, request, response, band)
 		bcode = '1'
 	end
 
-	trx.write(string.format('MD%s;', bcode))
-	local reply = trx.read(5)
+	local reply = trx.transact(string.format('MD%s;', bcode),
+	    { terminator = ';' })
+
+	if reply == nil then
+		response.status = 'Failure'
+		response.reason = 'No reply from trx'
+		return
+	end
+
 	local mode = string.sub(reply, 4, 4)
 
 	for k, v in pairs(driver.validModes) do
@@ -217,5 +257,6 @@ return {
 	setFrequency = setFrequency,
 	getFrequency = getFrequency,
 	getMode = getMode,
-	setMode = setMode
+	setMode = setMode,
+	getStatus = getStatus
 }
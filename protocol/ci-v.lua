@@ -26,31 +26,29 @@ local internalMode = {}
 local controllerAddress = 0xe0
 local transceiverAddress = 0xa4
 
-local function sendMessage(cn, sc, data)
-	local message = string.format('\xfe\xfe%c%c%s', transceiverAddress,
-	    controllerAddress, cn)
-
-	if sc ~= nil then
-		message = message .. sc
-	end
-
-	if data ~= nil then
-		message = message .. data
+-- Send a command and return the command and data of the reply
+local function transact(cn, data)
+	local message = trx.codec.civFrame(transceiverAddress,
+	    controllerAddress, cn, data)
+
+	-- Only accept frames from the transceiver to us, this drops the
+	-- echo of our own command on the CI-V bus.  Transceive broadcasts
+	-- received meanwhile are passed on to handleStatusUpdates.
+	local reply = trx.transact(message, {
+		civ = true,
+		from = transceiverAddress,
+		to = controllerAddress,
+		broadcast = 0x00
+	})
+
+	if reply ~= nil then
+		local to, from, command, data = trx.codec.civParse(reply)
+		return command, data
 	end
-
-	message = message .. '\xfd'
-
-	trx.write(message)
 end
 
-local function recvReply()
-	local reply = trx.read(6)
-
-	if string.byte(reply, 5) == 0xfb then
-		return true
-	else
-		return false
-	end
+local function isOk(command)
+	return command == 0xfb
 end
 
 -- Exported functions
@@ -79,11 +77,10 @@ local function setFrequency(driver, request, response)
 
 	response.frequency = request.frequency
 
-	local freq = string.sub(string.format('%010d', request.frequency), 1, -1)
-	local bcd = string.reverse(trx.stringToBcd(freq))
+	local bcd = trx.codec.bcdPack(string.format('%010d', request.frequency),
+	    true)
 
-	sendMessage('\x05', nil, bcd)
-	if recvReply() ~= true then
+	if not isOk(transact(0x05, bcd)) then
 		response.status = 'Failure'
 		response.reason = 'No reply from trx'
 		response.state = 'Frequency not set'
@@ -93,17 +90,20 @@ local function setFrequency(driver, request, response)
 end
 
 local function getFrequency(driver, request, response)
-	sendMessage('\x03')
-	local reply = trx.read(11)
+	local command, data = transact(0x03)
 
-	response.frequency =
-	    tonumber(trx.bcdToString(string.reverse(string.sub(reply, 6, -2))))
+	if command ~= 0x03 then
+		response.status = 'Failure'
+		response.reason = 'No reply from trx'
+		return
+	end
 
-	sendMessage('\x04')
-	reply = trx.read(8)
+	response.frequency = tonumber(trx.codec.bcdUnpack(data, true))
 
-	local mode = string.byte(reply, 6)
-	response.mode = internalMode[mode] or '??'
+	command, data = transact(0x04)
+	if command == 0x04 then
+		response.mode = internalMode[string.byte(data, 1)] or '??'
+	end
 end
 
 local function setMode(driver, request, response)
@@ -115,11 +115,10 @@ local function setMode(driver, request, response)
 	if driver.validModes[mode] == nil then
 		response.status = 'Failure'
 		response.reason = 'Unknown mode'
+		return
 	end
 
-	local data = string.char(driver.validModes[mode])
-	sendMessage('\x01', nil, data)
-	if (recvReply == true) then
+	if isOk(transact(0x06, string.char(driver.validModes[mode]))) then
 		response.state = 'mode set'
 	else
 		response.status = 'Failure'
@@ -129,12 +128,56 @@ local function setMode(driver, request, response)
 end
 
 local function getMode(driver, request, response)
-	sendMessage('\x04')
-	local reply = trx.read(8)
+	local command, data = transact(0x04)
+
+	if command ~= 0x04 then
+		response.status = 'Failure'
+		response.reason = 'No reply from trx'
+		return
+	end
+
+	response.mode = internalMode[string.byte(data, 1)] or '??'
+end
+
+-- Commands are not chained, a second command could collide with the reply
+-- to the first one on the CI-V bus
+local function getStatus(driver, request, response)
+	getFrequency(driver, request, response)
+end
+
+-- With CI-V transceive enabled, the transceiver broadcasts frequency and
+-- mode changes on its own.  Frames end with 0xfd.
+local function startStatusUpdates(driver)
+	return 0xfd
+end
+
+local function handleStatusUpdates(driver, data)
+	-- Skip collisions before the preamble
+	local start = string.find(data, '\xfe\xfe', 1, true)
+
+	if start == nil then
+		return nil
+	end
 
-	local mode = string.byte(reply, 6)
+	local to, from, cn, payload = trx.codec.civParse(string.sub(data, start))
 
-	response.mode = internalMode[mode] or '??'
+	-- Only accept frames from the transceiver, broadcast or to us.  This
+	-- drops the echo of our own commands and traffic of other stations.
+	if to == nil or from ~= transceiverAddress
+	    or (to ~= 0x00 and to ~= controllerAddress) then
+		return nil
+	end
+
+	if (cn == 0x00 or cn == 0x03) and #payload > 0 then
+		return {
+			frequency = tonumber(trx.codec.bcdUnpack(payload, true))
+		}
+	elseif (cn == 0x01 or cn == 0x04) and #payload > 0 then
+		return {
+			mode = internalMode[string.byte(payload, 1)] or '??'
+		}
+	end
+	return nil
 end
 
 return {
@@ -151,15 +194,16 @@ return {
 	ctcssModes = {},
 	statusUpdatesRequirePolling = true,
 	initialize = initialize,
-	startStatusUpdates = nil,
+	startStatusUpdates = startStatusUpdates,
 	stopStatusUpdates = nil,
-	handleStatusUpdates = nil,
+	handleStatusUpdates = handleStatusUpdates,
 	setLock = setLock,
 	setUnlock = setUnlock,
 	setFrequency = setFrequency,
 	getFrequency = getFrequency,
 	getMode = getMode,
 	setMode = setMode,
+	getStatus = getStatus,
 	getPtt = nil,
 	setPtt = nil
 }
@@ -29,6 +29,20 @@ local function sendMessage(data)
 	trx.write(message)
 end
 
+-- Send one or more queries and return the answers, which are terminated
+-- by a semicolon
+local function query(data, ...)
+	local message = data .. ';'
+
+	for _, v in ipairs({...}) do
+		message = message .. v .. ';'
+	end
+	return trx.transact(message, {
+		terminator = ';',
+		frames = select('#', ...) + 1
+	})
+end
+
 -- Exported functions
 local function initialize(driver)
 	print (driver.name .. ': initialize')
@@ -55,17 +69,27 @@ local function setFrequency(driver, request, response)
 	sendMessage(data)
 end
 
-local function getFrequency(driver, request, response)
-	sendMessage('FA')
-	local reply = trx.read(14)
-	local freq = string.sub(reply, 3, 13)
+-- Frequency and mode are queried in one go
+local function getStatus(driver, request, response)
+	for _, reply in ipairs({ query('FA', 'MD') }) do
+		local command = string.sub(reply, 1, 2)
+
+		if command == 'FA' then
+			response.frequency = tonumber(string.sub(reply, 3, 13))
+		elseif command == 'MD' then
+			local mode = string.sub(reply, 3, 3)
+			response.mode = internalMode[tonumber(mode)] or '??'
+		end
+	end
 
-	sendMessage('MD')
-        reply = trx.read(4)
-        local mode = string.sub(reply, 3,3 )
+	if response.frequency == nil then
+		response.status = 'Failure'
+		response.reason = 'No reply from trx'
+	end
+end
 
-	response.frequency = tonumber(freq)
-	response.mode = internalMode[tonumber(mode)] or '??'
+local function getFrequency(driver, request, response)
+	getStatus(driver, request, response)
 end
 
 
@@ -84,10 +108,15 @@ local function setMode(driver, request, response, band, mode)
 end
 
 local function getMode(driver, request, response)
-	sendMessage('MD')
-	local reply = trx.read(4)
-        local mode = string.sub(reply,3,3)
+	local reply = query('MD')
+
+	if reply == nil then
+		response.status = 'Failure'
+		response.reason = 'No reply from trx'
+		return
+	end
 
+	local mode = string.sub(reply, 3, 3)
 	response.mode = internalMode[tonumber(mode)]
 end
 
@@ -110,5 +139,6 @@ return {
 	setFrequency = setFrequency,
 	getFrequency = getFrequency,
 	getMode = getMode,
-	setMode = setMode
+	setMode = setMode,
+	getStatus = getStatus
 }
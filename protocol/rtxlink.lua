@@ -20,36 +20,22 @@
 
 -- OpenRTX RTXLink protocol (http://openrtx.org/#/rtxlink)
 
-local function slipWrite(s)
-	trx.write(string.format('\xc0%s\xc0',
-	    s:gsub('\xc0', '\xc0\xdc'):gsub('\xdb', '\xdb\xdd')))
-end
-
-local function slipRead(nbytes)
-	local rawData = trx.read(nbytes)
-	local decodedData = ''
-
-	repeat
-		local data, n = rawData:gsub('\xc0\xdc', '\xc0')
-		local data, m = data:gsub('\xdb\xdd', '\xdb')
-		decodedData = decodedData .. data
-		local missingBytes = n + m
-
-		if missingBytes > 0 then
-			rawData = trx.read(missingBytes)
-		end
-	until missingBytes == 0
-
-	return decodedData
+-- Send a SLIP encoded request and return the decoded reply frame, which
+-- starts with the protocol identifier and ends with the CRC
+local function transact(payload)
+	local frame = trx.codec.slipEncode(payload .. trx.codec.crc16(payload))
+
+	return trx.transact(frame, {
+		slip = true,
+		timeout = 1000
+	})
 end
 
 local function initialize(driver)
 	print('initialize', driver.name)
-	local payload = '\x01GIN'
-	slipWrite(payload .. trx.crc16(payload))
-	if trx.waitForData(1000) then
-		local resp = slipRead(19)
-		print('OpenRTX device ID', resp:sub(4, -4))
+	local resp = transact('\x01GIN')
+	if resp ~= nil then
+		print('OpenRTX device ID', resp:sub(3, -3))
 	else
 		print('Could not retrieve OpenRTX device ID')
 	end
@@ -75,22 +61,15 @@ local function setFrequency(driver, request, response)
 	local payload = string.format('\x01SRF%s',
 	     string.char(byte1, byte2, byte3, byte4))
 
-	slipWrite(payload .. trx.crc16(payload))
-
-	if trx.waitForData(1000) then
-		local ack = slipRead(8)
-	end
+	transact(payload)
 end
 
 local function getFrequency(driver, request, response)
-	local payload = '\x01GRF'
-	slipWrite(payload .. trx.crc16(payload))
-	if trx.waitForData(1000) then
-		local resp = slipRead(10)
-
-		local frequency = resp:byte(7) * 16777216 +
-		    resp:byte(6) * 65536 +
-		    resp:byte(5) * 256 + resp:byte(4)
+	local resp = transact('\x01GRF')
+	if resp ~= nil then
+		local frequency = resp:byte(6) * 16777216 +
+		    resp:byte(5) * 65536 +
+		    resp:byte(4) * 256 + resp:byte(3)
 
 		response.frequency = frequency
 	else
@@ -120,10 +99,7 @@ local function setMode(driver, request, response)
 	end
 
 	local payload = string.format('\x01SOM%c', newmode)
-	slipWrite(payload .. trx.crc16(payload))
-	if trx.waitForData(1000) then
-		local resp = slipRead(6)
-	else
+	if transact(payload) == nil then
 		response.status = 'Failure'
 		response.reason = 'No response from trx'
 	end
@@ -131,14 +107,10 @@ local function setMode(driver, request, response)
 end
 
 local function getMode(driver, request, response)
-	local payload = '\x01GOM'
-	slipWrite(payload .. trx.crc16(payload))
-	if trx.waitForData(1000) then
-		local name = 'unknown mode'
-		local resp = slipRead(6)
-
+	local resp = transact('\x01GOM')
+	if resp ~= nil then
 		local operatingMode = 'none'
-		local opmode = tonumber(string.byte(resp, 4))
+		local opmode = tonumber(string.byte(resp, 3))
 
 		for k, v in pairs(modes) do
 			if v == opmode then
@@ -153,6 +125,14 @@ local function getMode(driver, request, response)
 	end
 end
 
+-- RTXLink handles one request at a time
+local function getStatus(driver, request, response)
+	getFrequency(driver, request, response)
+	if response.status ~= 'Failure' then
+		getMode(driver, request, response)
+	end
+end
+
 local function setPtt(driver, request, response)
 
 	response.ptt = request.ptt
@@ -162,22 +142,16 @@ local function setPtt(driver, request, response)
 	end
 
 	local payload = string.format('\x01SPT%c', opstatus)
-	slipWrite(payload .. trx.crc16(payload))
-	if trx.waitForData(1000) then
-		local resp = slipRead(6)
-	else
+	if transact(payload) == nil then
 		response.status = 'Failure'
 		response.reason = 'No answer from trx'
 	end
 end
 
 local function getPtt(driver, request, response)
-	local payload = '\x01GPT'
-	slipWrite(payload .. trx.crc16(payload))
-	if trx.waitForData(1000) then
-		local resp = slipRead(6)
-
-		response.ptt = tonumber(string.byte(resp, 4)) == 0x02
+	local resp = transact('\x01GPT')
+	if resp ~= nil then
+		response.ptt = tonumber(string.byte(resp, 3)) == 0x02
 		    and 'on' or 'off'
 	else
 		response.status = 'Failure'
@@ -189,11 +163,7 @@ local function setCallsign(driver, request, response)
 	response.callsign = request.callsign
 
 	local payload = string.format('\x01SMC%-10s', request.callsign)
-	slipWrite(payload .. trx.crc16(payload))
-
-	if trx.waitForData(1000) then
-		local resp = slipRead(6)
-	else
+	if transact(payload) == nil then
 		response.status = 'Failure'
 		response.reason = 'No answer from trx'
 	end
@@ -204,12 +174,9 @@ end
 local function getCallsign(driver, request, response)
 	response.callsign = request.callsign
 
-	local payload = '\x01GMC'
-	slipWrite(payload .. trx.crc16(payload))
-
-	if trx.waitForData(1000) then
-		local resp = slipRead(16)
-		response.callsign = resp:sub(4, -4)
+	local resp = transact('\x01GMC')
+	if resp ~= nil then
+		response.callsign = resp:sub(3, -3)
 	else
 		response.status = 'Failure'
 		response.reason = 'No answer from trx'
@@ -222,23 +189,16 @@ end
 local function setDestination(driver, request, response)
 	response.callsign = request.callsign
 	local payload = string.format('\x01SMD%-10s', request.callsign)
-	slipWrite(payload .. trx.crc16(payload))
-
-	if trx.waitForData(1000) then
-		local resp = slipRead(6)
-	else
+	if transact(payload) == nil then
 		response.status = 'Failure'
 		response.reason = 'No answer from trx'
 	end
 end
 
 local function getDestination(driver, request, response)
-	local payload = '\x01GMD'
-	slipWrite(payload .. trx.crc16(payload))
-
-	if trx.waitForData(1000) then
-		local resp = slipRead(16)
-		response.callsign = resp:sub(4, -4)
+	local resp = transact('\x01GMD')
+	if resp ~= nil then
+		response.callsign = resp:sub(3, -3)
 	else
 		response.status = 'Failure'
 		response.reason = 'No answer from trx'
@@ -273,6 +233,7 @@ return {
 	getFrequency = getFrequency,
 	getMode = getMode,
 	setMode = setMode,
+	getStatus = getStatus,
 	getPtt = getPtt,
 	setPtt = setPtt,
 	getCallsign = getCallsign,
@@ -66,7 +66,12 @@ end
 
 local function getMode(driver, request, response, band)
 	print (driver.name .. ': get mode')
-	reponse.mode = mode
+	response.mode = mode
+end
+
+local function getStatus(driver, request, response)
+	response.frequency = frequency
+	response.mode = mode
 end
 
 return {
@@ -88,5 +93,6 @@ return {
 	setFrequency = setFrequency,
 	getFrequency = getFrequency,
 	getMode = getMode,
-	setMode = setMode
+	setMode = setMode,
+	getStatus = getStatus
 }
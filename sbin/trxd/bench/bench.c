@@ -0,0 +1,284 @@
+/*
+ * Copyright (c) 2014 - 2024 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+/*
+ * Microbenchmark host: run a Lua script with trx.codec available as codec
+ * and the implementations it replaced, taken from luatrx.c, as old.  The
+ * CBOR conversions of libtrx-control are available as cbor, luajson as
+ * json.  With -c, a cty.dat file is loaded and trxd.cty is available as
+ * well, plus native.ctyLookup to time cty_lookup() without the Lua binding.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include "cty.h"
+#include "trx-control.h"
+
+extern int luaopen_json(lua_State *);
+extern int luaopen_trx_codec(lua_State *);
+extern int luaopen_trxd_cty(lua_State *);
+
+cty_t cty;
+
+static int
+old_bcd_to_string(lua_State *L)
+{
+	unsigned char *bcd_string, *string, *p;
+	size_t len;
+	int n;
+
+	bcd_string = (unsigned char *)luaL_checklstring(L, 1, &len);
+	string = p = malloc(len * 2 + 1);
+	for (n = 0; n < len; n++, bcd_string++) {
+		*p++ = '0' + (*bcd_string >> 4);
+		*p++ = '0' + (*bcd_string & 0x0f);
+	}
+	*p = '\0';
+	lua_pushstring(L, (char *)string);
+	free(string);
+	return 1;
+}
+
+static int
+old_string_to_bcd(lua_State *L)
+{
+	unsigned char *bcd_string, *string, *p;
+	size_t len;
+	int n;
+
+	string = (unsigned char *)luaL_checklstring(L, 1, &len);
+	bcd_string = p = malloc(len + 1);
+	for (n = 0; n < len / 2; n++, string += 2)
+		*p++ = (string[0] - '0') << 4 | (string[1] & 0x0f);
+	*p = '\0';
+
+	lua_pushlstring(L, (char *)bcd_string, len / 2);
+	free(bcd_string);
+	return 1;
+}
+
+static int
+old_crc16(lua_State *L)
+{
+	void const *data;
+	size_t len, i;
+	uint16_t x, crc;
+	const uint8_t *buf;
+	char crc_out[2];
+
+	x = 0;
+	crc = 0x1d0f;
+	data = luaL_checklstring(L, 1, &len);
+	buf = ((const uint8_t *) data);
+
+	for(i = 0; i < len; i++) {
+		x = (crc >> 8) ^ buf[i];
+		x ^= x >> 4;
+		crc = (crc << 8) ^ (x << 12) ^ (x << 5) ^ x;
+	}
+	crc_out[0] = crc & 0xff;
+	crc_out[1] = (crc >> 8) & 0xff;
+	lua_pushlstring(L, crc_out, 2);
+	return 1;
+}
+
+/* The SLIP framing of trx.transact, applied to a string */
+static int
+old_slip_decode(lua_State *L)
+{
+	luaL_Buffer b;
+	unsigned char *p, *data, *end;
+	size_t len;
+
+	data = (unsigned char *)luaL_checklstring(L, 1, &len);
+	for (p = data; p < data + len && *p == 0xc0; p++)
+		;
+	end = memchr(p, 0xc0, data + len - p);
+	if (end == NULL)
+		return 0;
+
+	luaL_buffinit(L, &b);
+	for (; p < end; p++) {
+		if (*p == 0xdb && p + 1 < end) {
+			p++;
+			if (*p == 0xdc)
+				luaL_addchar(&b, 0xc0);
+			else if (*p == 0xdd)
+				luaL_addchar(&b, 0xdb);
+			else
+				luaL_addchar(&b, *p);
+		} else
+			luaL_addchar(&b, *p);
+	}
+	luaL_pushresult(&b);
+	return 1;
+}
+
+/* JSON text to CBOR, as done for each message sent to a CBOR client */
+static int
+cbor_encode(lua_State *L)
+{
+	unsigned char *data;
+	size_t len;
+
+	data = trxd_json_to_cbor(luaL_checkstring(L, 1), &len);
+	if (data == NULL)
+		return luaL_error(L, "invalid JSON");
+	lua_pushlstring(L, (char *)data, len);
+	free(data);
+	return 1;
+}
+
+/* CBOR to JSON text, as done for each message received from a CBOR client */
+static int
+cbor_decode(lua_State *L)
+{
+	const char *data;
+	char *json;
+	size_t len;
+
+	data = luaL_checklstring(L, 1, &len);
+	json = trxd_cbor_to_json((const unsigned char *)data, len);
+	if (json == NULL)
+		return luaL_error(L, "invalid CBOR");
+	lua_pushstring(L, json);
+	free(json);
+	return 1;
+}
+
+/* Look up a list of callsigns n times, return the number found */
+static int
+native_cty_lookup(lua_State *L)
+{
+	const char **calls;
+	lua_Integer found, n, rounds;
+	size_t len;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	rounds = luaL_optinteger(L, 2, 1);
+	len = luaL_len(L, 1);
+	calls = lua_newuserdatauv(L, len * sizeof(char *), 0);
+	for (n = 0; n < len; n++) {
+		lua_rawgeti(L, 1, n + 1);
+		calls[n] = luaL_checkstring(L, -1);
+		lua_pop(L, 1);
+	}
+
+	found = 0;
+	while (rounds-- > 0)
+		for (n = 0; n < len; n++)
+			if (cty_lookup(&cty, calls[n]) != NULL)
+				found++;
+	lua_pushinteger(L, found);
+	return 1;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct luaL_Reg old[] = {
+		{ "bcdToString",	old_bcd_to_string },
+		{ "stringToBcd",	old_string_to_bcd },
+		{ "crc16",		old_crc16 },
+		{ "slipDecode",		old_slip_decode },
+		{ NULL,			NULL }
+	};
+	struct luaL_Reg cbor[] = {
+		{ "encode",		cbor_encode },
+		{ "decode",		cbor_decode },
+		{ NULL,			NULL }
+	};
+	struct luaL_Reg native[] = {
+		{ "ctyLookup",		native_cty_lookup },
+		{ NULL,			NULL }
+	};
+	lua_State *L;
+	char *ctyfile = NULL;
+	int c, line, n;
+
+	while ((c = getopt(argc, argv, "c:")) != -1) {
+		switch (c) {
+		case 'c':
+			ctyfile = optarg;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	if (argc < 2) {
+usage:
+		fprintf(stderr, "usage: bench [-c cty.dat] script [arg ...]\n");
+		return 1;
+	}
+
+	if (ctyfile != NULL && cty_load(&cty, ctyfile, &line)) {
+		if (line)
+			fprintf(stderr, "%s: invalid entry in line %d\n",
+			    ctyfile, line);
+		else
+			fprintf(stderr, "can't read %s\n", ctyfile);
+		return 1;
+	}
+
+	L = luaL_newstate();
+	luaL_openlibs(L);
+
+	luaopen_trx_codec(L);
+	lua_setglobal(L, "codec");
+	luaL_newlib(L, old);
+	lua_setglobal(L, "old");
+	luaL_newlib(L, cbor);
+	lua_setglobal(L, "cbor");
+	luaopen_json(L);
+	lua_setglobal(L, "json");
+	luaL_newlib(L, native);
+	lua_setglobal(L, "native");
+	lua_createtable(L, 0, 1);
+	luaopen_trxd_cty(L);
+	lua_setfield(L, -2, "cty");
+	lua_setglobal(L, "trxd");
+
+	if (luaL_loadfile(L, argv[1])) {
+		fprintf(stderr, "%s\n", lua_tostring(L, -1));
+		return 1;
+	}
+	for (n = 2; n < argc; n++)
+		lua_pushstring(L, argv[n]);
+	if (lua_pcall(L, argc - 2, 0, 0)) {
+		fprintf(stderr, "%s\n", lua_tostring(L, -1));
+		return 1;
+	}
+	lua_close(L);
+	return 0;
+}
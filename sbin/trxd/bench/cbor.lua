@@ -0,0 +1,67 @@
+-- Copyright (c) 2023 - 2024 Marc Balmer HB9SSB
+--
+-- Permission is hereby granted, free of charge, to any person obtaining a copy
+-- of this software and associated documentation files (the "Software"), to
+-- deal in the Software without restriction, including without limitation the
+-- rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+-- sell copies of the Software, and to permit persons to whom the Software is
+-- furnished to do so, subject to the following conditions:
+--
+-- The above copyright notice and this permission notice shall be included in
+-- all copies or substantial portions of the Software.
+--
+-- THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+-- IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+-- FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+-- AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+-- LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+-- FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+-- IN THE SOFTWARE.
+
+-- Compare the size and conversion cost of JSON and CBOR messages, run as
+-- ./bench cbor.lua [n]
+
+local n = tonumber((...)) or 1000000
+
+local messages = {
+	{
+		'set-frequency request',
+		'{"request":"set-frequency","to":"ic-705","frequency":14074000}'
+	},
+	{
+		'get-frequency response',
+		'{"status":"Ok","response":"get-frequency","from":"ic-705",'
+		    .. '"frequency":14074000}'
+	},
+	{
+		'status update, 8 keys',
+		'{"status":"Ok","response":"status-update","from":"ic-705",'
+		    .. '"frequency":14074000,"mode":"usb","ptt":false,'
+		    .. '"smeter":-73.5,"power":10}'
+	}
+}
+
+local function time(f, arg)
+	local t = os.clock()
+	for i = 1, n do
+		f(arg)
+	end
+	return (os.clock() - t) / n * 1e9
+end
+
+print(string.format('%d iterations            JSON   CBOR   json->cbor  '
+    .. 'cbor->json  luajson', n))
+print('                           bytes  bytes  ns          ns          '
+    .. 'decode ns')
+
+for _, m in ipairs(messages) do
+	local name, text = m[1], m[2]
+	local data = cbor.encode(text)
+
+	assert(cbor.decode(data) == text, name .. ': round trip failed')
+
+	-- The newline, or the 4 byte length prefix
+	print(string.format('%-26s %5d  %5d  %10.0f  %10.0f  %9.0f', name,
+	    #text + 1, #data + 4, time(cbor.encode, text),
+	    time(cbor.decode, data), time(json.decode, text)))
+end
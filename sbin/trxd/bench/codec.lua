@@ -0,0 +1,104 @@
+-- Copyright (c) 2023 - 2024 Marc Balmer HB9SSB
+--
+-- Permission is hereby granted, free of charge, to any person obtaining a copy
+-- of this software and associated documentation files (the "Software"), to
+-- deal in the Software without restriction, including without limitation the
+-- rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+-- sell copies of the Software, and to permit persons to whom the Software is
+-- furnished to do so, subject to the following conditions:
+--
+-- The above copyright notice and this permission notice shall be included in
+-- all copies or substantial portions of the Software.
+--
+-- THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+-- IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+-- FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+-- AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+-- LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+-- FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+-- IN THE SOFTWARE.
+
+-- Compare trx.codec with the code it replaced, run as ./bench codec.lua [n]
+
+local n = tonumber((...)) or 1000000
+
+local function bench(name, before, after)
+	assert(before() == after(), name .. ': results differ')
+
+	local t = os.clock()
+	for i = 1, n do
+		before()
+	end
+	local tb = (os.clock() - t) / n * 1e9
+
+	t = os.clock()
+	for i = 1, n do
+		after()
+	end
+	local ta = (os.clock() - t) / n * 1e9
+
+	print(string.format('%-28s %6.0f ns %6.0f ns', name, tb, ta))
+end
+
+-- An RTXLink request with bytes that need escaping
+local payload = '\x01SRF\xc0\x12\xdb\x00'
+local encoded = codec.slipEncode(payload .. codec.crc16(payload))
+
+local frequency = 14074000
+local civFrame = codec.civFrame(0xe0, 0xa4, 0x03,
+    codec.bcdPack(string.format('%010d', frequency), true))
+
+local data = string.rep('\x12\x34\x56\x78\x9a\xbc\xde\xf0\xc0\xdb\x00', 2)
+
+print(string.format('%d iterations               before      codec', n))
+
+bench('SLIP encode + crc16',
+	function ()
+		local frame = payload .. old.crc16(payload)
+
+		frame = frame:gsub('\xdb', '\xdb\xdd'):gsub('\xc0', '\xdb\xdc')
+		return '\xc0' .. frame .. '\xc0'
+	end,
+	function ()
+		return codec.slipEncode(payload .. codec.crc16(payload))
+	end)
+
+bench('SLIP decode',
+	function ()
+		return old.slipDecode(encoded)
+	end,
+	function ()
+		return codec.slipDecode(encoded)
+	end)
+
+bench('CI-V set frequency frame',
+	function ()
+		local freq = string.format('%010d', frequency)
+		local bcd = string.reverse(old.stringToBcd(freq))
+
+		return string.format('\xfe\xfe%c%c%s', 0xa4, 0xe0, '\x05')
+		    .. bcd .. '\xfd'
+	end,
+	function ()
+		return codec.civFrame(0xa4, 0xe0, 0x05,
+		    codec.bcdPack(string.format('%010d', frequency), true))
+	end)
+
+bench('CI-V parse frequency',
+	function ()
+		return tonumber(old.bcdToString(string.reverse(
+		    string.sub(civFrame, 6, -2))))
+	end,
+	function ()
+		local to, from, command, data = codec.civParse(civFrame)
+
+		return tonumber(codec.bcdUnpack(data, true))
+	end)
+
+bench('crc16, 22 bytes',
+	function ()
+		return old.crc16(data)
+	end,
+	function ()
+		return codec.crc16(data)
+	end)
@@ -0,0 +1,85 @@
+-- Copyright (c) 2023 - 2024 Marc Balmer HB9SSB
+--
+-- Permission is hereby granted, free of charge, to any person obtaining a copy
+-- of this software and associated documentation files (the "Software"), to
+-- deal in the Software without restriction, including without limitation the
+-- rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+-- sell copies of the Software, and to permit persons to whom the Software is
+-- furnished to do so, subject to the following conditions:
+--
+-- The above copyright notice and this permission notice shall be included in
+-- all copies or substantial portions of the Software.
+--
+-- THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+-- IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+-- FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+-- AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+-- LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+-- FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+-- IN THE SOFTWARE.
+
+-- Time DXCC lookups, run as ./bench -c cty.dat cty.lua [n]
+
+local n = tonumber((...)) or 1000
+
+-- A mix of plain, portable, and prefixed callsigns, most of them found
+local calls = {}
+local prefixes = { 'DL', 'HB9', 'K', 'W', 'UA9', 'JA', 'VK', 'G', 'F', 'I',
+    'EA', 'OH', 'SM', 'LU', 'PY', 'ZS', 'VE', 'XE', '9A', 'S5' }
+
+math.randomseed(1)
+for i = 1, 1000 do
+	local call = string.format('%s%d%s', prefixes[math.random(#prefixes)],
+	    math.random(0, 9), string.char(math.random(65, 90),
+	    math.random(65, 90), math.random(65, 90)))
+
+	if i % 10 == 0 then
+		call = call .. '/P'
+	elseif i % 17 == 0 then
+		call = 'DL/' .. call
+	end
+	calls[i] = call
+end
+
+local stats = trxd.cty.stats()
+print(string.format('%d entities, %d prefixes, %d callsigns',
+    stats.entities, stats.prefixes, stats.callsigns))
+
+local function bench(name, f)
+	local t = os.clock()
+	local found = f()
+	t = os.clock() - t
+
+	print(string.format('%-28s %6.0f ns %9.0f/s %6d found', name,
+	    t / (n * #calls) * 1e9, n * #calls / t, found))
+end
+
+bench('cty_lookup()', function ()
+	return native.ctyLookup(calls, n)
+end)
+
+bench('trxd.cty.lookup(call)', function ()
+	local found = 0
+
+	for r = 1, n do
+		for i = 1, #calls do
+			if trxd.cty.lookup(calls[i]) ~= nil then
+				found = found + 1
+			end
+		end
+	end
+	return found
+end)
+
+bench('trxd.cty.lookup(list)', function ()
+	local found = 0
+
+	for r = 1, n do
+		for _, info in ipairs(trxd.cty.lookup(calls)) do
+			if info then
+				found = found + 1
+			end
+		end
+	end
+	return found
+end)
@@ -0,0 +1,110 @@
+-- Copyright (c) 2023 - 2024 Marc Balmer HB9SSB
+--
+-- Permission is hereby granted, free of charge, to any person obtaining a copy
+-- of this software and associated documentation files (the "Software"), to
+-- deal in the Software without restriction, including without limitation the
+-- rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+-- sell copies of the Software, and to permit persons to whom the Software is
+-- furnished to do so, subject to the following conditions:
+--
+-- The above copyright notice and this permission notice shall be included in
+-- all copies or substantial portions of the Software.
+--
+-- THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+-- IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+-- FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+-- AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+-- LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+-- FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+-- IN THE SOFTWARE.
+
+-- Write a cty.dat file of about the size of BigCTY to stdout, run as
+-- ./bench gencty.lua [entities] > cty.dat.  The names, prefixes, and
+-- callsigns are made up, only their number and shape resemble the real
+-- list: some twenty prefixes and seventy callsigns per entity, with a
+-- share of them carrying zone, continent, or position overrides.
+
+local entities = tonumber((...)) or 346
+
+local letters = 'ABCDEFGHIJKLMNOPQRSTUVWXYZ'
+local alnum = letters .. '0123456789'
+local continents = { 'EU', 'NA', 'SA', 'AF', 'AS', 'OC', 'AN' }
+local used = {}
+
+math.randomseed(1)
+
+local function pick(s)
+	local n = math.random(#s)
+
+	return string.sub(s, n, n)
+end
+
+-- A string that has not been used so far, made by make()
+local function unique(make)
+	local s
+
+	repeat
+		s = make()
+	until not used[s]
+	used[s] = true
+	return s
+end
+
+local function override()
+	local r = math.random(10)
+
+	if r == 1 then
+		return string.format('(%d)', math.random(40))
+	elseif r == 2 then
+		return string.format('(%d)[%d]', math.random(40), math.random(90))
+	elseif r == 3 then
+		return string.format('<%.2f/%.2f>', math.random() * 180 - 90,
+		    math.random() * 360 - 180)
+	elseif r == 4 then
+		return string.format('{%s}', continents[math.random(#continents)])
+	end
+	return ''
+end
+
+for n = 1, entities do
+	local primary = unique(function ()
+		return pick(letters) .. pick(alnum)
+		    .. (math.random(3) == 1 and pick('0123456789') or '')
+	end)
+	local aliases = { primary }
+
+	for i = 1, math.random(10, 34) do
+		aliases[#aliases + 1] = unique(function ()
+			local s = primary
+
+			for k = 1, math.random(2) do
+				s = s .. pick(alnum)
+			end
+			return s
+		end) .. override()
+	end
+	for i = 1, math.random(30, 114) do
+		aliases[#aliases + 1] = '=' .. unique(function ()
+			return primary .. pick('0123456789') .. pick(letters)
+			    .. pick(letters) .. pick(letters)
+			    .. (math.random(8) == 1 and '/P' or '')
+		end) .. override()
+	end
+
+	io.write(string.format('%-26s%02d:  %02d:  %s:  %6.2f:  %7.2f:  %5.1f:  %s:\n',
+	    string.format('Entity %d:', n), math.random(40), math.random(90),
+	    continents[math.random(#continents)], math.random() * 180 - 90,
+	    math.random() * 360 - 180, math.random(-24, 24) / 2, primary))
+
+	-- Continuation lines of at most about 80 characters
+	local line = '    '
+	for i, alias in ipairs(aliases) do
+		alias = alias .. (i < #aliases and ',' or ';')
+		if #line + #alias > 80 then
+			io.write(line, '\n')
+			line = '    '
+		end
+		line = line .. alias
+	end
+	io.write(line, '\n')
+end
@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2014 - 2024 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Cache precompiled Lua chunks to speed up starting trxd */
+
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "pathnames.h"
+
+#define CACHE_MAGIC	"trxdluac"
+
+extern int verbose;
+
+/*
+ * A cache file starts with this header, followed by the path of the source
+ * file and the bytecode.  The cached chunk is only used if it was compiled
+ * by the same Lua release from the same, unmodified, source file.
+ */
+struct cache_header {
+	char		magic[8];
+	int32_t		release;
+	int32_t		pathlen;
+	int64_t		mtime_sec;
+	int64_t		mtime_nsec;
+	int64_t		size;
+	uint64_t	ino;
+};
+
+static void
+cache_path(const char *path, char *cpath, size_t len)
+{
+	char *p, *name;
+	uint64_t hash = 0xcbf29ce484222325ULL;	/* FNV-1a */
+
+	for (p = (char *)path; *p; p++) {
+		hash ^= (unsigned char)*p;
+		hash *= 0x100000001b3ULL;
+	}
+
+	if ((p = strdup(path)) == NULL) {
+		syslog(LOG_ERR, "bytecode: strdup");
+		exit(1);
+	}
+	name = basename(p);
+	snprintf(cpath, len, "%s/%s-%016llx.luac", _PATH_CACHE, name,
+	    (unsigned long long)hash);
+	free(p);
+}
+
+static void
+make_header(struct cache_header *h, const char *path, struct stat *sb)
+{
+	memset(h, 0, sizeof(struct cache_header));
+	memcpy(h->magic, CACHE_MAGIC, sizeof(h->magic));
+	h->release = LUA_VERSION_RELEASE_NUM;
+	h->pathlen = strlen(path);
+	h->mtime_sec = sb->st_mtim.tv_sec;
+	h->mtime_nsec = sb->st_mtim.tv_nsec;
+	h->size = sb->st_size;
+	h->ino = sb->st_ino;
+}
+
+/* Load a chunk from the cache, returns 0 on success */
+static int
+load_cached(lua_State *L, const char *path, const char *cpath,
+    struct cache_header *h)
+{
+	struct cache_header ch;
+	struct stat sb;
+	char *data, chunkname[PATH_MAX + 1];
+	size_t len, off;
+	int fd, rv = -1;
+
+	if ((fd = open(cpath, O_RDONLY | O_NOFOLLOW)) == -1)
+		return -1;
+
+	/* Don't load bytecode somebody else could have modified */
+	if (fstat(fd, &sb) || sb.st_uid != geteuid()
+	    || sb.st_mode & (S_IWGRP | S_IWOTH)
+	    || sb.st_size < sizeof(ch) + h->pathlen) {
+		close(fd);
+		return -1;
+	}
+
+	len = sb.st_size;
+	if ((data = malloc(len)) == NULL) {
+		syslog(LOG_ERR, "bytecode: malloc");
+		exit(1);
+	}
+
+	off = sizeof(ch) + h->pathlen;
+	if (read(fd, data, len) == len) {
+		memcpy(&ch, data, sizeof(ch));
+		if (!memcmp(&ch, h, sizeof(ch))
+		    && !memcmp(data + sizeof(ch), path, h->pathlen)) {
+			snprintf(chunkname, sizeof(chunkname), "@%s", path);
+			if (luaL_loadbufferx(L, data + off, len - off,
+			    chunkname, "b") == LUA_OK)
+				rv = 0;
+			else
+				lua_pop(L, 1);
+		}
+	}
+	free(data);
+	close(fd);
+	return rv;
+}
+
+static int
+writer(lua_State *L, const void *p, size_t len, void *ud)
+{
+	return fwrite(p, 1, len, (FILE *)ud) != len;
+}
+
+/* Store the chunk on top of the stack, errors are not fatal */
+static void
+store(lua_State *L, const char *path, const char *cpath,
+    struct cache_header *h)
+{
+	FILE *fp;
+	char tmp[PATH_MAX];
+	int fd, error;
+
+	snprintf(tmp, sizeof(tmp), "%s/.luac-XXXXXX", _PATH_CACHE);
+	if ((fd = mkstemp(tmp)) == -1)
+		return;
+
+	if ((fp = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+
+	error = fwrite(h, sizeof(struct cache_header), 1, fp) != 1
+	    || fwrite(path, h->pathlen, 1, fp) != 1
+	    || lua_dump(L, writer, fp, 0);
+	error |= fclose(fp) != 0;
+
+	/* Readers see either the old or the new file, never a partial one */
+	if (error || rename(tmp, cpath)) {
+		unlink(tmp);
+		if (verbose)
+			syslog(LOG_NOTICE, "bytecode: can't cache %s", path);
+	}
+}
+
+/*
+ * Load a Lua file like luaL_loadfile, but use precompiled bytecode from the
+ * cache if it is up to date.  Otherwise the file is compiled and the
+ * bytecode is stored in the cache.
+ */
+int
+bytecode_loadfile(lua_State *L, const char *path)
+{
+	struct cache_header h;
+	struct stat sb;
+	char cpath[PATH_MAX];
+	int status;
+
+	if (stat(path, &sb) || strlen(path) >= PATH_MAX)
+		return luaL_loadfile(L, path);
+
+	make_header(&h, path, &sb);
+	cache_path(path, cpath, sizeof(cpath));
+
+	if (!load_cached(L, path, cpath, &h))
+		return LUA_OK;
+
+	if ((status = luaL_loadfile(L, path)) == LUA_OK)
+		store(L, path, cpath, &h);
+	return status;
+}
+
+/* Like luaL_dofile */
+int
+bytecode_dofile(lua_State *L, const char *path)
+{
+	return bytecode_loadfile(L, path)
+	    || lua_pcall(L, 0, LUA_MULTRET, 0);
+}
@@ -0,0 +1,256 @@
+/*
+ * Copyright (c) 2014 - 2024 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Encoding and decoding of data used by CAT protocols */
+
+#include <string.h>
+
+#include "codec.h"
+
+/* CRC-16/CCITT, polynomial 0x1021 */
+static const uint16_t crc16_table[256] = {
+	0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+	0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+	0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
+	0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+	0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
+	0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+	0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
+	0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+	0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
+	0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
+	0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
+	0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+	0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
+	0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+	0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
+	0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+	0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
+	0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
+	0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
+	0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
+	0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
+	0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+	0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
+	0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
+	0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
+	0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
+	0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
+	0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+	0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
+	0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+	0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
+	0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0
+};
+
+/* CRC-16 as used by RTXLink, i.e. with an initial value of 0x1d0f */
+uint16_t
+codec_crc16(const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	uint16_t crc = 0x1d0f;
+
+	while (len--)
+		crc = (crc << 8) ^ crc16_table[(crc >> 8) ^ *p++];
+	return crc;
+}
+
+/*
+ * SLIP encode len bytes into a frame delimited by END bytes.  The frame
+ * buffer must hold SLIP_ENCODED_MAX(len) bytes, the length of the frame is
+ * returned.
+ */
+size_t
+codec_slip_encode(const void *data, size_t len, unsigned char *frame)
+{
+	const unsigned char *p = data;
+	unsigned char *q = frame;
+
+	*q++ = SLIP_END;
+	while (len--) {
+		switch (*p) {
+		case SLIP_END:
+			*q++ = SLIP_ESC;
+			*q++ = SLIP_ESC_END;
+			break;
+		case SLIP_ESC:
+			*q++ = SLIP_ESC;
+			*q++ = SLIP_ESC_ESC;
+			break;
+		default:
+			*q++ = *p;
+		}
+		p++;
+	}
+	*q++ = SLIP_END;
+	return q - frame;
+}
+
+void
+codec_slip_decoder(slip_decoder_t *d, unsigned char *frame, size_t size)
+{
+	d->frame = frame;
+	d->size = size;
+	d->len = 0;
+	d->escape = d->overflow = d->done = 0;
+}
+
+/*
+ * Feed data to a SLIP decoder.  Decoding stops after a frame is complete,
+ * which is indicated in complete.  The frame is then in d->frame and is
+ * valid until more data is fed.  Returns the number
+ * of bytes used.  Empty frames and frames that don't fit are dropped.
+ */
+size_t
+codec_slip_decode(slip_decoder_t *d, const void *data, size_t len,
+    int *complete)
+{
+	const unsigned char *p = data, *end = p + len;
+	unsigned char c;
+
+	*complete = 0;
+
+	/* The previous frame has been consumed */
+	if (d->done) {
+		d->len = 0;
+		d->done = 0;
+	}
+
+	for (; p < end; p++) {
+		c = *p;
+		if (c == SLIP_END) {
+			if (d->len > 0 && !d->overflow) {
+				*complete = d->done = 1;
+				return p - (const unsigned char *)data + 1;
+			}
+			d->len = 0;
+			d->escape = d->overflow = 0;
+			continue;
+		}
+		if (d->escape) {
+			if (c == SLIP_ESC_END)
+				c = SLIP_END;
+			else if (c == SLIP_ESC_ESC)
+				c = SLIP_ESC;
+			d->escape = 0;
+		} else if (c == SLIP_ESC) {
+			d->escape = 1;
+			continue;
+		}
+		if (d->len < d->size)
+			d->frame[d->len++] = c;
+		else
+			d->overflow = 1;
+	}
+	return len;
+}
+
+/*
+ * Pack a string of decimal digits to BCD, two digits per byte.  An odd
+ * number of digits is padded with a leading zero.  If reverse is set, the
+ * least significant byte comes first, as used by CI-V.  Returns the number
+ * of bytes or -1 if a character is not a digit.
+ */
+int
+codec_bcd_pack(const char *digits, size_t len, unsigned char *bcd,
+    int reverse)
+{
+	size_t n, nbytes;
+	int hi, lo;
+
+	nbytes = (len + 1) / 2;
+	for (n = 0; n < nbytes; n++) {
+		hi = n == 0 && len % 2 ? '0' : *digits++;
+		lo = *digits++;
+		if (hi < '0' || hi > '9' || lo < '0' || lo > '9')
+			return -1;
+		bcd[reverse ? nbytes - n - 1 : n] = (hi - '0') << 4 | (lo - '0');
+	}
+	return nbytes;
+}
+
+/* Unpack len BCD bytes to 2 * len digits, the digits are not terminated */
+void
+codec_bcd_unpack(const void *data, size_t len, char *digits, int reverse)
+{
+	const unsigned char *bcd = data;
+	size_t n;
+	unsigned char c;
+
+	for (n = 0; n < len; n++) {
+		c = bcd[reverse ? len - n - 1 : n];
+		*digits++ = '0' + (c >> 4);
+		*digits++ = '0' + (c & 0x0f);
+	}
+}
+
+/*
+ * Build a CI-V frame, the subcommand is optional.  The frame buffer must
+ * hold CIV_FRAME_MAX(len) bytes, the length of the frame is returned.
+ */
+size_t
+codec_civ_frame(unsigned char *frame, int to, int from, int command,
+    int subcommand, const void *data, size_t len)
+{
+	unsigned char *p = frame;
+
+	*p++ = CIV_PREAMBLE;
+	*p++ = CIV_PREAMBLE;
+	*p++ = to;
+	*p++ = from;
+	*p++ = command;
+	if (subcommand != CIV_NO_SUBCOMMAND)
+		*p++ = subcommand;
+	if (len > 0) {
+		memcpy(p, data, len);
+		p += len;
+	}
+	*p++ = CIV_EOM;
+	return p - frame;
+}
+
+/*
+ * Parse a CI-V frame, additional preamble bytes are skipped.  The data
+ * includes a subcommand, if any, as it depends on the command whether
+ * there is one.  Returns 0 on success or -1 if this is not a valid frame.
+ */
+int
+codec_civ_parse(const void *data, size_t len, civ_frame_t *f)
+{
+	const unsigned char *p = data, *end = p + len;
+
+	if (len < 6 || p[0] != CIV_PREAMBLE || p[1] != CIV_PREAMBLE
+	    || end[-1] != CIV_EOM)
+		return -1;
+
+	for (p += 2; p < end && *p == CIV_PREAMBLE; p++)
+		;
+	if (end - p < 4)
+		return -1;
+
+	f->to = p[0];
+	f->from = p[1];
+	f->command = p[2];
+	f->data = p + 3;
+	f->len = end - p - 4;
+	return 0;
+}
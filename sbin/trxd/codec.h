@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2014 - 2024 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Encoding and decoding of data used by CAT protocols */
+
+#ifndef __CODEC_H__
+#define __CODEC_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SLIP_END		0xc0
+#define SLIP_ESC		0xdb
+#define SLIP_ESC_END		0xdc
+#define SLIP_ESC_ESC		0xdd
+
+#define CIV_PREAMBLE		0xfe
+#define CIV_EOM			0xfd
+#define CIV_NO_SUBCOMMAND	-1
+
+/* Buffer sizes needed to encode len bytes */
+#define SLIP_ENCODED_MAX(len)	(2 * (len) + 2)
+#define CIV_FRAME_MAX(len)	((len) + 7)
+
+/* A SLIP decoder can be fed data as it arrives */
+typedef struct slip_decoder {
+	unsigned char	*frame;		/* Provided by the caller */
+	size_t		 size;
+	size_t		 len;
+	int		 escape;
+	int		 overflow;	/* The frame did not fit */
+	int		 done;		/* The frame is complete */
+} slip_decoder_t;
+
+typedef struct civ_frame {
+	int			 to;
+	int			 from;
+	int			 command;
+	const unsigned char	*data;	/* Points into the parsed frame */
+	size_t			 len;
+} civ_frame_t;
+
+extern uint16_t codec_crc16(const void *, size_t);
+
+extern size_t codec_slip_encode(const void *, size_t, unsigned char *);
+extern void codec_slip_decoder(slip_decoder_t *, unsigned char *, size_t);
+extern size_t codec_slip_decode(slip_decoder_t *, const void *, size_t,
+    int *);
+
+extern int codec_bcd_pack(const char *, size_t, unsigned char *, int);
+extern void codec_bcd_unpack(const void *, size_t, char *, int);
+
+extern size_t codec_civ_frame(unsigned char *, int, int, int, int,
+    const void *, size_t);
+extern int codec_civ_parse(const void *, size_t, civ_frame_t *);
+
+#endif /* __CODEC_H__ */
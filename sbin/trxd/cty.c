@@ -0,0 +1,490 @@
+/*
+ * Copyright (c) 2014 - 2024 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+/*
+ * Resolve callsigns to DXCC entities.  The prefixes of a cty.dat file are
+ * kept in a trie which is walked along the callsign, the deepest node that
+ * ends a prefix gives the entity, so a lookup touches at most one node per
+ * character.  Callsigns that are listed explicitly ("=CALL") are kept in a
+ * hash table and take precedence over the prefixes.
+ *
+ * Each entity is described by a header line, followed by its prefixes and
+ * callsigns, separated by commas and terminated by a semicolon:
+ *
+ * Switzerland:  14:  28:  EU:   46.87:    -8.12:    -1.0:  HB:
+ *     HB,HE,=HB9ABC(15)[29];
+ *
+ * Longitudes and time offsets are positive to the west in the file and are
+ * stored positive to the east.  A prefix or callsign can override the CQ
+ * zone (n), ITU zone [n], position <lat/lon>, continent {cc}, and time
+ * offset ~n~ of its entity.
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cty.h"
+
+#define CTY_FIELDS	8
+
+/* Suffixes that do not change the entity of a callsign */
+static const char *modifiers[] = {
+	"P", "M", "A", "B", "LH", "QRP", "QRPP"
+};
+#define MODIFIERS	(sizeof(modifiers) / sizeof(modifiers[0]))
+
+static int
+cty_symbol(int c)
+{
+	if (c >= 'A' && c <= 'Z')
+		return c - 'A';
+	if (c >= 'a' && c <= 'z')
+		return c - 'a';
+	if (c >= '0' && c <= '9')
+		return 26 + c - '0';
+	if (c == '/')
+		return 36;
+	return -1;
+}
+
+static uint32_t
+cty_hash(const cty_t *c, const char *call)
+{
+	uint32_t h = 2166136261u;
+
+	for (; *call; call++)
+		h = (h ^ (unsigned char)*call) * 16777619u;
+	return h & (c->hash_size - 1);
+}
+
+/* Make room for one more element of an array */
+static int
+cty_grow(void *array, size_t *alloc, size_t n, size_t size)
+{
+	void *p;
+	size_t len;
+
+	if (n < *alloc)
+		return 0;
+	len = *alloc ? *alloc * 2 : 256;
+	if ((p = realloc(*(void **)array, len * size)) == NULL)
+		return -1;
+	*(void **)array = p;
+	*alloc = len;
+	return 0;
+}
+
+/* Copy a header field up to the next colon, without surrounding space */
+static char *
+cty_field(char **p, char *end)
+{
+	char *field, *s;
+
+	for (field = *p; field < end && isspace((unsigned char)*field);
+	    field++)
+		;
+	for (s = field; s < end && *s != ':' && *s != ';'; s++)
+		;
+	if (s == end || *s != ':')
+		return NULL;
+	*p = s + 1;
+	while (s > field && isspace((unsigned char)s[-1]))
+		s--;
+	*s = '\0';
+	return field;
+}
+
+/* Apply the overrides following a prefix or callsign */
+static int
+cty_override(char *s, cty_info_t *info)
+{
+	char *e;
+
+	while (*s) {
+		switch (*s) {
+		case '(':
+			info->cq_zone = strtol(s + 1, &e, 10);
+			if (*e != ')')
+				return -1;
+			break;
+		case '[':
+			info->itu_zone = strtol(s + 1, &e, 10);
+			if (*e != ']')
+				return -1;
+			break;
+		case '<':
+			info->latitude = strtod(s + 1, &e);
+			if (*e != '/')
+				return -1;
+			info->longitude = -strtod(e + 1, &e);
+			if (*e != '>')
+				return -1;
+			break;
+		case '{':
+			if (!isalpha((unsigned char)s[1])
+			    || !isalpha((unsigned char)s[2]) || s[3] != '}')
+				return -1;
+			info->continent[0] = s[1];
+			info->continent[1] = s[2];
+			info->continent[2] = '\0';
+			e = s + 3;
+			break;
+		case '~':
+			info->utc_offset = -strtod(s + 1, &e);
+			if (*e != '~')
+				return -1;
+			break;
+		default:
+			return -1;
+		}
+		s = e + 1;
+	}
+	return 0;
+}
+
+/* Insert a prefix into the trie */
+static int
+cty_insert(cty_t *c, size_t *alloc, const char *prefix, int32_t info)
+{
+	int32_t n, next;
+	int sym;
+
+	for (n = 0; *prefix; prefix++) {
+		if ((sym = cty_symbol(*prefix)) == -1)
+			return -1;
+		if ((next = c->node[n].child[sym]) == 0) {
+			if (cty_grow(&c->node, alloc, c->nodes,
+			    sizeof(cty_node_t)))
+				return -1;
+			next = c->nodes++;
+			memset(&c->node[next], 0, sizeof(cty_node_t));
+			c->node[next].info = -1;
+			c->node[n].child[sym] = next;
+		}
+		n = next;
+	}
+	if (c->node[n].info == -1)
+		c->prefixes++;
+	c->node[n].info = info;
+	return 0;
+}
+
+/* Parse the prefixes and callsigns of an entity */
+static int
+cty_aliases(cty_t *c, char **p, char *end, int *line, size_t *alloc)
+{
+	cty_info_t info;
+	char alias[64], *s;
+	size_t len, n;
+	int32_t idx, base;
+	int last;
+
+	base = c->infos - 1;
+	for (last = 0, s = *p; !last; ) {
+		for (; s < end && (isspace((unsigned char)*s) || *s == ',');
+		    s++)
+			if (*s == '\n')
+				(*line)++;
+		for (len = 0; s < end && *s != ',' && *s != ';'
+		    && !isspace((unsigned char)*s); s++)
+			if (len < sizeof(alias) - 1)
+				alias[len++] = *s;
+		alias[len] = '\0';
+		if (s == end)
+			return -1;
+		last = *s == ';';
+		s++;
+		if (len == 0)
+			continue;
+
+		/* The callsign or prefix proper, up to any overrides */
+		for (n = alias[0] == '='; alias[n]
+		    && cty_symbol(alias[n]) != -1; n++)
+			alias[n] = toupper((unsigned char)alias[n]);
+
+		idx = base;
+		if (alias[n]) {
+			info = c->info[base];
+			if (cty_override(&alias[n], &info))
+				return -1;
+			if (cty_grow(&c->info, &alloc[1], c->infos,
+			    sizeof(cty_info_t)))
+				return -1;
+			idx = c->infos++;
+			c->info[idx] = info;
+			alias[n] = '\0';
+		}
+
+		if (alias[0] == '=') {
+			if (n == 1 || n > CTY_CALLMAX)
+				return -1;
+			if (cty_grow(&c->call, &alloc[2], c->calls,
+			    sizeof(cty_call_t)))
+				return -1;
+			strcpy(c->call[c->calls].call, &alias[1]);
+			c->call[c->calls++].info = idx;
+		} else if (n == 0 || cty_insert(c, &alloc[3], alias, idx))
+			return -1;
+	}
+	*p = s;
+	return 0;
+}
+
+/* Parse the header line of an entity */
+static int
+cty_entity(cty_t *c, char **p, char *end, size_t *alloc)
+{
+	cty_entity_t *e;
+	cty_info_t *info;
+	char *field[CTY_FIELDS], *prefix;
+	int n;
+
+	for (n = 0; n < CTY_FIELDS; n++)
+		if ((field[n] = cty_field(p, end)) == NULL)
+			return -1;
+
+	if (cty_grow(&c->entity, &alloc[0], c->entities,
+	    sizeof(cty_entity_t))
+	    || cty_grow(&c->info, &alloc[1], c->infos, sizeof(cty_info_t)))
+		return -1;
+
+	e = &c->entity[c->entities];
+	prefix = field[7];
+	e->wae = *prefix == '*';
+	if (e->wae)
+		prefix++;
+	if (strlen(prefix) >= CTY_PREFIXMAX
+	    || (e->name = strdup(field[0])) == NULL)
+		return -1;
+	strcpy(e->prefix, prefix);
+
+	info = &c->info[c->infos++];
+	info->entity = c->entities++;
+	info->cq_zone = atoi(field[1]);
+	info->itu_zone = atoi(field[2]);
+	snprintf(info->continent, sizeof(info->continent), "%s", field[3]);
+	info->latitude = strtod(field[4], NULL);
+	info->longitude = -strtod(field[5], NULL);
+	info->utc_offset = -strtod(field[6], NULL);
+	return 0;
+}
+
+static char *
+cty_read(const char *path, size_t *len)
+{
+	FILE *fp;
+	char *buf;
+	size_t alloc, n;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		return NULL;
+	buf = NULL;
+	alloc = *len = 0;
+	do {
+		if (cty_grow(&buf, &alloc, *len, 1)) {
+			free(buf);
+			fclose(fp);
+			return NULL;
+		}
+		n = fread(buf + *len, 1, alloc - *len, fp);
+		*len += n;
+	} while (n > 0);
+	fclose(fp);
+	return buf;
+}
+
+/*
+ * Load a cty.dat file.  Returns 0 on success, or -1 and the line number of
+ * the first error (0 if the file could not be read).
+ */
+int
+cty_load(cty_t *c, const char *path, int *line)
+{
+	char *buf, *p, *end;
+	size_t alloc[4], len, n;
+	uint32_t h;
+
+	memset(c, 0, sizeof(cty_t));
+	memset(alloc, 0, sizeof(alloc));
+	*line = 0;
+
+	if ((buf = cty_read(path, &len)) == NULL)
+		return -1;
+
+	/* The root of the trie */
+	if (cty_grow(&c->node, &alloc[3], 0, sizeof(cty_node_t)))
+		goto failed;
+	memset(c->node, 0, sizeof(cty_node_t));
+	c->node[0].info = -1;
+	c->nodes = 1;
+
+	*line = 1;
+	for (p = buf, end = buf + len; ; ) {
+		for (; p < end && isspace((unsigned char)*p); p++)
+			if (*p == '\n')
+				(*line)++;
+		if (p == end)
+			break;
+		if (cty_entity(c, &p, end, alloc)
+		    || cty_aliases(c, &p, end, line, alloc))
+			goto failed;
+	}
+	free(buf);
+
+	for (c->hash_size = 16; c->hash_size < 2 * c->calls;
+	    c->hash_size *= 2)
+		;
+	if ((c->hash = malloc(c->hash_size * sizeof(int32_t))) == NULL) {
+		*line = 0;
+		cty_free(c);
+		return -1;
+	}
+	for (n = 0; n < c->hash_size; n++)
+		c->hash[n] = -1;
+	for (n = 0; n < c->calls; n++) {
+		h = cty_hash(c, c->call[n].call);
+		c->call[n].hash_next = c->hash[h];
+		c->hash[h] = n;
+	}
+	return 0;
+
+failed:
+	free(buf);
+	cty_free(c);
+	return -1;
+}
+
+void
+cty_free(cty_t *c)
+{
+	size_t n;
+
+	for (n = 0; n < c->entities; n++)
+		free(c->entity[n].name);
+	free(c->entity);
+	free(c->info);
+	free(c->node);
+	free(c->call);
+	free(c->hash);
+	memset(c, 0, sizeof(cty_t));
+}
+
+static int32_t
+cty_exact(const cty_t *c, const char *call)
+{
+	int32_t n;
+
+	for (n = c->hash[cty_hash(c, call)]; n != -1; n = c->call[n].hash_next)
+		if (!strcmp(c->call[n].call, call))
+			return c->call[n].info;
+	return -1;
+}
+
+/* The longest prefix of s that is in the trie */
+static int32_t
+cty_prefix(const cty_t *c, const char *s)
+{
+	int32_t n, info;
+	int sym;
+
+	for (n = 0, info = -1; *s; s++) {
+		if ((sym = cty_symbol(*s)) == -1
+		    || (n = c->node[n].child[sym]) == 0)
+			break;
+		if (c->node[n].info != -1)
+			info = c->node[n].info;
+	}
+	return info;
+}
+
+/*
+ * Find the entity of a callsign.  A callsign that is listed explicitly is
+ * used as is.  Otherwise modifiers like /P are removed and of a callsign
+ * with a prefix like DL/HB9SSB the shorter part is looked up.  A single
+ * digit replaces the call area, W1AW/4 is looked up as W4AW.  Maritime and
+ * aeronautical mobile stations have no entity.
+ */
+const cty_info_t *
+cty_lookup(const cty_t *c, const char *call)
+{
+	char buf[CTY_CALLMAX], *part, *prefix, *last, *s;
+	size_t len, n, parts;
+	int32_t info;
+	int area;
+
+	if (c->nodes == 0)
+		return NULL;
+
+	for (len = 0; call[len]; len++) {
+		if (len == CTY_CALLMAX - 1)
+			return NULL;
+		buf[len] = toupper((unsigned char)call[len]);
+	}
+	buf[len] = '\0';
+	if (len == 0)
+		return NULL;
+
+	if ((info = cty_exact(c, buf)) != -1)
+		return &c->info[info];
+	if (strchr(buf, '/') == NULL) {
+		info = cty_prefix(c, buf);
+		return info == -1 ? NULL : &c->info[info];
+	}
+
+	prefix = NULL;
+	area = 0;
+	for (parts = 0, part = strtok_r(buf, "/", &last); part != NULL;
+	    part = strtok_r(NULL, "/", &last)) {
+		if (!strcmp(part, "MM") || !strcmp(part, "AM"))
+			return NULL;
+		for (n = 0; n < MODIFIERS; n++)
+			if (!strcmp(part, modifiers[n]))
+				break;
+		if (n < MODIFIERS)
+			continue;
+		if (isdigit((unsigned char)part[0]) && part[1] == '\0') {
+			area = part[0];
+			continue;
+		}
+		if (prefix == NULL || strlen(part) < strlen(prefix))
+			prefix = part;
+		parts++;
+	}
+	if (prefix == NULL)
+		return NULL;
+
+	if (parts == 1) {
+		if ((info = cty_exact(c, prefix)) != -1)
+			return &c->info[info];
+		if (area)
+			for (s = prefix; *s; s++)
+				if (isdigit((unsigned char)*s)) {
+					*s = area;
+					break;
+				}
+	}
+	info = cty_prefix(c, prefix);
+	return info == -1 ? NULL : &c->info[info];
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2014 - 2024 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+/*
+ * Resolve callsigns to DXCC entities using the prefix list of a cty.dat
+ * (or BigCTY) file.
+ */
+
+#ifndef __CTY_H__
+#define __CTY_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CTY_CALLMAX		16
+#define CTY_PREFIXMAX		8
+#define CTY_SYMBOLS		37		/* A-Z, 0-9, and / */
+
+typedef struct cty_entity {
+	char		*name;
+	char		 prefix[CTY_PREFIXMAX];	/* Primary prefix */
+	int		 wae;			/* Only on the WAE list */
+} cty_entity_t;
+
+/* The data of an entity, with the overrides of a prefix or callsign */
+typedef struct cty_info {
+	int		 entity;
+	int		 cq_zone;
+	int		 itu_zone;
+	char		 continent[3];
+	double		 latitude;		/* North positive */
+	double		 longitude;		/* East positive */
+	double		 utc_offset;		/* Hours */
+} cty_info_t;
+
+/* A node of the prefix trie */
+typedef struct cty_node {
+	int32_t		 child[CTY_SYMBOLS];
+	int32_t		 info;			/* -1 if no prefix ends here */
+} cty_node_t;
+
+/* A callsign that is listed explicitly */
+typedef struct cty_call {
+	char		 call[CTY_CALLMAX];
+	int32_t		 info;
+	int32_t		 hash_next;
+} cty_call_t;
+
+typedef struct cty {
+	cty_entity_t	*entity;
+	size_t		 entities;
+	cty_info_t	*info;
+	size_t		 infos;
+	cty_node_t	*node;
+	size_t		 nodes;
+	cty_call_t	*call;
+	size_t		 calls;
+	size_t		 prefixes;
+
+	int32_t		*hash;
+	size_t		 hash_size;
+} cty_t;
+
+extern int cty_load(cty_t *, const char *, int *);
+extern void cty_free(cty_t *);
+extern const cty_info_t *cty_lookup(const cty_t *, const char *);
+
+#endif /* __CTY_H__ */
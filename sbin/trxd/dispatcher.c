@@ -41,84 +41,436 @@
 #include "trx-control.h"
 
 extern int luaopen_json(lua_State *);
+extern void sender_send(sender_tag_t *, const char *);
+extern void sender_release(sender_tag_t *);
+extern void sender_list(struct buffer *, sender_tag_t *);
 extern void proxy_map(lua_State *, lua_State *, int);
 extern void *trx_poller(void *);
-extern void *trx_handler(void *);
+extern enum TrxRequestClass trx_request_class(const char *);
+extern char *trx_call(trx_controller_tag_t *, enum TrxRequestClass,
+    const char *, const char *, int, const char *);
+extern trx_request_t *trx_submit(trx_controller_tag_t *,
+    enum TrxRequestClass, const char *, const char *, size_t, int,
+    const char *);
+extern char *trx_wait(trx_controller_tag_t *, trx_request_t *);
+extern void trx_abandon(trx_controller_tag_t *, trx_request_t *);
+extern int trx_attached(trx_controller_tag_t *);
+extern void trx_queue_statistics(trx_controller_tag_t *, struct buffer *);
+extern char *trx_state_lookup(trx_controller_tag_t *, enum TrxStateItem, int);
+extern void trx_state_statistics(trx_controller_tag_t *, struct buffer *);
+extern int ratelimit_take(token_bucket_t *, token_bucket_t **, int, long *);
+extern void nmea_fix(nmea_tag_t *, struct buffer *);
+extern listen_filter_t *filter_compile(lua_State *, int, const char **);
+extern void filter_free(listen_filter_t *);
+extern void ratelimit_statistics(token_bucket_t *, struct buffer *);
 
 extern destination_t *destination;
+extern destination_t *find_destination(const char *);
+extern void hold_destination(destination_t *);
+extern void release_destination(destination_t *);
+extern void destination_rdlock(void);
+extern void destination_unlock(void);
 extern int verbose;
 
-static void
-call_trx_controller(dispatcher_tag_t *d, trx_controller_tag_t *t)
+#define INBOX_MAX	64	/* Requests received, but not yet dispatched */
+
+/*
+ * Queue a request received by a (web)socket-handler for dispatching.  The
+ * handler only waits if the dispatcher is too far behind.  data will be
+ * freed by the dispatcher.
+ */
+void
+dispatcher_submit(dispatcher_tag_t *d, char *data)
 {
-	if (pthread_mutex_lock(&t->mutex)) {
-		syslog(LOG_ERR, "dispatcher: pthread_mutex_lock");
+	dispatcher_request_t *r;
+
+	r = malloc(sizeof(dispatcher_request_t));
+	if (r == NULL) {
+		syslog(LOG_ERR, "dispatcher: malloc");
 		exit(1);
 	}
+	r->data = data;
+	r->next = NULL;
 
-	if (pthread_mutex_lock(&d->sender->mutex)) {
+	if (pthread_mutex_lock(&d->mutex2)) {
 		syslog(LOG_ERR, "dispatcher: pthread_mutex_lock");
 		exit(1);
 	}
 
-	t->handler = "requestHandler";
-	t->response = NULL;
-	t->data = d->data;
-
-	if (pthread_mutex_lock(&t->mutex2)) {
-		syslog(LOG_ERR, "dispatcher: pthread_mutex_lock");
-		exit(1);
+	while (d->inbox_len >= INBOX_MAX) {
+		if (pthread_cond_wait(&d->cond2, &d->mutex2)) {
+			syslog(LOG_ERR, "dispatcher: pthread_cond_wait");
+			exit(1);
+		}
 	}
 
-	/* We signal cond, and mutex gets owned by trx-controller */
-	if (pthread_cond_signal(&t->cond1)) {
+	if (d->inbox_tail == NULL)
+		d->inbox = r;
+	else
+		d->inbox_tail->next = r;
+	d->inbox_tail = r;
+	d->inbox_len++;
+
+	if (pthread_cond_signal(&d->cond)) {
 		syslog(LOG_ERR, "dispatcher: pthread_cond_signal");
 		exit(1);
 	}
 
-	if (pthread_mutex_unlock(&t->mutex2)) {
+	if (pthread_mutex_unlock(&d->mutex2)) {
 		syslog(LOG_ERR, "dispatcher: pthread_mutex_unlock");
 		exit(1);
 	}
+}
 
-	while (t->response == NULL) {
-		if (pthread_cond_wait(&t->cond2, &t->mutex2)) {
+/* Wait for the next request in the inbox */
+static char *
+next_request(dispatcher_tag_t *d)
+{
+	dispatcher_request_t *r;
+	char *data;
+
+	if (pthread_mutex_lock(&d->mutex2)) {
+		syslog(LOG_ERR, "dispatcher: pthread_mutex_lock");
+		exit(1);
+	}
+
+	while (d->inbox == NULL) {
+		if (pthread_cond_wait(&d->cond, &d->mutex2)) {
 			syslog(LOG_ERR, "dispatcher: pthread_cond_wait");
 			exit(1);
 		}
 	}
 
-	if (strlen(t->response) > 0) {
-		d->sender->data = t->response;
-		if (pthread_cond_signal(&d->sender->cond)) {
-			syslog(LOG_ERR, "dispatcher: pthread_cond_signal");
-			exit(1);
-		}
-		pthread_mutex_unlock(&d->sender->mutex);
-	} else {
-		pthread_mutex_unlock(&d->sender->mutex);
+	r = d->inbox;
+	d->inbox = r->next;
+	if (d->inbox == NULL)
+		d->inbox_tail = NULL;
+	d->inbox_len--;
+
+	if (pthread_cond_signal(&d->cond2)) {
+		syslog(LOG_ERR, "dispatcher: pthread_cond_signal");
+		exit(1);
 	}
 
-	if (pthread_mutex_unlock(&t->mutex2)) {
+	if (pthread_mutex_unlock(&d->mutex2)) {
 		syslog(LOG_ERR, "dispatcher: pthread_mutex_unlock");
 		exit(1);
 	}
 
-	if (pthread_mutex_unlock(&t->mutex)) {
-		syslog(LOG_ERR, "dispatcher: pthread_mutex_unlock");
+	data = r->data;
+	free(r);
+	return data;
+}
+
+/* Queue a reply for the client, it is sent by the sender thread */
+static void
+send_reply(dispatcher_tag_t *d, const char *data)
+{
+	sender_send(d->sender, data);
+}
+
+static void
+destination_removed(dispatcher_tag_t *d)
+{
+	send_reply(d, "{\"status\":\"Error\",\"reason\":"
+	    "\"Destination removed\"}");
+}
+
+static void
+call_trx_controller(dispatcher_tag_t *d, trx_controller_tag_t *t,
+    const char *req, const char *key)
+{
+	char *response;
+
+	/*
+	 * The request is queued by its priority class and the trx-controller
+	 * serves it in turn, requests from other clients or the poller can
+	 * be served in the meantime.
+	 */
+	response = trx_call(t, trx_request_class(req), "requestHandler",
+	    d->data, d->sender->socket, key);
+
+	if (strlen(response) > 0)
+		send_reply(d, response);
+	free(response);
+}
+
+/* Requests to a transceiver that is not attached fail right away */
+static void
+trx_not_attached(dispatcher_tag_t *d, trx_controller_tag_t *t,
+    const char *req)
+{
+	char *response;
+
+	if (asprintf(&response, "{\"status\":\"Failure\",\"response\":"
+	    "\"%s\",\"reason\":\"Transceiver not attached\","
+	    "\"from\":\"%s\"}", req, t->name) == -1) {
+		syslog(LOG_ERR, "dispatcher: asprintf");
 		exit(1);
 	}
+	send_reply(d, response);
+	free(response);
+}
+
+static char *
+rate_limit_exceeded(trx_controller_tag_t *t, const char *req, long retry)
+{
+	char *response;
+
+	if (asprintf(&response, "{\"status\":\"Failure\",\"response\":"
+	    "\"%s\",\"reason\":\"Rate limit exceeded\","
+	    "\"retryAfter\":%ld,\"from\":\"%s\"}", req, retry,
+	    t->name) == -1) {
+		syslog(LOG_ERR, "dispatcher: asprintf");
+		exit(1);
+	}
+	return response;
+}
+
+/*
+ * Requests that are sent to a transceiver are rate limited per client and
+ * per transceiver, PTT requests never are.  Returns NULL if the request
+ * can be sent, possibly after waiting, or the response if it is refused.
+ */
+static char *
+rate_limited(dispatcher_tag_t *d, trx_controller_tag_t *t, const char *req)
+{
+	token_bucket_t *limit = &t->limit;
+	long retry;
+
+	if (trx_request_class(req) == TRX_CLASS_PTT
+	    || !ratelimit_take(&d->sender->limit, &limit, 1, &retry))
+		return NULL;
+	return rate_limit_exceeded(t, req, retry);
+}
+
+/*
+ * Answer get-frequency, get-mode, and get-ptt requests from the state cache
+ * if the cached value is not older than the maximum age given in the
+ * request or configured for the transceiver.  Returns NULL if the request
+ * has to be handled by the trx-controller.
+ */
+static char *
+trx_state_response(lua_State *L, int request, destination_t *dst,
+    const char *req)
+{
+	trx_controller_tag_t *t = dst->tag.trx;
+	struct buffer buf;
+	enum TrxStateItem item;
+	const char *field, *vfo;
+	char *value;
+	int max_age;
+
+	if (!strcmp(req, "get-frequency")) {
+		item = TRX_STATE_FREQUENCY;
+		field = "frequency";
+	} else if (!strcmp(req, "get-mode")) {
+		item = TRX_STATE_MODE;
+		field = "mode";
+	} else if (!strcmp(req, "get-ptt")) {
+		item = TRX_STATE_PTT;
+		field = "ptt";
+	} else
+		return NULL;
+
+	max_age = t->max_age;
+	lua_getfield(L, request, "maxAge");
+	if (lua_isnumber(L, -1))
+		max_age = lua_tointeger(L, -1);
+	lua_getfield(L, request, "vfo");
+	vfo = lua_tostring(L, -1);
+	if (vfo != NULL && item == TRX_STATE_FREQUENCY) {
+		if (!strcmp(vfo, "vfo-a"))
+			item = TRX_STATE_VFO_A;
+		else if (!strcmp(vfo, "vfo-b"))
+			item = TRX_STATE_VFO_B;
+	}
+	lua_pop(L, 2);
+
+	if (max_age <= 0 || (value = trx_state_lookup(t, item, max_age)) == NULL)
+		return NULL;
+
+	buf_init(&buf);
+	buf_printf(&buf, "{\"status\":\"Ok\",\"response\":\"%s\","
+	    "\"from\":\"%s\",\"%s\":%s,\"cached\":true}", req, dst->name,
+	    field, value);
+	free(value);
+	return buf.data;
+}
+
+/* Returns 0 if the request has to be handled by the trx-controller */
+static int
+call_trx_state(lua_State *L, int request, dispatcher_tag_t *d,
+    destination_t *dst, const char *req)
+{
+	char *response;
+
+	if ((response = trx_state_response(L, request, dst, req)) == NULL)
+		return 0;
+
+	send_reply(d, response);
+	free(response);
+	return 1;
+}
+
+/*
+ * Queued set-frequency and set-mode requests from other clients are
+ * superseded by a request with the same key.  The key might be pushed
+ * onto the Lua stack.
+ */
+static const char *
+request_key(lua_State *L, int request, const char *req)
+{
+	if (strcmp(req, "set-frequency") && strcmp(req, "set-mode"))
+		return NULL;
+
+	lua_getfield(L, request, "vfo");
+	if (lua_isstring(L, -1)) {
+		lua_pushfstring(L, "%s %s", req, lua_tostring(L, -1));
+		return lua_tostring(L, -1);
+	}
+	return req;
 }
 
 static void
-call_sdr_controller(dispatcher_tag_t *d, sdr_controller_tag_t *t)
+get_statistics(dispatcher_tag_t *d, destination_t *dst)
 {
-	if (pthread_mutex_lock(&t->mutex)) {
+	struct buffer buf;
+
+	buf_init(&buf);
+	buf_printf(&buf, "{\"status\":\"Ok\",\"response\":\"get-statistics\","
+	    "\"from\":\"%s\",", dst->name);
+	trx_queue_statistics(dst->tag.trx, &buf);
+	buf_addchar(&buf, ',');
+	trx_state_statistics(dst->tag.trx, &buf);
+	buf_addchar(&buf, ',');
+	ratelimit_statistics(&dst->tag.trx->limit, &buf);
+	buf_addstring(&buf, "}");
+
+	send_reply(d, buf.data);
+	buf_free(&buf);
+}
+
+/*
+ * A set-frequency or set-mode request is superseded if the inbox already
+ * holds a later request of the same kind for the same destination and
+ * VFO.  Only directly following requests of the same kind are looked at,
+ * so the order of different requests is preserved.
+ */
+static int
+superseded(lua_State *L, int request, dispatcher_tag_t *d,
+    destination_t *dst, const char *req)
+{
+	dispatcher_request_t *r;
+	const char *vfo, *next_vfo, *s;
+	int top, found;
+
+	if (strcmp(req, "set-frequency") && strcmp(req, "set-mode"))
+		return 0;
+
+	top = lua_gettop(L);
+	lua_getfield(L, request, "vfo");
+	vfo = lua_tostring(L, -1);
+
+	if (pthread_mutex_lock(&d->mutex2)) {
 		syslog(LOG_ERR, "dispatcher: pthread_mutex_lock");
 		exit(1);
 	}
 
-	if (pthread_mutex_lock(&d->sender->mutex)) {
+	for (found = 0, r = d->inbox; r != NULL && !found; r = r->next) {
+		if (strstr(r->data, req) == NULL)
+			break;
+
+		lua_settop(L, top + 1);
+		lua_getglobal(L, "json");
+		lua_getfield(L, -1, "decode");
+		lua_pushstring(L, r->data);
+		if (lua_pcall(L, 1, 1, 0) != LUA_OK
+		    || lua_type(L, -1) != LUA_TTABLE)
+			break;
+
+		lua_getfield(L, -1, "request");
+		s = lua_tostring(L, -1);
+		if (s == NULL || strcmp(s, req))
+			break;
+
+		lua_getfield(L, -2, "to");
+		s = lua_tostring(L, -1);
+		if (lua_istable(L, -1) || (s != NULL && strcmp(s, dst->name)))
+			break;
+
+		lua_getfield(L, -3, "vfo");
+		next_vfo = lua_tostring(L, -1);
+		if (vfo == NULL ? next_vfo == NULL
+		    : next_vfo != NULL && !strcmp(vfo, next_vfo))
+			found = 1;
+	}
+
+	if (pthread_mutex_unlock(&d->mutex2)) {
+		syslog(LOG_ERR, "dispatcher: pthread_mutex_unlock");
+		exit(1);
+	}
+
+	lua_settop(L, top);
+	return found;
+}
+
+static void
+request_superseded(dispatcher_tag_t *d, destination_t *dst, const char *req)
+{
+	struct buffer buf;
+
+	buf_init(&buf);
+	buf_printf(&buf, "{\"status\":\"Superseded\",\"response\":\"%s\","
+	    "\"from\":\"%s\"}", req, dst->name);
+
+	send_reply(d, buf.data);
+	buf_free(&buf);
+}
+
+/*
+ * A dispatcher cancelled while it waits for a response (the client went
+ * away) owns the mutexes of the destination, they are released once the
+ * pending call is complete so that other clients can continue to use it.
+ */
+static void
+cleanup_sdr_call(void *arg)
+{
+	sdr_controller_tag_t *t = (sdr_controller_tag_t *)arg;
+
+	while (t->response == NULL)
+		pthread_cond_wait(&t->cond2, &t->mutex2);
+	pthread_mutex_unlock(&t->mutex2);
+	pthread_mutex_unlock(&t->mutex);
+}
+
+static void
+cleanup_gpio_call(void *arg)
+{
+	gpio_controller_tag_t *t = (gpio_controller_tag_t *)arg;
+
+	while (t->response == NULL)
+		pthread_cond_wait(&t->cond2, &t->mutex2);
+	pthread_mutex_unlock(&t->mutex2);
+	pthread_mutex_unlock(&t->mutex);
+}
+
+static void
+cleanup_extension_call(void *arg)
+{
+	extension_tag_t *e = (extension_tag_t *)arg;
+
+	while (!e->done)
+		pthread_cond_wait(&e->cond2, &e->mutex2);
+	e->done = 0;
+	pthread_mutex_unlock(&e->mutex2);
+	pthread_mutex_unlock(&e->mutex);
+}
+
+static void
+call_sdr_controller(dispatcher_tag_t *d, sdr_controller_tag_t *t)
+{
+	if (pthread_mutex_lock(&t->mutex)) {
 		syslog(LOG_ERR, "dispatcher: pthread_mutex_lock");
 		exit(1);
 	}
@@ -132,34 +484,26 @@ call_sdr_controller(dispatcher_tag_t *d, sdr_controller_tag_t *t)
 		exit(1);
 	}
 
-	/* We signal cond, and mutex gets owned by trx-controller */
+	/*
+	 * We signal cond, mutex2 gets owned by the controller once
+	 * pthread_cond_wait() releases it.
+	 */
 	if (pthread_cond_signal(&t->cond1)) {
 		syslog(LOG_ERR, "dispatcher: pthread_cond_signal");
 		exit(1);
 	}
 
-	if (pthread_mutex_unlock(&t->mutex2)) {
-		syslog(LOG_ERR, "dispatcher: pthread_mutex_unlock");
-		exit(1);
-	}
-
+	pthread_cleanup_push(cleanup_sdr_call, t);
 	while (t->response == NULL) {
 		if (pthread_cond_wait(&t->cond2, &t->mutex2)) {
 			syslog(LOG_ERR, "dispatcher: pthread_cond_wait");
 			exit(1);
 		}
 	}
+	pthread_cleanup_pop(0);
 
-	if (strlen(t->response) > 0) {
-		d->sender->data = t->response;
-		if (pthread_cond_signal(&d->sender->cond)) {
-			syslog(LOG_ERR, "dispatcher: pthread_cond_signal");
-			exit(1);
-		}
-		pthread_mutex_unlock(&d->sender->mutex);
-	} else {
-		pthread_mutex_unlock(&d->sender->mutex);
-	}
+	if (strlen(t->response) > 0)
+		send_reply(d, t->response);
 
 	if (pthread_mutex_unlock(&t->mutex2)) {
 		syslog(LOG_ERR, "dispatcher: pthread_mutex_unlock");
@@ -180,9 +524,11 @@ call_gpio_controller(dispatcher_tag_t *d, gpio_controller_tag_t *t)
 		exit(1);
 	}
 
-	if (pthread_mutex_lock(&d->sender->mutex)) {
-		syslog(LOG_ERR, "dispatcher: pthread_mutex_lock");
-		exit(1);
+	/* The gpio has been removed by a configuration reload */
+	if (t->removed) {
+		destination_removed(d);
+		pthread_mutex_unlock(&t->mutex);
+		return;
 	}
 
 	t->handler = "requestHandler";
@@ -194,34 +540,26 @@ call_gpio_controller(dispatcher_tag_t *d, gpio_controller_tag_t *t)
 		exit(1);
 	}
 
-	/* We signal cond, and mutex gets owned by trx-controller */
+	/*
+	 * We signal cond, mutex2 gets owned by the controller once
+	 * pthread_cond_wait() releases it.
+	 */
 	if (pthread_cond_signal(&t->cond1)) {
 		syslog(LOG_ERR, "dispatcher: pthread_cond_signal");
 		exit(1);
 	}
 
-	if (pthread_mutex_unlock(&t->mutex2)) {
-		syslog(LOG_ERR, "dispatcher: pthread_mutex_unlock");
-		exit(1);
-	}
-
+	pthread_cleanup_push(cleanup_gpio_call, t);
 	while (t->response == NULL) {
 		if (pthread_cond_wait(&t->cond2, &t->mutex2)) {
 			syslog(LOG_ERR, "dispatcher: pthread_cond_wait");
 			exit(1);
 		}
 	}
+	pthread_cleanup_pop(0);
 
-	if (strlen(t->response) > 0) {
-		d->sender->data = t->response;
-		if (pthread_cond_signal(&d->sender->cond)) {
-			syslog(LOG_ERR, "dispatcher: pthread_cond_signal");
-			exit(1);
-		}
-		pthread_mutex_unlock(&d->sender->mutex);
-	} else {
-		pthread_mutex_unlock(&d->sender->mutex);
-	}
+	if (strlen(t->response) > 0)
+		send_reply(d, t->response);
 
 	if (pthread_mutex_unlock(&t->mutex2)) {
 		syslog(LOG_ERR, "dispatcher: pthread_mutex_unlock");
@@ -242,242 +580,96 @@ call_nmea(dispatcher_tag_t *d, nmea_tag_t *t)
 	buf_init(&buf);
 	buf_addstring(&buf,
 	    "{\"status\":\"Ok\",\"response\":\"get-fix\",\"from\":\"nmea\","
-	    "\"fix\":{");
+	    "\"fix\":");
 
 	if (pthread_mutex_lock(&t->mutex)) {
 		syslog(LOG_ERR, "dispatcher: pthread_mutex_lock");
 		exit(1);
 	}
 
-	buf_printf(&buf, "\"date\":\"%02d.%02d.%04d\",",
-	    t->day, t->month, t->year > 0 ? t->year + 2000 : 0);
-	buf_printf(&buf, "\"time\":\"%02d:%02d:%02d\",",
-	    t->hour, t->minute, t->second);
-	buf_printf(&buf, "\"status\":\"%d\",", t->status);
-	buf_printf(&buf, "\"latitude\":\"%.6f\",", t->latitude);
-	buf_printf(&buf, "\"longitude\":\"%.6f\",", t->longitude);
-	buf_printf(&buf, "\"altitude\":\"%.2f\",", t->altitude);
-	buf_printf(&buf, "\"variation\":\"%.4f\",", t->variation);
-	buf_printf(&buf, "\"speed\":\"%.2f\",", t->speed);
-	buf_printf(&buf, "\"course\":\"%.4f\",", t->course);
-	buf_printf(&buf, "\"mode\":\"%c\",", t->mode);
-	buf_printf(&buf, "\"locator\":\"%s\"", t->locator);
+	nmea_fix(t, &buf);
 
 	if (pthread_mutex_unlock(&t->mutex)) {
 		syslog(LOG_ERR, "dispatcher: pthread_mutex_unlock");
 		exit(1);
 	}
 
-	buf_addstring(&buf, "}}");
-
-	if (pthread_mutex_lock(&d->sender->mutex)) {
-		syslog(LOG_ERR, "dispatcher: pthread_mutex_lock");
-		exit(1);
-	}
-
-	d->sender->data = buf.data;
-
-	if (pthread_cond_signal(&d->sender->cond)) {
-		syslog(LOG_ERR, "dispatcher: pthread_cond_signal");
-		exit(1);
-	}
+	buf_addstring(&buf, "}");
 
-	while (d->sender->data != NULL) {
-		if (pthread_cond_wait(&d->sender->cond2, &d->sender->mutex)) {
-			syslog(LOG_ERR, "dispatcher: pthread_cond_wait");
-			exit(1);
-		}
-	}
-	pthread_mutex_unlock(&d->sender->mutex);
+	send_reply(d, buf.data);
 	buf_free(&buf);
 }
 
 static void
 destination_not_found(dispatcher_tag_t *d)
 {
-	if (pthread_mutex_lock(&d->sender->mutex)) {
-		syslog(LOG_ERR, "dispatcher: pthread_mutex_lock");
-		exit(1);
-	}
-
-	d->sender->data = "{\"status\":\"Error\",\"reason\":"
-	    "\"Destination not found\"}";
-
-	if (pthread_cond_signal(&d->sender->cond)) {
-		syslog(LOG_ERR, "dispatcher: pthread_cond_signal");
-		exit(1);
-	}
-
-	while (d->sender->data != NULL) {
-		if (pthread_cond_wait(&d->sender->cond2, &d->sender->mutex)) {
-			syslog(LOG_ERR, "dispatcher: pthread_cond_wait");
-			exit(1);
-		}
-	}
-	pthread_mutex_unlock(&d->sender->mutex);
+	send_reply(d, "{\"status\":\"Error\",\"reason\":"
+	    "\"Destination not found\"}");
 }
 
 static void
 destination_set(dispatcher_tag_t *d)
 {
-	if (pthread_mutex_lock(&d->sender->mutex)) {
-		syslog(LOG_ERR, "dispatcher: pthread_mutex_lock");
-		exit(1);
-	}
-
-	d->sender->data = "{\"status\":\"Ok\",\"message\":"
-	    "\"Destination set\"}";
-
-	if (pthread_cond_signal(&d->sender->cond)) {
-		syslog(LOG_ERR, "dispatcher: pthread_cond_signal");
-		exit(1);
-	}
-
-	while (d->sender->data != NULL) {
-		if (pthread_cond_wait(&d->sender->cond2, &d->sender->mutex)) {
-			syslog(LOG_ERR, "dispatcher: pthread_cond_wait");
-			exit(1);
-		}
-	}
-	pthread_mutex_unlock(&d->sender->mutex);
+	send_reply(d, "{\"status\":\"Ok\",\"message\":"
+	    "\"Destination set\"}");
 }
 
 static void
 destination_not_supported(dispatcher_tag_t *d)
 {
-	if (pthread_mutex_lock(&d->sender->mutex)) {
-		syslog(LOG_ERR, "dispatcher: pthread_mutex_lock");
-		exit(1);
-	}
-
-	d->sender->data = "{\"status\":\"Error\",\"reason\":"
-	    "\"Destination type not supported\"}";
-
-	if (pthread_cond_signal(&d->sender->cond)) {
-		syslog(LOG_ERR, "dispatcher: pthread_cond_signal");
-		exit(1);
-	}
-
-	while (d->sender->data != NULL) {
-		if (pthread_cond_wait(&d->sender->cond2, &d->sender->mutex)) {
-			syslog(LOG_ERR, "dispatcher: pthread_cond_wait");
-			exit(1);
-		}
-	}
-	pthread_mutex_unlock(&d->sender->mutex);
+	send_reply(d, "{\"status\":\"Error\",\"reason\":"
+	    "\"Destination type not supported\"}");
 }
 
 static void
 request_not_supported(dispatcher_tag_t *d)
 {
-	/* The sender mutex is already locked */
-	d->sender->data = "{\"status\":\"Error\",\"reason\":"
-	    "\"Request not supported by extension\"}";
-
-	if (pthread_cond_signal(&d->sender->cond)) {
-		syslog(LOG_ERR, "dispatcher: pthread_cond_signal");
-		exit(1);
-	}
-
-	while (d->sender->data != NULL) {
-		if (pthread_cond_wait(&d->sender->cond2, &d->sender->mutex)) {
-			syslog(LOG_ERR, "dispatcher: pthread_cond_wait");
-			exit(1);
-		}
-	}
-	pthread_mutex_unlock(&d->sender->mutex);
+	send_reply(d, "{\"status\":\"Error\",\"reason\":"
+	    "\"Request not supported by extension\"}");
 }
 
 static void
 request_ok(dispatcher_tag_t *d)
 {
-	/* The sender mutex is already locked */
-	d->sender->data = "{\"status\":\"Ok\",\"response\":"
-	    "\"Request handled\"}";
-
-	if (pthread_cond_signal(&d->sender->cond)) {
-		syslog(LOG_ERR, "dispatcher: pthread_cond_signal");
-		exit(1);
-	}
-
-	while (d->sender->data != NULL) {
-		if (pthread_cond_wait(&d->sender->cond2, &d->sender->mutex)) {
-			syslog(LOG_ERR, "dispatcher: pthread_cond_wait");
-			exit(1);
-		}
-	}
-	pthread_mutex_unlock(&d->sender->mutex);
+	send_reply(d, "{\"status\":\"Ok\",\"response\":"
+	    "\"Request handled\"}");
 }
 
 static void
 status_updates_not_supported(dispatcher_tag_t *d)
 {
-	if (pthread_mutex_lock(&d->sender->mutex)) {
-		syslog(LOG_ERR, "dispatcher: pthread_mutex_lock");
-		exit(1);
-	}
-
-	d->sender->data = "{\"status\":\"Error\",\"reason\":"
-	    "\"Automatic status updated not supported by destination\"}";
-
-	if (pthread_cond_signal(&d->sender->cond)) {
-		syslog(LOG_ERR, "dispatcher: pthread_cond_signal");
-		exit(1);
-	}
-
-	while (d->sender->data != NULL) {
-		if (pthread_cond_wait(&d->sender->cond2, &d->sender->mutex)) {
-			syslog(LOG_ERR, "dispatcher: pthread_cond_wait");
-			exit(1);
-		}
-	}
-	pthread_mutex_unlock(&d->sender->mutex);
+	send_reply(d, "{\"status\":\"Error\",\"reason\":"
+	    "\"Automatic status updated not supported by destination\"}");
 }
 
 static void
 listen_not_supported(dispatcher_tag_t *d)
 {
-	if (pthread_mutex_lock(&d->sender->mutex)) {
-		syslog(LOG_ERR, "dispatcher: pthread_mutex_lock");
-		exit(1);
-	}
-
-	d->sender->data = "{\"status\":\"Error\",\"reason\":"
-	    "\"Listen not supported by destination\"}";
-
-	if (pthread_cond_signal(&d->sender->cond)) {
-		syslog(LOG_ERR, "dispatcher: pthread_cond_signal");
-		exit(1);
-	}
-
-	while (d->sender->data != NULL) {
-		if (pthread_cond_wait(&d->sender->cond2, &d->sender->mutex)) {
-			syslog(LOG_ERR, "dispatcher: pthread_cond_wait");
-			exit(1);
-		}
-	}
-	pthread_mutex_unlock(&d->sender->mutex);
+	send_reply(d, "{\"status\":\"Error\",\"reason\":"
+	    "\"Listen not supported by destination\"}");
 }
 
+/*
+ * Start the poller, or tell the trx-controller to start the trx-handler.
+ * The driver talks to the transceiver, so this must be done in the
+ * trx-controller thread, which is not possible with the trx mutex locked.
+ */
 static void
 start_updater_if_not_running(trx_controller_tag_t *t)
 {
+	char *response;
+
 	if (t->poller_required) {
+		pthread_mutex_lock(&t->mutex);
 		if (t->poller_running == 0) {
 			t->poller_running = 1;
 			pthread_create(&t->trx_poller, NULL, trx_poller, t);
 		}
+		pthread_mutex_unlock(&t->mutex);
 	} else {
-		if (t->handler_running = 0) {
-			t->handler_running = 1;
-			lua_geti(t->L, LUA_REGISTRYINDEX, t->ref);
-			lua_getfield(t->L, -1, "startStatusUpdates");
-			lua_pcall(t->L, 0, 1, 0);
-			t->handler_eol = lua_tointeger(t->L, -1);
-			if (verbose > 1)
-				printf("EOL character is %c\n", t->handler_eol);
-			pthread_create(&t->trx_handler, NULL, trx_handler, t);
-		}
+		response = trx_call(t, TRX_CLASS_SET, "startStatusUpdates",
+		    NULL, 0, NULL);
+		free(response);
 	}
 }
 
@@ -485,6 +677,7 @@ static void
 add_sender(dispatcher_tag_t *d, destination_t *dst)
 {
 	sender_list_t *p, *l;
+	int added = 0;
 
 	pthread_mutex_lock(&dst->tag.trx->mutex);
 
@@ -500,8 +693,9 @@ add_sender(dispatcher_tag_t *d, destination_t *dst)
 			}
 			p = p->next;
 			p->sender = d->sender;
+			p->filter = NULL;
 			p->next = NULL;
-			start_updater_if_not_running(dst->tag.trx);
+			added = 1;
 		}
 	} else {
 		dst->tag.trx->senders = malloc(sizeof(sender_list_t));
@@ -510,10 +704,61 @@ add_sender(dispatcher_tag_t *d, destination_t *dst)
 			exit(1);
 		}
 		dst->tag.trx->senders->sender = d->sender;
+		dst->tag.trx->senders->filter = NULL;
 		dst->tag.trx->senders->next = NULL;
-		start_updater_if_not_running(dst->tag.trx);
+		added = 1;
 	}
 	pthread_mutex_unlock(&dst->tag.trx->mutex);
+
+	if (added)
+		start_updater_if_not_running(dst->tag.trx);
+}
+
+/* The nmea-handler sends fix changes to the senders in its list */
+static void
+add_nmea_sender(dispatcher_tag_t *d, nmea_tag_t *t)
+{
+	sender_list_t *l;
+
+	pthread_mutex_lock(&t->mutex);
+	for (l = t->senders; l != NULL; l = l->next)
+		if (l->sender == d->sender)
+			break;
+	if (l == NULL) {
+		l = malloc(sizeof(sender_list_t));
+		if (l == NULL) {
+			syslog(LOG_ERR, "malloc");
+			exit(1);
+		}
+		l->sender = d->sender;
+		l->filter = NULL;
+		l->next = t->senders;
+		t->senders = l;
+
+		/* Send the current fix to the new client, too */
+		free(t->last);
+		t->last = NULL;
+	}
+	pthread_mutex_unlock(&t->mutex);
+}
+
+static void
+remove_nmea_sender(dispatcher_tag_t *d, nmea_tag_t *t)
+{
+	sender_list_t *p, *l;
+
+	pthread_mutex_lock(&t->mutex);
+	for (l = t->senders, p = NULL; l; p = l, l = l->next) {
+		if (l->sender == d->sender) {
+			if (p == NULL)
+				t->senders = l->next;
+			else
+				p->next = l->next;
+			free(l);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&t->mutex);
 }
 
 static void
@@ -521,14 +766,16 @@ remove_sender(dispatcher_tag_t *d, destination_t *dst)
 {
 	sender_list_t *p, *l;
 	trx_controller_tag_t *t;
-	int n;
+	char *response;
+	int n, removed = 0;
 
 	pthread_mutex_lock(&dst->tag.trx->mutex);
 
 	for (l = dst->tag.trx->senders, p = NULL; l; p = l, l = l->next) {
 		if (l->sender == d->sender) {
+			removed = 1;
 			if (p == NULL) {
-				dst->tag.trx->senders = NULL;
+				dst->tag.trx->senders = l->next;
 				free(l);
 				break;
 			} else {
@@ -547,67 +794,63 @@ remove_sender(dispatcher_tag_t *d, destination_t *dst)
 			l = l->next;
 	}
 
-	if (n == 0) {
-		t = dst->tag.trx;
-
-		if (t->poller_running) {
-			t->poller_running = 0;
-			if (verbose > 1)
-				printf("dispatcher: stopping the poller\n");
-			pthread_cancel(t->trx_poller);
-		} else if (t->handler_running) {
-			t->handler_running = 0;
-			if (verbose > 1)
-				printf("dispatcher: stopping the handler\n");
-			lua_geti(t->L, LUA_REGISTRYINDEX, t->ref);
-			lua_getfield(t->L, -1, "stopStatusUpdates");
-			lua_pcall(t->L, 0, 1, 0);
-			pthread_cancel(t->trx_handler);
-		}
+	t = dst->tag.trx;
+	if (n == 0 && t->poller_running) {
+		t->poller_running = 0;
+		if (verbose > 1)
+			printf("dispatcher: stopping the poller\n");
+		pthread_cancel(t->trx_poller);
 	}
 	pthread_mutex_unlock(&dst->tag.trx->mutex);
+
+	/* The trx-controller stops the handler if there are no listeners */
+	if (removed && n == 0 && !t->poller_required) {
+		if (verbose > 1)
+			printf("dispatcher: stopping the handler\n");
+		response = trx_call(t, TRX_CLASS_SET, "stopStatusUpdates",
+		    NULL, 0, NULL);
+		free(response);
+	}
 }
 
+/*
+ * Add a listener to an extension, or replace the filter of a client that
+ * is already listening.  The filter is owned by the listener.
+ */
 static void
-add_listener(dispatcher_tag_t *d, destination_t *dst)
+add_listener(dispatcher_tag_t *d, destination_t *dst, listen_filter_t *filter)
 {
-	sender_list_t *p, *l;
+	extension_tag_t *e = dst->tag.extension;
+	sender_list_t *l;
 
-	pthread_mutex_lock(&dst->tag.extension->mutex);
-	pthread_mutex_lock(&dst->tag.extension->mutex2);
+	pthread_mutex_lock(&e->mutex);
+	pthread_mutex_lock(&e->mutex2);
 
-	if (dst->tag.extension->listeners != NULL) {
-		for (l = dst->tag.extension->listeners; l; p = l, l = l->next)
-			if (l->sender == d->sender)
-				break;
+	for (l = e->listeners; l != NULL; l = l->next)
+		if (l->sender == d->sender)
+			break;
+	if (l == NULL) {
+		l = malloc(sizeof(sender_list_t));
 		if (l == NULL) {
-			p->next = malloc(sizeof(sender_list_t));
-			if (p->next == NULL) {
-				syslog(LOG_ERR, "malloc");
-				exit(1);
-		}
-		p = p->next;
-			p->sender = d->sender;
-			p->next = NULL;
-		}
-	} else {
-		dst->tag.extension->listeners = malloc(sizeof(sender_list_t));
-		if (dst->tag.extension->listeners == NULL) {
 			syslog(LOG_ERR, "malloc");
 			exit(1);
 		}
-		dst->tag.extension->listeners->sender = d->sender;
-		dst->tag.extension->listeners->next = NULL;
+		l->sender = d->sender;
+		l->filter = NULL;
+		l->next = e->listeners;
+		e->listeners = l;
 	}
-	pthread_mutex_unlock(&dst->tag.extension->mutex);
-	pthread_mutex_unlock(&dst->tag.extension->mutex2);
+	filter_free(l->filter);
+	l->filter = filter;
+
+	pthread_mutex_unlock(&e->mutex);
+	pthread_mutex_unlock(&e->mutex2);
 }
 
 static void
 remove_listener(dispatcher_tag_t *d, destination_t *dst)
 {
 	sender_list_t *p, *l;
-	extension_tag_t * t;
 
 	pthread_mutex_lock(&dst->tag.extension->mutex);
 	pthread_mutex_lock(&dst->tag.extension->mutex2);
@@ -615,35 +858,60 @@ remove_listener(dispatcher_tag_t *d, destination_t *dst)
 	for (l = dst->tag.extension->listeners, p = NULL; l;
 	    p = l, l = l->next) {
 		if (l->sender == d->sender) {
-			if (p == NULL) {
-				dst->tag.extension->listeners = NULL;
-				free(l);
-				break;
-			} else {
+			if (p == NULL)
+				dst->tag.extension->listeners = l->next;
+			else
 				p->next = l->next;
-				free(l);
-				break;
-			}
+			filter_free(l->filter);
+			free(l);
+			break;
 		}
 	}
 	pthread_mutex_unlock(&dst->tag.extension->mutex);
 	pthread_mutex_unlock(&dst->tag.extension->mutex2);
 }
 
+/* Listen to an extension, optionally with a filter */
+static void
+listen_extension(lua_State *L, int request, dispatcher_tag_t *d,
+    destination_t *dst)
+{
+	listen_filter_t *filter = NULL;
+	struct buffer buf;
+	const char *error;
+
+	if (lua_getfield(L, request, "filter") == LUA_TTABLE
+	    && (filter = filter_compile(L, -1, &error)) == NULL) {
+		lua_pop(L, 1);
+		buf_init(&buf);
+		buf_printf(&buf, "{\"status\":\"Error\",\"reason\":"
+		    "\"%s\"}", error);
+		send_reply(d, buf.data);
+		buf_free(&buf);
+		return;
+	}
+	lua_pop(L, 1);
+	add_listener(d, dst, filter);
+	request_ok(d);
+}
+
 static void
 call_extension(lua_State *L, dispatcher_tag_t* d, extension_tag_t *e,
     const char *req)
 {
 	pthread_mutex_lock(&e->mutex);
 
-	if (pthread_mutex_lock(&d->sender->mutex)) {
+	if (pthread_mutex_lock(&e->mutex2)) {
 		syslog(LOG_ERR, "dispatcher: pthread_mutex_lock");
 		exit(1);
 	}
 
-	if (pthread_mutex_lock(&e->mutex2)) {
-		syslog(LOG_ERR, "dispatcher: pthread_mutex_lock");
-		exit(1);
+	/* The extension has been removed by a configuration reload */
+	if (e->removed) {
+		pthread_mutex_unlock(&e->mutex2);
+		destination_removed(d);
+		pthread_mutex_unlock(&e->mutex);
+		return;
 	}
 
 	e->done = 0;
@@ -655,14 +923,13 @@ call_extension(lua_State *L, dispatcher_tag_t* d, extension_tag_t *e,
 		proxy_map(L, e->L, lua_gettop(e->L));
 		e->call = 1;
 
+		/* mutex2 is released while waiting for the extension */
 		pthread_cond_signal(&e->cond1);
-		if (pthread_mutex_unlock(&e->mutex2)) {
-			syslog(LOG_ERR, "dispatcher: pthread_mutex_unlock");
-			exit(1);
-		}
 
+		pthread_cleanup_push(cleanup_extension_call, e);
 		while (!e->done)
 			pthread_cond_wait(&e->cond2, &e->mutex2);
+		pthread_cleanup_pop(0);
 
 		e->done = 0;
 
@@ -694,33 +961,251 @@ call_extension(lua_State *L, dispatcher_tag_t* d, extension_tag_t *e,
 			exit(1);
 		}
 
-		d->sender->data = (char *)lua_tostring(L, -1);
+		send_reply(d, lua_tostring(L, -1));
+	}
+	pthread_mutex_unlock(&e->mutex2);
+	pthread_mutex_unlock(&e->mutex);
+}
+
+struct fan_out {
+	trx_controller_tag_t	**trx;
+	token_bucket_t		**limit;
+	trx_request_t		**r;
+	char			**response;
+	int			 n;
+	int			 waiting;
+};
 
-		if (pthread_cond_signal(&d->sender->cond)) {
-			syslog(LOG_ERR, "dispatcher: pthread_cond_signal");
-			exit(1);
+/* The dispatcher was cancelled, trx_wait() cleans up the current request */
+static void
+cancel_fan_out(void *arg)
+{
+	struct fan_out *f = (struct fan_out *)arg;
+	int n;
+
+	for (n = f->waiting + 1; n < f->n; n++)
+		if (f->r[n] != NULL)
+			trx_abandon(f->trx[n], f->r[n]);
+	for (n = 0; n < f->n; n++)
+		free(f->response[n]);
+	free(f->trx);
+	free(f->limit);
+	free(f->r);
+	free(f->response);
+}
+
+static char *
+fan_out_error(const char *name, const char *reason)
+{
+	char *response;
+
+	if (asprintf(&response, "{\"status\":\"Error\",\"reason\":\"%s\","
+	    "\"from\":\"%s\"}", reason, name) == -1) {
+		syslog(LOG_ERR, "dispatcher: asprintf");
+		exit(1);
+	}
+	return response;
+}
+
+/*
+ * Send a request to several transceivers.  All requests are queued before
+ * waiting for the first response, so the trx-controllers serve them at the
+ * same time.  The request takes a single token from the client's bucket
+ * and waits at most once for the buckets of all transceivers.  The
+ * responses are returned as one response, its status is "Ok" only if all
+ * requests succeeded.
+ */
+static void
+fan_out(lua_State *L, int request, dispatcher_tag_t *d, const char **name,
+    int n, const char *req)
+{
+	struct fan_out f;
+	destination_t *dst;
+	const char *key;
+	long retry;
+	int i, j, nlimited = 0;
+	volatile int ok = 1, refused = 0;
+
+	f.n = n;
+	f.waiting = -1;
+	f.trx = calloc(n, sizeof(trx_controller_tag_t *));
+	f.limit = calloc(n, sizeof(token_bucket_t *));
+	f.r = calloc(n, sizeof(trx_request_t *));
+	f.response = calloc(n, sizeof(char *));
+	if (n > 0 && (f.trx == NULL || f.limit == NULL || f.r == NULL
+	    || f.response == NULL)) {
+		syslog(LOG_ERR, "dispatcher: calloc");
+		exit(1);
+	}
+
+	pthread_cleanup_push(cancel_fan_out, &f);
+	for (i = 0; i < n; i++) {
+		dst = find_destination(name[i]);
+		if (dst == NULL)
+			f.response[i] = fan_out_error(name[i],
+			    "Destination not found");
+		else if (dst->type != DEST_TRX)
+			f.response[i] = fan_out_error(name[i],
+			    "Destination not supported");
+		else if ((f.response[i] = trx_state_response(L, request, dst,
+		    req)) == NULL) {
+			f.trx[i] = dst->tag.trx;
+			f.limit[nlimited++] = &f.trx[i]->limit;
 		}
+		release_destination(dst);
+	}
+
+	/* The buckets of refused transceivers are set to NULL */
+	if (nlimited > 0 && trx_request_class(req) != TRX_CLASS_PTT)
+		refused = ratelimit_take(&d->sender->limit, f.limit, nlimited,
+		    &retry);
+
+	key = request_key(L, request, req);
+	for (i = 0, j = 0; i < n; i++) {
+		if (f.trx[i] == NULL)
+			continue;
+		if (refused || f.limit[j++] == NULL)
+			f.response[i] = rate_limit_exceeded(f.trx[i], req,
+			    retry);
+		else
+			f.r[i] = trx_submit(f.trx[i], trx_request_class(req),
+			    "requestHandler", d->data, strlen(d->data),
+			    d->sender->socket, key);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (f.r[i] == NULL)
+			continue;
+		f.waiting = i;
+		f.response[i] = trx_wait(f.trx[i], f.r[i]);
+		f.r[i] = NULL;
+	}
+	pthread_cleanup_pop(0);
 
-		while (d->sender->data != NULL) {
-			if (pthread_cond_wait(&d->sender->cond2,
-			    &d->sender->mutex)) {
-				syslog(LOG_ERR, "dispatcher: "
-				    "pthread_cond_wait");
-				exit(1);
-			}
+	/* Aggregate the responses, empty ones are left out */
+	lua_settop(L, request);
+	lua_newtable(L);
+	lua_newtable(L);
+	for (i = 0; i < n; i++) {
+		if (strlen(f.response[i]) == 0)
+			continue;
+		lua_getglobal(L, "json");
+		lua_getfield(L, -1, "decode");
+		lua_pushstring(L, f.response[i]);
+		if (lua_pcall(L, 1, 1, 0) != LUA_OK
+		    || lua_type(L, -1) != LUA_TTABLE) {
+			lua_pop(L, 2);
+			continue;
 		}
+		lua_getfield(L, -1, "status");
+		if (lua_tostring(L, -1) == NULL
+		    || strcmp(lua_tostring(L, -1), "Ok"))
+			ok = 0;
+		lua_pop(L, 1);
+		lua_seti(L, -3, luaL_len(L, -3) + 1);
+		lua_pop(L, 1);
+	}
+	lua_setfield(L, -2, "responses");
+	lua_pushstring(L, ok ? "Ok" : "Failure");
+	lua_setfield(L, -2, "status");
+	lua_pushstring(L, req);
+	lua_setfield(L, -2, "response");
+
+	lua_getglobal(L, "json");
+	lua_getfield(L, -1, "encode");
+	lua_pushvalue(L, -3);
+	if (lua_pcall(L, 1, 1, 0) != LUA_OK) {
+		syslog(LOG_ERR, "dispatcher: %s", lua_tostring(L, -1));
+		exit(1);
 	}
-	pthread_mutex_unlock(&d->sender->mutex);
-	pthread_mutex_unlock(&e->mutex2);
-	pthread_mutex_unlock(&e->mutex);
+	send_reply(d, lua_tostring(L, -1));
+	lua_settop(L, request);
+
+	for (i = 0; i < n; i++)
+		free(f.response[i]);
+	free(f.trx);
+	free(f.limit);
+	free(f.r);
+	free(f.response);
+}
+
+/*
+ * The to field is a list of destination names.  A list can not name more
+ * destinations than there are, longer lists are refused.  The names remain
+ * valid while the request is on the stack.
+ */
+static void
+fan_out_list(lua_State *L, int request, dispatcher_tag_t *d,
+    const char *req)
+{
+	destination_t *dst;
+	const char **name;
+	char *response;
+	int n, i, ndestinations = 0;
+
+	destination_rdlock();
+	for (dst = destination; dst != NULL; dst = dst->next)
+		ndestinations++;
+	destination_unlock();
+
+	lua_getfield(L, request, "to");
+	n = luaL_len(L, -1);
+	if (n > ndestinations) {
+		lua_pop(L, 1);
+		if (asprintf(&response, "{\"status\":\"Failure\","
+		    "\"response\":\"%s\",\"reason\":"
+		    "\"Too many destinations\"}", req) == -1) {
+			syslog(LOG_ERR, "dispatcher: asprintf");
+			exit(1);
+		}
+		send_reply(d, response);
+		free(response);
+		return;
+	}
+
+	name = calloc(n, sizeof(char *));
+	if (n > 0 && name == NULL) {
+		syslog(LOG_ERR, "dispatcher: calloc");
+		exit(1);
+	}
+	for (i = 0; i < n; i++) {
+		if (lua_geti(L, -1, i + 1) == LUA_TSTRING)
+			name[i] = lua_tostring(L, -1);
+		else
+			name[i] = "";
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+
+	pthread_cleanup_push(free, name);
+	fan_out(L, request, d, name, n, req);
+	pthread_cleanup_pop(1);
 }
 
 static void
-dispatch(lua_State *L, dispatcher_tag_t *d, destination_t *to, const char *req)
+dispatch(lua_State *L, int request, dispatcher_tag_t *d, destination_t *to,
+    const char *req)
 {
+	const char *key = NULL;
+	char *response;
+
 	switch (to->type) {
 	case DEST_TRX:
-		call_trx_controller(d, to->tag.trx);
+		if (!trx_attached(to->tag.trx)) {
+			trx_not_attached(d, to->tag.trx, req);
+			break;
+		}
+		if (call_trx_state(L, request, d, to, req))
+			break;
+		if ((response = rate_limited(d, to->tag.trx, req)) != NULL) {
+			send_reply(d, response);
+			free(response);
+			break;
+		}
+
+		key = request_key(L, request, req);
+		call_trx_controller(d, to->tag.trx, req, key);
+		lua_settop(L, request);
 		break;
 	case DEST_SDR:
 		call_sdr_controller(d, to->tag.sdr);
@@ -740,26 +1225,43 @@ dispatch(lua_State *L, dispatcher_tag_t *d, destination_t *to, const char *req)
 	case DEST_EXTENSION:
 		call_extension(L, d, to->tag.extension, req);
 		break;
+	case DEST_GROUP:
+		fan_out(L, request, d, (const char **)to->tag.group->member,
+		    to->tag.group->nmembers, req);
+		break;
 	default:
 		destination_not_supported(d);
 	}
 }
 
+/* The connected clients and their output queues */
+static void
+list_clients(dispatcher_tag_t *d)
+{
+	struct buffer buf;
+
+	buf_init(&buf);
+	buf_addstring(&buf,
+	    "{\"status\":\"Ok\",\"response\":\"list-clients\","
+	    "\"clients\":");
+	sender_list(&buf, d->sender);
+	buf_addstring(&buf, "}");
+	send_reply(d, buf.data);
+	buf_free(&buf);
+}
+
 void
 list_destination(dispatcher_tag_t *d)
 {
 	struct buffer buf;
 	destination_t *dest;
-
-	if (pthread_mutex_lock(&d->sender->mutex)) {
-		syslog(LOG_ERR, "dispatcher: pthread_mutex_lock");
-		exit(1);
-	}
+	int n;
 
 	buf_init(&buf);
 	buf_addstring(&buf,
 	    "{\"status\":\"Ok\",\"response\":\"list-destination\","
 	    "\"destination\":[");
+	destination_rdlock();
 	for (dest = destination; dest != NULL; dest = dest->next) {
 		if (dest != destination)
 			buf_addchar(&buf, ',');
@@ -790,12 +1292,25 @@ list_destination(dispatcher_tag_t *d)
 		case DEST_EXTENSION:
 			buf_addstring(&buf, "extension");
 			break;
+		case DEST_GROUP:
+			buf_addstring(&buf, "group");
+			break;
 		}
 		buf_addchar(&buf, '"');
 
+		if (dest->type == DEST_GROUP) {
+			buf_addstring(&buf, ",\"members\":[");
+			for (n = 0; n < dest->tag.group->nmembers; n++)
+				buf_printf(&buf, "%s\"%s\"", n > 0 ? "," : "",
+				    dest->tag.group->member[n]);
+			buf_addchar(&buf, ']');
+		}
+
 		if (dest->type == DEST_TRX) {
 			if (dest->tag.trx->is_default)
 				buf_addstring(&buf, ",\"default\":true");
+			buf_printf(&buf, ",\"attached\":%s",
+			    trx_attached(dest->tag.trx) ? "true" : "false");
 			if (dest->tag.trx->audio_input)
 				buf_printf(&buf, ",\"audioIn\":\"%s\"",
 				    dest->tag.trx->audio_input);
@@ -806,22 +1321,10 @@ list_destination(dispatcher_tag_t *d)
 
 		buf_addchar(&buf, '}');
 	}
+	destination_unlock();
 	buf_addstring(&buf, "]}");
 
-	d->sender->data = buf.data;
-
-	if (pthread_cond_signal(&d->sender->cond)) {
-		syslog(LOG_ERR, "dispatcher: pthread_cond_signal");
-		exit(1);
-	}
-
-	while (d->sender->data != NULL) {
-		if (pthread_cond_wait(&d->sender->cond2, &d->sender->mutex)) {
-			syslog(LOG_ERR, "dispatcher: pthread_cond_wait");
-			exit(1);
-		}
-	}
-	pthread_mutex_unlock(&d->sender->mutex);
+	send_reply(d, buf.data);
 	buf_free(&buf);
 }
 
@@ -829,13 +1332,19 @@ static void
 cleanup(void *arg)
 {
 	dispatcher_tag_t *d = (dispatcher_tag_t *)arg;
+	dispatcher_request_t *r;
 	destination_t *dst;
 
+	destination_rdlock();
 	for (dst = destination; dst != NULL; dst = dst->next) {
 		switch (dst->type) {
 		case DEST_TRX:
 			remove_sender(d, dst);
 			break;
+		case DEST_INTERNAL:
+			if (!strcmp(dst->name, "nmea"))
+				remove_nmea_sender(d, dst->tag.nmea);
+			break;
 		case DEST_EXTENSION:
 			remove_listener(d, dst);
 			break;
@@ -843,9 +1352,50 @@ cleanup(void *arg)
 			break;
 		}
 	}
+	destination_unlock();
+
+	while (d->inbox != NULL) {
+		r = d->inbox;
+		d->inbox = r->next;
+		free(r->data);
+		free(r);
+	}
+	free(d->data);
+	sender_release(d->sender);
 	free(arg);
 }
 
+/* The default transceiver, or the first one */
+static destination_t *
+default_destination(void)
+{
+	destination_t *to;
+
+	destination_rdlock();
+	for (to = destination; to != NULL; to = to->next)
+		if (to->type == DEST_TRX && to->tag.trx->is_default)
+			break;
+
+	if (to == NULL)
+		for (to = destination; to != NULL; to = to->next)
+			if (to->type == DEST_TRX)
+				break;
+
+	if (to == NULL)
+		 to = destination;
+	if (to != NULL)
+		hold_destination(to);
+	destination_unlock();
+	return to;
+}
+
+/* Release the destination the client talks to when it goes away */
+static void
+cleanup_destination(void *arg)
+{
+	release_destination(*(destination_t * volatile *)arg);
+}
+
 static void
 cleanup_lua(void *arg)
 {
@@ -859,9 +1409,9 @@ dispatcher(void *arg)
 {
 	dispatcher_tag_t *d = (dispatcher_tag_t *)arg;
 	trx_controller_tag_t *t;
-	destination_t *to, *dst;
+	destination_t * volatile to, *dst;
 	lua_State *L;
-	int status, request;
+	int status, request, is_list;
 	const char *dest, *req;
 
 	if (pthread_detach(pthread_self())) {
@@ -876,18 +1426,8 @@ dispatcher(void *arg)
 		exit(1);
 	}
 
-	/* Check if we have a default transceiver */
-	for (to = destination; to != NULL; to = to->next)
-		if (to->type == DEST_TRX && to->tag.trx->is_default)
-			break;
-
-	if (to == NULL)
-		for (to = destination; to != NULL; to = to->next)
-			if (to->type == DEST_TRX)
-				break;
-
-	if (to == NULL)
-		 to = destination;
+	to = default_destination();
+	pthread_cleanup_push(cleanup_destination, (void *)&to);
 
 	/* Setup Lua */
 	L = luaL_newstate();
@@ -916,13 +1456,14 @@ dispatcher(void *arg)
 		exit(1);
 	}
 
+	if (pthread_mutex_unlock(&d->mutex)) {
+		syslog(LOG_ERR, "dispatcher: pthread_mutex_unlock");
+		exit(1);
+	}
+
 	for (;;) {
-		while (d->data == NULL) {
-			if (pthread_cond_wait(&d->cond, &d->mutex)) {
-				syslog(LOG_ERR, "dispatcher: pthread_cond_wait");
-				exit(1);
-			}
-		}
+		d->data = next_request(d);
+
 		lua_getglobal(L, "json");
 		if (lua_type(L, -1) != LUA_TTABLE) {
 			syslog(LOG_ERR, "dispatcher: table expected");
@@ -953,43 +1494,61 @@ dispatcher(void *arg)
 		request = lua_gettop(L);
 		dest = NULL;
 		dst = NULL;
+		is_list = 0;
 		lua_getfield(L, request, "to");
 		if (lua_type(L, -1) == LUA_TSTRING) {
 			dest = lua_tostring(L, -1);
-
-			for (dst = destination; dst != NULL; dst = dst->next) {
-				if (!strcmp(dst->name, dest)) {
-					to = dst;
-					break;
-				}
+			if ((dst = find_destination(dest)) != NULL) {
+				release_destination(to);
+				to = dst;
+			}
+		} else if (lua_istable(L, -1))
+			is_list = 1;
+		else {
+			/* The default might have been removed by a reload */
+			if (to == NULL || to->removed) {
+				release_destination(to);
+				to = default_destination();
 			}
-		} else
 			dst = to;
+		}
 
 		lua_getfield(L, request, "request");
 		req = lua_tostring(L, -1);
 		lua_pop(L, 2);
 
-		if (dst == NULL)
+		if (is_list) {
+			if (req)
+				fan_out_list(L, request, d, req);
+			else
+				destination_not_found(d);
+		} else if (dst == NULL)
 			destination_not_found(d);
 		else {
 			if (req && !strcmp(req, "start-status-updates")) {
 				if (dst->type == DEST_TRX) {
 					add_sender(d, dst);
 					request_ok(d);
+				} else if (dst->type == DEST_INTERNAL
+				    && !strcmp(dst->name, "nmea")) {
+					add_nmea_sender(d, dst->tag.nmea);
+					request_ok(d);
 				} else
 					status_updates_not_supported(d);
 			} else if (req && !strcmp(req, "stop-status-updates")) {
 				if (dst->type == DEST_TRX) {
 					remove_sender(d, dst);
 					request_ok(d);
+				} else if (dst->type == DEST_INTERNAL
+				    && !strcmp(dst->name, "nmea")) {
+					remove_nmea_sender(d, dst->tag.nmea);
+					request_ok(d);
 				} else
 					status_updates_not_supported(d);
 			} else if (req && !strcmp(req, "listen")) {
-				if (dst->type == DEST_EXTENSION) {
-					add_listener(d, dst);
-					request_ok(d);
-				} else
+				if (dst->type == DEST_EXTENSION)
+					listen_extension(L, request, d, dst);
+				else
 					listen_not_supported(d);
 			} else if (req && !strcmp(req, "unlisten")) {
 				if (dst->type == DEST_EXTENSION) {
@@ -999,8 +1558,16 @@ dispatcher(void *arg)
 					listen_not_supported(d);
 			} else if (req && !strcmp(req, "list-destination"))
 				list_destination(d);
+			else if (req && !strcmp(req, "list-clients"))
+				list_clients(d);
+			else if (req && !strcmp(req, "get-statistics")
+			    && dst->type == DEST_TRX)
+				get_statistics(d, dst);
+			else if (req && dst->type == DEST_TRX
+			    && superseded(L, request, d, dst, req))
+				request_superseded(d, dst, req);
 			else if (req) {
-				dispatch(L, d, dst, req);
+				dispatch(L, request, d, dst, req);
 				/* XXX check stack depth */
 				/* lua_pop(L, 4); */
 			} else
@@ -1008,12 +1575,9 @@ dispatcher(void *arg)
 		}
 		free(d->data);
 		d->data = NULL;
-		if (pthread_cond_signal(&d->cond2)) {
-			syslog(LOG_ERR, "dispatcher: pthread_cond_signal");
-			exit(1);
-		}
 	}
 	pthread_cleanup_pop(0);
 	pthread_cleanup_pop(0);
+	pthread_cleanup_pop(0);
 	return NULL;
 }
@@ -50,6 +50,35 @@ cleanup(void *arg)
 
 __thread extension_tag_t	*extension_tag;
 
+/*
+ * The extension has been removed by a configuration reload, the mutex2 is
+ * locked.  The tag is not freed, dispatchers might still refer to it.
+ */
+static void
+stop(extension_tag_t *t)
+{
+	signal_input_t *i, *next;
+
+	/* They check for removal once they get the mutex2 */
+	for (i = t->inputs; i != NULL; i = next) {
+		next = i->next;
+		pthread_cancel(i->signal_input);
+	}
+	t->inputs = NULL;
+
+	t->done = 1;
+	if (pthread_cond_broadcast(&t->cond2)) {
+		syslog(LOG_ERR, "extension: pthread_cond_broadcast");
+		exit(1);
+	}
+	if (pthread_mutex_unlock(&t->mutex2)) {
+		syslog(LOG_ERR, "extension: pthread_mutex_unlock");
+		exit(1);
+	}
+	lua_close(t->L);
+	t->L = NULL;
+}
+
 void *
 extension(void *arg)
 {
@@ -89,6 +118,8 @@ extension(void *arg)
 				}
 			}
 			t->call = 0;
+			if (t->removed)
+				break;
 			switch (lua_pcall(t->L, 1, 1, 0)) {
 			case LUA_OK:
 				break;
@@ -107,6 +138,7 @@ extension(void *arg)
 				exit(1);
 			}
 		}
+		stop(t);
 	} else {
 		if (t->has_config)
 			lua_call(t->L, 1, 1);
@@ -0,0 +1,70 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2023 - 2024 Marc Balmer HB9SSB
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to
+# deal in the Software without restriction, including without limitation the
+# rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+# sell copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+# FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+# IN THE SOFTWARE.
+#
+# Stand in for gpsd to test the gpsd option of the nmea destination
+# without a GNSS receiver.  Each client is sent the reports of a log, one
+# line per report as gpsd sends them after ?WATCH, then the connection is
+# closed so that the reconnect of trxd is exercised as well.
+#
+# usage: gpsd-replay.py [-p port] [-d delay] [log]
+
+import argparse
+import os
+import socket
+import sys
+import time
+
+parser = argparse.ArgumentParser()
+parser.add_argument('-p', '--port', type=int, default=2947)
+parser.add_argument('-d', '--delay', type=float, default=0.2,
+    help='seconds between reports')
+parser.add_argument('log', nargs='?',
+    default=os.path.join(os.path.dirname(__file__), 'gpsd.log'))
+args = parser.parse_args()
+
+with open(args.log) as f:
+    reports = [line.strip() for line in f if line.strip()]
+
+s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+s.bind(('127.0.0.1', args.port))
+s.listen(1)
+
+while True:
+    c, peer = s.accept()
+    print('connected', peer, file=sys.stderr)
+
+    # gpsd sends nothing but the version banner before ?WATCH
+    c.sendall((reports[0] + '\n').encode())
+    watch = c.recv(256).decode(errors='replace')
+    print('<-', watch.strip(), file=sys.stderr)
+    if not watch.startswith('?WATCH'):
+        c.close()
+        continue
+
+    try:
+        for report in reports[1:]:
+            time.sleep(args.delay)
+            c.sendall((report + '\n').encode())
+    except OSError as e:
+        print('send:', e, file=sys.stderr)
+    c.close()
@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2014 - 2024 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+/*
+ * Maidenhead locators, distance and bearing on the great circle.  The
+ * distance functions work on arrays of points, with the latitudes and
+ * longitudes in separate arrays, so that the loops can be vectorized.
+ */
+
+#include <math.h>
+
+#include "geo.h"
+
+#define RAD(x)		((x) * M_PI / 180.0)
+#define DEG(x)		((x) * 180.0 / M_PI)
+
+/*
+ * The locator is made of pairs of letters and digits, each pair divides
+ * the area of the previous one in longitude and latitude.
+ */
+static const struct {
+	char	base;
+	int	steps;
+	double	lon;		/* Size in degrees */
+	double	lat;
+} pair[GEO_LOCATORMAX / 2] = {
+	{ 'A', 18, 20.0,		10.0 },		/* Field */
+	{ '0', 10, 2.0,			1.0 },		/* Square */
+	{ 'A', 24, 2.0 / 24,		1.0 / 24 },	/* Subsquare */
+	{ '0', 10, 2.0 / 240,		1.0 / 240 },	/* Extended square */
+	{ 'A', 24, 2.0 / 5760,		1.0 / 5760 }
+};
+
+/*
+ * Encode a position as a locator of len (2, 4, 6, 8, or 10) characters,
+ * loc must have room for the terminating NUL.
+ */
+int
+geo_locator(double lat, double lon, int len, char *loc)
+{
+	int n, x, y;
+
+	if (len < 2 || len > GEO_LOCATORMAX || len % 2
+	    || lon >= 180.0 || lon < -180.0 || lat >= 90.0 || lat < -90.0)
+		return -1;
+
+	lon += 180.0;
+	lat += 90.0;
+	for (n = 0; n < len / 2; n++) {
+		x = lon / pair[n].lon;
+		y = lat / pair[n].lat;
+
+		/* Rounding must not carry over into the next character */
+		if (x >= pair[n].steps)
+			x = pair[n].steps - 1;
+		if (y >= pair[n].steps)
+			y = pair[n].steps - 1;
+
+		loc[2 * n] = pair[n].base + x;
+		loc[2 * n + 1] = pair[n].base + y;
+		lon -= x * pair[n].lon;
+		lat -= y * pair[n].lat;
+	}
+	loc[len] = '\0';
+	return 0;
+}
+
+/* Decode a locator to the position at the center of its area */
+int
+geo_position(const char *loc, size_t len, double *lat, double *lon)
+{
+	int n, c, i, x[2];
+
+	if (len < 2 || len > GEO_LOCATORMAX || len % 2)
+		return -1;
+
+	*lon = -180.0;
+	*lat = -90.0;
+	for (n = 0; n < len / 2; n++) {
+		for (i = 0; i < 2; i++) {
+			c = loc[2 * n + i];
+			if (pair[n].base == 'A' && c >= 'a' && c <= 'z')
+				c -= 'a' - 'A';
+			x[i] = c - pair[n].base;
+			if (x[i] < 0 || x[i] >= pair[n].steps)
+				return -1;
+		}
+		*lon += x[0] * pair[n].lon;
+		*lat += x[1] * pair[n].lat;
+	}
+	*lon += pair[n - 1].lon / 2;
+	*lat += pair[n - 1].lat / 2;
+	return 0;
+}
+
+/*
+ * Distance in km and initial bearing in degrees from one position to n
+ * others, using the haversine formula.  bearing can be NULL.
+ */
+void
+geo_distance(double lat, double lon, const double *restrict lat2,
+    const double *restrict lon2, size_t n, double *restrict dist,
+    double *restrict bearing)
+{
+	double phi, sinphi, cosphi, a, dphi, dlambda, cosphi2;
+	size_t i;
+
+	phi = RAD(lat);
+	sinphi = sin(phi);
+	cosphi = cos(phi);
+
+	for (i = 0; i < n; i++) {
+		dphi = RAD(lat2[i]) - phi;
+		dlambda = RAD(lon2[i] - lon);
+		cosphi2 = cos(RAD(lat2[i]));
+		a = sin(dphi / 2) * sin(dphi / 2)
+		    + cosphi * cosphi2 * sin(dlambda / 2) * sin(dlambda / 2);
+		dist[i] = 2 * GEO_EARTH_RADIUS * asin(sqrt(fmin(a, 1.0)));
+	}
+	if (bearing == NULL)
+		return;
+
+	for (i = 0; i < n; i++) {
+		dlambda = RAD(lon2[i] - lon);
+		cosphi2 = cos(RAD(lat2[i]));
+		bearing[i] = fmod(DEG(atan2(sin(dlambda) * cosphi2,
+		    cosphi * sin(RAD(lat2[i]))
+		    - sinphi * cosphi2 * cos(dlambda))) + 360.0, 360.0);
+	}
+}
+
+/*
+ * Find the positions that are at most maxdist km away.  The haversine is
+ * compared directly, without the inverse trigonometric function.  The
+ * indices of the positions found are stored in idx, their number is
+ * returned.
+ */
+size_t
+geo_within(double lat, double lon, const double *restrict lat2,
+    const double *restrict lon2, size_t n, double maxdist,
+    size_t *restrict idx)
+{
+	double phi, cosphi, a, limit, dphi, dlambda;
+	size_t i, found;
+
+	if (maxdist < 0.0)
+		return 0;
+	if (maxdist >= M_PI * GEO_EARTH_RADIUS) {
+		for (i = 0; i < n; i++)
+			idx[i] = i;
+		return n;
+	}
+	limit = sin(maxdist / (2 * GEO_EARTH_RADIUS));
+	limit *= limit;
+
+	phi = RAD(lat);
+	cosphi = cos(phi);
+
+	for (i = found = 0; i < n; i++) {
+		dphi = RAD(lat2[i]) - phi;
+		dlambda = RAD(lon2[i] - lon);
+		a = sin(dphi / 2) * sin(dphi / 2) + cosphi * cos(RAD(lat2[i]))
+		    * sin(dlambda / 2) * sin(dlambda / 2);
+		idx[found] = i;
+		found += a <= limit;
+	}
+	return found;
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2014 - 2024 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+/* Maidenhead locators, distance and bearing on the great circle */
+
+#ifndef __GEO_H__
+#define __GEO_H__
+
+#include <stddef.h>
+
+#define GEO_LOCATORMAX		10
+#define GEO_EARTH_RADIUS	6371.0		/* Mean radius in km */
+
+extern int geo_locator(double, double, int, char *);
+extern int geo_position(const char *, size_t, double *, double *);
+
+extern void geo_distance(double, double, const double *, const double *,
+    size_t, double *, double *);
+extern size_t geo_within(double, double, const double *, const double *,
+    size_t, double, size_t *);
+
+#endif /* __GEO_H__ */
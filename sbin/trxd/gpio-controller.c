@@ -47,20 +47,29 @@ extern int luaopen_trxd(lua_State *);
 extern int luaopen_gpio_controller(lua_State *);
 extern int luaopen_gpio(lua_State *);
 extern int luaopen_json(lua_State *);
+extern int bytecode_dofile(lua_State *, const char *);
 
 extern int verbose;
 
 __thread gpio_controller_tag_t	*gpio_controller_tag;
 __thread int gpio_device;
 
+/*
+ * The gpio-controller is cancelled when it has been removed by a
+ * configuration reload.  The tag is not freed, dispatchers might still
+ * refer to it.
+ */
 static void
 cleanup(void *arg)
 {
 	gpio_controller_tag_t *t = (gpio_controller_tag_t *)arg;
 	if (t->L)
 		lua_close(t->L);
-	free(t->name);
-	free(arg);
+	t->L = NULL;
+	close(t->gpio_device);
+
+	/* Cancelled while waiting for the next request */
+	pthread_mutex_unlock(&t->mutex2);
 }
 
 void *
@@ -153,7 +162,7 @@ gpio_controller(void *arg)
 	luaopen_json(t->L);
 	lua_setglobal(t->L, "json");
 
-	if (luaL_dofile(t->L, _PATH_GPIO_CONTROLLER)) {
+	if (bytecode_dofile(t->L, _PATH_GPIO_CONTROLLER)) {
 		syslog(LOG_ERR, "gpio-controller: %s", lua_tostring(t->L, -1));
 		exit(1);
 	}
@@ -175,7 +184,7 @@ gpio_controller(void *arg)
 	lua_getfield(t->L, -1, "registerDriver");
 	lua_pushstring(t->L, t->name);
 	lua_pushstring(t->L, t->device);
-	if (luaL_dofile(t->L, gpio_driver)) {
+	if (bytecode_dofile(t->L, gpio_driver)) {
 		syslog(LOG_ERR, "gpio-controller: %s", lua_tostring(t->L, -1));
 		exit(1);
 	}
@@ -0,0 +1,477 @@
+/*
+ * Copyright (c) 2023 - 2024 Marc Balmer HB9SSB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Receive the fix from gpsd instead of reading a GNSS receiver directly.
+ * gpsd is asked to stream JSON reports, the TPV and SKY reports are mapped
+ * to the NMEA fix data.  If the connection to gpsd is lost, it is
+ * reestablished with exponential backoff.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "trxd.h"
+
+extern void nmea_update(nmea_tag_t *);
+extern int nmea_pending(nmea_tag_t *);
+extern int verbose;
+
+#define GPSD_WATCH	"?WATCH={\"enable\":true,\"json\":true};\n"
+#define REPORTMAX	16384
+#define DELAY_MIN	1		/* seconds */
+#define DELAY_MAX	60
+
+/* Skip whitespace in a JSON text */
+static const char *
+gpsd_space(const char *p)
+{
+	while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+		p++;
+	return p;
+}
+
+/* Skip a JSON value, return NULL if it is malformed */
+static const char *
+gpsd_skip(const char *p)
+{
+	int depth = 0;
+
+	do {
+		switch (*p) {
+		case '\0':
+			return NULL;
+		case '"':
+			for (p++; *p != '"'; p++) {
+				if (*p == '\0')
+					return NULL;
+				if (*p == '\\' && *++p == '\0')
+					return NULL;
+			}
+			break;
+		case '{':
+		case '[':
+			depth++;
+			break;
+		case '}':
+		case ']':
+			if (depth == 0)
+				return NULL;
+			depth--;
+			break;
+		case ',':
+		case ':':
+			if (depth == 0)
+				return NULL;
+			break;
+		default:
+			if (depth == 0) {
+				while (*p && !strchr(",:{}[]\" \t\r\n", *p))
+					p++;
+				return p;
+			}
+		}
+		p++;
+	} while (depth > 0);
+	return p;
+}
+
+/*
+ * Find a member of a JSON object, only the members of the object itself
+ * are looked at, not those of nested objects.  Returns a pointer to the
+ * value or NULL.
+ */
+static const char *
+gpsd_member(const char *obj, const char *name)
+{
+	const char *p, *key;
+	size_t len = strlen(name);
+
+	p = gpsd_space(obj);
+	if (*p++ != '{')
+		return NULL;
+	for (;;) {
+		p = gpsd_space(p);
+		if (*p != '"')
+			return NULL;
+		key = p + 1;
+		if ((p = gpsd_skip(p)) == NULL)
+			return NULL;
+		p = gpsd_space(p);
+		if (*p++ != ':')
+			return NULL;
+		p = gpsd_space(p);
+		if (!strncmp(key, name, len) && key[len] == '"')
+			return p;
+		if ((p = gpsd_skip(p)) == NULL)
+			return NULL;
+		p = gpsd_space(p);
+		if (*p++ != ',')
+			return NULL;
+	}
+}
+
+/* Get a numeric member, dst is left unchanged if it is not present */
+static int
+gpsd_number(const char *obj, const char *name, double *dst)
+{
+	const char *p;
+	char *end;
+	double v;
+
+	if ((p = gpsd_member(obj, name)) == NULL)
+		return -1;
+	v = strtod(p, &end);
+	if (end == p)
+		return -1;
+	*dst = v;
+	return 0;
+}
+
+static int
+gpsd_integer(const char *obj, const char *name, int *dst)
+{
+	double v;
+
+	if (gpsd_number(obj, name, &v))
+		return -1;
+	*dst = (int)v;
+	return 0;
+}
+
+/* Does the string member have the value s? */
+static int
+gpsd_is(const char *obj, const char *name, const char *s)
+{
+	const char *p;
+	size_t len = strlen(s);
+
+	if ((p = gpsd_member(obj, name)) == NULL || *p != '"')
+		return 0;
+	return !strncmp(p + 1, s, len) && p[len + 1] == '"';
+}
+
+/* Time of the fix, in ISO 8601 format: 2024-05-01T12:34:56.000Z */
+static void
+gpsd_time(nmea_tag_t *t, const char *obj)
+{
+	const char *p;
+	int year, month, day, hour, minute, second;
+
+	if ((p = gpsd_member(obj, "time")) == NULL || *p != '"')
+		return;
+	if (sscanf(p + 1, "%4d-%2d-%2dT%2d:%2d:%2d", &year, &month, &day,
+	    &hour, &minute, &second) != 6)
+		return;
+
+	/* Like in RMC sentences, the year is kept without the century */
+	t->year = year % 100;
+	t->month = month;
+	t->day = day;
+	t->hour = hour;
+	t->minute = minute;
+	t->second = second;
+}
+
+/*
+ * Time-position-velocity report.  The gpsd mode is 0 (unknown), 1 (no fix),
+ * 2 (2D fix), or 3 (3D fix), status 2 denotes a differential fix.
+ */
+static void
+gpsd_tpv(nmea_tag_t *t, const char *obj)
+{
+	int mode = 0, status = 0;
+
+	gpsd_integer(obj, "mode", &mode);
+	gpsd_integer(obj, "status", &status);
+
+	t->fix_type = mode > 1 ? mode : 1;
+	t->status = mode > 1;
+	t->mode = mode < 2 ? 'N' : status == 2 ? 'D' : 'A';
+
+	gpsd_time(t, obj);
+	if (mode < 2)
+		return;
+
+	gpsd_number(obj, "lat", &t->latitude);
+	gpsd_number(obj, "lon", &t->longitude);
+
+	/* Like GGA, use the altitude above mean sea level */
+	if (gpsd_number(obj, "altMSL", &t->altitude))
+		gpsd_number(obj, "alt", &t->altitude);
+	gpsd_number(obj, "speed", &t->speed);
+	gpsd_number(obj, "track", &t->course);
+	gpsd_number(obj, "magvar", &t->variation);
+}
+
+/*
+ * Sky view report.  Older versions of gpsd don't send the number of
+ * satellites, they are then counted from the list of satellites.
+ */
+static void
+gpsd_sky(nmea_tag_t *t, const char *obj)
+{
+	const char *p, *used;
+	int n, nused;
+
+	gpsd_number(obj, "pdop", &t->pdop);
+	gpsd_number(obj, "hdop", &t->hdop);
+	gpsd_number(obj, "vdop", &t->vdop);
+
+	if (!gpsd_integer(obj, "nSat", &t->sats_in_view)
+	    && !gpsd_integer(obj, "uSat", &t->sats_used))
+		return;
+
+	if ((p = gpsd_member(obj, "satellites")) == NULL || *p++ != '[')
+		return;
+	for (n = nused = 0; ; n++) {
+		p = gpsd_space(p);
+		if (*p == ']')
+			break;
+		if (*p == '{') {
+			used = gpsd_member(p, "used");
+			if (used != NULL && !strncmp(used, "true", 4))
+				nused++;
+		}
+		if ((p = gpsd_skip(p)) == NULL)
+			return;
+		p = gpsd_space(p);
+		if (*p == ',')
+			p++;
+		else if (*p != ']')
+			return;
+	}
+	t->sats_in_view = n;
+	t->sats_used = nused;
+}
+
+/* Map a report to the fix data, other reports are ignored */
+static void
+gpsd_report(nmea_tag_t *t, const char *report)
+{
+	int tpv;
+
+	if (verbose > 3)
+		printf("%s\n", report);
+
+	if (!(tpv = gpsd_is(report, "class", "TPV"))
+	    && !gpsd_is(report, "class", "SKY"))
+		return;
+
+	if (pthread_mutex_lock(&t->mutex)) {
+		syslog(LOG_ERR, "gpsd-handler: pthread_mutex_lock");
+		exit(1);
+	}
+	if (tpv)
+		gpsd_tpv(t, report);
+	else
+		gpsd_sky(t, report);
+	nmea_update(t);
+	if (pthread_mutex_unlock(&t->mutex)) {
+		syslog(LOG_ERR, "gpsd-handler: pthread_mutex_unlock");
+		exit(1);
+	}
+}
+
+/* There is no fix while gpsd can't be reached */
+static void
+gpsd_lost(nmea_tag_t *t)
+{
+	if (pthread_mutex_lock(&t->mutex)) {
+		syslog(LOG_ERR, "gpsd-handler: pthread_mutex_lock");
+		exit(1);
+	}
+	t->status = 0;
+	t->fix_type = 1;
+	t->mode = 'N';
+	nmea_update(t);
+	if (pthread_mutex_unlock(&t->mutex)) {
+		syslog(LOG_ERR, "gpsd-handler: pthread_mutex_unlock");
+		exit(1);
+	}
+}
+
+static int
+gpsd_connect(nmea_tag_t *t)
+{
+	struct addrinfo hints, *res, *res0;
+	int error, fd = -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	error = getaddrinfo(t->gpsd_host, t->gpsd_port, &hints, &res0);
+	if (error) {
+		syslog(LOG_ERR, "gpsd-handler: %s:%s: %s", t->gpsd_host,
+		    t->gpsd_port, gai_strerror(error));
+		return -1;
+	}
+	for (res = res0; res != NULL; res = res->ai_next) {
+		fd = socket(res->ai_family, res->ai_socktype,
+		    res->ai_protocol);
+		if (fd == -1)
+			continue;
+		if (connect(fd, res->ai_addr, res->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res0);
+	if (fd == -1)
+		return -1;
+
+	if (write(fd, GPSD_WATCH, strlen(GPSD_WATCH)) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Read reports until the connection is lost */
+static void
+gpsd_read(nmea_tag_t *t, char *buf)
+{
+	struct pollfd pfd;
+	char *p, *nl;
+	size_t have = 0;
+	ssize_t len;
+	int discard = 0, n;
+
+	pfd.fd = t->fd;
+	pfd.events = POLLIN;
+
+	for (;;) {
+		/* Wake up to send a change held back by the update interval */
+		n = poll(&pfd, 1, nmea_pending(t));
+		if (n == -1 && errno != EINTR) {
+			syslog(LOG_NOTICE, "gpsd-handler: poll: %s",
+			    strerror(errno));
+			return;
+		}
+		if (n <= 0)
+			continue;
+
+		len = read(t->fd, buf + have, REPORTMAX - 1 - have);
+		if (len == -1 && errno == EINTR)
+			continue;
+		if (len <= 0) {
+			syslog(LOG_NOTICE, "gpsd-handler: %s", len == 0 ?
+			    "connection closed" : strerror(errno));
+			return;
+		}
+		have += len;
+		buf[have] = '\0';
+
+		/* Each report is a JSON object terminated by a newline */
+		for (p = buf; (nl = strchr(p, '\n')) != NULL; p = nl + 1) {
+			*nl = '\0';
+			if (!discard)
+				gpsd_report(t, p);
+			discard = 0;
+		}
+		have -= p - buf;
+		memmove(buf, p, have);
+
+		/* Skip overlong reports */
+		if (have == REPORTMAX - 1) {
+			have = 0;
+			discard = 1;
+		}
+	}
+}
+
+/* The tag is not freed, it is still used by the nmea destination */
+static void
+cleanup(void *arg)
+{
+	nmea_tag_t *t = (nmea_tag_t *)arg;
+
+	if (t->fd != -1) {
+		close(t->fd);
+		t->fd = -1;
+	}
+}
+
+static void
+cleanup_buf(void *arg)
+{
+	free(arg);
+}
+
+void *
+gpsd_handler(void *arg)
+{
+	nmea_tag_t *t = (nmea_tag_t *)arg;
+	char *buf;
+	int delay = DELAY_MIN;
+
+	if (pthread_detach(pthread_self())) {
+		syslog(LOG_ERR, "gpsd-handler: pthread_detach");
+		exit(1);
+	}
+
+	pthread_cleanup_push(cleanup, arg);
+
+	if (pthread_setname_np(pthread_self(), "gpsd")) {
+		syslog(LOG_ERR, "gpsd-handler: pthread_setname_np");
+		exit(1);
+	}
+
+	buf = malloc(REPORTMAX);
+	if (buf == NULL) {
+		syslog(LOG_ERR, "gpsd-handler: malloc");
+		exit(1);
+	}
+
+	pthread_cleanup_push(cleanup_buf, buf);
+
+	for (;;) {
+		if ((t->fd = gpsd_connect(t)) == -1) {
+			sleep(delay);
+			if ((delay *= 2) > DELAY_MAX)
+				delay = DELAY_MAX;
+			continue;
+		}
+		syslog(LOG_INFO, "gpsd-handler: connected to %s:%s",
+		    t->gpsd_host, t->gpsd_port);
+		delay = DELAY_MIN;
+
+		gpsd_read(t, buf);
+		close(t->fd);
+		t->fd = -1;
+		gpsd_lost(t);
+		sleep(delay);
+	}
+	pthread_cleanup_pop(1);
+	pthread_cleanup_pop(1);
+	return NULL;
+}
@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2024 Marc Balmer HB9SSB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Notice devices being plugged in, so that transceivers attach at once */
+
+#include <sys/socket.h>
+
+#include <linux/netlink.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "trxd.h"
+
+extern destination_t *destination;
+extern void destination_rdlock(void);
+extern void destination_unlock(void);
+extern int verbose;
+
+/* Is this a kernel event for a new serial or Bluetooth device? */
+static int
+is_added(const char *event, size_t len)
+{
+	const char *p;
+
+	if (strncmp(event, "add@", 4))
+		return 0;
+
+	/* The header is followed by NUL separated KEY=value pairs */
+	for (p = event + strlen(event) + 1; p < event + len;
+	    p += strlen(p) + 1) {
+		if (!strcmp(p, "SUBSYSTEM=tty")
+		    || !strcmp(p, "SUBSYSTEM=bluetooth"))
+			return 1;
+	}
+	return 0;
+}
+
+void *
+hotplug(void *arg)
+{
+	struct sockaddr_nl addr;
+	destination_t *dst;
+	trx_controller_tag_t *t;
+	char event[8192];
+	ssize_t len;
+	int fd;
+
+	if (pthread_detach(pthread_self())) {
+		syslog(LOG_ERR, "hotplug: pthread_detach");
+		exit(1);
+	}
+
+	if (pthread_setname_np(pthread_self(), "hotplug")) {
+		syslog(LOG_ERR, "hotplug: pthread_setname_np");
+		exit(1);
+	}
+
+	/*
+	 * Without kernel events, e.g. in a container, transceivers are
+	 * still attached by retrying periodically.
+	 */
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC,
+	    NETLINK_KOBJECT_UEVENT);
+	if (fd == -1) {
+		syslog(LOG_NOTICE, "hotplug: socket: %m");
+		return NULL;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = 1;	/* Kernel events */
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		syslog(LOG_NOTICE, "hotplug: bind: %m");
+		close(fd);
+		return NULL;
+	}
+
+	for (;;) {
+		len = recv(fd, event, sizeof(event) - 1, 0);
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+
+			/* Events were lost, one of them might be ours */
+			if (errno != ENOBUFS) {
+				syslog(LOG_ERR, "hotplug: recv");
+				exit(1);
+			}
+			strcpy(event, "overrun");
+		} else {
+			event[len] = '\0';
+			if (!is_added(event, len))
+				continue;
+		}
+
+		if (verbose)
+			printf("hotplug: %s\n", event);
+
+		destination_rdlock();
+		for (dst = destination; dst != NULL; dst = dst->next) {
+			if (dst->type != DEST_TRX)
+				continue;
+			t = dst->tag.trx;
+
+			if (pthread_mutex_lock(&t->mutex2)) {
+				syslog(LOG_ERR, "hotplug: pthread_mutex_lock");
+				exit(1);
+			}
+			if (!t->attached) {
+				t->plugged = 1;
+				if (pthread_cond_signal(&t->cond3)) {
+					syslog(LOG_ERR,
+					    "hotplug: pthread_cond_signal");
+					exit(1);
+				}
+			}
+			if (pthread_mutex_unlock(&t->mutex2)) {
+				syslog(LOG_ERR,
+				    "hotplug: pthread_mutex_unlock");
+				exit(1);
+			}
+		}
+		destination_unlock();
+	}
+	return NULL;
+}
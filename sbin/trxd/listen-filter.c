@@ -0,0 +1,297 @@
+/*
+ * Copyright (c) 2023 - 2024 Marc Balmer HB9SSB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+/*
+ * Filters for the notifications of extensions.  A listener can restrict
+ * the notifications it receives to bands, modes, callsign prefixes,
+ * continents, and a maximum distance.  The filter is compiled once when
+ * the listener is added and evaluated before a notification is queued.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "geo.h"
+#include "spotstore.h"
+#include "trxd.h"
+
+/* Free a list of strings */
+static void
+filter_free_list(char **list, int n)
+{
+	int i;
+
+	if (list == NULL)
+		return;
+	for (i = 0; i < n; i++)
+		free(list[i]);
+	free(list);
+}
+
+void
+filter_free(listen_filter_t *f)
+{
+	if (f == NULL)
+		return;
+	filter_free_list(f->modes, f->nmodes);
+	filter_free_list(f->prefixes, f->nprefixes);
+	filter_free_list(f->continents, f->ncontinents);
+	free(f);
+}
+
+/*
+ * Get a list of strings, given as an array or as a single string.  Returns
+ * -1 if the value is neither or on memory allocation errors.
+ */
+static int
+filter_list(lua_State *L, int idx, const char *name, char ***list, int *n)
+{
+	int i, len, type;
+
+	*list = NULL;
+	*n = 0;
+
+	type = lua_getfield(L, idx, name);
+	if (type == LUA_TNIL) {
+		lua_pop(L, 1);
+		return 0;
+	}
+	if (type == LUA_TSTRING)
+		len = 1;
+	else if (type == LUA_TTABLE)
+		len = lua_rawlen(L, -1);
+	else {
+		lua_pop(L, 1);
+		return -1;
+	}
+
+	if (len > 0 && (*list = calloc(len, sizeof(char *))) == NULL) {
+		lua_pop(L, 1);
+		return -1;
+	}
+	for (i = 0; i < len; i++) {
+		if (type == LUA_TTABLE)
+			lua_rawgeti(L, -1, i + 1);
+		else
+			lua_pushvalue(L, -1);
+		if (lua_type(L, -1) != LUA_TSTRING
+		    || ((*list)[i] = strdup(lua_tostring(L, -1))) == NULL) {
+			lua_pop(L, 2);
+			filter_free_list(*list, i);
+			*list = NULL;
+			return -1;
+		}
+		lua_pop(L, 1);
+		(*n)++;
+	}
+	lua_pop(L, 1);
+	return 0;
+}
+
+/* Get a position, from coordinates or a locator */
+static int
+filter_position(lua_State *L, int idx, double *lat, double *lon)
+{
+	const char *loc;
+	size_t len;
+	int valid = 0;
+
+	lua_getfield(L, idx, "latitude");
+	lua_getfield(L, idx, "longitude");
+	if (lua_isnumber(L, -2) && lua_isnumber(L, -1)) {
+		*lat = lua_tonumber(L, -2);
+		*lon = lua_tonumber(L, -1);
+		valid = 1;
+	}
+	lua_pop(L, 2);
+
+	if (!valid) {
+		if (lua_getfield(L, idx, "locator") == LUA_TSTRING) {
+			loc = lua_tolstring(L, -1, &len);
+			valid = geo_position(loc, len, lat, lon) == 0;
+		}
+		lua_pop(L, 1);
+	}
+	return valid;
+}
+
+/*
+ * Compile the filter table at idx.  Returns NULL and sets error if the
+ * filter is not valid.
+ */
+listen_filter_t *
+filter_compile(lua_State *L, int idx, const char **error)
+{
+	listen_filter_t *f;
+	char **bands;
+	int n, nbands, band;
+
+	idx = lua_absindex(L, idx);
+	f = calloc(1, sizeof(listen_filter_t));
+	if (f == NULL) {
+		*error = "Out of memory";
+		return NULL;
+	}
+
+	if (filter_list(L, idx, "bands", &bands, &nbands)) {
+		*error = "Invalid bands";
+		goto failed;
+	}
+	for (n = 0; n < nbands; n++) {
+		if ((band = spot_band_lookup(bands[n])) == SPOT_NONE)
+			break;
+		f->bands |= 1U << band;
+	}
+	filter_free_list(bands, nbands);
+	if (n < nbands) {
+		*error = "Unknown band";
+		goto failed;
+	}
+
+	if (filter_list(L, idx, "modes", &f->modes, &f->nmodes)) {
+		*error = "Invalid modes";
+		goto failed;
+	}
+	if (filter_list(L, idx, "prefixes", &f->prefixes, &f->nprefixes)) {
+		*error = "Invalid prefixes";
+		goto failed;
+	}
+	if (filter_list(L, idx, "continents", &f->continents,
+	    &f->ncontinents)) {
+		*error = "Invalid continents";
+		goto failed;
+	}
+
+	lua_getfield(L, idx, "maxDistance");
+	if (!lua_isnil(L, -1)) {
+		if (!lua_isnumber(L, -1)) {
+			lua_pop(L, 1);
+			*error = "Invalid maxDistance";
+			goto failed;
+		}
+		f->max_distance = lua_tonumber(L, -1);
+		if (!filter_position(L, idx, &f->latitude, &f->longitude)) {
+			lua_pop(L, 1);
+			*error = "maxDistance needs a locator or position";
+			goto failed;
+		}
+		f->has_position = 1;
+	}
+	lua_pop(L, 1);
+	return f;
+
+failed:
+	filter_free(f);
+	return NULL;
+}
+
+/* Get the attributes of a notification from the table at idx */
+void
+filter_attributes(lua_State *L, int idx, notify_attr_t *a)
+{
+	idx = lua_absindex(L, idx);
+
+	a->band = SPOT_NONE;
+	if (lua_getfield(L, idx, "band") == LUA_TSTRING)
+		a->band = spot_band_lookup(lua_tostring(L, -1));
+	lua_pop(L, 1);
+	if (a->band == SPOT_NONE) {
+		lua_getfield(L, idx, "frequency");
+		if (lua_isnumber(L, -1))
+			a->band = spot_band(lua_tonumber(L, -1));
+		lua_pop(L, 1);
+	}
+
+	/* The strings are kept alive by the table */
+	lua_getfield(L, idx, "mode");
+	a->mode = lua_type(L, -1) == LUA_TSTRING ? lua_tostring(L, -1) : NULL;
+	lua_getfield(L, idx, "spotted");
+	if (lua_type(L, -1) != LUA_TSTRING) {
+		lua_pop(L, 1);
+		lua_getfield(L, idx, "call");
+	}
+	a->call = lua_type(L, -1) == LUA_TSTRING ? lua_tostring(L, -1) : NULL;
+	lua_getfield(L, idx, "continent");
+	a->continent = lua_type(L, -1) == LUA_TSTRING ?
+	    lua_tostring(L, -1) : NULL;
+	lua_pop(L, 3);
+
+	a->has_position = filter_position(L, idx, &a->latitude,
+	    &a->longitude);
+}
+
+/* Does a notification match the filter? */
+int
+filter_match(const listen_filter_t *f, const notify_attr_t *a)
+{
+	double distance;
+	int n;
+
+	if (f->bands && (a->band == SPOT_NONE || !(f->bands & 1U << a->band)))
+		return 0;
+
+	if (f->nmodes) {
+		if (a->mode == NULL)
+			return 0;
+		for (n = 0; n < f->nmodes; n++)
+			if (!strcasecmp(a->mode, f->modes[n]))
+				break;
+		if (n == f->nmodes)
+			return 0;
+	}
+
+	if (f->nprefixes) {
+		if (a->call == NULL)
+			return 0;
+		for (n = 0; n < f->nprefixes; n++)
+			if (!strncasecmp(a->call, f->prefixes[n],
+			    strlen(f->prefixes[n])))
+				break;
+		if (n == f->nprefixes)
+			return 0;
+	}
+
+	if (f->ncontinents) {
+		if (a->continent == NULL)
+			return 0;
+		for (n = 0; n < f->ncontinents; n++)
+			if (!strcasecmp(a->continent, f->continents[n]))
+				break;
+		if (n == f->ncontinents)
+			return 0;
+	}
+
+	if (f->has_position) {
+		if (!a->has_position)
+			return 0;
+		geo_distance(f->latitude, f->longitude, &a->latitude,
+		    &a->longitude, 1, &distance, NULL);
+		if (distance > f->max_distance)
+			return 0;
+	}
+	return 1;
+}
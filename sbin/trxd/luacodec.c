@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2014 - 2024 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Provide the 'trx.codec' Lua module to transceiver drivers */
+
+#include <stdint.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "codec.h"
+
+static int
+luacodec_crc16(lua_State *L)
+{
+	const char *data;
+	size_t len;
+	uint16_t crc;
+	char crc_out[2];
+
+	data = luaL_checklstring(L, 1, &len);
+	crc = codec_crc16(data, len);
+	crc_out[0] = crc & 0xff;
+	crc_out[1] = crc >> 8;
+	lua_pushlstring(L, crc_out, 2);
+	return 1;
+}
+
+static int
+luacodec_slip_encode(lua_State *L)
+{
+	luaL_Buffer b;
+	const char *data;
+	unsigned char *frame;
+	size_t len;
+
+	data = luaL_checklstring(L, 1, &len);
+	frame = (unsigned char *)luaL_buffinitsize(L, &b,
+	    SLIP_ENCODED_MAX(len));
+	luaL_pushresultsize(&b, codec_slip_encode(data, len, frame));
+	return 1;
+}
+
+/* Return all complete frames, incomplete data at the end is ignored */
+static int
+luacodec_slip_decode(lua_State *L)
+{
+	slip_decoder_t d;
+	const char *data;
+	unsigned char *frame;
+	size_t len, n;
+	int complete, nframes = 0;
+
+	data = luaL_checklstring(L, 1, &len);
+	frame = lua_newuserdatauv(L, len > 0 ? len : 1, 0);
+	codec_slip_decoder(&d, frame, len);
+
+	while (len > 0) {
+		n = codec_slip_decode(&d, data, len, &complete);
+		data += n;
+		len -= n;
+		if (complete) {
+			luaL_checkstack(L, 1, "too many frames");
+			lua_pushlstring(L, (char *)d.frame, d.len);
+			nframes++;
+		}
+	}
+	return nframes;
+}
+
+static int
+luacodec_bcd_pack(lua_State *L)
+{
+	luaL_Buffer b;
+	const char *digits;
+	unsigned char *bcd;
+	size_t len;
+	int n, reverse;
+
+	/* Get all arguments first, the buffer uses a stack slot */
+	digits = luaL_checklstring(L, 1, &len);
+	reverse = lua_toboolean(L, 2);
+	bcd = (unsigned char *)luaL_buffinitsize(L, &b, (len + 1) / 2);
+	n = codec_bcd_pack(digits, len, bcd, reverse);
+	if (n == -1)
+		return luaL_error(L, "invalid digits");
+	luaL_pushresultsize(&b, n);
+	return 1;
+}
+
+static int
+luacodec_bcd_unpack(lua_State *L)
+{
+	luaL_Buffer b;
+	const char *bcd;
+	char *digits;
+	size_t len;
+	int reverse;
+
+	bcd = luaL_checklstring(L, 1, &len);
+	reverse = lua_toboolean(L, 2);
+	digits = luaL_buffinitsize(L, &b, 2 * len);
+	codec_bcd_unpack(bcd, len, digits, reverse);
+	luaL_pushresultsize(&b, 2 * len);
+	return 1;
+}
+
+static int
+luacodec_civ_frame(lua_State *L)
+{
+	luaL_Buffer b;
+	const char *data;
+	unsigned char *frame;
+	size_t len;
+	int to, from, command;
+
+	to = luaL_checkinteger(L, 1);
+	from = luaL_checkinteger(L, 2);
+	command = luaL_checkinteger(L, 3);
+	data = luaL_optlstring(L, 4, "", &len);
+
+	frame = (unsigned char *)luaL_buffinitsize(L, &b, CIV_FRAME_MAX(len));
+	luaL_pushresultsize(&b, codec_civ_frame(frame, to, from, command,
+	    CIV_NO_SUBCOMMAND, data, len));
+	return 1;
+}
+
+/* Return to, from, command, and data of a CI-V frame or nil */
+static int
+luacodec_civ_parse(lua_State *L)
+{
+	civ_frame_t f;
+	const char *frame;
+	size_t len;
+
+	frame = luaL_checklstring(L, 1, &len);
+	if (codec_civ_parse(frame, len, &f)) {
+		lua_pushnil(L);
+		return 1;
+	}
+	lua_pushinteger(L, f.to);
+	lua_pushinteger(L, f.from);
+	lua_pushinteger(L, f.command);
+	lua_pushlstring(L, (const char *)f.data, f.len);
+	return 4;
+}
+
+int
+luaopen_trx_codec(lua_State *L)
+{
+	struct luaL_Reg luacodec[] = {
+		{ "crc16",		luacodec_crc16 },
+		{ "slipEncode",		luacodec_slip_encode },
+		{ "slipDecode",		luacodec_slip_decode },
+		{ "bcdPack",		luacodec_bcd_pack },
+		{ "bcdUnpack",		luacodec_bcd_unpack },
+		{ "civFrame",		luacodec_civ_frame },
+		{ "civParse",		luacodec_civ_parse },
+		{ NULL, NULL }
+	};
+
+	luaL_newlib(L, luacodec);
+	return 1;
+}
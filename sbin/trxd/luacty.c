@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2014 - 2024 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+/* Provide the 'trxd.cty' Lua module */
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "cty.h"
+
+/* Loaded once at startup and only read afterwards */
+extern cty_t cty;
+
+static void
+luacty_pushinfo(lua_State *L, const cty_info_t *info)
+{
+	const cty_entity_t *e = &cty.entity[info->entity];
+
+	lua_createtable(L, 0, 9);
+	lua_pushstring(L, e->name);
+	lua_setfield(L, -2, "entity");
+	lua_pushstring(L, e->prefix);
+	lua_setfield(L, -2, "prefix");
+	lua_pushstring(L, info->continent);
+	lua_setfield(L, -2, "continent");
+	lua_pushinteger(L, info->cq_zone);
+	lua_setfield(L, -2, "cqZone");
+	lua_pushinteger(L, info->itu_zone);
+	lua_setfield(L, -2, "ituZone");
+	lua_pushnumber(L, info->latitude);
+	lua_setfield(L, -2, "latitude");
+	lua_pushnumber(L, info->longitude);
+	lua_setfield(L, -2, "longitude");
+	lua_pushnumber(L, info->utc_offset);
+	lua_setfield(L, -2, "utcOffset");
+	if (e->wae) {
+		lua_pushboolean(L, 1);
+		lua_setfield(L, -2, "wae");
+	}
+}
+
+/*
+ * Look up a callsign, or a list of callsigns.  Returns a table with the
+ * entity data, or nil (false in a list) if the callsign is unknown.
+ */
+static int
+luacty_lookup(lua_State *L)
+{
+	const cty_info_t *info;
+	lua_Integer n, len;
+
+	if (lua_type(L, 1) != LUA_TTABLE) {
+		info = cty_lookup(&cty, luaL_checkstring(L, 1));
+		if (info == NULL)
+			lua_pushnil(L);
+		else
+			luacty_pushinfo(L, info);
+		return 1;
+	}
+
+	len = luaL_len(L, 1);
+	lua_createtable(L, len, 0);
+	for (n = 1; n <= len; n++) {
+		info = NULL;
+		if (lua_rawgeti(L, 1, n) == LUA_TSTRING)
+			info = cty_lookup(&cty, lua_tostring(L, -1));
+		lua_pop(L, 1);
+		if (info == NULL)
+			lua_pushboolean(L, 0);
+		else
+			luacty_pushinfo(L, info);
+		lua_rawseti(L, -2, n);
+	}
+	return 1;
+}
+
+/* The number of entities, prefixes, and callsigns that have been loaded */
+static int
+luacty_stats(lua_State *L)
+{
+	lua_createtable(L, 0, 3);
+	lua_pushinteger(L, cty.entities);
+	lua_setfield(L, -2, "entities");
+	lua_pushinteger(L, cty.prefixes);
+	lua_setfield(L, -2, "prefixes");
+	lua_pushinteger(L, cty.calls);
+	lua_setfield(L, -2, "callsigns");
+	return 1;
+}
+
+int
+luaopen_trxd_cty(lua_State *L)
+{
+	struct luaL_Reg luacty[] = {
+		{ "lookup",		luacty_lookup },
+		{ "stats",		luacty_stats },
+		{ NULL, NULL }
+	};
+
+	luaL_newlib(L, luacty);
+	return 1;
+}
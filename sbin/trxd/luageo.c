@@ -0,0 +1,238 @@
+/*
+ * Copyright (c) 2014 - 2024 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+/* Provide the 'trxd.geo' Lua module */
+
+#include <stdlib.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "geo.h"
+
+/*
+ * A position is either a locator or a latitude and a longitude.  Returns
+ * the stack index following the position.
+ */
+static int
+luageo_checkpoint(lua_State *L, int arg, double *lat, double *lon)
+{
+	const char *loc;
+	size_t len;
+
+	if (lua_type(L, arg) == LUA_TSTRING) {
+		loc = lua_tolstring(L, arg, &len);
+		if (geo_position(loc, len, lat, lon))
+			luaL_argerror(L, arg, "invalid locator");
+		return arg + 1;
+	}
+	*lat = luaL_checknumber(L, arg);
+	*lon = luaL_checknumber(L, arg + 1);
+	return arg + 2;
+}
+
+/* A position in a list is a locator or a table { latitude, longitude } */
+static int
+luageo_topoint(lua_State *L, int idx, double *lat, double *lon)
+{
+	const char *loc;
+	size_t len;
+	int valid = 0;
+
+	idx = lua_absindex(L, idx);
+	switch (lua_type(L, idx)) {
+	case LUA_TSTRING:
+		loc = lua_tolstring(L, idx, &len);
+		return geo_position(loc, len, lat, lon) == 0;
+	case LUA_TTABLE:
+		lua_rawgeti(L, idx, 1);
+		lua_rawgeti(L, idx, 2);
+		if (lua_isnumber(L, -2) && lua_isnumber(L, -1)) {
+			*lat = lua_tonumber(L, -2);
+			*lon = lua_tonumber(L, -1);
+			valid = 1;
+		}
+		lua_pop(L, 2);
+		break;
+	}
+	return valid;
+}
+
+/*
+ * Convert a list of positions to arrays of latitudes and longitudes, the
+ * arrays are allocated as userdata on the stack.  Invalid positions are
+ * marked in the valid array.
+ */
+static size_t
+luageo_points(lua_State *L, int arg, double **lat, double **lon,
+    char **valid)
+{
+	size_t n, i;
+
+	luaL_checktype(L, arg, LUA_TTABLE);
+	n = lua_rawlen(L, arg);
+	*lat = lua_newuserdatauv(L, (n > 0 ? n : 1) * sizeof(double), 0);
+	*lon = lua_newuserdatauv(L, (n > 0 ? n : 1) * sizeof(double), 0);
+	*valid = lua_newuserdatauv(L, n > 0 ? n : 1, 0);
+
+	for (i = 0; i < n; i++) {
+		lua_rawgeti(L, arg, i + 1);
+		(*valid)[i] = luageo_topoint(L, -1, &(*lat)[i], &(*lon)[i]);
+		if (!(*valid)[i])
+			(*lat)[i] = (*lon)[i] = 0.0;
+		lua_pop(L, 1);
+	}
+	return n;
+}
+
+static int
+luageo_locator(lua_State *L)
+{
+	double lat, lon;
+	char loc[GEO_LOCATORMAX + 1];
+	int len;
+
+	lat = luaL_checknumber(L, 1);
+	lon = luaL_checknumber(L, 2);
+	len = luaL_optinteger(L, 3, 6);
+
+	if (geo_locator(lat, lon, len, loc)) {
+		lua_pushnil(L);
+		lua_pushstring(L, "position or length out of range");
+		return 2;
+	}
+	lua_pushstring(L, loc);
+	return 1;
+}
+
+static int
+luageo_position(lua_State *L)
+{
+	const char *loc;
+	double lat, lon;
+	size_t len;
+
+	loc = luaL_checklstring(L, 1, &len);
+	if (geo_position(loc, len, &lat, &lon)) {
+		lua_pushnil(L);
+		lua_pushstring(L, "invalid locator");
+		return 2;
+	}
+	lua_pushnumber(L, lat);
+	lua_pushnumber(L, lon);
+	return 2;
+}
+
+/* Distance in km and bearing from one position to another */
+static int
+luageo_distance(lua_State *L)
+{
+	double lat, lon, lat2, lon2, dist, bearing;
+
+	luageo_checkpoint(L, luageo_checkpoint(L, 1, &lat, &lon), &lat2,
+	    &lon2);
+	geo_distance(lat, lon, &lat2, &lon2, 1, &dist, &bearing);
+	lua_pushnumber(L, dist);
+	lua_pushnumber(L, bearing);
+	return 2;
+}
+
+/*
+ * Distances and bearings from one position to a list of positions, as two
+ * lists.  Invalid positions have a distance and bearing of false.
+ */
+static int
+luageo_distances(lua_State *L)
+{
+	double lat, lon, *lat2, *lon2, *dist, *bearing;
+	char *valid;
+	size_t n, i;
+	int arg;
+
+	arg = luageo_checkpoint(L, 1, &lat, &lon);
+	n = luageo_points(L, arg, &lat2, &lon2, &valid);
+	dist = lua_newuserdatauv(L, (n > 0 ? n : 1) * sizeof(double), 0);
+	bearing = lua_newuserdatauv(L, (n > 0 ? n : 1) * sizeof(double), 0);
+
+	geo_distance(lat, lon, lat2, lon2, n, dist, bearing);
+
+	lua_createtable(L, n, 0);
+	lua_createtable(L, n, 0);
+	for (i = 0; i < n; i++) {
+		if (valid[i]) {
+			lua_pushnumber(L, dist[i]);
+			lua_pushnumber(L, bearing[i]);
+		} else {
+			lua_pushboolean(L, 0);
+			lua_pushboolean(L, 0);
+		}
+		lua_rawseti(L, -3, i + 1);
+		lua_rawseti(L, -3, i + 1);
+	}
+	return 2;
+}
+
+/*
+ * The indices of the positions in a list that are at most a given
+ * distance away, in ascending order.  Invalid positions are skipped.
+ */
+static int
+luageo_within(lua_State *L)
+{
+	double lat, lon, maxdist, *lat2, *lon2;
+	size_t *idx, n, found, i, k;
+	char *valid;
+	int arg;
+
+	arg = luageo_checkpoint(L, 1, &lat, &lon);
+	maxdist = luaL_checknumber(L, arg + 1);
+	n = luageo_points(L, arg, &lat2, &lon2, &valid);
+	idx = lua_newuserdatauv(L, (n > 0 ? n : 1) * sizeof(size_t), 0);
+
+	found = geo_within(lat, lon, lat2, lon2, n, maxdist, idx);
+
+	lua_createtable(L, found, 0);
+	for (i = k = 0; i < found; i++) {
+		if (!valid[idx[i]])
+			continue;
+		lua_pushinteger(L, idx[i] + 1);
+		lua_rawseti(L, -2, ++k);
+	}
+	return 1;
+}
+
+int
+luaopen_trxd_geo(lua_State *L)
+{
+	struct luaL_Reg luageo[] = {
+		{ "locator",		luageo_locator },
+		{ "position",		luageo_position },
+		{ "distance",		luageo_distance },
+		{ "distances",		luageo_distances },
+		{ "within",		luageo_within },
+		{ NULL, NULL }
+	};
+
+	luaL_newlib(L, luageo);
+	return 1;
+}
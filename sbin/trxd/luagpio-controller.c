@@ -35,31 +35,20 @@
 #include "trx-control.h"
 #include "trxd.h"
 
+extern void sender_notify(sender_tag_t *, const char *);
+
 extern __thread gpio_controller_tag_t	*gpio_controller_tag;
 
 static int
 notify_listeners(lua_State *L)
 {
 	sender_list_t *l;
-	char *data;
+	const char *data;
 
-	data = (char *)luaL_checkstring(L, 1);
+	data = luaL_checkstring(L, 1);
 
-	for (l = gpio_controller_tag->senders; l != NULL; l = l->next) {
-		if (pthread_mutex_lock(&l->sender->mutex)) {
-			syslog(LOG_ERR, "luatrxd: pthread_mutex_lock");
-			exit(1);
-		}
-		l->sender->data = data;
-		if (pthread_cond_signal(&l->sender->cond)) {
-			syslog(LOG_ERR, "luatrxd: pthread_cond_signal");
-			exit(1);
-		}
-		if (pthread_mutex_unlock(&l->sender->mutex)) {
-			syslog(LOG_ERR, "luatrxd: pthread_mutex_unlock");
-			exit(1);
-		}
-	}
+	for (l = gpio_controller_tag->senders; l != NULL; l = l->next)
+		sender_notify(l->sender, data);
 	return 0;
 }
 
@@ -0,0 +1,303 @@
+/*
+ * Copyright (c) 2014 - 2024 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+/*
+ * Provide the 'trxd.spots' Lua module, a store for DX spots.  The spot
+ * tables are kept in the user value of the store, indexed by slot.
+ */
+
+#include <time.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "geo.h"
+#include "spotstore.h"
+
+#define SPOTS_METATABLE		"trxd spot store"
+
+/*
+ * The table of spots must be on top of the stack.  The store methods
+ * push it as the third value on the stack.
+ */
+static void
+luaspots_removed(void *arg, int slot)
+{
+	lua_State *L = (lua_State *)arg;
+
+	lua_pushnil(L);
+	lua_rawseti(L, -2, slot + 1);
+}
+
+static void
+luaspots_moved(void *arg, int from, int to)
+{
+	lua_State *L = (lua_State *)arg;
+
+	lua_rawgeti(L, -1, from + 1);
+	lua_rawseti(L, -2, to + 1);
+	lua_pushnil(L);
+	lua_rawseti(L, -2, from + 1);
+}
+
+static spot_store_t *
+luaspots_checkstore(lua_State *L)
+{
+	spot_store_t *s;
+
+	lua_settop(L, 2);
+	s = luaL_checkudata(L, 1, SPOTS_METATABLE);
+	if (s->entry == NULL)
+		luaL_error(L, "spot store has been freed");
+	lua_getiuservalue(L, 1, 1);
+	s->arg = L;
+	return s;
+}
+
+/* Get the position of a spot or query, from coordinates or a locator */
+static int
+luaspots_position(lua_State *L, int idx, double *position)
+{
+	const char *loc;
+	size_t len;
+	int valid = 0;
+
+	lua_getfield(L, idx, "latitude");
+	lua_getfield(L, idx, "longitude");
+	if (lua_isnumber(L, -2) && lua_isnumber(L, -1)) {
+		position[0] = lua_tonumber(L, -2);
+		position[1] = lua_tonumber(L, -1);
+		valid = 1;
+	}
+	lua_pop(L, 2);
+
+	if (!valid) {
+		if (lua_getfield(L, idx, "locator") == LUA_TSTRING) {
+			loc = lua_tolstring(L, -1, &len);
+			valid = geo_position(loc, len, &position[0],
+			    &position[1]) == 0;
+		}
+		lua_pop(L, 1);
+	}
+	return valid;
+}
+
+static int
+luaspots_new(lua_State *L)
+{
+	spot_store_t *s;
+	size_t size;
+	time_t max_age;
+	int64_t window;
+
+	size = luaL_checkinteger(L, 1);
+	max_age = luaL_optinteger(L, 2, 0);
+	window = luaL_optinteger(L, 3, 1000);
+	luaL_argcheck(L, size > 0, 1, "size must be positive");
+
+	s = lua_newuserdatauv(L, sizeof(spot_store_t), 1);
+	if (spot_store_init(s, size, max_age, window))
+		return luaL_error(L, "out of memory");
+	s->removed = luaspots_removed;
+	s->moved = luaspots_moved;
+	luaL_setmetatable(L, SPOTS_METATABLE);
+
+	lua_createtable(L, size, 0);
+	lua_setiuservalue(L, -2, 1);
+	return 1;
+}
+
+/*
+ * Add a spot.  Returns true, or false and the age in seconds of the
+ * duplicate it replaced.
+ */
+static int
+luaspots_add(lua_State *L)
+{
+	spot_store_t *s;
+	const char *spotted, *mode;
+	double position[2];
+	int64_t frequency;
+	time_t age;
+	int slot, has_position;
+
+	s = luaspots_checkstore(L);
+	luaL_checktype(L, 2, LUA_TTABLE);
+
+	lua_getfield(L, 2, "spotted");
+	spotted = lua_tostring(L, -1);
+	lua_getfield(L, 2, "frequency");
+	frequency = lua_tonumber(L, -1);
+	lua_getfield(L, 2, "mode");
+	mode = lua_tostring(L, -1);
+	if (spotted == NULL || frequency <= 0)
+		return luaL_argerror(L, 2, "spotted and frequency required");
+	has_position = luaspots_position(L, 2, position);
+
+	/* Removed spots are cleared from the table below the fields */
+	lua_pushvalue(L, 3);
+	slot = spot_store_add(s, time(NULL), spotted, frequency, mode,
+	    has_position ? position : NULL, &age);
+	lua_pushvalue(L, 2);
+	lua_rawseti(L, -2, slot + 1);
+
+	lua_pushboolean(L, age == -1);
+	if (age == -1)
+		return 1;
+	lua_pushinteger(L, age);
+	return 2;
+}
+
+/*
+ * Return the spots matching a filter, newest first.  The filter can
+ * contain maxAge, band, mode, maxSpots, and maxDistance (in km) from a
+ * position given as latitude and longitude or as locator.
+ */
+static int
+luaspots_query(lua_State *L)
+{
+	spot_store_t *s;
+	spot_query_t q;
+	double position[2];
+	size_t max, found, n;
+	int *slots;
+
+	s = luaspots_checkstore(L);
+	q.max_age = 0;
+	q.band = q.mode = SPOT_NONE;
+	q.has_position = 0;
+	max = s->count;
+
+	if (lua_istable(L, 2)) {
+		lua_getfield(L, 2, "maxAge");
+		q.max_age = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+
+		lua_getfield(L, 2, "maxSpots");
+		if (lua_tointeger(L, -1) > 0 && lua_tointeger(L, -1) < max)
+			max = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+
+		if (lua_getfield(L, 2, "band") == LUA_TSTRING
+		    && (q.band = spot_band_lookup(lua_tostring(L, -1)))
+		    == SPOT_NONE)
+			max = 0;
+		lua_pop(L, 1);
+
+		if (lua_getfield(L, 2, "mode") == LUA_TSTRING
+		    && (q.mode = spot_mode(s, lua_tostring(L, -1), 0))
+		    == SPOT_NONE)
+			max = 0;
+		lua_pop(L, 1);
+
+		lua_getfield(L, 2, "maxDistance");
+		if (lua_isnumber(L, -1) && luaspots_position(L, 2, position)) {
+			q.has_position = 1;
+			q.max_distance = lua_tonumber(L, -1);
+			q.latitude = position[0];
+			q.longitude = position[1];
+		}
+		lua_pop(L, 1);
+	}
+
+	lua_pushvalue(L, 3);
+	slots = lua_newuserdatauv(L, (max > 0 ? max : 1) * sizeof(int), 0);
+	lua_insert(L, -2);
+	found = max > 0 ? spot_store_query(s, time(NULL), &q, slots, max) : 0;
+
+	lua_createtable(L, found, 0);
+	for (n = 0; n < found; n++) {
+		lua_rawgeti(L, -2, slots[n] + 1);
+		lua_rawseti(L, -2, n + 1);
+	}
+	return 1;
+}
+
+static int
+luaspots_count(lua_State *L)
+{
+	spot_store_t *s;
+
+	s = luaspots_checkstore(L);
+	spot_store_expire(s, time(NULL));
+	lua_pushinteger(L, s->count);
+	return 1;
+}
+
+static int
+luaspots_free(lua_State *L)
+{
+	spot_store_t *s;
+
+	s = luaL_checkudata(L, 1, SPOTS_METATABLE);
+	if (s->entry != NULL)
+		spot_store_free(s);
+	return 0;
+}
+
+/* The band of a frequency in Hz */
+static int
+luaspots_band(lua_State *L)
+{
+	const char *band;
+
+	band = spot_band_name(spot_band(luaL_checknumber(L, 1)));
+	if (band != NULL)
+		lua_pushstring(L, band);
+	else
+		lua_pushnil(L);
+	return 1;
+}
+
+int
+luaopen_trxd_spots(lua_State *L)
+{
+	struct luaL_Reg luaspots[] = {
+		{ "new",		luaspots_new },
+		{ "band",		luaspots_band },
+		{ NULL, NULL }
+	};
+	struct luaL_Reg store_methods[] = {
+		{ "__gc",		luaspots_free },
+		{ "add",		luaspots_add },
+		{ "query",		luaspots_query },
+		{ "count",		luaspots_count },
+		{ NULL, NULL }
+	};
+
+	if (luaL_newmetatable(L, SPOTS_METATABLE)) {
+		luaL_setfuncs(L, store_methods, 0);
+
+		lua_pushliteral(L, "__index");
+		lua_pushvalue(L, -2);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__metatable");
+		lua_pushliteral(L, "must not access this metatable");
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
+
+	luaL_newlib(L, luaspots);
+	return 1;
+}
@@ -32,42 +32,162 @@
 #include <lua.h>
 #include <lauxlib.h>
 
+#include "buffer.h"
 #include "trx-control.h"
 #include "trxd.h"
 
+extern void sender_notify(sender_tag_t *, const char *);
+
 extern __thread trx_controller_tag_t	*trx_controller_tag;
 
+extern void trx_state_update(trx_controller_tag_t *, enum TrxStateItem,
+    const char *);
+extern void *trx_handler(void *);
+
+static const char *state_item[TRX_STATE_ITEMS + 1] = {
+	"frequency",
+	"vfo-a",
+	"vfo-b",
+	"mode",
+	"ptt",
+	"lock",
+	NULL
+};
+
 static int
 notify_listeners(lua_State *L)
 {
 	sender_list_t *l;
-	char *data;
+	const char *data;
+
+	data = luaL_checkstring(L, 1);
+
+	for (l = trx_controller_tag->senders; l != NULL; l = l->next)
+		sender_notify(l->sender, data);
+	return 0;
+}
+
+static int
+has_listeners(lua_State *L)
+{
+	lua_pushboolean(L, trx_controller_tag->senders != NULL);
+	return 1;
+}
 
-        data = (char *)luaL_checkstring(L, 1);
+static int
+handler_running(lua_State *L)
+{
+	lua_pushboolean(L, trx_controller_tag->handler_running);
+	return 1;
+}
 
-	for (l = trx_controller_tag->senders; l != NULL; l = l->next) {
-		if (pthread_mutex_lock(&l->sender->mutex)) {
-			syslog(LOG_ERR, "luatrxd: pthread_mutex_lock");
+/*
+ * Start the trx-handler which reads data sent by the transceiver on its
+ * own, frames end with the given character.
+ */
+static int
+start_handler(lua_State *L)
+{
+	trx_controller_tag_t *t = trx_controller_tag;
+
+	t->handler_eol = luaL_checkinteger(L, 1) & 0xff;
+	if (!t->handler_running) {
+		if (pthread_create(&t->trx_handler, NULL, trx_handler, t)) {
+			syslog(LOG_ERR, "luatrxd: pthread_create");
 			exit(1);
 		}
-		l->sender->data = data;
-		if (pthread_cond_signal(&l->sender->cond)) {
-			syslog(LOG_ERR, "luatrxd: pthread_cond_signal");
-			exit(1);
+		t->handler_running = 1;
+	}
+	return 0;
+}
+
+static int
+stop_handler(lua_State *L)
+{
+	trx_controller_tag_t *t = trx_controller_tag;
+
+	if (t->handler_running) {
+		t->handler_running = 0;
+		pthread_cancel(t->trx_handler);
+	}
+	return 0;
+}
+
+/* Update the state cache from a table of scalar values */
+static int
+update_state(lua_State *L)
+{
+	struct buffer buf;
+	const char *s;
+	int item;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+
+	for (item = 0; item < TRX_STATE_ITEMS; item++) {
+		buf_init(&buf);
+		switch (lua_getfield(L, 1, state_item[item])) {
+		case LUA_TNIL:
+			break;
+		case LUA_TBOOLEAN:
+			buf_addstring(&buf, lua_toboolean(L, -1) ?
+			    "true" : "false");
+			break;
+		case LUA_TNUMBER:
+			if (lua_isinteger(L, -1))
+				buf_printf(&buf, "%lld",
+				    (long long)lua_tointeger(L, -1));
+			else
+				buf_printf(&buf, "%.14g", lua_tonumber(L, -1));
+			break;
+		case LUA_TSTRING:
+			buf_addchar(&buf, '"');
+			for (s = lua_tostring(L, -1); *s; s++) {
+				if (*s == '"' || *s == '\\')
+					buf_addchar(&buf, '\\');
+				if ((unsigned char)*s >= 0x20)
+					buf_addchar(&buf, *s);
+			}
+			buf_addchar(&buf, '"');
+			break;
+		default:
+			lua_pop(L, 1);
+			buf_free(&buf);
+			return luaL_error(L, "invalid type for %s",
+			    state_item[item]);
 		}
-		if (pthread_mutex_unlock(&l->sender->mutex)) {
-			syslog(LOG_ERR, "luatrxd: pthread_mutex_unlock");
-			exit(1);
+		if (buf.size > 0) {
+			buf_addchar(&buf, '\0');
+			trx_state_update(trx_controller_tag, item, buf.data);
 		}
+		lua_pop(L, 1);
+		buf_free(&buf);
 	}
 	return 0;
 }
 
+/* Forget the cached values of the named items */
+static int
+invalidate_state(lua_State *L)
+{
+	int n;
+
+	for (n = 1; n <= lua_gettop(L); n++)
+		trx_state_update(trx_controller_tag,
+		    luaL_checkoption(L, n, NULL, state_item), NULL);
+	return 0;
+}
+
 int
 luaopen_trx_controller(lua_State *L)
 {
 	struct luaL_Reg luatrxcontroller[] = {
 		{ "notifyListeners",		notify_listeners },
+		{ "hasListeners",		has_listeners },
+		{ "handlerRunning",		handler_running },
+		{ "invalidateState",		invalidate_state },
+		{ "startHandler",		start_handler },
+		{ "stopHandler",		stop_handler },
+		{ "updateState",		update_state },
 		{ NULL, NULL }
 	};
 
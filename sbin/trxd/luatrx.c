@@ -23,18 +23,470 @@
 /* Provide the 'trx' Lua module to transceiver drivers */
 
 #include <err.h>
+#include <errno.h>
 #include <poll.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <lua.h>
 #include <lauxlib.h>
 
+#include "codec.h"
 #include "trxd.h"
 
 extern __thread int cat_device;
+extern __thread int cat_detached;
+extern __thread trx_controller_tag_t *trx_controller_tag;
 extern int verbose;
+extern int luaopen_trx_codec(lua_State *);
+
+#define TRANSACT_TIMEOUT	500	/* milliseconds */
+
+enum FrameType {
+	FRAME_TERMINATOR,	/* Frames end with a terminator byte */
+	FRAME_LENGTH,		/* Frames have a fixed length */
+	FRAME_CIV,		/* ICOM CI-V, FE FE to from ... FD */
+	FRAME_SLIP		/* SLIP encoded, RFC 1055 */
+};
+
+typedef struct frame_spec {
+	enum FrameType		 type;
+	int			 terminator;
+	size_t			 length;
+	int			 civ_from;	/* -1 accepts any address */
+	int			 civ_to;
+	int			 civ_broadcast;	/* -1 drops broadcasts */
+} frame_spec_t;
+
+/* Data read from the CAT device, but not yet returned to the driver */
+static __thread unsigned char	*rx_data;
+static __thread size_t		 rx_len;
+static __thread size_t		 rx_size;
+
+/* Transceive broadcasts received during a transaction, CI-V frames */
+static __thread unsigned char	*bc_data;
+static __thread size_t		 bc_len;
+static __thread size_t		 bc_size;
+
+static void
+rx_consume(size_t len)
+{
+	if (len < rx_len)
+		memmove(rx_data, rx_data + len, rx_len - len);
+	rx_len = len < rx_len ? rx_len - len : 0;
+}
+
+/* The CAT device is gone, e.g. the USB cable has been unplugged */
+static int
+is_hangup(int error)
+{
+	switch (error) {
+	case EIO:
+	case ENXIO:
+	case ENODEV:
+	case EPIPE:
+	case ECONNRESET:
+	case ENOTCONN:
+	case EHOSTDOWN:
+	case EBADF:
+		return 1;
+	}
+	return 0;
+}
+
+/* Let the trx-controller detach the transceiver */
+static int
+detached(lua_State *L)
+{
+	cat_detached = 1;
+	rx_len = bc_len = 0;
+	return luaL_error(L, "transceiver detached");
+}
+
+/* Read what is available within timeout milliseconds */
+static int
+rx_fill(lua_State *L, int timeout)
+{
+	struct pollfd pfd;
+	ssize_t nread;
+	int i;
+
+	pfd.fd = cat_device;
+	pfd.events = POLLIN;
+
+	switch (poll(&pfd, 1, timeout)) {
+	case -1:
+		if (errno == EINTR)
+			return 0;
+		return luaL_error(L, "poll error");
+	case 0:
+		return 0;
+	}
+
+	if (rx_size - rx_len < 256) {
+		rx_size += 1024;
+		rx_data = realloc(rx_data, rx_size);
+		if (rx_data == NULL)
+			return luaL_error(L, "memory error");
+	}
+
+	nread = read(cat_device, rx_data + rx_len, rx_size - rx_len);
+	if (nread == -1) {
+		if (errno == EINTR || errno == EAGAIN)
+			return 0;
+		if (is_hangup(errno))
+			return detached(L);
+		return luaL_error(L, "read error");
+	}
+
+	/* Readable, but no data means hangup */
+	if (nread == 0)
+		return detached(L);
+
+	if (verbose > 1) {
+		printf("<- ");
+		for (i = 0; i < nread; i++)
+			printf("%02X ", rx_data[rx_len + i]);
+		printf("\n");
+	}
+	rx_len += nread;
+	return nread;
+}
+
+/*
+ * Push the next complete frame from the receive buffer on the Lua stack.
+ * Returns 0 if there is no complete frame yet.
+ */
+static int
+next_frame(lua_State *L, frame_spec_t *f)
+{
+	luaL_Buffer b;
+	slip_decoder_t d;
+	civ_frame_t civ;
+	unsigned char *p, *end;
+	size_t len;
+	int complete;
+
+	switch (f->type) {
+	case FRAME_TERMINATOR:
+		end = memchr(rx_data, f->terminator, rx_len);
+		if (end == NULL)
+			return 0;
+		len = end - rx_data + 1;
+		lua_pushlstring(L, (char *)rx_data, len);
+		rx_consume(len);
+		return 1;
+	case FRAME_LENGTH:
+		if (rx_len < f->length)
+			return 0;
+		lua_pushlstring(L, (char *)rx_data, f->length);
+		rx_consume(f->length);
+		return 1;
+	case FRAME_CIV:
+		for (;;) {
+			/* Discard anything before the preamble */
+			for (p = rx_data; p + 1 < rx_data + rx_len; p++)
+				if (p[0] == CIV_PREAMBLE && p[1] == CIV_PREAMBLE)
+					break;
+			rx_consume(p - rx_data);
+			if (rx_len < 2)
+				return 0;
+
+			end = memchr(rx_data, CIV_EOM, rx_len);
+			if (end == NULL)
+				return 0;
+			len = end - rx_data + 1;
+
+			/*
+			 * Drop frames that are not valid, and frames not
+			 * between the given addresses, notably the echo of
+			 * our own commands on the CI-V bus.
+			 */
+			if (codec_civ_parse(rx_data, len, &civ)
+			    || (f->civ_from != -1 && civ.from != f->civ_from)
+			    || (f->civ_to != -1 && civ.to != f->civ_to
+			    && civ.to != f->civ_broadcast)) {
+				rx_consume(len);
+				continue;
+			}
+
+			/* Strip additional preamble bytes */
+			p = (unsigned char *)civ.data - 5;
+
+			/*
+			 * Keep broadcasts, e.g. a frequency change in
+			 * transceive mode, for the status update handler.
+			 */
+			if (f->civ_broadcast != -1
+			    && civ.to == f->civ_broadcast) {
+				if (bc_size - bc_len < end - p + 1) {
+					bc_size += end - p + 1 + 256;
+					bc_data = realloc(bc_data, bc_size);
+					if (bc_data == NULL)
+						return luaL_error(L,
+						    "memory error");
+				}
+				memcpy(bc_data + bc_len, p, end - p + 1);
+				bc_len += end - p + 1;
+				rx_consume(len);
+				continue;
+			}
+
+			lua_pushlstring(L, (char *)p, end - p + 1);
+			rx_consume(len);
+			return 1;
+		}
+	case FRAME_SLIP:
+		for (;;) {
+			for (p = rx_data; p < rx_data + rx_len
+			    && *p == SLIP_END; p++)
+				;
+			rx_consume(p - rx_data);
+
+			end = memchr(rx_data, SLIP_END, rx_len);
+			if (end == NULL)
+				return 0;
+
+			/*
+			 * The decoded frame is never longer than the encoded
+			 * one.  A frame that decodes to nothing, e.g. only an
+			 * escape, is dropped.
+			 */
+			len = end - rx_data;
+			codec_slip_decoder(&d, (unsigned char *)
+			    luaL_buffinitsize(L, &b, len), len);
+			len = codec_slip_decode(&d, rx_data, len + 1,
+			    &complete);
+			luaL_pushresultsize(&b, d.len);
+			rx_consume(len);
+			if (complete)
+				return 1;
+			lua_pop(L, 1);
+		}
+	}
+	return 0;
+}
+
+static void
+frame_spec(lua_State *L, int idx, frame_spec_t *f)
+{
+	int n = 0;
+
+	f->civ_from = f->civ_to = f->civ_broadcast = -1;
+
+	switch (lua_getfield(L, idx, "terminator")) {
+	case LUA_TSTRING:
+		f->terminator = *(unsigned char *)lua_tostring(L, -1);
+		f->type = FRAME_TERMINATOR;
+		n++;
+		break;
+	case LUA_TNUMBER:
+		f->terminator = lua_tointeger(L, -1);
+		f->type = FRAME_TERMINATOR;
+		n++;
+		break;
+	}
+	lua_pop(L, 1);
+
+	if (lua_getfield(L, idx, "length") == LUA_TNUMBER) {
+		f->length = lua_tointeger(L, -1);
+		f->type = FRAME_LENGTH;
+		n++;
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, idx, "civ");
+	if (lua_toboolean(L, -1)) {
+		f->type = FRAME_CIV;
+		n++;
+		lua_getfield(L, idx, "from");
+		f->civ_from = luaL_optinteger(L, -1, -1);
+		lua_getfield(L, idx, "to");
+		f->civ_to = luaL_optinteger(L, -1, -1);
+		lua_getfield(L, idx, "broadcast");
+		f->civ_broadcast = luaL_optinteger(L, -1, -1);
+		lua_pop(L, 3);
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, idx, "slip");
+	if (lua_toboolean(L, -1)) {
+		f->type = FRAME_SLIP;
+		n++;
+	}
+	lua_pop(L, 1);
+
+	if (n != 1)
+		luaL_error(L, "exactly one of terminator, length, civ, or slip "
+		    "must be specified");
+}
+
+/* Time in milliseconds left until the deadline */
+static int
+time_left(struct timespec *deadline)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (deadline->tv_sec - now.tv_sec) * 1000
+	    + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+}
+
+/*
+ * Pass the broadcasts received during a transaction to the dataHandler
+ * of the trx-controller, as the trx-handler would have done had it read
+ * them.  This runs before the response to the request updates the state,
+ * so the state reflects the order in which the transceiver sent them.
+ */
+static void
+deliver_broadcasts(lua_State *L)
+{
+	unsigned char *data, *p, *end;
+	size_t len;
+
+	data = bc_data;
+	len = bc_len;
+	bc_data = NULL;
+	bc_len = bc_size = 0;
+
+	if (trx_controller_tag == NULL) {
+		free(data);
+		return;
+	}
+
+	luaL_checkstack(L, 4, "out of stack space");
+	for (p = data; p < data + len; p = end + 1) {
+		end = memchr(p, CIV_EOM, data + len - p);
+		lua_geti(L, LUA_REGISTRYINDEX, trx_controller_tag->ref);
+		if (lua_getfield(L, -1, "dataHandler") == LUA_TFUNCTION) {
+			lua_pushlstring(L, (char *)p, end - p + 1);
+			lua_pushinteger(L, 0);
+			if (lua_pcall(L, 2, 0, 0) != LUA_OK) {
+				syslog(LOG_ERR, "Lua error: %s",
+				    lua_tostring(L, -1));
+				lua_pop(L, 1);
+			}
+		} else
+			lua_pop(L, 1);
+		lua_pop(L, 1);
+	}
+	free(data);
+}
+
+/*
+ * trx.transact(request, framing) writes a request and returns the frames
+ * of the reply, or nil and an error message if no frame was received
+ * before the timeout expired.  The framing table holds one of terminator,
+ * length, civ (with optional from, to, and broadcast addresses), or slip,
+ * and optionally timeout (milliseconds, default 500), frames (the number
+ * of frames to return, default 1), and flush (discard input before
+ * writing, default true).  If a CI-V broadcast address is given, input is
+ * read instead of flushed and stale frames are dropped after reading,
+ * while frames sent to the broadcast address are passed to the
+ * dataHandler.
+ */
+static int
+luatrx_transact(lua_State *L)
+{
+	frame_spec_t f;
+	struct timespec deadline;
+	const char *data;
+	size_t len, nwritten;
+	ssize_t n;
+	int frames, nframes, timeout, flush, i;
+
+	data = luaL_optlstring(L, 1, NULL, &len);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	frame_spec(L, 2, &f);
+
+	lua_getfield(L, 2, "timeout");
+	timeout = luaL_optinteger(L, -1, TRANSACT_TIMEOUT);
+	lua_getfield(L, 2, "frames");
+	frames = luaL_optinteger(L, -1, 1);
+	lua_getfield(L, 2, "flush");
+	flush = lua_isnil(L, -1) ? 1 : lua_toboolean(L, -1);
+	lua_pop(L, 3);
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += timeout / 1000;
+	deadline.tv_nsec += (timeout % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	if (data != NULL && len > 0) {
+		/* Stale data would be taken as the reply */
+		if (flush && f.civ_broadcast != -1) {
+			while (rx_fill(L, 0) > 0)
+				;
+			while (next_frame(L, &f))
+				lua_pop(L, 1);
+		} else if (flush) {
+			tcflush(cat_device, TCIFLUSH);
+			rx_len = 0;
+		}
+
+		if (verbose > 1) {
+			printf("-> ");
+			for (i = 0; i < len; i++)
+				printf("%02X ", (unsigned char)data[i]);
+			printf("\n");
+		}
+
+		for (nwritten = 0; nwritten < len; nwritten += n) {
+			n = write(cat_device, data + nwritten, len - nwritten);
+			if (n == -1) {
+				if (errno == EINTR) {
+					n = 0;
+					continue;
+				}
+				if (is_hangup(errno))
+					return detached(L);
+				return luaL_error(L, "write error");
+			}
+		}
+	}
+
+	/*
+	 * rx_fill() returns 0 if it was interrupted (EINTR, EAGAIN), reading
+	 * is then retried until the deadline.
+	 */
+	for (nframes = 0; nframes < frames; ) {
+		luaL_checkstack(L, 1, "too many frames");
+		if (next_frame(L, &f)) {
+			nframes++;
+			continue;
+		}
+		if ((timeout = time_left(&deadline)) <= 0)
+			break;
+		rx_fill(L, timeout);
+	}
+
+	/*
+	 * Further complete frames are stale, but broadcasts among them
+	 * would never be seen by the trx-handler.
+	 */
+	if (flush && f.civ_broadcast != -1) {
+		luaL_checkstack(L, 1, "too many frames");
+		while (next_frame(L, &f))
+			lua_pop(L, 1);
+	}
+	if (bc_len > 0)
+		deliver_broadcasts(L);
+
+	if (nframes == 0) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "timeout");
+		return 2;
+	}
+	return nframes;
+}
 
 static int
 luatrx_version(lua_State *L)
@@ -55,6 +507,11 @@ luatrx_wait_for_data(lua_State *L)
 	else
 		timeout = -1;	/* Infinite timeout */
 
+	if (rx_len > 0) {
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+
 	pfd.fd = cat_device;
 	pfd.events = POLLIN;
 
@@ -70,46 +527,26 @@ luatrx_wait_for_data(lua_State *L)
 static int
 luatrx_read(lua_State *L)
 {
-	struct pollfd pfd;
-	char buf[256];
-	size_t len, nread, nfds;
+	size_t len, nread;
 
 	len = luaL_checkinteger(L, 1);
 
-	pfd.fd = cat_device;
-	pfd.events = POLLIN;
-
-	nread = 0;
 	if (verbose > 1)
-		printf("<- (read %d bytes from %d)\n", len, cat_device);
-	while (nread < len) {
-		nfds = poll(&pfd, 1, 100);
-		if (nfds == -1)
-			return luaL_error(L, "poll error");
-		if (nfds == 1) {
-			nread += read(cat_device, &buf[nread], len - nread);
-		} else {
-			if (verbose > 1)
-				printf("timeout\n");
-			break;
-		}
-	}
-
-	if (nread > 0 && verbose > 1) {
-		int i;
-
-		for (i = 0; i < nread; i++)
-			printf("%02X ", buf[i]);
-		printf("\n");
-	}
-
-	if (nread > 0)
-		lua_pushlstring(L, buf, nread);
-	else
+		printf("<- (read %zu bytes from %d)\n", len, cat_device);
+
+	/* Data that has already been received comes first */
+	while (rx_len < len && rx_fill(L, 100) > 0)
+		;
+
+	nread = rx_len < len ? rx_len : len;
+	if (nread > 0) {
+		lua_pushlstring(L, (char *)rx_data, nread);
+		rx_consume(nread);
+	} else {
+		if (verbose > 1)
+			printf("timeout\n");
 		lua_pushnil(L);
-
-	if (verbose > 1)
-		printf("\n");
+	}
 	return 1;
 }
 
@@ -121,6 +558,7 @@ luatrx_write(lua_State *L)
 
 	data = luaL_checklstring(L, 1, &len);
 	tcflush(cat_device, TCIFLUSH);
+	rx_len = 0;
 	if (verbose > 1) {
 		int i;
 
@@ -129,69 +567,56 @@ luatrx_write(lua_State *L)
 			printf("%02X ", data[i]);
 		printf("\n");
 	}
-	write(cat_device, data, len);
-	tcdrain(cat_device);
+	if (write(cat_device, data, len) == -1 && is_hangup(errno))
+		return detached(L);
 	return 0;
 }
 
 static int
 bcd_to_string(lua_State *L)
 {
-	unsigned char *bcd_string, *string, *p;
+	luaL_Buffer b;
+	const char *bcd;
 	size_t len;
-	int n;
 
-	bcd_string = (unsigned char *)luaL_checklstring(L, 1, &len);
-	string = p = malloc(len * 2 + 1);
-	for (n = 0; n < len; n++, bcd_string++) {
-		*p++ = '0' + (*bcd_string >> 4);
-		*p++ = '0' + (*bcd_string & 0x0f);
-	}
-	*p = '\0';
-	lua_pushstring(L, string);
-	free(string);
+	bcd = luaL_checklstring(L, 1, &len);
+	codec_bcd_unpack(bcd, len, luaL_buffinitsize(L, &b, 2 * len), 0);
+	luaL_pushresultsize(&b, 2 * len);
 	return 1;
 }
 
+/*
+ * Pack pairs of digits, a trailing odd digit is ignored and the digits are
+ * not checked.  trx.codec.bcdPack() pads and checks its input instead.
+ */
 static int
 string_to_bcd(lua_State *L)
 {
-	unsigned char *bcd_string, *string, *p;
-	size_t len;
-	int n;
+	luaL_Buffer b;
+	const unsigned char *string;
+	unsigned char *bcd;
+	size_t len, n;
 
-	string = (unsigned char *)luaL_checklstring(L, 1, &len);
-	bcd_string = p = malloc(len);
+	string = (const unsigned char *)luaL_checklstring(L, 1, &len);
+	bcd = (unsigned char *)luaL_buffinitsize(L, &b, len / 2);
 	for (n = 0; n < len / 2; n++)
-		*p++ = *string++ - '0' << 4 | *string++ & 0x0f;
-	*p = '\0';
-
-	lua_pushlstring(L, bcd_string, len / 2);
-	free(bcd_string);
+		bcd[n] = (string[2 * n] - '0') << 4 | (string[2 * n + 1] & 0x0f);
+	luaL_pushresultsize(&b, len / 2);
 	return 1;
 }
 
 static int
 crc16(lua_State *L)
 {
-	void const *data;
-	size_t len, i;
-	uint16_t x, crc;
-	const uint8_t *buf;
-	unsigned char crc_out[2];
+	const char *data;
+	size_t len;
+	uint16_t crc;
+	char crc_out[2];
 
-	x = 0;
-	crc = 0x1d0f;
 	data = luaL_checklstring(L, 1, &len);
-	buf = ((const uint8_t *) data);
-
-	for(i = 0; i < len; i++) {
-		x = (crc >> 8) ^ buf[i];
-		x ^= x >> 4;
-		crc = (crc << 8) ^ (x << 12) ^ (x << 5) ^ x;
-	}
+	crc = codec_crc16(data, len);
 	crc_out[0] = crc & 0xff;
-	crc_out[1] = (crc >> 8) & 0xff;
+	crc_out[1] = crc >> 8;
 	lua_pushlstring(L, crc_out, 2);
 	return 1;
 }
@@ -210,6 +635,7 @@ luaopen_trx(lua_State *L)
 		{ "version",		luatrx_version },
 		{ "read",		luatrx_read },
 		{ "write",		luatrx_write },
+		{ "transact",		luatrx_transact },
 		{ "waitForData",	luatrx_wait_for_data },
 		{ "bcdToString",	bcd_to_string },
 		{ "stringToBcd",	string_to_bcd },
@@ -219,6 +645,8 @@ luaopen_trx(lua_State *L)
 	};
 
 	luaL_newlib(L, luatrx);
+	luaopen_trx_codec(L);
+	lua_setfield(L, -2, "codec");
 	lua_pushliteral(L, "_COPYRIGHT");
 	lua_pushliteral(L, "Copyright (c) 2023 - 2024 Marc Balmer HB9SSB");
 	lua_settable(L, -3);
@@ -32,37 +32,43 @@
 #include <lua.h>
 #include <lauxlib.h>
 
+#include "geo.h"
 #include "trx-control.h"
 #include "trxd.h"
 
+extern void sender_notify(sender_tag_t *, const char *);
+extern void filter_attributes(lua_State *, int, notify_attr_t *);
+extern int filter_match(const listen_filter_t *, const notify_attr_t *);
+extern int luaopen_trxd_geo(lua_State *);
+extern int luaopen_trxd_cty(lua_State *);
+extern int luaopen_trxd_spots(lua_State *);
+
 extern int verbose;
 extern __thread extension_tag_t	*extension_tag;
 
 extern void *signal_input(void *);
 
+/*
+ * Send a notification to the listeners.  If the optional table of
+ * attributes is given, it is only sent to the listeners whose filter
+ * matches.
+ */
 static int
 luatrxd_notify(lua_State *L)
 {
 	sender_list_t *l;
-	char *data;
-
-	data = (char *)luaL_checkstring(L, 1);
-
-	for (l = extension_tag->listeners; l != NULL; l = l->next) {
-		if (pthread_mutex_lock(&l->sender->mutex)) {
-			syslog(LOG_ERR, "luatrxd: pthread_mutex_lock");
-			exit(1);
-		}
-		l->sender->data = data;
-		if (pthread_cond_signal(&l->sender->cond)) {
-			syslog(LOG_ERR, "luatrxd: pthread_cond_signal");
-			exit(1);
-		}
-		if (pthread_mutex_unlock(&l->sender->mutex)) {
-			syslog(LOG_ERR, "luatrxd: pthread_mutex_unlock");
-			exit(1);
-		}
-	}
+	notify_attr_t attr;
+	const char *data;
+	int has_attr;
+
+	data = luaL_checkstring(L, 1);
+	if ((has_attr = lua_istable(L, 2)))
+		filter_attributes(L, 2, &attr);
+
+	for (l = extension_tag->listeners; l != NULL; l = l->next)
+		if (!has_attr || l->filter == NULL
+		    || filter_match(l->filter, &attr))
+			sender_notify(l->sender, data);
 	return 0;
 }
 
@@ -75,22 +81,50 @@ luatrxd_signal_input(lua_State *L)
 	if (s == NULL)
 		return luaL_error(L, "out of memory");
 	s->fd = luaL_checkinteger(L, 1);
+	s->timeout = 0;
 	s->func = strdup(luaL_checkstring(L, 2));
 	s->extension = extension_tag;
 
+	/* Remember the input, it is cancelled if the extension is removed */
+	s->next = extension_tag->inputs;
+	extension_tag->inputs = s;
+
 	/* Create the signal-input thread */
 	pthread_create(&s->signal_input, NULL, signal_input, s);
 	return 0;
 }
 
+/* Call a function once after a number of seconds */
+static int
+luatrxd_timer(lua_State *L)
+{
+	signal_input_t *s;
+
+	s = malloc(sizeof(signal_input_t));
+	if (s == NULL)
+		return luaL_error(L, "out of memory");
+	s->fd = -1;
+	s->timeout = luaL_checknumber(L, 1) * 1000;
+	s->func = strdup(luaL_checkstring(L, 2));
+	s->extension = extension_tag;
+
+	s->next = extension_tag->inputs;
+	extension_tag->inputs = s;
+
+	pthread_create(&s->signal_input, NULL, signal_input, s);
+	return 0;
+}
+
 static int
 luatrxd_locator(lua_State *L)
 {
 	double lat, lon;
-	char locator[6];
+	char locator[GEO_LOCATORMAX + 1];
+	int len;
 
 	lat = luaL_checknumber(L, 1);
 	lon = luaL_checknumber(L, 2);
+	len = luaL_optinteger(L, 3, 6);
 
 	if (lat >= 90.0 || lat < -90.0) {
 		lua_pushnil(L);
@@ -104,17 +138,13 @@ luatrxd_locator(lua_State *L)
 		return 2;
 	}
 
-	lon += 180.0;
-	lat += 90.0;
-
-	locator[0] = 'A' + lon / 20;
-	locator[1] = 'A' + lat / 10;
-	locator[2] = '0' + (int)lon % 20 / 2;
-	locator[3] = '0' + (int)lat % 10;
-	locator[4] = 'A' + (lon - (int)lon / 2 * 2 ) * 12;
-	locator[5] = 'A' + (lat - (int)lat) * 24;
+	if (geo_locator(lat, lon, len, locator)) {
+		lua_pushnil(L);
+		lua_pushstring(L, "length out of range");
+		return 2;
+	}
 
-	lua_pushlstring(L, locator, sizeof(locator));
+	lua_pushstring(L, locator);
 	return 1;
 }
 
@@ -138,6 +168,7 @@ luaopen_trxd(lua_State *L)
 	struct luaL_Reg luatrxd[] = {
 		{ "notify",		luatrxd_notify },
 		{ "signalInput",	luatrxd_signal_input },
+		{ "timer",		luatrxd_timer },
 		{ "locator",		luatrxd_locator },
 		{ "verbose",		luatrxd_verbose },
 		{ "version",		luatrxd_version },
@@ -145,6 +176,12 @@ luaopen_trxd(lua_State *L)
 	};
 
 	luaL_newlib(L, luatrxd);
+	luaopen_trxd_geo(L);
+	lua_setfield(L, -2, "geo");
+	luaopen_trxd_spots(L);
+	lua_setfield(L, -2, "spots");
+	luaopen_trxd_cty(L);
+	lua_setfield(L, -2, "cty");
 	lua_pushliteral(L, "_COPYRIGHT");
 	lua_pushliteral(L, "Copyright (c) 2023 - 2024 Marc Balmer HB9SSB");
 	lua_settable(L, -3);
@@ -20,20 +20,26 @@
  * IN THE SOFTWARE.
  */
 
-/* Handle incoming NMEA data  */
+/*
+ * Handle incoming NMEA data.  The device is read in blocks as data arrives,
+ * changes of the fix are sent to clients that requested status updates.
+ */
 
 #include <errno.h>
 #include <poll.h>
 #include <pthread.h>
-#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "buffer.h"
+#include "geo.h"
 #include "trxd.h"
 
+extern void sender_notify(sender_tag_t *, const char *);
 extern int verbose;
 
 #ifdef NMEA_DEBUG
@@ -45,7 +51,7 @@ int nmeadebug = 0;
 #define DPRINTF(x)	DPRINTFN(0, x)
 
 #define NMEAMAX		82
-#define LOCMAX		6
+#define READMAX		256
 #define MAXFLDS		32
 #define KNOTTOMS	(0.514444)
 #ifdef NMEA_DEBUG
@@ -54,16 +60,25 @@ int nmeadebug = 0;
 #define TRUSTTIME	(10 * 60)	/* 10 minutes */
 #endif
 
+/* Satellites in view are reported by each system separately */
+static const char *talker[] = { "BD", "GA", "GL", "GN", "GP" };
+#define TALKERS		(sizeof(talker) / sizeof(talker[0]))
+
 struct nmea {
 	char			cbuf[NMEAMAX];	/* receive buffer */
 	int			sync;		/* if 1, waiting for '$' */
 	int			pos;		/* position in rcv buffer */
+	int			view[TALKERS];	/* satellites in view */
 };
 
 /* NMEA decoding */
 static void	nmea_scan(nmea_tag_t *, struct nmea *);
 static int	nmea_gprmc(nmea_tag_t *, char *fld[], int fldcnt);
 static int	nmea_gpgga(nmea_tag_t *, char *fld[], int fldcnt);
+static int	nmea_gpgsa(nmea_tag_t *, char *fld[], int fldcnt);
+static int	nmea_gpgsv(nmea_tag_t *, struct nmea *, int, char *fld[],
+		    int fldcnt);
+static int	nmea_gpvtg(nmea_tag_t *, char *fld[], int fldcnt);
 
 /* Maidenhead Locator */
 static int	nmea_locator(nmea_tag_t *);
@@ -90,14 +105,138 @@ nmea_dump(nmea_tag_t *t)
 	printf("Speed    : %6.2f m/s\n", t->speed);
 	printf("Course   : %8.4f\n", t->course);
 	printf("GPS mode : %c\n", t->mode);
+	printf("Fix type : %d\n", t->fix_type);
+	printf("Sats used: %d of %d\n", t->sats_used, t->sats_in_view);
+	printf("DOP      : %.2f (h %.2f, v %.2f)\n", t->pdop, t->hdop, t->vdop);
 	printf("Locator  : %s\n", t->locator);
 	printf("\n");
 }
 
+/* The fix as JSON object, the mutex must be locked */
+void
+nmea_fix(nmea_tag_t *t, struct buffer *buf)
+{
+	buf_printf(buf, "{\"date\":\"%02d.%02d.%04d\",",
+	    t->day, t->month, t->year > 0 ? t->year + 2000 : 0);
+	buf_printf(buf, "\"time\":\"%02d:%02d:%02d\",",
+	    t->hour, t->minute, t->second);
+	buf_printf(buf, "\"status\":\"%d\",", t->status);
+	buf_printf(buf, "\"latitude\":\"%.6f\",", t->latitude);
+	buf_printf(buf, "\"longitude\":\"%.6f\",", t->longitude);
+	buf_printf(buf, "\"altitude\":\"%.2f\",", t->altitude);
+	buf_printf(buf, "\"variation\":\"%.4f\",", t->variation);
+	buf_printf(buf, "\"speed\":\"%.2f\",", t->speed);
+	buf_printf(buf, "\"course\":\"%.4f\",", t->course);
+	buf_printf(buf, "\"mode\":\"%c\",", t->mode);
+	buf_printf(buf, "\"fixType\":\"%d\",", t->fix_type);
+	buf_printf(buf, "\"satellitesUsed\":\"%d\",", t->sats_used);
+	buf_printf(buf, "\"satellitesInView\":\"%d\",", t->sats_in_view);
+	buf_printf(buf, "\"pdop\":\"%.2f\",", t->pdop);
+	buf_printf(buf, "\"hdop\":\"%.2f\",", t->hdop);
+	buf_printf(buf, "\"vdop\":\"%.2f\",", t->vdop);
+	buf_printf(buf, "\"locator\":\"%s\"}", t->locator);
+}
+
+/* Milliseconds since the fix was last sent */
+static long
+since_notified(nmea_tag_t *t, struct timespec *now)
+{
+	clock_gettime(CLOCK_MONOTONIC, now);
+	return (now->tv_sec - t->notified.tv_sec) * 1000
+	    + (now->tv_nsec - t->notified.tv_nsec) / 1000000;
+}
+
+/*
+ * Send the fix to the clients that requested status updates if it has
+ * changed, but not more often than every interval milliseconds.  A change
+ * within the interval is held back and sent by nmea_pending() once the
+ * interval has passed.  The mutex must be locked.
+ */
+static void
+nmea_notify(nmea_tag_t *t)
+{
+	struct timespec now;
+	struct buffer buf;
+	sender_list_t *l;
+
+	if (t->senders == NULL) {
+		t->pending = 0;
+		return;
+	}
+
+	if (since_notified(t, &now) < t->interval && t->last != NULL) {
+		t->pending = 1;
+		return;
+	}
+	t->pending = 0;
+
+	buf_init(&buf);
+	buf_addstring(&buf,
+	    "{\"request\":\"status-update\",\"from\":\"nmea\",\"fix\":");
+	nmea_fix(t, &buf);
+	buf_addstring(&buf, "}");
+
+	if (t->last == NULL || strcmp(t->last, buf.data)) {
+		for (l = t->senders; l != NULL; l = l->next)
+			sender_notify(l->sender, buf.data);
+		free(t->last);
+		t->last = strdup(buf.data);
+		if (t->last == NULL) {
+			syslog(LOG_ERR, "nmea-handler: strdup");
+			exit(1);
+		}
+		t->notified = now;
+	}
+	buf_free(&buf);
+}
+
+/*
+ * Send a change held back by nmea_notify() if the interval has passed.
+ * Returns the milliseconds until it is due, or -1 if no change is held
+ * back, as the poll(2) timeout of the thread reading the fix.
+ */
+int
+nmea_pending(nmea_tag_t *t)
+{
+	struct timespec now;
+	long timeout = -1;
+
+	if (pthread_mutex_lock(&t->mutex)) {
+		syslog(LOG_ERR, "nmea-handler: pthread_mutex_lock");
+		exit(1);
+	}
+	if (t->pending) {
+		timeout = t->interval - since_notified(t, &now);
+		if (timeout <= 0) {
+			nmea_notify(t);
+			timeout = -1;
+		}
+	}
+	if (pthread_mutex_unlock(&t->mutex)) {
+		syslog(LOG_ERR, "nmea-handler: pthread_mutex_unlock");
+		exit(1);
+	}
+	return timeout;
+}
+
+/*
+ * The fix data has been updated, from an NMEA sentence or a gpsd report.
+ * The mutex must be locked.
+ */
+void
+nmea_update(nmea_tag_t *t)
+{
+	nmea_locator(t);
+	if (verbose > 2)
+		nmea_dump(t);
+	nmea_notify(t);
+}
+
 /* Collect NMEA sentences from the device. */
-static int
+static void
 nmea_input(nmea_tag_t *t, int c, struct nmea *np)
-{	switch (c) {
+{
+	switch (c) {
 	case '$':
 		np->pos = np->sync = 0;
 		break;
@@ -120,7 +259,7 @@ nmea_input(nmea_tag_t *t, int c, struct nmea *np)
 static void
 nmea_scan(nmea_tag_t *t, struct nmea *np)
 {
-	int fldcnt = 0, cksum = 0, msgcksum, n;
+	int fldcnt = 0, cksum = 0, msgcksum, n, src;
 	char *fld[MAXFLDS], *cs;
 
 	if (verbose > 3)
@@ -160,16 +299,18 @@ nmea_scan(nmea_tag_t *t, struct nmea *np)
 	 * Galileo (GA)
 	 * 'Any kind/a mix of GNSS systems' (GN)
 	 */
-	if (strncmp(fld[0], "BD", 2) &&
-	    strncmp(fld[0], "GA", 2) &&
-	    strncmp(fld[0], "GL", 2) &&
-	    strncmp(fld[0], "GN", 2) &&
-	    strncmp(fld[0], "GP", 2))
+	for (src = 0; src < TALKERS; src++)
+		if (!strncmp(fld[0], talker[src], 2))
+			break;
+	if (src == TALKERS)
 		return;
 
-	/* we look for the RMC & GGA messages */
+	/* we look for the RMC, GGA, GSA, GSV, and VTG messages */
 	if (strncmp(fld[0] + 2, "RMC", 3) &&
-	    strncmp(fld[0] + 2, "GGA", 3))
+	    strncmp(fld[0] + 2, "GGA", 3) &&
+	    strncmp(fld[0] + 2, "GSA", 3) &&
+	    strncmp(fld[0] + 2, "GSV", 3) &&
+	    strncmp(fld[0] + 2, "VTG", 3))
 		return;
 
 	/* if we have a checksum, verify it */
@@ -206,9 +347,13 @@ nmea_scan(nmea_tag_t *t, struct nmea *np)
 		nmea_gprmc(t, fld, fldcnt);
 	else if (!strncmp(fld[0] + 2, "GGA", 3))
 		nmea_gpgga(t, fld, fldcnt);
-	nmea_locator(t);
-	if (verbose > 2)
-		nmea_dump(t);
+	else if (!strncmp(fld[0] + 2, "GSA", 3))
+		nmea_gpgsa(t, fld, fldcnt);
+	else if (!strncmp(fld[0] + 2, "GSV", 3))
+		nmea_gpgsv(t, np, src, fld, fldcnt);
+	else
+		nmea_gpvtg(t, fld, fldcnt);
+	nmea_update(t);
 
 	if (pthread_mutex_unlock(&t->mutex)) {
 		syslog(LOG_ERR, "nmea-handler: pthread_mutex_unlock");
@@ -235,7 +380,8 @@ nmea_gprmc(nmea_tag_t *t, char *fld[], int fldcnt)
 		return -1;
 	}
 
-	if (*fld[12] != t->mode)
+	/* The mode indicator was added in NMEA 2.3 */
+	if (fldcnt > 12 && *fld[12] != t->mode)
 		t->mode = *fld[12];
 
 	switch (*fld[2]) {
@@ -286,34 +432,79 @@ nmea_gpgga(nmea_tag_t *t, char *fld[], int fldcnt)
 	if (nmea_degrees(&t->longitude, fld[4], *fld[5] == 'W' ? 1 : 0))
 		return -1;
 
+	if (*fld[7])
+		t->sats_used = atoi(fld[7]);
+	if (*fld[8])
+		t->hdop = atof(fld[8]);
 	t->altitude = atof(fld[9]);
 	return 0;
 }
 
+/*
+ * Decode the fix type and the dilution of precision.
+ * $GNGSA,A,3,05,07,13,14,15,17,19,30,,,,,1.50,0.84,1.24*1B
+ */
 static int
-nmea_locator(nmea_tag_t *t)
+nmea_gpgsa(nmea_tag_t *t, char *fld[], int fldcnt)
 {
-	double lat, lon;
-
-	if (t->longitude >= 180.0 || t->longitude < -180.0
-	   || t->latitude >= 90.0 || t->latitude < -90.0)
+	if (fldcnt < 18) {
+		DPRINTF(("GSA: field count mismatch, %d\n", fldcnt));
 		return -1;
+	}
 
-	lon = t->longitude + 180.0;
-	lat = t->latitude + 90.0;
+	t->fix_type = atoi(fld[2]);
+	t->pdop = atof(fld[15]);
+	t->hdop = atof(fld[16]);
+	t->vdop = atof(fld[17]);
+	return 0;
+}
 
-	t->locator[0] = 'A' + lon / 20;
-	t->locator[1] = 'A' + lat / 10;
-	t->locator[2] = '0' + (int)lon % 20 / 2;
-	t->locator[3] = '0' + (int)lat % 10;
-	t->locator[4] = 'A' + (lon - (int)lon / 2 * 2 ) * 12;
-	t->locator[5] = 'A' + (lat - (int)lat) * 24;
+/*
+ * Decode the number of satellites in view, each system reports its own.
+ * $GPGSV,3,1,11,05,41,294,44,07,23,045,40,13,71,133,46,14,19,196,38*7C
+ */
+static int
+nmea_gpgsv(nmea_tag_t *t, struct nmea *np, int src, char *fld[], int fldcnt)
+{
+	int n;
 
-	t->locator[6] = '\0';
+	if (fldcnt < 4) {
+		DPRINTF(("GSV: field count mismatch, %d\n", fldcnt));
+		return -1;
+	}
 
+	np->view[src] = atoi(fld[3]);
+	for (t->sats_in_view = 0, n = 0; n < TALKERS; n++)
+		t->sats_in_view += np->view[n];
 	return 0;
 }
 
+/*
+ * Decode the course and speed over ground.
+ * $GPVTG,054.7,T,034.4,M,005.5,N,010.2,K,A*25
+ */
+static int
+nmea_gpvtg(nmea_tag_t *t, char *fld[], int fldcnt)
+{
+	if (fldcnt < 9) {
+		DPRINTF(("VTG: field count mismatch, %d\n", fldcnt));
+		return -1;
+	}
+
+	if (*fld[1])
+		t->course = atof(fld[1]);
+	if (*fld[7])
+		t->speed = atof(fld[7]) / 3.6;
+	return 0;
+}
+
+static int
+nmea_locator(nmea_tag_t *t)
+{
+	return geo_locator(t->latitude, t->longitude, LOCATORMAX,
+	    t->locator);
+}
+
 /*
  * Convert nmea integer/decimal values in the form of XXXX.Y to an integer value
  * if it's a meter/altitude value, will be returned as mm
@@ -422,13 +613,13 @@ nmea_time(nmea_tag_t *t, char *s)
 	return 0;
 }
 
+/* The tag is not freed, it is still used by the nmea destination */
 static void
 cleanup(void *arg)
 {
 	nmea_tag_t *t = (nmea_tag_t *)arg;
 
 	close(t->fd);
-	free(t);
 }
 
 static void
@@ -443,10 +634,10 @@ void *
 nmea_handler(void *arg)
 {
 	nmea_tag_t *t = (nmea_tag_t *)arg;
-	struct nmea *np;
 	struct pollfd pfd;
-	int n, fd;
-	char data;
+	struct nmea *np;
+	char data[READMAX];
+	ssize_t len, n;
 
 	if (pthread_detach(pthread_self())) {
 		syslog(LOG_ERR, "nmea-handler: pthread_detach");
@@ -460,7 +651,7 @@ nmea_handler(void *arg)
 		exit(1);
 	}
 
-	np = malloc(sizeof(struct nmea));
+	np = calloc(1, sizeof(struct nmea));
 	if (np == NULL) {
 		syslog(LOG_ERR, "nmea-handler: malloc");
 		exit(1);
@@ -469,22 +660,35 @@ nmea_handler(void *arg)
 
 	pthread_cleanup_push(cleanup_nmea, np);
 
-
 	pfd.fd = t->fd;
 	pfd.events = POLLIN;
 
+	/*
+	 * The read returns what is available once data arrives.  The poll
+	 * times out when a held back change of the fix is due.
+	 */
 	for (;;) {
-		if (poll(&pfd, 1, 0) == -1) {
-			syslog(LOG_ERR, "nmea-handler: poll");
-			exit(1);
+		n = poll(&pfd, 1, nmea_pending(t));
+		if (n == -1 && errno != EINTR) {
+			syslog(LOG_ERR, "nmea-handler: poll: %s",
+			    strerror(errno));
+			break;
 		}
-
-		if (pfd.revents) {
-			read(t->fd, &data, 1);
-			nmea_input(t, data, np);
+		if (n <= 0)
+			continue;
+
+		len = read(t->fd, data, sizeof(data));
+		if (len == -1 && errno == EINTR)
+			continue;
+		if (len <= 0) {
+			syslog(LOG_ERR, "nmea-handler: %s", len == 0 ?
+			    "end of file" : strerror(errno));
+			break;
 		}
-	};
-	pthread_cleanup_pop(0);
-	pthread_cleanup_pop(0);
+		for (n = 0; n < len; n++)
+			nmea_input(t, data[n], np);
+	}
+	pthread_cleanup_pop(1);
+	pthread_cleanup_pop(1);
 	return NULL;
 }
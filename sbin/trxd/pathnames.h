@@ -34,5 +34,6 @@
 #define _PATH_TRX_CONTROLLER	"/usr/share/trxd/trx-controller.lua"
 #define _PATH_GPIO_CONTROLLER	"/usr/share/trxd/gpio-controller.lua"
 #define _PATH_CFG		"/etc/trxd.yaml"
+#define _PATH_CACHE		"/var/cache/trxd"
 
 #endif /* __TRXD_PATHNAMES_H__ */
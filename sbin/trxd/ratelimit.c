@@ -0,0 +1,334 @@
+/*
+ * Copyright (c) 2024 Marc Balmer HB9SSB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Admission control and rate limiting.  The number of clients connected
+ * over each listener can be limited.  Requests that are sent to a
+ * transceiver, and thus use its CAT line, are limited by a token bucket
+ * per client and a token bucket per transceiver.  A request for which no
+ * token is available is delayed if a token becomes available within
+ * max-wait milliseconds, otherwise it is refused at once.  A request sent
+ * to several transceivers at once takes a single token from the client's
+ * bucket and is delayed at most once.
+ */
+
+#include <sys/socket.h>
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "buffer.h"
+#include "trxd.h"
+
+static const char *listener_name[LISTENERS] = {
+	"socket",
+	"unix",
+	"websocket"
+};
+
+/* Connections per listener, a maximum of 0 means no limit */
+static int max_connections[LISTENERS];
+static int connections[LISTENERS];
+static int refusing[LISTENERS];
+static pthread_mutex_t admission_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Rate limit per client */
+static double client_rate;
+static double client_burst;
+static long max_wait;
+
+static void
+config_rate(lua_State *L, const char *section, double *rate, double *burst)
+{
+	lua_getfield(L, -1, "rate-limit");
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		return;
+	}
+	if (!lua_istable(L, -1)) {
+		syslog(LOG_ERR, "%s: rate-limit must be a table", section);
+		exit(1);
+	}
+
+	lua_getfield(L, -1, "rate");
+	*rate = lua_tonumber(L, -1);
+	lua_pop(L, 1);
+	if (*rate < 0) {
+		syslog(LOG_ERR, "%s: rate must not be negative", section);
+		exit(1);
+	}
+
+	/* Allow a second's worth of requests at once by default */
+	lua_getfield(L, -1, "burst");
+	*burst = lua_isnumber(L, -1) ? lua_tonumber(L, -1) : ceil(*rate);
+	lua_pop(L, 1);
+	if (*rate > 0 && *burst < 1) {
+		syslog(LOG_ERR, "%s: burst must be at least 1", section);
+		exit(1);
+	}
+	lua_pop(L, 1);
+}
+
+/*
+ * Read the limits from the clients section of the configuration table on
+ * top of the stack.  max-connections is either a number, which applies to
+ * each listener, or a table with a number per listener.
+ */
+void
+ratelimit_config(lua_State *L)
+{
+	int n, max;
+
+	lua_getfield(L, -1, "clients");
+	if (!lua_istable(L, -1)) {
+		lua_pop(L, 1);
+		return;
+	}
+
+	lua_getfield(L, -1, "max-connections");
+	if (lua_isinteger(L, -1)) {
+		max = lua_tointeger(L, -1);
+		for (n = 0; n < LISTENERS; n++)
+			max_connections[n] = max;
+	} else if (lua_istable(L, -1)) {
+		for (n = 0; n < LISTENERS; n++) {
+			lua_getfield(L, -1, listener_name[n]);
+			max_connections[n] = lua_tointeger(L, -1);
+			lua_pop(L, 1);
+		}
+	} else if (!lua_isnil(L, -1)) {
+		syslog(LOG_ERR, "clients: invalid max-connections");
+		exit(1);
+	}
+	lua_pop(L, 1);
+	for (n = 0; n < LISTENERS; n++)
+		if (max_connections[n] < 0) {
+			syslog(LOG_ERR, "clients: max-connections must not be "
+			    "negative");
+			exit(1);
+		}
+
+	config_rate(L, "clients", &client_rate, &client_burst);
+
+	lua_getfield(L, -1, "max-wait");
+	max_wait = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+	if (max_wait < 0) {
+		syslog(LOG_ERR, "clients: max-wait must not be negative");
+		exit(1);
+	}
+	lua_pop(L, 1);
+}
+
+static void
+bucket_init(token_bucket_t *b, double rate, double burst)
+{
+	if (pthread_mutex_init(&b->mutex, NULL)) {
+		syslog(LOG_ERR, "ratelimit: pthread_mutex_init");
+		exit(1);
+	}
+	b->rate = rate;
+	b->burst = burst;
+	b->tokens = burst;
+	b->delayed = b->refused = 0;
+	clock_gettime(CLOCK_MONOTONIC, &b->updated);
+}
+
+/* The rate limit of a transceiver, its configuration is on top of the stack */
+void
+ratelimit_init(token_bucket_t *b, lua_State *L, const char *name)
+{
+	double rate = 0, burst = 0;
+
+	config_rate(L, name, &rate, &burst);
+	bucket_init(b, rate, burst);
+}
+
+/* The rate limit of a new client */
+void
+ratelimit_client(token_bucket_t *b)
+{
+	bucket_init(b, client_rate, client_burst);
+}
+
+/*
+ * Take a token.  Returns the number of milliseconds to wait until the
+ * token is available, or -1 if that is longer than max-wait.
+ */
+static long
+reserve(token_bucket_t *b, long *retry)
+{
+	struct timespec now;
+	double elapsed;
+	long wait;
+
+	if (b->rate == 0)
+		return 0;
+
+	pthread_mutex_lock(&b->mutex);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - b->updated.tv_sec)
+	    + (now.tv_nsec - b->updated.tv_nsec) / 1e9;
+	b->updated = now;
+	b->tokens += elapsed * b->rate;
+	if (b->tokens > b->burst)
+		b->tokens = b->burst;
+
+	wait = 0;
+	if (b->tokens < 1) {
+		wait = ceil((1 - b->tokens) / b->rate * 1000);
+		if (wait > max_wait) {
+			b->refused++;
+			pthread_mutex_unlock(&b->mutex);
+			if (wait > *retry)
+				*retry = wait;
+			return -1;
+		}
+		b->delayed++;
+	}
+	b->tokens -= 1;
+	pthread_mutex_unlock(&b->mutex);
+	return wait;
+}
+
+static void
+refund(token_bucket_t *b, long wait)
+{
+	if (b->rate == 0)
+		return;
+
+	/* The bucket may have been refilled since the token was taken */
+	pthread_mutex_lock(&b->mutex);
+	b->tokens += 1;
+	if (b->tokens > b->burst)
+		b->tokens = b->burst;
+	if (wait > 0)
+		b->delayed--;
+	pthread_mutex_unlock(&b->mutex);
+}
+
+/*
+ * Take a token from the client's bucket and one from the bucket of each of
+ * the n transceivers a request is sent to, waiting once up to max-wait
+ * milliseconds for all of them.  The bucket of a transceiver that is
+ * refused is set to NULL.  Returns 0 if the request can be sent to at least
+ * one transceiver, or -1 if it is refused, retry is then set to the time
+ * in milliseconds after which it would be accepted.
+ */
+int
+ratelimit_take(token_bucket_t *client, token_bucket_t **trx, int n,
+    long *retry)
+{
+	struct timespec ts;
+	long wait, cwait, w;
+	int i, taken = 0;
+
+	*retry = 0;
+	if ((cwait = reserve(client, retry)) == -1)
+		return -1;
+	wait = cwait;
+	for (i = 0; i < n; i++) {
+		if ((w = reserve(trx[i], retry)) == -1) {
+			trx[i] = NULL;
+			continue;
+		}
+		taken++;
+		if (w > wait)
+			wait = w;
+	}
+	if (taken == 0) {
+		refund(client, cwait);
+		return -1;
+	}
+
+	if (wait > 0) {
+		ts.tv_sec = wait / 1000;
+		ts.tv_nsec = (wait % 1000) * 1000000L;
+		nanosleep(&ts, NULL);
+	}
+	return 0;
+}
+
+/* Statistics for get-statistics */
+void
+ratelimit_statistics(token_bucket_t *b, struct buffer *buf)
+{
+	pthread_mutex_lock(&b->mutex);
+	buf_printf(buf, "\"rateLimit\":{\"rate\":%g,\"burst\":%g,"
+	    "\"delayed\":%lu,\"refused\":%lu}", b->rate, b->burst,
+	    b->delayed, b->refused);
+	pthread_mutex_unlock(&b->mutex);
+}
+
+/* The listener a socket-handler's client connected to */
+enum Listener
+socket_listener(int fd)
+{
+	struct sockaddr_storage sa;
+	socklen_t len;
+
+	len = sizeof(sa);
+	if (!getsockname(fd, (struct sockaddr *)&sa, &len)
+	    && sa.ss_family == AF_UNIX)
+		return LISTENER_UNIX;
+	return LISTENER_SOCKET;
+}
+
+/*
+ * Admit a client that has connected to a listener.  Returns 0 if too many
+ * clients are connected, the connection must then be closed.  An admitted
+ * client must call client_leave() when it disconnects.
+ */
+int
+client_admit(enum Listener l)
+{
+	int admit;
+
+	pthread_mutex_lock(&admission_mutex);
+	admit = max_connections[l] == 0 || connections[l] < max_connections[l];
+	if (admit) {
+		connections[l]++;
+		refusing[l] = 0;
+	} else if (!refusing[l]) {
+		/* Only log once while clients are being refused */
+		syslog(LOG_NOTICE, "%s: %d clients connected, refusing new "
+		    "connections", listener_name[l], connections[l]);
+		refusing[l] = 1;
+	}
+	pthread_mutex_unlock(&admission_mutex);
+	return admit;
+}
+
+void
+client_leave(enum Listener l)
+{
+	pthread_mutex_lock(&admission_mutex);
+	connections[l]--;
+	pthread_mutex_unlock(&admission_mutex);
+}
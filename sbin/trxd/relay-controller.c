@@ -48,12 +48,18 @@ extern int luaopen_json(lua_State *);
 extern trx_controller_tag_t *trx_controller_tag;
 extern int verbose;
 
+/*
+ * The relay-controller is cancelled when it has been removed by a
+ * configuration reload.  The tag is not freed, dispatchers might still
+ * refer to it.
+ */
 static void
 cleanup(void *arg)
 {
 	relay_controller_tag_t *t = (relay_controller_tag_t *)arg;
-	free(t->name);
-	free(arg);
+
+	/* Cancelled while waiting for the next request */
+	pthread_mutex_unlock(&t->mutex2);
 }
 
 static void
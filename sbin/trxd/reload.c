@@ -0,0 +1,459 @@
+/*
+ * Copyright (c) 2024 Marc Balmer HB9SSB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Reload the configuration file.  Transceivers, gpio, relays, extensions,
+ * and groups that have been removed or changed are stopped, new or changed
+ * ones are started.  Everything else, including the client connections, is
+ * left alone.
+ */
+
+#include <sys/stat.h>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include "buffer.h"
+#include "trxd.h"
+
+extern int luaopen_yaml(lua_State *);
+extern int luaopen_trxd(lua_State *);
+extern int setup_transceiver(lua_State *, sender_list_t *);
+extern int setup_gpio(lua_State *);
+extern int setup_relay(lua_State *);
+extern int setup_extension(lua_State *, sender_list_t *);
+extern int setup_group(lua_State *);
+extern destination_t *find_destination(const char *);
+extern void remove_destination(destination_t *);
+extern void release_destination(destination_t *);
+extern void trx_remove(trx_controller_tag_t *);
+extern void trx_state_detach(trx_controller_tag_t *);
+
+extern destination_t *destination;
+extern int verbose;
+
+static struct section {
+	const char		*name;
+	enum DestinationType	 type;
+} sections[] = {
+	{ "transceivers",	DEST_TRX },
+	{ "gpio",		DEST_GPIO },
+	{ "relays",		DEST_RELAY },
+	{ "extensions",		DEST_EXTENSION },
+	{ "groups",		DEST_GROUP },
+	{ NULL,			0 }
+};
+
+/* What has been stopped, a replacement takes over the senders */
+struct retired {
+	destination_t		*dst;
+	const char		*name;
+	enum DestinationType	 type;
+	sender_list_t		*senders;
+	trx_controller_tag_t	*trx;
+	struct retired		*next;
+};
+
+static int
+compare(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ * Return a string representation of the value at index idx.  Table keys are
+ * sorted, so that the same configuration always results in the same string.
+ */
+char *
+config_fingerprint(lua_State *L, int idx)
+{
+	struct buffer b;
+	char **item = NULL, *value;
+	size_t n, nitems = 0;
+
+	idx = lua_absindex(L, idx);
+	if (buf_init(&b)) {
+		syslog(LOG_ERR, "reload: memory allocation error");
+		exit(1);
+	}
+
+	switch (lua_type(L, idx)) {
+	case LUA_TTABLE:
+		lua_pushnil(L);
+		while (lua_next(L, idx)) {
+			item = reallocarray(item, nitems + 1, sizeof(char *));
+			if (item == NULL) {
+				syslog(LOG_ERR, "reload: memory allocation "
+				    "error");
+				exit(1);
+			}
+			value = config_fingerprint(L, -1);
+			if (asprintf(&item[nitems++], "%s=%s",
+			    luaL_tolstring(L, -2, NULL), value) == -1) {
+				syslog(LOG_ERR, "reload: memory allocation "
+				    "error");
+				exit(1);
+			}
+			free(value);
+			lua_pop(L, 2);
+		}
+		qsort(item, nitems, sizeof(char *), compare);
+
+		buf_addchar(&b, '{');
+		for (n = 0; n < nitems; n++) {
+			if (n > 0)
+				buf_addchar(&b, ',');
+			buf_addstring(&b, item[n]);
+			free(item[n]);
+		}
+		buf_addchar(&b, '}');
+		free(item);
+		break;
+	case LUA_TSTRING:
+		buf_printf(&b, "\"%s\"", lua_tostring(L, idx));
+		break;
+	default:
+		buf_addstring(&b, luaL_tolstring(L, idx, NULL));
+		lua_pop(L, 1);
+	}
+	buf_addchar(&b, '\0');
+	return b.data;
+}
+
+/*
+ * Stop a transceiver.  Requests that are queued or arrive later fail, the
+ * trx-controller closes the CAT device and terminates.
+ */
+static sender_list_t *
+stop_transceiver(trx_controller_tag_t *t)
+{
+	sender_list_t *senders;
+
+	if (pthread_mutex_lock(&t->mutex)) {
+		syslog(LOG_ERR, "reload: pthread_mutex_lock");
+		exit(1);
+	}
+	if (t->poller_running) {
+		t->poller_running = 0;
+		pthread_cancel(t->trx_poller);
+	}
+	senders = t->senders;
+	t->senders = NULL;
+	if (pthread_mutex_unlock(&t->mutex)) {
+		syslog(LOG_ERR, "reload: pthread_mutex_unlock");
+		exit(1);
+	}
+	trx_remove(t);
+	return senders;
+}
+
+/* The gpio-controller waits for requests and can be cancelled */
+static void
+stop_gpio(gpio_controller_tag_t *t)
+{
+	if (pthread_mutex_lock(&t->mutex)) {
+		syslog(LOG_ERR, "reload: pthread_mutex_lock");
+		exit(1);
+	}
+	t->removed = 1;
+	pthread_cancel(t->gpio_controller);
+	if (pthread_mutex_unlock(&t->mutex)) {
+		syslog(LOG_ERR, "reload: pthread_mutex_unlock");
+		exit(1);
+	}
+}
+
+static void
+stop_relay(relay_controller_tag_t *t)
+{
+	if (pthread_mutex_lock(&t->mutex)) {
+		syslog(LOG_ERR, "reload: pthread_mutex_lock");
+		exit(1);
+	}
+	t->removed = 1;
+	pthread_cancel(t->relay_controller);
+	if (pthread_mutex_unlock(&t->mutex)) {
+		syslog(LOG_ERR, "reload: pthread_mutex_unlock");
+		exit(1);
+	}
+}
+
+/*
+ * A callable extension is told to stop like it is called, it then stops
+ * its signal inputs and closes its Lua state.
+ */
+static sender_list_t *
+stop_extension(extension_tag_t *e)
+{
+	sender_list_t *listeners;
+
+	if (pthread_mutex_lock(&e->mutex)) {
+		syslog(LOG_ERR, "reload: pthread_mutex_lock");
+		exit(1);
+	}
+	if (pthread_mutex_lock(&e->mutex2)) {
+		syslog(LOG_ERR, "reload: pthread_mutex_lock");
+		exit(1);
+	}
+	listeners = e->listeners;
+	e->listeners = NULL;
+	e->removed = 1;
+	e->done = 0;
+	e->call = 1;
+	if (pthread_cond_signal(&e->cond1)) {
+		syslog(LOG_ERR, "reload: pthread_cond_signal");
+		exit(1);
+	}
+	while (!e->done) {
+		if (pthread_cond_wait(&e->cond2, &e->mutex2)) {
+			syslog(LOG_ERR, "reload: pthread_cond_wait");
+			exit(1);
+		}
+	}
+	pthread_mutex_unlock(&e->mutex2);
+	pthread_mutex_unlock(&e->mutex);
+	return listeners;
+}
+
+/*
+ * Returns 1 if the destination is no longer part of section or if its
+ * configuration changed.  The section table is on top of the stack.
+ */
+static int
+is_changed(lua_State *L, destination_t *d)
+{
+	char *config;
+	int changed;
+
+	if (!lua_istable(L, -1))
+		return 1;
+	lua_getfield(L, -1, d->name);
+	if (!lua_istable(L, -1)) {
+		lua_pop(L, 1);
+		return 1;
+	}
+	config = config_fingerprint(L, -1);
+	changed = d->config == NULL || strcmp(d->config, config);
+	free(config);
+	lua_pop(L, 1);
+	return changed;
+}
+
+void
+reload(const char *cfg_file)
+{
+	lua_State *L;
+	struct section *s;
+	destination_t *d, *next;
+	struct retired *retired = NULL, *r;
+	sender_list_t *senders, *l;
+	struct stat sb;
+	int top, stopped = 0, started = 0;
+
+	syslog(LOG_NOTICE, "reloading %s", cfg_file);
+
+	L = luaL_newstate();
+	if (L == NULL) {
+		syslog(LOG_ERR, "reload: cannot initialize Lua state");
+		return;
+	}
+	luaL_openlibs(L);
+	luaopen_yaml(L);
+	lua_setglobal(L, "yaml");
+	luaopen_trxd(L);
+	lua_setglobal(L, "trxd");
+
+	if (stat(cfg_file, &sb)) {
+		syslog(LOG_ERR, "configuration file '%s' not accessible",
+		    cfg_file);
+		lua_close(L);
+		return;
+	}
+
+	lua_getglobal(L, "yaml");
+	lua_getfield(L, -1, "parsefile");
+	lua_pushstring(L, cfg_file);
+	if (lua_pcall(L, 1, 1, 0) != LUA_OK) {
+		syslog(LOG_ERR, "%s: %s", cfg_file, lua_tostring(L, -1));
+		lua_close(L);
+		return;
+	}
+	if (lua_type(L, -1) != LUA_TTABLE) {
+		syslog(LOG_ERR, "invalid configuration file");
+		lua_close(L);
+		return;
+	}
+	top = lua_gettop(L);
+
+	/* Stop what has been removed or changed */
+	for (s = sections; s->name != NULL; s++) {
+		lua_getfield(L, top, s->name);
+		for (d = destination; d != NULL; d = next) {
+			next = d->next;
+			if (d->type != s->type || !is_changed(L, d))
+				continue;
+
+			if (d->type == DEST_EXTENSION
+			    && !d->tag.extension->is_callable) {
+				syslog(LOG_NOTICE, "extension %s is not "
+				    "callable and can not be stopped, "
+				    "restart trxd to reload it", d->name);
+				continue;
+			}
+
+			r = malloc(sizeof(struct retired));
+			if (r == NULL) {
+				syslog(LOG_ERR, "reload: memory allocation "
+				    "error");
+				exit(1);
+			}
+			r->dst = d;
+			r->name = d->name;
+			r->type = d->type;
+			r->senders = NULL;
+			r->trx = d->type == DEST_TRX ? d->tag.trx : NULL;
+			r->next = retired;
+			retired = r;
+
+			remove_destination(d);
+			switch (d->type) {
+			case DEST_TRX:
+				r->senders = stop_transceiver(d->tag.trx);
+				break;
+			case DEST_GPIO:
+				stop_gpio(d->tag.gpio);
+				break;
+			case DEST_RELAY:
+				stop_relay(d->tag.relay);
+				break;
+			case DEST_EXTENSION:
+				r->senders = stop_extension(d->tag.extension);
+				break;
+			default:
+				break;
+			}
+			stopped++;
+			if (verbose)
+				syslog(LOG_NOTICE, "%s stopped", d->name);
+		}
+		lua_settop(L, top);
+	}
+
+	/* Start what is new or has been changed */
+	for (s = sections; s->name != NULL; s++) {
+		lua_getfield(L, top, s->name);
+		if (!lua_istable(L, -1)) {
+			lua_settop(L, top);
+			continue;
+		}
+		lua_pushnil(L);
+		while (lua_next(L, top + 1)) {
+			if (lua_type(L, -2) != LUA_TSTRING) {
+				lua_pop(L, 1);
+				continue;
+			}
+			if ((d = find_destination(lua_tostring(L, -2)))
+			    != NULL) {
+				release_destination(d);
+				lua_pop(L, 1);
+				continue;
+			}
+
+			senders = NULL;
+			for (r = retired; r != NULL; r = r->next) {
+				if (r->type == s->type
+				    && !strcmp(r->name, lua_tostring(L, -2))) {
+					senders = r->senders;
+					r->senders = NULL;
+					break;
+				}
+			}
+
+			switch (s->type) {
+			case DEST_TRX:
+				if (setup_transceiver(L, senders))
+					goto failed;
+				break;
+			case DEST_GPIO:
+				if (setup_gpio(L))
+					goto failed;
+				break;
+			case DEST_RELAY:
+				if (setup_relay(L))
+					goto failed;
+				break;
+			case DEST_EXTENSION:
+				if (setup_extension(L, senders))
+					goto failed;
+				break;
+			case DEST_GROUP:
+				if (setup_group(L))
+					goto failed;
+				break;
+			default:
+				break;
+			}
+			started++;
+			if (verbose)
+				syslog(LOG_NOTICE, "%s started",
+				    lua_tostring(L, -2));
+			lua_settop(L, top + 2);
+			continue;
+failed:
+			syslog(LOG_ERR, "%s: not started, check the "
+			    "configuration", lua_tostring(L, -2));
+			lua_settop(L, top + 2);
+		}
+		lua_settop(L, top);
+	}
+
+	/*
+	 * Senders of a destination that is gone for good are dropped.  The
+	 * shared memory slot of a transceiver is freed only now, a changed
+	 * transceiver has taken it over while it was started.  The removed
+	 * destination is freed once no dispatcher refers to it anymore.
+	 */
+	while (retired != NULL) {
+		if (retired->trx != NULL)
+			trx_state_detach(retired->trx);
+		while (retired->senders != NULL) {
+			l = retired->senders->next;
+			free(retired->senders);
+			retired->senders = l;
+		}
+		release_destination(retired->dst);
+		r = retired->next;
+		free(retired);
+		retired = r;
+	}
+	lua_close(L);
+
+	syslog(LOG_NOTICE, "configuration reloaded, %d stopped, %d started",
+	    stopped, started);
+}
@@ -0,0 +1,474 @@
+/*
+ * Copyright (c) 2024 Marc Balmer HB9SSB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * The outbox of a client.  Replies and status updates are queued by the
+ * dispatcher and the controllers, the socket-sender or websocket-sender
+ * takes everything that has been queued at once and sends it in one go.
+ *
+ * Queueing never blocks, so a client on a bad link can not stall a
+ * controller and with it all other clients.  Instead, the output queued
+ * for each client is limited:  Above the high watermark the client is
+ * considered slow and status updates to it are dropped until its queue
+ * has drained below the low watermark.  A client that exceeds its budget,
+ * or that does not accept any data for send-timeout seconds, is
+ * disconnected.
+ */
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "buffer.h"
+#include "trxd.h"
+
+#define HIGH_WATERMARK	(256 * 1024)
+#define LOW_WATERMARK	(64 * 1024)
+#define MAX_QUEUED	(4 * 1024 * 1024)
+#define MAX_MESSAGES	8192
+#define SEND_TIMEOUT	30
+
+extern int log_connections;
+extern void ratelimit_client(token_bucket_t *);
+
+static size_t high_watermark = HIGH_WATERMARK;
+static size_t low_watermark = LOW_WATERMARK;
+static size_t max_queued = MAX_QUEUED;
+static int max_messages = MAX_MESSAGES;
+static int send_timeout = SEND_TIMEOUT;
+static int slow_disconnect;
+
+/* All connected clients */
+static sender_tag_t *clients;
+static pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t
+config_size(lua_State *L, const char *field, size_t size)
+{
+	lua_getfield(L, -1, field);
+	if (lua_isinteger(L, -1) && lua_tointeger(L, -1) > 0)
+		size = lua_tointeger(L, -1);
+	else if (!lua_isnil(L, -1)) {
+		syslog(LOG_ERR, "clients: %s must be a positive integer",
+		    field);
+		exit(1);
+	}
+	lua_pop(L, 1);
+	return size;
+}
+
+/* Read the client limits from the configuration table on top of the stack */
+void
+sender_config(lua_State *L)
+{
+	const char *policy;
+
+	lua_getfield(L, -1, "clients");
+	if (!lua_istable(L, -1)) {
+		lua_pop(L, 1);
+		return;
+	}
+
+	high_watermark = config_size(L, "high-watermark", high_watermark);
+	low_watermark = config_size(L, "low-watermark", low_watermark);
+	max_queued = config_size(L, "max-queued", max_queued);
+	max_messages = config_size(L, "max-messages", max_messages);
+	send_timeout = config_size(L, "send-timeout", send_timeout);
+
+	lua_getfield(L, -1, "slow-clients");
+	policy = lua_tostring(L, -1);
+	if (policy == NULL || !strcmp(policy, "drop"))
+		slow_disconnect = 0;
+	else if (!strcmp(policy, "disconnect"))
+		slow_disconnect = 1;
+	else {
+		syslog(LOG_ERR, "clients: slow-clients must be 'drop' or "
+		    "'disconnect'");
+		exit(1);
+	}
+	lua_pop(L, 1);
+
+	if (low_watermark > high_watermark || high_watermark > max_queued) {
+		syslog(LOG_ERR, "clients: low-watermark <= high-watermark <= "
+		    "max-queued is required");
+		exit(1);
+	}
+	lua_pop(L, 1);
+}
+
+/*
+ * Clients on the Unix domain socket that run as root or as the user of trxd
+ * are privileged.
+ */
+static void
+peer_name(sender_tag_t *s)
+{
+	struct sockaddr_storage sa;
+	struct ucred cred;
+	socklen_t len;
+	char host[NI_MAXHOST], port[NI_MAXSERV];
+
+	strcpy(s->peer, "unknown");
+	s->privileged = 0;
+	len = sizeof(sa);
+	if (getpeername(s->socket, (struct sockaddr *)&sa, &len))
+		return;
+
+	if (sa.ss_family == AF_UNIX) {
+		len = sizeof(cred);
+		if (!getsockopt(s->socket, SOL_SOCKET, SO_PEERCRED, &cred,
+		    &len)) {
+			snprintf(s->peer, sizeof(s->peer), "pid %d, uid %d",
+			    cred.pid, cred.uid);
+			s->privileged = cred.uid == 0 || cred.uid == geteuid();
+		}
+	} else if (!getnameinfo((struct sockaddr *)&sa, len, host,
+	    sizeof(host), port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV))
+		snprintf(s->peer, sizeof(s->peer),
+		    sa.ss_family == AF_INET6 ? "[%s]:%s" : "%s:%s", host, port);
+}
+
+/*
+ * Initialize the outbox of a new client.  The sender and the dispatcher
+ * each hold a reference and call sender_release() when they terminate.
+ */
+void
+sender_init(sender_tag_t *s, const char *protocol)
+{
+	struct timeval tv;
+
+	s->outbox = s->outbox_tail = NULL;
+	s->queued_bytes = s->inflight_bytes = 0;
+	s->queued = s->inflight = 0;
+	s->slow = s->closed = 0;
+	s->sent = s->sent_bytes = s->dropped = s->slow_count = 0;
+	s->connected = time(NULL);
+	s->protocol = protocol;
+	s->refs = 2;
+	peer_name(s);
+	ratelimit_client(&s->limit);
+
+	if (pthread_mutex_init(&s->mutex, NULL)) {
+		syslog(LOG_ERR, "sender: pthread_mutex_init");
+		exit(1);
+	}
+
+	if (pthread_cond_init(&s->cond, NULL)) {
+		syslog(LOG_ERR, "sender: pthread_cond_init");
+		exit(1);
+	}
+
+	/* A write that blocks longer than this fails and evicts the client */
+	tv.tv_sec = send_timeout;
+	tv.tv_usec = 0;
+	if (setsockopt(s->socket, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)))
+		syslog(LOG_ERR, "sender: setsockopt: %m");
+
+	pthread_mutex_lock(&clients_mutex);
+	s->next = clients;
+	clients = s;
+	pthread_mutex_unlock(&clients_mutex);
+}
+
+void
+sender_free(sender_msg_t *m)
+{
+	sender_msg_t *next;
+
+	for (; m != NULL; m = next) {
+		next = m->next;
+		free(m->data);
+		free(m);
+	}
+}
+
+void
+sender_release(sender_tag_t *s)
+{
+	sender_tag_t **p;
+	int refs;
+
+	pthread_mutex_lock(&s->mutex);
+	refs = --s->refs;
+	pthread_mutex_unlock(&s->mutex);
+	if (refs > 0)
+		return;
+
+	pthread_mutex_lock(&clients_mutex);
+	for (p = &clients; *p != NULL; p = &(*p)->next)
+		if (*p == s) {
+			*p = s->next;
+			break;
+		}
+	pthread_mutex_unlock(&clients_mutex);
+
+	sender_free(s->outbox);
+	pthread_mutex_destroy(&s->mutex);
+	pthread_cond_destroy(&s->cond);
+	pthread_mutex_destroy(&s->limit.mutex);
+	free(s);
+}
+
+/* Discard all output that has not yet been taken by the sender */
+static void
+discard(sender_tag_t *s)
+{
+	s->closed = 1;
+	sender_free(s->outbox);
+	s->outbox = s->outbox_tail = NULL;
+	s->queued_bytes = s->inflight_bytes;
+	s->queued = s->inflight;
+}
+
+/*
+ * Disconnect a client, the mutex is locked.  Shutting down the socket
+ * makes the (web)socket-handler see the end of the connection and
+ * terminate the client's threads as if the client had disconnected.
+ */
+static void
+evict(sender_tag_t *s, const char *reason)
+{
+	if (s->closed)
+		return;
+	syslog(LOG_NOTICE, "client %s (%s) disconnected: %s", s->peer,
+	    s->protocol, reason);
+	shutdown(s->socket, SHUT_RDWR);
+	discard(s);
+}
+
+/*
+ * The client has disconnected, the socket is about to be closed and must
+ * no longer be shut down by evict().
+ */
+void
+sender_close(sender_tag_t *s)
+{
+	pthread_mutex_lock(&s->mutex);
+	discard(s);
+	pthread_mutex_unlock(&s->mutex);
+}
+
+static void
+enqueue(sender_tag_t *s, const char *data, int update)
+{
+	sender_msg_t *m;
+	size_t len;
+
+	len = strlen(data);
+
+	if (pthread_mutex_lock(&s->mutex)) {
+		syslog(LOG_ERR, "sender: pthread_mutex_lock");
+		exit(1);
+	}
+
+	if (s->closed || (update && s->slow)) {
+		s->dropped++;
+		goto done;
+	}
+
+	if (s->queued_bytes + len > max_queued
+	    || s->queued + 1 > max_messages) {
+		s->dropped++;
+		evict(s, "output budget exceeded");
+		goto done;
+	}
+
+	m = malloc(sizeof(sender_msg_t));
+	if (m == NULL) {
+		syslog(LOG_ERR, "sender: malloc");
+		exit(1);
+	}
+	m->len = len;
+	m->data = malloc(len + 1);
+	if (m->data == NULL) {
+		syslog(LOG_ERR, "sender: malloc");
+		exit(1);
+	}
+	memcpy(m->data, data, len + 1);
+	m->next = NULL;
+
+	if (s->outbox_tail == NULL)
+		s->outbox = m;
+	else
+		s->outbox_tail->next = m;
+	s->outbox_tail = m;
+	s->queued_bytes += len;
+	s->queued++;
+
+	if (s->queued_bytes > high_watermark && !s->slow) {
+		if (slow_disconnect)
+			evict(s, "high watermark exceeded");
+		else {
+			s->slow = 1;
+			s->slow_count++;
+			if (log_connections)
+				syslog(LOG_INFO, "client %s (%s) is slow, "
+				    "status updates are dropped", s->peer,
+				    s->protocol);
+		}
+	}
+
+	if (pthread_cond_signal(&s->cond)) {
+		syslog(LOG_ERR, "sender: pthread_cond_signal");
+		exit(1);
+	}
+done:
+	if (pthread_mutex_unlock(&s->mutex)) {
+		syslog(LOG_ERR, "sender: pthread_mutex_unlock");
+		exit(1);
+	}
+}
+
+/* Queue a copy of a reply for sending, the caller does not wait */
+void
+sender_send(sender_tag_t *s, const char *data)
+{
+	enqueue(s, data, 0);
+}
+
+/* Queue a status update, it is dropped if the client is slow */
+void
+sender_notify(sender_tag_t *s, const char *data)
+{
+	enqueue(s, data, 1);
+}
+
+static void
+cleanup_wait(void *arg)
+{
+	sender_tag_t *s = (sender_tag_t *)arg;
+
+	pthread_mutex_unlock(&s->mutex);
+}
+
+/* Wait for data to be sent and take all of it from the outbox */
+sender_msg_t *
+sender_wait(sender_tag_t *s)
+{
+	sender_msg_t *m;
+
+	if (pthread_mutex_lock(&s->mutex)) {
+		syslog(LOG_ERR, "sender: pthread_mutex_lock");
+		exit(1);
+	}
+
+	pthread_cleanup_push(cleanup_wait, s);
+	while (s->outbox == NULL) {
+		if (pthread_cond_wait(&s->cond, &s->mutex)) {
+			syslog(LOG_ERR, "sender: pthread_cond_wait");
+			exit(1);
+		}
+	}
+	pthread_cleanup_pop(0);
+
+	m = s->outbox;
+	s->outbox = s->outbox_tail = NULL;
+	s->inflight_bytes = s->queued_bytes;
+	s->inflight = s->queued;
+
+	if (pthread_mutex_unlock(&s->mutex)) {
+		syslog(LOG_ERR, "sender: pthread_mutex_unlock");
+		exit(1);
+	}
+	return m;
+}
+
+/* The data taken by sender_wait() has been written, or writing failed */
+void
+sender_done(sender_tag_t *s, int failed)
+{
+	if (pthread_mutex_lock(&s->mutex)) {
+		syslog(LOG_ERR, "sender: pthread_mutex_lock");
+		exit(1);
+	}
+
+	s->queued_bytes -= s->inflight_bytes;
+	s->queued -= s->inflight;
+	if (!failed) {
+		s->sent += s->inflight;
+		s->sent_bytes += s->inflight_bytes;
+	}
+	s->inflight_bytes = 0;
+	s->inflight = 0;
+	if (failed)
+		evict(s, "write failed or timed out");
+
+	if (s->slow && s->queued_bytes <= low_watermark) {
+		s->slow = 0;
+		if (log_connections)
+			syslog(LOG_INFO, "client %s (%s) has caught up, "
+			    "%lu status updates dropped so far", s->peer,
+			    s->protocol, s->dropped);
+	}
+
+	if (pthread_mutex_unlock(&s->mutex)) {
+		syslog(LOG_ERR, "sender: pthread_mutex_unlock");
+		exit(1);
+	}
+}
+
+/*
+ * Add the list of clients and their output statistics to a buffer.  The
+ * peers of other clients are only listed for a privileged client.
+ */
+void
+sender_list(struct buffer *buf, sender_tag_t *self)
+{
+	sender_tag_t *s;
+	time_t now;
+
+	now = time(NULL);
+	buf_addchar(buf, '[');
+	pthread_mutex_lock(&clients_mutex);
+	for (s = clients; s != NULL; s = s->next) {
+		pthread_mutex_lock(&s->mutex);
+		buf_addstring(buf, s == clients ? "{" : ",{");
+		if (s == self || self->privileged)
+			buf_printf(buf, "\"peer\":\"%s\",", s->peer);
+		buf_printf(buf, "\"protocol\":\"%s\",\"format\":\"%s\","
+		    "\"connected\":%lld,\"queued\":%d,\"queuedBytes\":%zu,"
+		    "\"sent\":%lu,\"sentBytes\":%lu,\"dropped\":%lu,"
+		    "\"slow\":%s,\"slowCount\":%lu,\"delayed\":%lu,"
+		    "\"refused\":%lu%s}", s->protocol,
+		    s->cbor ? "cbor" : "json", (long long)(now - s->connected),
+		    s->queued, s->queued_bytes, s->sent, s->sent_bytes,
+		    s->dropped, s->slow ? "true" : "false", s->slow_count,
+		    s->limit.delayed, s->limit.refused,
+		    s == self ? ",\"self\":true" : "");
+		pthread_mutex_unlock(&s->mutex);
+	}
+	pthread_mutex_unlock(&clients_mutex);
+	buf_addchar(buf, ']');
+}
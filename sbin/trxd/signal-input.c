@@ -20,7 +20,10 @@
  * IN THE SOFTWARE.
  */
 
-/* Signal incoming data from a file descriptor (usually a socket) */
+/*
+ * Signal incoming data from a file descriptor (usually a socket) or the
+ * expiry of a timer.
+ */
 
 #include <errno.h>
 #include <poll.h>
@@ -39,7 +42,23 @@ extern int verbose;
 static void
 cleanup(void *arg)
 {
-	free(arg);
+	signal_input_t *i = (signal_input_t *)arg;
+
+	free(i->func);
+	free(i);
+}
+
+/* Unlink an input that stops by itself, the mutex2 must be locked */
+static void
+unlink_input(signal_input_t *i)
+{
+	signal_input_t **p;
+
+	for (p = &i->extension->inputs; *p != NULL; p = &(*p)->next)
+		if (*p == i) {
+			*p = i->next;
+			break;
+		}
 }
 
 void *
@@ -48,6 +67,7 @@ signal_input(void *arg)
 	signal_input_t *i = (signal_input_t *)arg;
 	extension_tag_t *e;
 	struct pollfd pfd;
+	int state, stop;
 
 	e = i->extension;
 
@@ -66,12 +86,27 @@ signal_input(void *arg)
 	pfd.fd = i->fd;
 	pfd.events = POLLIN;
 
-	for (;;) {
-		if (poll(&pfd, 1, -1) == -1) {
+	/*
+	 * The function is called whenever data arrives, until it returns
+	 * false or the file descriptor is closed.  A timer calls it once.
+	 */
+	for (stop = 0; !stop; ) {
+		if (i->fd == -1) {
+			poll(NULL, 0, i->timeout);
+			pfd.revents = POLLIN;
+			stop = 1;
+		} else if (poll(&pfd, 1, -1) == -1) {
+			if (errno == EINTR)
+				continue;
 			syslog(LOG_ERR, "signal-input: poll");
 			exit(1);
 		}
 		if (pfd.revents) {
+			/*
+			 * Only get cancelled in poll(), not while holding the
+			 * extension mutex.
+			 */
+			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
 
 			if (pthread_mutex_lock(&e->mutex2)) {
 				syslog(LOG_ERR,
@@ -79,9 +114,24 @@ signal_input(void *arg)
 				exit(1);
 			}
 
+			/* The extension has been removed */
+			if (e->removed) {
+				pthread_mutex_unlock(&e->mutex2);
+				break;
+			}
+
+			if (pfd.revents & POLLNVAL) {
+				unlink_input(i);
+				pthread_mutex_unlock(&e->mutex2);
+				break;
+			}
+
 			e->done = 0;
 			lua_getglobal(e->L, i->func);
-			lua_pushinteger(e->L, i->fd);
+			if (i->fd == -1)
+				lua_pushnil(e->L);
+			else
+				lua_pushinteger(e->L, i->fd);
 
 			e->call = 1;
 			pthread_cond_signal(&e->cond1);
@@ -89,11 +139,21 @@ signal_input(void *arg)
 			while (!e->done)
 				pthread_cond_wait(&e->cond2, &e->mutex2);
 
-			e->done = 0;
+			/* Whoever removes the extension waits for done, too */
+			if (!e->removed) {
+				e->done = 0;
+				if (lua_isboolean(e->L, -1)
+				    && !lua_toboolean(e->L, -1))
+					stop = 1;
+				lua_pop(e->L, 1);
+				if (stop)
+					unlink_input(i);
+			}
 
 			pthread_mutex_unlock(&e->mutex2);
+			pthread_setcancelstate(state, NULL);
 		}
-	};
-	pthread_cleanup_pop(0);
+	}
+	pthread_cleanup_pop(1);
 	return NULL;
 }
@@ -22,6 +22,8 @@
 
 /* Handle network clients over TCP/IP sockets */
 
+#include <sys/socket.h>
+
 #include <pthread.h>
 #include <sched.h>
 #include <stdio.h>
@@ -34,7 +36,12 @@
 #include "trx-control.h"
 
 extern void *socket_sender(void *);
+extern void sender_init(sender_tag_t *, const char *);
+extern void sender_close(sender_tag_t *);
+extern enum Listener socket_listener(int);
+extern void client_leave(enum Listener);
 extern void *dispatcher(void *);
+extern void dispatcher_submit(dispatcher_tag_t *, char *);
 
 extern trx_controller_tag_t *trx_controller_tag;
 extern int verbose;
@@ -43,6 +50,8 @@ static void
 cleanup(void *arg)
 {
 	int fd = *(int *)arg;
+
+	client_leave(socket_listener(fd));
 	close(fd);
 }
 
@@ -51,6 +60,8 @@ cleanup_sender(void *arg)
 {
 	sender_tag_t *s = (sender_tag_t *)arg;
 
+	/* Nothing is sent to the client once the socket is being closed */
+	sender_close(s);
 	pthread_cancel(s->sender);
 }
 
@@ -68,7 +79,10 @@ socket_handler(void *arg)
 	sender_tag_t *s;
 	dispatcher_tag_t *d;
 	int fd = *(int *)arg;
-	char *buf;
+	volatile int cbor = 0;
+	char *buf, magic[TRXD_CBOR_MAGIC_LEN];
+	void *frame;
+	size_t len;
 
 	if (pthread_detach(pthread_self())) {
 		syslog(LOG_ERR, "socket-handler: pthread_detach");
@@ -82,34 +96,29 @@ socket_handler(void *arg)
 		exit(1);
 	}
 
+	/*
+	 * A client that starts with the CBOR self-describe tag wants to use
+	 * binary framing, which is confirmed by echoing the tag.  JSON text
+	 * never starts with this byte.
+	 */
+	if (recv(fd, magic, 1, MSG_PEEK) == 1
+	    && magic[0] == TRXD_CBOR_MAGIC[0]) {
+		if (recv(fd, magic, sizeof(magic), MSG_WAITALL) != sizeof(magic)
+		    || memcmp(magic, TRXD_CBOR_MAGIC, sizeof(magic))
+		    || write(fd, magic, sizeof(magic)) != sizeof(magic))
+			pthread_exit(NULL);
+		cbor = 1;
+	}
+
 	/* Create a socket-sender thread to send data to the client */
 	s = malloc(sizeof(sender_tag_t));
 	if (s == NULL) {
 		syslog(LOG_ERR, "socket-handler: malloc");
 		exit(1);
 	}
-	s->data = (char *)1;
 	s->socket = fd;
-
-	if (pthread_mutex_init(&s->mutex, NULL)) {
-		syslog(LOG_ERR, "socket-handler: pthread_mutex_init");
-		exit(1);
-	}
-
-	if (pthread_mutex_init(&s->mutex2, NULL)) {
-		syslog(LOG_ERR, "socket-handler: pthread_mutex_init");
-		exit(1);
-	}
-
-	if (pthread_cond_init(&s->cond, NULL)) {
-		syslog(LOG_ERR, "socket-handler: pthread_cond_init");
-		exit(1);
-	}
-
-	if (pthread_cond_init(&s->cond2, NULL)) {
-		syslog(LOG_ERR, "socket-handler: pthread_cond_init");
-		exit(1);
-	}
+	s->cbor = cbor;
+	sender_init(s, "socket");
 
 	if (pthread_create(&s->sender, NULL, socket_sender, s)) {
 		syslog(LOG_ERR, "socket-handler: pthread_create");
@@ -125,6 +134,8 @@ socket_handler(void *arg)
 		exit(1);
 	}
 	d->data = (char *)1;
+	d->inbox = d->inbox_tail = NULL;
+	d->inbox_len = 0;
 	d->sender = s;
 
 	if (pthread_mutex_init(&d->mutex, NULL)) {
@@ -168,45 +179,33 @@ socket_handler(void *arg)
 			exit(1);
 		}
 
-	if (pthread_mutex_lock(&s->mutex2)) {
-		syslog(LOG_ERR, "socket-handler: pthread_mutex_lock");
+	if (pthread_mutex_unlock(&d->mutex2)) {
+		syslog(LOG_ERR, "socket-handler: pthread_mutex_unlock");
 		exit(1);
 	}
 
-	if (verbose)
-		printf("socket-handler: wait for sender\n");
-
-	while (s->data != NULL)
-		if (pthread_cond_wait(&s->cond2, &s->mutex2)) {
-			syslog(LOG_ERR, "socket-handler: pthread_cond_wait");
-			exit(1);
-		}
-
-	if (verbose)
-		printf("socket-handler: sender is ready\n");
-
 	for (;;) {
 		/* buf will later be freed by the dispatcher */
-		buf = trxd_readln(fd);
+		if (cbor) {
+			frame = trxd_readframe(fd, &len);
+			if (frame == NULL)
+				pthread_exit(NULL);
+			buf = trxd_cbor_to_json(frame, len);
+			free(frame);
+			if (buf == NULL) {
+				syslog(LOG_NOTICE, "socket-handler: invalid "
+				    "CBOR data, closing connection");
+				pthread_exit(NULL);
+			}
+		} else
+			buf = trxd_readln(fd);
 
 		if (buf == NULL)
 			pthread_exit(NULL);
 		else if (verbose)
 			printf("socket-handler: <- %s\n", buf);
 
-		d->data = buf;
-
-		if (pthread_cond_signal(&d->cond)) {
-			syslog(LOG_ERR, "socket-handler: pthread_cond_signal");
-			exit(1);
-		}
-
-		while (d->data != NULL)
-			if (pthread_cond_wait(&d->cond2, &d->mutex2)) {
-				syslog(LOG_ERR, "socket-handler: "
-				    "pthread_cond_wait");
-			exit(1);
-		}
+		dispatcher_submit(d, buf);
 	}
 	pthread_cleanup_pop(0);
 	pthread_cleanup_pop(0);
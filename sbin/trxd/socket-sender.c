@@ -22,8 +22,9 @@
 
 /* Send data to networked clients over plain TCP/IP sockets */
 
+#include <sys/uio.h>
+
 #include <pthread.h>
-#include <sched.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -33,18 +34,64 @@
 #include "trxd.h"
 #include "trx-control.h"
 
+extern sender_msg_t *sender_wait(sender_tag_t *);
+extern void sender_done(sender_tag_t *, int);
+extern void sender_free(sender_msg_t *);
+extern void sender_release(sender_tag_t *);
+
 extern int verbose;
 
+#define MAX_IOV		64
+
 static void
 cleanup(void *arg)
 {
-	free(arg);
+	sender_release((sender_tag_t *)arg);
+}
+
+static void
+cleanup_batch(void *arg)
+{
+	sender_free(*(sender_msg_t **)arg);
+}
+
+/* CBOR frames, each with its length in network byte order */
+static int
+encode_cbor(sender_msg_t *m)
+{
+	unsigned char *frame;
+	size_t len;
+
+	frame = trxd_json_to_cbor(m->data, &len);
+	if (frame == NULL || len > TRXD_MAX_FRAME) {
+		syslog(LOG_ERR, "socket-sender: can't encode %s as CBOR",
+		    m->data);
+		free(frame);
+		return -1;
+	}
+	free(m->data);
+	m->data = malloc(len + 4);
+	if (m->data == NULL) {
+		syslog(LOG_ERR, "socket-sender: malloc");
+		exit(1);
+	}
+	m->data[0] = len >> 24 & 0xff;
+	m->data[1] = len >> 16 & 0xff;
+	m->data[2] = len >> 8 & 0xff;
+	m->data[3] = len & 0xff;
+	memcpy(m->data + 4, frame, len);
+	m->len = len + 4;
+	free(frame);
+	return 0;
 }
 
 void *
 socket_sender(void *arg)
 {
 	sender_tag_t *s = (sender_tag_t *)arg;
+	sender_msg_t *batch = NULL, *m;
+	struct iovec iov[MAX_IOV];
+	int niov, failed;
 
 	if (pthread_detach(pthread_self())) {
 		syslog(LOG_ERR, "socket-sender: pthread_detach");
@@ -52,41 +99,51 @@ socket_sender(void *arg)
 	}
 
 	pthread_cleanup_push(cleanup, arg);
+	pthread_cleanup_push(cleanup_batch, &batch);
 
 	if (pthread_setname_np(pthread_self(), "sender")) {
 		syslog(LOG_ERR, "socket-sender: pthread_setname_np");
 		exit(1);
 	}
 
-	if (pthread_mutex_lock(&s->mutex)) {
-		syslog(LOG_ERR, "socket-sender: pthread_mutex_lock");
-		exit(1);
-	}
+	/*
+	 * Everything that has been queued since the last wake-up is written
+	 * with a single writev(2), so a burst of status updates does not
+	 * cost a system call (and a TCP segment) per message.
+	 */
+	for (;;) {
+		batch = sender_wait(s);
 
-	s->data = NULL;
-	if (pthread_cond_signal(&s->cond2)) {
-		syslog(LOG_ERR, "socket-sender: pthread_cond_signal");
-		exit(1);
-	}
+		failed = 0;
+		for (niov = 0, m = batch; m != NULL; m = m->next) {
+			if (verbose)
+				printf("socket-sender: -> %s\n", m->data);
 
-	for (;;) {
-		while (s->data == NULL) {
-			if (pthread_cond_wait(&s->cond, &s->mutex)) {
-				syslog(LOG_ERR, "socket-sender: pthread_cond_wait");
-				exit(1);
+			/* The terminating NUL is replaced by a newline */
+			if (s->cbor) {
+				if (encode_cbor(m))
+					continue;
+			} else
+				m->data[m->len++] = '\n';
+
+			iov[niov].iov_base = m->data;
+			iov[niov++].iov_len = m->len;
+			if (niov == MAX_IOV) {
+				if (!failed && trxd_writev(s->socket, iov,
+				    niov) == -1)
+					failed = 1;
+				niov = 0;
 			}
 		}
+		if (niov > 0 && !failed && trxd_writev(s->socket, iov, niov)
+		    == -1)
+			failed = 1;
 
-		if (verbose)
-			printf("socket-sender: -> %s\n", s->data);
-
-		trxd_writeln(s->socket, s->data);
-		s->data = NULL;
-		if (pthread_cond_signal(&s->cond2)) {
-			syslog(LOG_ERR, "socket-sender: pthread_cond_signal");
-			exit(1);
-		}
+		sender_free(batch);
+		batch = NULL;
+		sender_done(s, failed);
 	}
 	pthread_cleanup_pop(0);
+	pthread_cleanup_pop(0);
 	return NULL;
 }
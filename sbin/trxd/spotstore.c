@@ -0,0 +1,444 @@
+/*
+ * Copyright (c) 2014 - 2024 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+/*
+ * A time ordered store of DX spots.  Spots are kept in a ring buffer in
+ * the order they arrive, the oldest spot is overwritten when the ring is
+ * full and spots older than the maximum age are expired from the tail.
+ * The spots of each band and mode are linked newest first, so queries
+ * only visit the spots that can match and stop at the first spot that is
+ * too old.  A spot of the same station within the duplicate window
+ * replaces the earlier spot.
+ */
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "geo.h"
+#include "spotstore.h"
+
+/* Amateur radio bands, in Hz */
+static const struct {
+	const char	*name;
+	int64_t		 low;
+	int64_t		 high;
+} bands[] = {
+	{ "2200m",	135700,		137800 },
+	{ "630m",	472000,		479000 },
+	{ "160m",	1800000,	2000000 },
+	{ "80m",	3500000,	4000000 },
+	{ "60m",	5060000,	5450000 },
+	{ "40m",	7000000,	7300000 },
+	{ "30m",	10100000,	10150000 },
+	{ "20m",	14000000,	14350000 },
+	{ "17m",	18068000,	18168000 },
+	{ "15m",	21000000,	21450000 },
+	{ "12m",	24890000,	24990000 },
+	{ "10m",	28000000,	29700000 },
+	{ "6m",		50000000,	54000000 },
+	{ "4m",		70000000,	70500000 },
+	{ "2m",		144000000,	148000000 },
+	{ "70cm",	430000000,	440000000 },
+	{ "23cm",	1240000000,	1300000000 }
+};
+#define BANDS	(sizeof(bands) / sizeof(bands[0]))
+
+int
+spot_band(int64_t frequency)
+{
+	int n;
+
+	for (n = 0; n < BANDS; n++)
+		if (frequency >= bands[n].low && frequency <= bands[n].high)
+			return n;
+	return SPOT_NONE;
+}
+
+const char *
+spot_band_name(int band)
+{
+	return band >= 0 && band < BANDS ? bands[band].name : NULL;
+}
+
+int
+spot_band_lookup(const char *name)
+{
+	int n;
+
+	for (n = 0; n < BANDS; n++)
+		if (!strcasecmp(name, bands[n].name))
+			return n;
+	return SPOT_NONE;
+}
+
+/* Look up a mode, optionally adding it if there is room */
+int
+spot_mode(spot_store_t *s, const char *name, int add)
+{
+	int n;
+
+	for (n = 0; n < s->modes; n++)
+		if (!strcasecmp(name, s->mode_name[n]))
+			return n;
+	if (!add || s->modes == SPOT_MODES)
+		return SPOT_NONE;
+	if ((s->mode_name[n] = strdup(name)) == NULL)
+		return SPOT_NONE;
+	s->mode_head[n] = -1;
+	return s->modes++;
+}
+
+int
+spot_store_init(spot_store_t *s, size_t size, time_t max_age,
+    int64_t window)
+{
+	size_t n;
+
+	memset(s, 0, sizeof(spot_store_t));
+	s->size = size > 0 ? size : 1;
+	s->max_age = max_age;
+	s->window = window > 0 ? window : 1;
+
+	for (s->hash_size = 16; s->hash_size < 2 * s->size; s->hash_size *= 2)
+		;
+	s->entry = calloc(s->size, sizeof(spot_entry_t));
+	s->hash = malloc(s->hash_size * sizeof(int));
+	s->band_head = malloc(BANDS * sizeof(int));
+	if (s->entry == NULL || s->hash == NULL || s->band_head == NULL) {
+		spot_store_free(s);
+		return -1;
+	}
+	for (n = 0; n < s->hash_size; n++)
+		s->hash[n] = -1;
+	for (n = 0; n < BANDS; n++)
+		s->band_head[n] = -1;
+	return 0;
+}
+
+void
+spot_store_free(spot_store_t *s)
+{
+	int n;
+
+	for (n = 0; n < s->modes; n++)
+		free(s->mode_name[n]);
+	free(s->entry);
+	free(s->hash);
+	free(s->band_head);
+	s->entry = NULL;
+	s->hash = NULL;
+	s->band_head = NULL;
+}
+
+/* Hash of the spotted station and the duplicate window */
+static size_t
+spot_hash(spot_store_t *s, const char *spotted, int64_t bucket)
+{
+	uint32_t h = 2166136261u;
+
+	for (; *spotted; spotted++)
+		h = (h ^ (unsigned char)toupper((unsigned char)*spotted))
+		    * 16777619u;
+	h = (h ^ (uint32_t)bucket) * 16777619u;
+	h = (h ^ (uint32_t)(bucket >> 32)) * 16777619u;
+	return h & (s->hash_size - 1);
+}
+
+/* Find an earlier spot of the same station in the duplicate window */
+static int
+spot_duplicate(spot_store_t *s, const char *spotted, int64_t frequency)
+{
+	int64_t bucket, b;
+	spot_entry_t *e;
+	int n;
+
+	bucket = frequency / s->window;
+	for (b = bucket - 1; b <= bucket + 1; b++) {
+		for (n = s->hash[spot_hash(s, spotted, b)]; n != -1;
+		    n = e->hash_next) {
+			e = &s->entry[n];
+			if (e->frequency / s->window == b
+			    && llabs(e->frequency - frequency) < s->window
+			    && !strcasecmp(e->spotted, spotted))
+				return n;
+		}
+	}
+	return -1;
+}
+
+#define LINK(head, n, prev, next)					\
+	do {								\
+		s->entry[n].prev = -1;					\
+		s->entry[n].next = (head);				\
+		if ((head) != -1)					\
+			s->entry[head].prev = (n);			\
+		(head) = (n);						\
+	} while (0)
+
+#define UNLINK(head, n, prev, next)					\
+	do {								\
+		spot_entry_t *_e = &s->entry[n];			\
+		if (_e->prev != -1)					\
+			s->entry[_e->prev].next = _e->next;		\
+		else							\
+			(head) = _e->next;				\
+		if (_e->next != -1)					\
+			s->entry[_e->next].prev = _e->prev;		\
+	} while (0)
+
+/* Remove a spot from the indexes, its slot stays in the ring until compacted */
+static void
+spot_remove(spot_store_t *s, int n)
+{
+	spot_entry_t *e = &s->entry[n];
+	int *p;
+
+	if (!e->valid)
+		return;
+
+	if (e->band != SPOT_NONE)
+		UNLINK(s->band_head[e->band], n, band_prev, band_next);
+	if (e->mode != SPOT_NONE)
+		UNLINK(s->mode_head[e->mode], n, mode_prev, mode_next);
+
+	p = &s->hash[spot_hash(s, e->spotted, e->frequency / s->window)];
+	while (*p != n)
+		p = &s->entry[*p].hash_next;
+	*p = e->hash_next;
+
+	e->valid = 0;
+	s->count--;
+	if (s->removed != NULL)
+		s->removed(s->arg, n);
+}
+
+/* Release the oldest slot */
+static void
+spot_release(spot_store_t *s)
+{
+	spot_remove(s, (s->head + s->size - s->used) % s->size);
+	s->used--;
+}
+
+/*
+ * Move the spots towards the oldest end of the ring, closing the gaps left
+ * by replaced duplicates.  The order of the spots is kept.
+ */
+static void
+spot_compact(spot_store_t *s)
+{
+	spot_entry_t *e;
+	size_t oldest, k;
+	int from, to, *p;
+
+	oldest = (s->head + s->size - s->used) % s->size;
+	to = oldest;
+	for (k = 0; k < s->used; k++) {
+		from = (oldest + k) % s->size;
+		if (!s->entry[from].valid)
+			continue;
+		if (from == to) {
+			to = (to + 1) % s->size;
+			continue;
+		}
+
+		e = &s->entry[to];
+		*e = s->entry[from];
+		s->entry[from].valid = 0;
+
+		/* Point the neighbours in the indexes to the new slot */
+		if (e->band != SPOT_NONE) {
+			if (e->band_prev != -1)
+				s->entry[e->band_prev].band_next = to;
+			else
+				s->band_head[e->band] = to;
+			if (e->band_next != -1)
+				s->entry[e->band_next].band_prev = to;
+		}
+		if (e->mode != SPOT_NONE) {
+			if (e->mode_prev != -1)
+				s->entry[e->mode_prev].mode_next = to;
+			else
+				s->mode_head[e->mode] = to;
+			if (e->mode_next != -1)
+				s->entry[e->mode_next].mode_prev = to;
+		}
+		p = &s->hash[spot_hash(s, e->spotted, e->frequency / s->window)];
+		while (*p != from)
+			p = &s->entry[*p].hash_next;
+		*p = to;
+
+		if (s->moved != NULL)
+			s->moved(s->arg, from, to);
+		to = (to + 1) % s->size;
+	}
+	s->used = s->count;
+	s->head = (oldest + s->used) % s->size;
+}
+
+void
+spot_store_expire(spot_store_t *s, time_t now)
+{
+	spot_entry_t *e;
+
+	while (s->used > 0) {
+		e = &s->entry[(s->head + s->size - s->used) % s->size];
+		if (e->valid && (s->max_age == 0
+		    || e->time + s->max_age >= now))
+			break;
+		spot_release(s);
+	}
+}
+
+/*
+ * Add a spot, replacing an earlier spot of the same station in the
+ * duplicate window.  position is NULL or the latitude and longitude.
+ * Returns the slot of the spot, age is set to the age of the spot that was
+ * replaced, or -1.
+ */
+int
+spot_store_add(spot_store_t *s, time_t now, const char *spotted,
+    int64_t frequency, const char *mode, const double *position,
+    time_t *age)
+{
+	spot_entry_t *e;
+	char call[SPOT_CALLMAX];
+	size_t h;
+	int n;
+
+	strncpy(call, spotted, SPOT_CALLMAX - 1);
+	call[SPOT_CALLMAX - 1] = '\0';
+
+	spot_store_expire(s, now);
+
+	if (age != NULL)
+		*age = -1;
+	if ((n = spot_duplicate(s, call, frequency)) != -1) {
+		if (age != NULL)
+			*age = now - s->entry[n].time;
+		spot_remove(s, n);
+	}
+
+	/*
+	 * A full ring is compacted if at least an eighth of it are gaps,
+	 * otherwise the oldest spot makes room.
+	 */
+	if (s->used == s->size) {
+		if ((s->used - s->count) * 8 >= s->size)
+			spot_compact(s);
+		else
+			spot_release(s);
+	}
+
+	n = s->head;
+	s->head = (s->head + 1) % s->size;
+	s->used++;
+
+	e = &s->entry[n];
+	e->time = now;
+	e->frequency = frequency;
+	memcpy(e->spotted, call, SPOT_CALLMAX);
+	if ((e->has_position = position != NULL)) {
+		e->latitude = position[0];
+		e->longitude = position[1];
+	}
+	e->band = spot_band(frequency);
+	e->mode = mode != NULL ? spot_mode(s, mode, 1) : SPOT_NONE;
+	e->valid = 1;
+	s->count++;
+
+	if (e->band != SPOT_NONE)
+		LINK(s->band_head[e->band], n, band_prev, band_next);
+	if (e->mode != SPOT_NONE)
+		LINK(s->mode_head[e->mode], n, mode_prev, mode_next);
+
+	h = spot_hash(s, e->spotted, frequency / s->window);
+	e->hash_next = s->hash[h];
+	s->hash[h] = n;
+	return n;
+}
+
+/* Does a spot match the query, apart from its age? */
+static int
+spot_match(spot_entry_t *e, const spot_query_t *q)
+{
+	double distance;
+
+	if (q->band != SPOT_NONE && e->band != q->band)
+		return 0;
+	if (q->mode != SPOT_NONE && e->mode != q->mode)
+		return 0;
+	if (q->has_position) {
+		if (!e->has_position)
+			return 0;
+		geo_distance(q->latitude, q->longitude, &e->latitude,
+		    &e->longitude, 1, &distance, NULL);
+		if (distance > q->max_distance)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Find the spots matching a query, newest first, and store up to max slots
+ * in slots.  The band or mode index is walked if the query has one, else
+ * the ring.  Returns the number of spots found.
+ */
+size_t
+spot_store_query(spot_store_t *s, time_t now, const spot_query_t *q,
+    int *slots, size_t max)
+{
+	spot_entry_t *e;
+	size_t found = 0, k;
+	int n;
+
+	spot_store_expire(s, now);
+
+	if (q->band != SPOT_NONE || q->mode != SPOT_NONE) {
+		n = q->band != SPOT_NONE ? s->band_head[q->band]
+		    : s->mode_head[q->mode];
+		for (; n != -1 && found < max; n = q->band != SPOT_NONE ?
+		    e->band_next : e->mode_next) {
+			e = &s->entry[n];
+			if (q->max_age && e->time + q->max_age < now)
+				break;
+			if (spot_match(e, q))
+				slots[found++] = n;
+		}
+		return found;
+	}
+
+	for (k = 1; k <= s->used && found < max; k++) {
+		n = (s->head + s->size - k) % s->size;
+		e = &s->entry[n];
+		if (!e->valid)
+			continue;
+		if (q->max_age && e->time + q->max_age < now)
+			break;
+		if (spot_match(e, q))
+			slots[found++] = n;
+	}
+	return found;
+}
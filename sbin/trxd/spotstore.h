@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2014 - 2024 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+/* A time ordered store of DX spots, indexed by band and mode */
+
+#ifndef __SPOTSTORE_H__
+#define __SPOTSTORE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define SPOT_CALLMAX		16
+#define SPOT_MODES		32
+#define SPOT_NONE		-1
+
+typedef struct spot_entry {
+	time_t		 time;
+	int64_t		 frequency;		/* Hz */
+	double		 latitude;
+	double		 longitude;
+	int		 has_position;
+	int		 valid;
+	int		 band;
+	int		 mode;
+	char		 spotted[SPOT_CALLMAX];
+
+	/* Links of the band, mode, and duplicate indexes */
+	int		 band_prev, band_next;
+	int		 mode_prev, mode_next;
+	int		 hash_next;
+} spot_entry_t;
+
+typedef struct spot_store {
+	spot_entry_t	*entry;
+	size_t		 size;
+	size_t		 head;			/* The next slot to use */
+	size_t		 used;			/* Slots in use, from the oldest */
+	size_t		 count;			/* Valid spots */
+	time_t		 max_age;		/* Seconds, 0 for no limit */
+	int64_t		 window;		/* Duplicates, Hz */
+
+	/* Newest spot of each band and mode */
+	int		*band_head;
+	int		 mode_head[SPOT_MODES];
+	char		*mode_name[SPOT_MODES];
+	int		 modes;
+
+	int		*hash;
+	size_t		 hash_size;
+
+	/* Called for each spot that is removed, and moved to another slot */
+	void		(*removed)(void *, int);
+	void		(*moved)(void *, int, int);
+	void		*arg;
+} spot_store_t;
+
+typedef struct spot_query {
+	time_t		 max_age;		/* Seconds, 0 for no limit */
+	int		 band;			/* SPOT_NONE for any */
+	int		 mode;
+	int		 has_position;		/* Filter by distance */
+	double		 latitude;
+	double		 longitude;
+	double		 max_distance;		/* km */
+} spot_query_t;
+
+extern int spot_store_init(spot_store_t *, size_t, time_t, int64_t);
+extern void spot_store_free(spot_store_t *);
+
+extern int spot_band(int64_t);
+extern const char *spot_band_name(int);
+extern int spot_band_lookup(const char *);
+extern int spot_mode(spot_store_t *, const char *, int);
+
+extern int spot_store_add(spot_store_t *, time_t, const char *, int64_t,
+    const char *, const double *, time_t *);
+extern void spot_store_expire(spot_store_t *, time_t);
+extern size_t spot_store_query(spot_store_t *, time_t, const spot_query_t *,
+    int *, size_t);
+
+#endif /* __SPOTSTORE_H__ */
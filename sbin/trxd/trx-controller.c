@@ -35,6 +35,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <bluetooth/bluetooth.h>
@@ -52,11 +53,22 @@ extern int luaopen_trxd(lua_State *);
 extern int luaopen_trx_controller(lua_State *);
 extern int luaopen_json(lua_State *);
 extern void *trx_handler(void *);
+extern trx_request_t *trx_next_request(trx_controller_tag_t *);
+extern void trx_request_done(trx_controller_tag_t *, trx_request_t *, char *);
+extern void trx_set_attached(trx_controller_tag_t *, int);
 
 extern int verbose;
 
+/* Milliseconds to wait before trying to attach the CAT device again */
+#define ATTACH_DELAY_MIN	1000
+#define ATTACH_DELAY_MAX	60000
+
+/* Device nodes and symlinks can appear after the kernel event */
+#define HOTPLUG_DELAY		250
+
 __thread trx_controller_tag_t	*trx_controller_tag;
 __thread int cat_device;
+__thread int cat_detached;	/* Set when the CAT device is gone */
 
 static void
 cleanup(void *arg)
@@ -68,97 +80,241 @@ cleanup(void *arg)
 	free(arg);
 }
 
-void *
-trx_controller(void *arg)
+/*
+ * Open the CAT device or connect to a Bluetooth RFCOMM device.  Failures
+ * are not fatal as the device might be plugged in or come in range later,
+ * they are only logged if report is set.
+ */
+static int
+attach(trx_controller_tag_t *t, int report)
 {
-	trx_controller_tag_t *t = (trx_controller_tag_t *)arg;
 	struct termios tty;
-	int fd, n;
-	struct stat sb;
-	pthread_t trx_handler_thread;
+	int fd;
 
-	if (pthread_detach(pthread_self())) {
-		syslog(LOG_ERR, "trx-controller: pthread_detach");
-		exit(1);
-	}
-	if (verbose)
-		printf("trx-controller: initializing trx %s\n", t->name);
+	if (*t->device == '/') {	/* Assume device under /dev */
+		fd = open(t->device, O_RDWR | O_NOCTTY | O_CLOEXEC);
+		if (fd == -1) {
+			if (report)
+				syslog(LOG_NOTICE, "trx-controller: can't open "
+				    "%s: %m", t->device);
+			return -1;
+		}
 
-	trx_controller_tag = t;
+		if (isatty(fd)) {
+			if (tcgetattr(fd, &tty) < 0) {
+				syslog(LOG_ERR, "trx-controller: tcgetattr");
+				close(fd);
+				return -1;
+			}
+			cfmakeraw(&tty);
+			tty.c_cflag |= CLOCAL;
+			cfsetspeed(&tty, t->speed);
+
+			if (tcsetattr(fd, TCSADRAIN, &tty) < 0) {
+				syslog(LOG_ERR, "trx-controller: tcsetattr");
+				close(fd);
+				return -1;
+			}
+		}
+	} else if (strlen(t->device) == 17) {	/* Assume Bluetooth RFCOMM */
+		struct sockaddr_rc addr = { 0 };
 
-	pthread_cleanup_push(cleanup, arg);
+		fd = socket(AF_BLUETOOTH, SOCK_STREAM | SOCK_CLOEXEC,
+		    BTPROTO_RFCOMM);
+		if (fd == -1) {
+			if (report)
+				syslog(LOG_NOTICE, "trx-controller: socket: %m");
+			return -1;
+		}
 
-	if (pthread_setname_np(pthread_self(), "trx")) {
-		syslog(LOG_ERR, "trx-controller: pthread_setname_np");
+		addr.rc_family = AF_BLUETOOTH;
+		addr.rc_channel = (uint8_t) t->channel;
+		str2ba(t->device, &addr.rc_bdaddr);
+
+		if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+			if (report)
+				syslog(LOG_NOTICE, "trx-controller: can't "
+				    "connect to %s: %m", t->device);
+			close(fd);
+			return -1;
+		}
+	} else {
+		syslog(LOG_ERR, "trx-controller: unknown device %s", t->device);
 		exit(1);
 	}
+	return fd;
+}
 
-	/*
-	 * Lock this transceivers mutex, so that no other thread accesses
-	 * while we are initializing.
-	 */
-	if (pthread_mutex_lock(&t->mutex)) {
-		syslog(LOG_ERR, "trx-controller: pthread_mutex_lock");
-		exit(1);
+/*
+ * Wait before trying to attach again.  The wait is cut short when the
+ * hotplug thread reports a new device, in which case 1 is returned, or
+ * when the transceiver has been removed, in which case -1 is returned.
+ */
+static int
+attach_wait(trx_controller_tag_t *t, int msec)
+{
+	struct timespec deadline;
+	int plugged, error;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += msec / 1000;
+	deadline.tv_nsec += (msec % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
 	}
 
 	if (pthread_mutex_lock(&t->mutex2)) {
 		syslog(LOG_ERR, "trx-controller: pthread_mutex_lock");
 		exit(1);
 	}
+	while (!t->plugged) {
+		error = pthread_cond_timedwait(&t->cond3, &t->mutex2,
+		    &deadline);
+		if (error == ETIMEDOUT)
+			break;
+		if (error) {
+			syslog(LOG_ERR, "trx-controller: "
+			    "pthread_cond_timedwait");
+			exit(1);
+		}
+	}
+	plugged = t->removed ? -1 : t->plugged;
+	t->plugged = 0;
+	if (pthread_mutex_unlock(&t->mutex2)) {
+		syslog(LOG_ERR, "trx-controller: pthread_mutex_unlock");
+		exit(1);
+	}
+	return plugged;
+}
 
-	if (*t->device == '/') {	/* Assume device under /dev */
-		fd = open(t->device, O_RDWR);
-		if (fd == -1) {
-			syslog(LOG_ERR, "trx-controller: can't open %s",
-			    t->device);
+/* Call a function of the upper half, the trx mutex is locked */
+static int
+call_upper_half(trx_controller_tag_t *t, const char *function)
+{
+	int status;
+
+	lua_geti(t->L, LUA_REGISTRYINDEX, t->ref);
+	lua_getfield(t->L, -1, function);
+	status = lua_pcall(t->L, 0, 0, 0);
+	if (status != LUA_OK) {
+		syslog(LOG_ERR, "trx-controller: %s: %s", function,
+		    lua_tostring(t->L, -1));
+		lua_pop(t->L, 1);
+	}
+	lua_pop(t->L, 1);
+	return status;
+}
+
+/* Serve requests until the transceiver is detached */
+static void
+serve(trx_controller_tag_t *t)
+{
+	trx_request_t *r;
+	char *response;
+
+	/* Wait for the next request, highest priority class first */
+	while ((r = trx_next_request(t)) != NULL) {
+		if (pthread_mutex_lock(&t->mutex)) {
+			syslog(LOG_ERR, "trx-controller: pthread_mutex_lock");
 			exit(1);
 		}
 
-		if (isatty(fd)) {
-			if (tcgetattr(fd, &tty) < 0) {
-				syslog(LOG_ERR, "trx-controller: tcgetattr");
-				exit(1);
-			}
-			else {
-				cfmakeraw(&tty);
-				tty.c_cflag |= CLOCAL;
-				cfsetspeed(&tty, t->speed);
-
-				if (tcsetattr(fd, TCSADRAIN, &tty) < 0) {
-					syslog(LOG_ERR, "trx-controller: tcsetattr");
-					exit(1);
+		lua_geti(t->L, LUA_REGISTRYINDEX, t->ref);
+		lua_getfield(t->L, -1, r->handler);
+		if (lua_type(t->L, -1) != LUA_TFUNCTION) {
+			response = strdup("command not supported, "
+			    "please submit a bug report");
+		} else {
+			if (r->data != NULL)
+				lua_pushlstring(t->L, r->data, r->len);
+			else
+				lua_pushnil(t->L);
+			lua_pushinteger(t->L, r->client_fd);
+
+			switch (lua_pcall(t->L, 2, 1, 0)) {
+			case LUA_OK:
+				if (lua_type(t->L, -1) == LUA_TSTRING)
+					response = strdup(lua_tostring(t->L,
+					    -1));
+				else
+					response = strdup("");
+				break;
+			default:
+				if (cat_detached) {
+					if (asprintf(&response, "{\"status\":"
+					    "\"Failure\",\"reason\":"
+					    "\"Transceiver detached\","
+					    "\"from\":\"%s\"}", t->name) == -1)
+						response = NULL;
+				} else {
+					response = strdup("{\"status\":"
+					    "\"Error\",\"reason\":"
+					    "\"Lua error\"}");
+					syslog(LOG_ERR, "Lua error: %s",
+					    lua_tostring(t->L, -1));
 				}
+				break;
 			}
 		}
-	} else if (strlen(t->device) == 17) {	/* Assume Bluetooth RFCOMM */
-		struct sockaddr_rc addr = { 0 };
-
-		fd = socket(AF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM);
+		lua_pop(t->L, 2);
 
-		addr.rc_family = AF_BLUETOOTH;
-		addr.rc_channel = (uint8_t) t->channel;
-		str2ba(t->device, &addr.rc_bdaddr);
+		if (pthread_mutex_unlock(&t->mutex)) {
+			syslog(LOG_ERR, "trx-controller: pthread_mutex_unlock");
+			exit(1);
+		}
 
-		if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
-			syslog(LOG_ERR, "trx-controller: can't connect to %s",
-				t->device);
+		if (response == NULL) {
+			syslog(LOG_ERR, "trx-controller: strdup");
 			exit(1);
 		}
-	} else {
-		syslog(LOG_ERR, "trx-controller: unknown device %s", t->device);
+
+		/* Fail further requests before the caller gets the reply */
+		if (cat_detached)
+			trx_set_attached(t, 0);
+		trx_request_done(t, r, response);
+	}
+}
+
+void *
+trx_controller(void *arg)
+{
+	trx_controller_tag_t *t = (trx_controller_tag_t *)arg;
+	int fd, delay, failures, initialized, plugged;
+
+	if (pthread_detach(pthread_self())) {
+		syslog(LOG_ERR, "trx-controller: pthread_detach");
 		exit(1);
 	}
+	if (verbose)
+		printf("trx-controller: initializing trx %s\n", t->name);
 
-	cat_device = fd;
-	t->cat_device = fd;
+	trx_controller_tag = t;
+	cat_device = -1;
+
+	pthread_cleanup_push(cleanup, arg);
+
+	if (pthread_setname_np(pthread_self(), "trx")) {
+		syslog(LOG_ERR, "trx-controller: pthread_setname_np");
+		exit(1);
+	}
+
+	/*
+	 * Lock this transceivers mutex, so that no other thread accesses
+	 * while we are initializing.
+	 */
+	if (pthread_mutex_lock(&t->mutex)) {
+		syslog(LOG_ERR, "trx-controller: pthread_mutex_lock");
+		exit(1);
+	}
 
 	if (verbose)
 		printf("trx_controller: registering the driver\n");
 
 	/*
 	 * Call the registerDriver function which had been setup in the
-	 * main thread.
+	 * main thread.  The driver is initialized once the CAT device
+	 * has been attached.
 	 */
 	switch (lua_pcall(t->L, 3, 0, 0)) {
 	case LUA_OK:
@@ -175,68 +331,112 @@ trx_controller(void *arg)
 
 	t->is_running = 1;
 
-	/*
-	 * We are ready to go, unlock the mutex, so that client-handlers,
-	 * trx-handlers, and, trx-pollers can access it.
-	 */
-
-	if (verbose)
-		printf("trx-controller: ready to control trx %s\n", t->name);
-
 	if (pthread_mutex_unlock(&t->mutex)) {
 		syslog(LOG_ERR, "trx-controller: pthread_mutex_unlock");
 		exit(1);
 	}
 
-	while (1) {
-		int nargs = 1;
+	/*
+	 * Requests fail while the transceiver is not attached.  Attaching
+	 * is retried with exponential backoff, or right away when a
+	 * device has been plugged in.
+	 */
+	delay = ATTACH_DELAY_MIN;
+	for (;;) {
+		for (failures = 0; (fd = attach(t, failures == 0)) == -1;
+		    failures++) {
+			if ((plugged = attach_wait(t, delay)) == -1)
+				goto removed;
+			else if (plugged)
+				delay = HOTPLUG_DELAY;
+			else if ((delay *= 2) > ATTACH_DELAY_MAX)
+				delay = ATTACH_DELAY_MAX;
+		}
 
-		/* Wait on cond, this releases the mutex */
-		while (t->handler == NULL) {
-			if (pthread_cond_wait(&t->cond1, &t->mutex2)) {
-				syslog(LOG_ERR, "trx-controller: "
-				    "pthread_cond_wait");
-				exit(1);
-			}
+		if (pthread_mutex_lock(&t->mutex)) {
+			syslog(LOG_ERR, "trx-controller: pthread_mutex_lock");
+			exit(1);
+		}
+		cat_device = t->cat_device = fd;
+		cat_detached = 0;
+
+		/* The device is needed by the initialize function */
+		trx_set_attached(t, 1);
+		initialized = call_upper_half(t, "initialize") == LUA_OK
+		    && !cat_detached;
+		if (initialized) {
+			delay = ATTACH_DELAY_MIN;
+			syslog(LOG_INFO, "trx-controller: %s attached on %s",
+			    t->name, t->device);
+			if (verbose)
+				printf("trx-controller: ready to control "
+				    "trx %s\n", t->name);
+		} else
+			trx_set_attached(t, 0);
+
+		/*
+		 * We are ready to go, unlock the mutex, so that
+		 * client-handlers, trx-handlers, and, trx-pollers can
+		 * access it.
+		 */
+		if (pthread_mutex_unlock(&t->mutex)) {
+			syslog(LOG_ERR, "trx-controller: pthread_mutex_unlock");
+			exit(1);
 		}
 
-		lua_geti(t->L, LUA_REGISTRYINDEX, t->ref);
-		lua_getfield(t->L, -1, t->handler);
-		if (lua_type(t->L, -1) != LUA_TFUNCTION) {
-			t->response = "command not supported, "
-			    "please submit a bug report";
-		} else {
-			lua_pushstring(t->L, t->data);
-			lua_pushinteger(t->L, t->client_fd);
-			t->response = NULL;
+		serve(t);
 
-			switch (lua_pcall(t->L, 2, 1, 0)) {
-			case LUA_OK:
-				if (lua_type(t->L, -1) == LUA_TSTRING)
-					t->response =
-					    (char *)lua_tostring(t->L, -1);
-				else
-					t->response = "";
-				break;
-			case LUA_ERRRUN:
-			case LUA_ERRMEM:
-			case LUA_ERRERR:
-				t->response = "{\"status\":\"Error\","
-				    "\"reason\":\"Lua error\"}";
-
-				syslog(LOG_ERR, "Lua error: %s",
-				    lua_tostring(t->L, -1));
-				break;
-			}
+		if (pthread_mutex_lock(&t->mutex)) {
+			syslog(LOG_ERR, "trx-controller: pthread_mutex_lock");
+			exit(1);
 		}
-		lua_pop(t->L, 2);
-		t->handler = NULL;
-
-		if (pthread_cond_signal(&t->cond2)) {
-			syslog(LOG_ERR, "trx-controller: pthread_cond_signal");
+		if (t->handler_running) {
+			pthread_cancel(t->trx_handler);
+			t->handler_running = 0;
+		}
+		close(fd);
+		cat_device = t->cat_device = -1;
+		if (pthread_mutex_unlock(&t->mutex)) {
+			syslog(LOG_ERR, "trx-controller: pthread_mutex_unlock");
 			exit(1);
 		}
+		syslog(LOG_NOTICE, "trx-controller: %s detached", t->name);
+
+		/* Don't retry a failing driver initialization at once */
+		if (attach_wait(t, initialized ? 0 : delay) == -1)
+			break;
+		if (!initialized && (delay *= 2) > ATTACH_DELAY_MAX)
+			delay = ATTACH_DELAY_MAX;
+	}
+removed:
+	/* The tag is not freed, dispatchers might still refer to it */
+	if (pthread_mutex_lock(&t->mutex)) {
+		syslog(LOG_ERR, "trx-controller: pthread_mutex_lock");
+		exit(1);
 	}
+	lua_close(t->L);
+	t->L = NULL;
+	if (pthread_mutex_unlock(&t->mutex)) {
+		syslog(LOG_ERR, "trx-controller: pthread_mutex_unlock");
+		exit(1);
+	}
+	syslog(LOG_INFO, "trx-controller: %s removed", t->name);
+
+	/* trx_remove() waits for this, so the device is free to be reused */
+	if (pthread_mutex_lock(&t->mutex2)) {
+		syslog(LOG_ERR, "trx-controller: pthread_mutex_lock");
+		exit(1);
+	}
+	t->is_running = 0;
+	if (pthread_cond_broadcast(&t->cond2)) {
+		syslog(LOG_ERR, "trx-controller: pthread_cond_broadcast");
+		exit(1);
+	}
+	if (pthread_mutex_unlock(&t->mutex2)) {
+		syslog(LOG_ERR, "trx-controller: pthread_mutex_unlock");
+		exit(1);
+	}
+
 	pthread_cleanup_pop(0);
 	return NULL;
 }
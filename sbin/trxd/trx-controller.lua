@@ -62,10 +62,6 @@ local function registerDriver(destination, dev, newDriver)
 		['unlock-trx'] = type(driver.setUnlock) == 'function'
 		    and driver.setUnlock or nil,
 	}
-
-	if type(driver.initialize) == 'function' then
-		driver:initialize()
-	end
 end
 
 local function getInfo(driver, request, response)
@@ -87,6 +83,44 @@ local function getInfo(driver, request, response)
 	response.audio = driver.audio
 end
 
+-- Feed what we learned about the transceiver state to the cache in trxd
+local function updateState(state)
+	local update = {
+		mode = state.mode,
+		ptt = state.ptt,
+		lock = state.lock
+	}
+
+	if type(state.frequency) == 'table' then
+		update['vfo-a'] = state.frequency['vfo-a']
+		update['vfo-b'] = state.frequency['vfo-b']
+	else
+		update.frequency = state.frequency
+	end
+
+	if type(state['vfo-a']) == 'table' then
+		update['vfo-a'] = state['vfo-a'].frequency
+	end
+
+	if type(state.operatingMode) == 'table' then
+		update.mode = state.operatingMode.mode
+	end
+
+	if update.ptt == true then
+		update.ptt = 'on'
+	elseif update.ptt == false then
+		update.ptt = 'off'
+	end
+
+	if update.lock == 'on' then
+		update.lock = true
+	elseif update.lock == 'off' then
+		update.lock = false
+	end
+
+	trxController.updateState(update)
+end
+
 local function notImplemented(response)
 	response.status = 'Failure'
 	response.reason = 'Function unknown or not implemented'
@@ -124,6 +158,40 @@ local function requestHandler(data, fd)
 	end
 
 	handler(driver, request, response)
+
+	if response.status == 'Ok' then
+		local state = {
+			frequency = response.frequency,
+			mode = response.mode,
+			ptt = response.ptt
+		}
+
+		-- Not all drivers echo the value that has been set
+		if request.request == 'set-frequency' then
+			state.frequency = state.frequency or request.frequency
+		elseif request.request == 'set-mode' then
+			state.mode = state.mode or request.mode
+		elseif request.request == 'set-ptt' then
+			state.ptt = state.ptt or request.ptt
+		end
+
+		-- The frequency of a VFO, echoed or as it has been set
+		if request.vfo ~= nil and tonumber(state.frequency) ~= nil then
+			state.frequency = {
+				[request.vfo] = tonumber(state.frequency)
+			}
+
+			-- The set VFO might be the current one
+			trxController.invalidateState('frequency')
+		end
+
+		if request.request == 'lock-trx' then
+			state.lock = true
+		elseif request.request == 'unlock-trx' then
+			state.lock = false
+		end
+		updateState(state)
+	end
 	return json.encode(response)
 end
 
@@ -134,8 +202,17 @@ local function pollHandler(data, fd)
 		from = name
 	}
 
-	driver.getFrequency(driver, nil, response)
-	driver.getMode(driver, nil, response)
+	-- Drivers can read all polled values in one go
+	if type(driver.getStatus) == 'function' then
+		driver.getStatus(driver, nil, response)
+	else
+		driver.getFrequency(driver, nil, response)
+		driver.getMode(driver, nil, response)
+	end
+
+	if response.status == 'Ok' then
+		updateState(response)
+	end
 
 	if lastFrequency ~= response.frequency or lastMode ~= response.mode then
 		local status = {
@@ -157,11 +234,48 @@ local function pollHandler(data, fd)
 	end
 end
 
+-- Let the transceiver send status updates on its own while there are
+-- listeners.  Requests are queued, so check the listeners again when
+-- the request is eventually handled.
+local function startStatusUpdates()
+	if trxController.handlerRunning() or not trxController.hasListeners()
+	    or type(driver.startStatusUpdates) ~= 'function' then
+		return
+	end
+
+	local eol = driver:startStatusUpdates()
+	if eol ~= nil then
+		trxController.startHandler(eol)
+	end
+end
+
+local function stopStatusUpdates()
+	if not trxController.handlerRunning() or trxController.hasListeners()
+	    then
+		return
+	end
+
+	trxController.stopHandler()
+	if type(driver.stopStatusUpdates) == 'function' then
+		driver:stopStatusUpdates()
+	end
+end
+
+-- Called whenever the transceiver has been attached
+local function initialize()
+	if type(driver.initialize) == 'function' then
+		driver:initialize()
+	end
+	startStatusUpdates()
+end
+
 -- Handle incoming data from the transceiver
 local function dataHandler(data)
 	if type(driver.handleStatusUpdates) == 'function' then
 		local response = driver:handleStatusUpdates(data)
 		if response ~= nil then
+			updateState(response)
+
 			local status = {
 				request = 'status-update',
 				from = name,
@@ -175,7 +289,10 @@ end
 
 return {
 	registerDriver = registerDriver,
+	initialize = initialize,
 	requestHandler = requestHandler,
 	pollHandler = pollHandler,
+	startStatusUpdates = startStatusUpdates,
+	stopStatusUpdates = stopStatusUpdates,
 	dataHandler = dataHandler
 }
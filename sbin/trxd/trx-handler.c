@@ -35,6 +35,9 @@
 #include "trxd.h"
 
 extern int verbose;
+extern void trx_set_attached(trx_controller_tag_t *, int);
+extern char *trx_call_data(trx_controller_tag_t *, enum TrxRequestClass,
+    const char *, const char *, size_t);
 
 static void
 cleanup(void *arg)
@@ -47,15 +50,15 @@ trx_handler(void *arg)
 {
 	trx_controller_tag_t *t = (trx_controller_tag_t *)arg;
 	struct pollfd pfd;
-	int n, fd;
-	char buf[128];
+	int n, fd, state, hangup;
+	char buf[128], *response;
 
 	if (pthread_detach(pthread_self())) {
 		syslog(LOG_ERR, "trx-handler: pthread_detach");
 		exit(1);
 	}
 
-	pthread_cleanup_push(cleanup, arg);
+	pthread_cleanup_push(cleanup, NULL);
 
 	if (pthread_setname_np(pthread_self(), "trx-handler")) {
 		syslog(LOG_ERR, "trx-handler: pthread_setname_np");
@@ -68,57 +71,77 @@ trx_handler(void *arg)
 	pfd.events = POLLIN;
 
 	for (;;) {
+		/* Wait for data without holding the trx mutex */
+		if (poll(&pfd, 1, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			syslog(LOG_ERR, "trx-handler: poll");
+			exit(1);
+		}
+
+		/* Don't get cancelled while holding the trx mutex */
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+
 		if (pthread_mutex_lock(&t->mutex)) {
 			syslog(LOG_ERR, "trx-handler: pthread_mutex_lock");
 			exit(1);
 		}
 
+		/*
+		 * The trx-controller might have consumed the data in the
+		 * meantime while handling a request.
+		 */
 		if (poll(&pfd, 1, 0) == -1) {
 			syslog(LOG_ERR, "trx-handler: poll");
 			exit(1);
 		}
-		if (pfd.revents) {
-			for (n = 0; n < sizeof(buf) - 1; n++) {
-				read(fd, &buf[n], 1);
-				if (buf[n] == t->handler_eol)
+		n = hangup = 0;
+		if (pfd.revents & (POLLERR | POLLNVAL))
+			hangup = 1;
+		else if (pfd.revents) {
+			for (; n < sizeof(buf) - 1; n++) {
+				switch (read(fd, &buf[n], 1)) {
+				case 1:
 					break;
+				case 0:
+					hangup = 1;
+					/* FALLTHROUGH */
+				default:
+					if (errno != EINTR && errno != EAGAIN)
+						hangup = 1;
+					goto done;
+				}
+				if ((unsigned char)buf[n] == t->handler_eol) {
+					n++;
+					break;
+				}
 			}
-			buf[++n] = '\0';
-
-			t->handler = "dataHandler";
-			t->response = NULL;
-			t->data = buf;
-			t->client_fd = 0;
+		}
+done:
+		buf[n] = '\0';
 
-			if (pthread_mutex_lock(&t->mutex2)) {
-				syslog(LOG_ERR, "trx-handler: pthread_mutex_lock");
-				exit(1);
-			}
+		/* The trx-controller cleans up once it notices */
+		if (hangup)
+			t->handler_running = 0;
 
-			if (pthread_cond_signal(&t->cond1)) {
-				syslog(LOG_ERR, "trx-handler: pthread_cond_signal");
-				exit(1);
-			}
+		if (pthread_mutex_unlock(&t->mutex)) {
+			syslog(LOG_ERR, "trx-handler: pthread_mutex_unlock");
+			exit(1);
+		}
+		pthread_setcancelstate(state, NULL);
 
-			if (pthread_mutex_unlock(&t->mutex2)) {
-				syslog(LOG_ERR, "trx-handler: pthread_mutex_unlock");
-				exit(1);
-			}
+		if (hangup) {
+			trx_set_attached(t, 0);
+			break;
+		}
 
-			while (t->response == NULL) {
-				if (pthread_cond_wait(&t->cond2, &t->mutex2)) {
-					syslog(LOG_ERR, "trx-handler: "
-					    "pthread_cond_wait");
-					exit(1);
-				}
-			}
-			if (pthread_mutex_unlock(&t->mutex)) {
-				syslog(LOG_ERR, "trx-handler: "
-				    "pthread_mutex_unlock");
-				exit(1);
-			}
+		/* Frames can contain NUL bytes, e.g. CI-V */
+		if (n > 0) {
+			response = trx_call_data(t, TRX_CLASS_POLL,
+			    "dataHandler", buf, n);
+			free(response);
 		}
-	};
+	}
 	pthread_cleanup_pop(0);
 	return NULL;
 }
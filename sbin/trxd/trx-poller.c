@@ -34,6 +34,10 @@
 #define STATUS_REQUEST	"{\"request\": \"status-update\"}"
 #define POLLING_INTERVAL	200000	/* microseconds */
 
+extern char *trx_call(trx_controller_tag_t *, enum TrxRequestClass,
+    const char *, const char *, int, const char *);
+extern int trx_attached(trx_controller_tag_t *);
+
 static void
 cleanup(void *arg)
 {
@@ -44,6 +48,7 @@ void *
 trx_poller(void *arg)
 {
 	trx_controller_tag_t *t = (trx_controller_tag_t *)arg;
+	char *response;
 
 	if (pthread_detach(pthread_self())) {
 		syslog(LOG_ERR, "trx-poller: pthread_detach");
@@ -58,51 +63,20 @@ trx_poller(void *arg)
 	}
 
 	for (;;) {
-		if (pthread_mutex_lock(&t->mutex)) {
-			syslog(LOG_ERR, "trx-poller: pthread_mutex_lock");
-			exit(1);
-		}
-
-		t->handler = "pollHandler";
-		t->response = NULL;
-		t->data  = NULL;
-
-		if (pthread_mutex_lock(&t->mutex2)) {
-			syslog(LOG_ERR, "trx-poller: pthread_mutex_lock");
-			exit(1);
+		/* Don't poll a transceiver that is not attached */
+		if (!trx_attached(t)) {
+			usleep(POLLING_INTERVAL);
+			continue;
 		}
 
-		if (pthread_cond_signal(&t->cond1)) {
-			syslog(LOG_ERR, "trx-poller: pthread_cond_signal");
-			exit(1);
-		}
-
-		if (pthread_mutex_unlock(&t->mutex2)) {
-			syslog(LOG_ERR, "trx-poller: pthread_mutex_unlock");
-			exit(1);
-		}
+		response = trx_call(t, TRX_CLASS_POLL, "pollHandler", NULL, 0,
+		    NULL);
 
-		while (t->response == NULL) {
-			if (pthread_cond_wait(&t->cond2, &t->mutex2)) {
-				syslog(LOG_ERR, "trx-poller: pthread_cond_wait");
-				exit(1);
-			}
-		}
-
-		if (strlen(t->response))
+		if (strlen(response) && trx_attached(t))
 			syslog(LOG_WARNING,
 			    "trx-poller: unexpected response '%s'\n",
-			    t->response);
-
-		if (pthread_mutex_unlock(&t->mutex2)) {
-			syslog(LOG_ERR, "trx-poller: pthread_mutex_unlock");
-			exit(1);
-		}
-
-		if (pthread_mutex_unlock(&t->mutex)) {
-			syslog(LOG_ERR, "trx-poller: pthread_mutex_unlock");
-			exit(1);
-		}
+			    response);
+		free(response);
 
 		usleep(POLLING_INTERVAL);
 	}
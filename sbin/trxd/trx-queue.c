@@ -0,0 +1,586 @@
+/*
+ * Copyright (c) 2023 - 2024 Marc Balmer HB9SSB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Queue requests to a trx-controller by priority class */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "buffer.h"
+#include "trxd.h"
+
+/*
+ * Maximum time in milliseconds a request of a given class waits before it
+ * is served ahead of higher classes.  PTT requests are never overtaken.
+ */
+static const long max_wait[TRX_CLASSES] = {
+	0,	/* TRX_CLASS_PTT */
+	250,	/* TRX_CLASS_SET */
+	500,	/* TRX_CLASS_GET */
+	1000	/* TRX_CLASS_POLL */
+};
+
+static const char *class_name[TRX_CLASSES] = {
+	"ptt",
+	"set",
+	"get",
+	"poll"
+};
+
+struct call {
+	trx_controller_tag_t	*t;
+	trx_request_t		*r;
+};
+
+/* Microseconds elapsed between two points in time */
+static unsigned long long
+elapsed(struct timespec *from, struct timespec *to)
+{
+	long long usec;
+
+	usec = (to->tv_sec - from->tv_sec) * 1000000LL
+	    + (to->tv_nsec - from->tv_nsec) / 1000;
+	return usec > 0 ? usec : 0;
+}
+
+static void
+free_request(trx_request_t *r)
+{
+	free(r->key);
+	free(r->data);
+	free(r->response);
+	free(r);
+}
+
+/* Remove a request that has not yet been started from its queue */
+static int
+unlink_request(trx_controller_tag_t *t, trx_request_t *r)
+{
+	trx_request_t *p, *l;
+
+	for (l = t->queue[r->class], p = NULL; l; p = l, l = l->next) {
+		if (l != r)
+			continue;
+		if (p == NULL)
+			t->queue[r->class] = l->next;
+		else
+			p->next = l->next;
+		if (t->queue_tail[r->class] == l)
+			t->queue_tail[r->class] = p;
+		t->pending[r->class]--;
+		return 0;
+	}
+	return -1;
+}
+
+enum TrxRequestClass
+trx_request_class(const char *request)
+{
+	if (request == NULL)
+		return TRX_CLASS_GET;
+	if (!strcmp(request, "set-ptt"))
+		return TRX_CLASS_PTT;
+	if (!strncmp(request, "set-", 4) || !strcmp(request, "lock-trx")
+	    || !strcmp(request, "unlock-trx"))
+		return TRX_CLASS_SET;
+	return TRX_CLASS_GET;
+}
+
+/*
+ * The caller was cancelled while waiting or abandoned the request, the
+ * mutex2 is locked.  A request that is done or still queued is freed here,
+ * one that is being handled is freed by trx_request_done() once it has
+ * completed.
+ */
+static void
+cancel_call(void *arg)
+{
+	struct call *c = (struct call *)arg;
+
+	if (c->r->done || !unlink_request(c->t, c->r))
+		free_request(c->r);
+	else
+		c->r->abandoned = 1;
+
+	pthread_mutex_unlock(&c->t->mutex2);
+}
+
+/*
+ * Complete queued requests with the same key that have not yet been
+ * started, they are superseded by a new request.  The mutex2 is locked.
+ */
+static void
+supersede_requests(trx_controller_tag_t *t, enum TrxRequestClass class,
+    const char *key)
+{
+	trx_request_t *r, *next;
+	int n = 0;
+
+	for (r = t->queue[class]; r != NULL; r = next) {
+		next = r->next;
+		if (r->key == NULL || strcmp(r->key, key))
+			continue;
+
+		unlink_request(t, r);
+		if (asprintf(&r->response, "{\"status\":\"Superseded\","
+		    "\"response\":\"%.*s\",\"from\":\"%s\"}",
+		    (int)strcspn(key, " "), key, t->name) == -1) {
+			syslog(LOG_ERR, "trx-queue: asprintf");
+			exit(1);
+		}
+		t->stats[class].superseded++;
+		if (r->abandoned)
+			free_request(r);
+		else
+			r->done = 1;
+		n++;
+	}
+
+	if (n > 0 && pthread_cond_broadcast(&t->cond2)) {
+		syslog(LOG_ERR, "trx-queue: pthread_cond_broadcast");
+		exit(1);
+	}
+}
+
+/* The response to requests for a transceiver that is not attached */
+static char *
+not_attached(trx_controller_tag_t *t)
+{
+	char *response;
+
+	if (asprintf(&response, "{\"status\":\"Failure\","
+	    "\"reason\":\"Transceiver not attached\",\"from\":\"%s\"}",
+	    t->name) == -1) {
+		syslog(LOG_ERR, "trx-queue: asprintf");
+		exit(1);
+	}
+	return response;
+}
+
+/*
+ * Queue a request for the trx-controller without waiting for it, so that
+ * requests to several transceivers can be served at the same time.  A
+ * request for a transceiver that is not attached is done immediately.  If
+ * a key is given, earlier requests with the same key that are still
+ * queued are answered as superseded.  The request must be passed to
+ * trx_wait() or trx_abandon().
+ */
+trx_request_t *
+trx_submit(trx_controller_tag_t *t, enum TrxRequestClass class,
+    const char *handler, const char *data, size_t len, int client_fd,
+    const char *key)
+{
+	trx_request_t *r;
+
+	r = malloc(sizeof(trx_request_t));
+	if (r == NULL) {
+		syslog(LOG_ERR, "trx-queue: malloc");
+		exit(1);
+	}
+	r->handler = handler;
+	r->data = NULL;
+	r->len = len;
+	if (data != NULL) {
+		if ((r->data = malloc(len + 1)) == NULL) {
+			syslog(LOG_ERR, "trx-queue: malloc");
+			exit(1);
+		}
+		memcpy(r->data, data, len);
+		r->data[len] = '\0';
+	}
+	r->key = NULL;
+	if (key != NULL && (r->key = strdup(key)) == NULL) {
+		syslog(LOG_ERR, "trx-queue: strdup");
+		exit(1);
+	}
+	r->client_fd = client_fd;
+	r->class = class;
+	r->response = NULL;
+	r->done = r->abandoned = 0;
+	r->next = NULL;
+
+	if (pthread_mutex_lock(&t->mutex2)) {
+		syslog(LOG_ERR, "trx-queue: pthread_mutex_lock");
+		exit(1);
+	}
+
+	if (!t->attached) {
+		r->response = not_attached(t);
+		r->done = 1;
+	} else {
+		if (key != NULL)
+			supersede_requests(t, class, key);
+
+		clock_gettime(CLOCK_MONOTONIC, &r->queued);
+		if (t->queue_tail[class] == NULL)
+			t->queue[class] = r;
+		else
+			t->queue_tail[class]->next = r;
+		t->queue_tail[class] = r;
+		t->pending[class]++;
+
+		if (pthread_cond_signal(&t->cond1)) {
+			syslog(LOG_ERR, "trx-queue: pthread_cond_signal");
+			exit(1);
+		}
+	}
+
+	if (pthread_mutex_unlock(&t->mutex2)) {
+		syslog(LOG_ERR, "trx-queue: pthread_mutex_unlock");
+		exit(1);
+	}
+	return r;
+}
+
+/*
+ * Wait until a submitted request has been handled.  The returned response
+ * must be freed by the caller.
+ */
+char *
+trx_wait(trx_controller_tag_t *t, trx_request_t *r)
+{
+	struct call c;
+	char *response;
+
+	if (pthread_mutex_lock(&t->mutex2)) {
+		syslog(LOG_ERR, "trx-queue: pthread_mutex_lock");
+		exit(1);
+	}
+
+	c.t = t;
+	c.r = r;
+	pthread_cleanup_push(cancel_call, &c);
+
+	while (!r->done) {
+		if (pthread_cond_wait(&t->cond2, &t->mutex2)) {
+			syslog(LOG_ERR, "trx-queue: pthread_cond_wait");
+			exit(1);
+		}
+	}
+	pthread_cleanup_pop(0);
+
+	if (pthread_mutex_unlock(&t->mutex2)) {
+		syslog(LOG_ERR, "trx-queue: pthread_mutex_unlock");
+		exit(1);
+	}
+
+	response = r->response;
+	r->response = NULL;
+	free_request(r);
+	return response;
+}
+
+/* The response to a submitted request is no longer of interest */
+void
+trx_abandon(trx_controller_tag_t *t, trx_request_t *r)
+{
+	struct call c;
+
+	if (pthread_mutex_lock(&t->mutex2)) {
+		syslog(LOG_ERR, "trx-queue: pthread_mutex_lock");
+		exit(1);
+	}
+	c.t = t;
+	c.r = r;
+	cancel_call(&c);
+}
+
+/*
+ * Queue a request for the trx-controller and wait until it has been
+ * handled.  Requests for a transceiver that is not attached fail
+ * immediately.
+ */
+char *
+trx_call(trx_controller_tag_t *t, enum TrxRequestClass class,
+    const char *handler, const char *data, int client_fd, const char *key)
+{
+	return trx_wait(t, trx_submit(t, class, handler, data,
+	    data != NULL ? strlen(data) : 0, client_fd, key));
+}
+
+/* Pass binary data, e.g. a frame received from the transceiver */
+char *
+trx_call_data(trx_controller_tag_t *t, enum TrxRequestClass class,
+    const char *handler, const char *data, size_t len)
+{
+	return trx_wait(t, trx_submit(t, class, handler, data, len, 0, NULL));
+}
+
+int
+trx_attached(trx_controller_tag_t *t)
+{
+	int attached;
+
+	if (pthread_mutex_lock(&t->mutex2)) {
+		syslog(LOG_ERR, "trx-queue: pthread_mutex_lock");
+		exit(1);
+	}
+	attached = t->attached;
+	if (pthread_mutex_unlock(&t->mutex2)) {
+		syslog(LOG_ERR, "trx-queue: pthread_mutex_unlock");
+		exit(1);
+	}
+	return attached;
+}
+
+/*
+ * Mark the transceiver as attached or detached.  When it is detached, all
+ * requests that have not yet been started fail and the trx-controller is
+ * woken up.
+ */
+void
+trx_set_attached(trx_controller_tag_t *t, int attached)
+{
+	trx_request_t *r, *next;
+	int class;
+
+	if (pthread_mutex_lock(&t->mutex2)) {
+		syslog(LOG_ERR, "trx-queue: pthread_mutex_lock");
+		exit(1);
+	}
+
+	t->attached = attached && !t->removed;
+	if (!t->attached) {
+		for (class = 0; class < TRX_CLASSES; class++) {
+			for (r = t->queue[class]; r != NULL; r = next) {
+				next = r->next;
+				unlink_request(t, r);
+				if (r->abandoned)
+					free_request(r);
+				else {
+					r->response = not_attached(t);
+					r->done = 1;
+				}
+			}
+		}
+		if (pthread_cond_broadcast(&t->cond2)) {
+			syslog(LOG_ERR, "trx-queue: pthread_cond_broadcast");
+			exit(1);
+		}
+		if (pthread_cond_signal(&t->cond1)) {
+			syslog(LOG_ERR, "trx-queue: pthread_cond_signal");
+			exit(1);
+		}
+	}
+
+	if (pthread_mutex_unlock(&t->mutex2)) {
+		syslog(LOG_ERR, "trx-queue: pthread_mutex_unlock");
+		exit(1);
+	}
+}
+
+/*
+ * Stop the trx-controller, the transceiver has been removed.  Returns once
+ * the trx-controller has terminated.
+ */
+void
+trx_remove(trx_controller_tag_t *t)
+{
+	if (pthread_mutex_lock(&t->mutex2)) {
+		syslog(LOG_ERR, "trx-queue: pthread_mutex_lock");
+		exit(1);
+	}
+	t->removed = 1;
+
+	/* Wake the trx-controller if it is waiting to attach */
+	t->plugged = 1;
+	if (pthread_cond_signal(&t->cond3)) {
+		syslog(LOG_ERR, "trx-queue: pthread_cond_signal");
+		exit(1);
+	}
+	if (pthread_mutex_unlock(&t->mutex2)) {
+		syslog(LOG_ERR, "trx-queue: pthread_mutex_unlock");
+		exit(1);
+	}
+	trx_set_attached(t, 0);
+
+	/* Wait for the trx-controller to close the device and terminate */
+	if (pthread_mutex_lock(&t->mutex2)) {
+		syslog(LOG_ERR, "trx-queue: pthread_mutex_lock");
+		exit(1);
+	}
+	while (t->is_running) {
+		if (pthread_cond_wait(&t->cond2, &t->mutex2)) {
+			syslog(LOG_ERR, "trx-queue: pthread_cond_wait");
+			exit(1);
+		}
+	}
+	if (pthread_mutex_unlock(&t->mutex2)) {
+		syslog(LOG_ERR, "trx-queue: pthread_mutex_unlock");
+		exit(1);
+	}
+}
+
+/*
+ * Wait for the next request to be handled by the trx-controller.  PTT
+ * requests are always served first, then the highest class that is not
+ * empty, unless a request of a lower class has waited longer than its
+ * class permits.  Returns NULL once the transceiver has been detached.
+ */
+trx_request_t *
+trx_next_request(trx_controller_tag_t *t)
+{
+	trx_request_t *r, *aged;
+	struct timespec now;
+	int class, first;
+	unsigned long long wait;
+
+	if (pthread_mutex_lock(&t->mutex2)) {
+		syslog(LOG_ERR, "trx-queue: pthread_mutex_lock");
+		exit(1);
+	}
+
+	for (;;) {
+		if (!t->attached) {
+			if (pthread_mutex_unlock(&t->mutex2)) {
+				syslog(LOG_ERR,
+				    "trx-queue: pthread_mutex_unlock");
+				exit(1);
+			}
+			return NULL;
+		}
+		for (first = 0; first < TRX_CLASSES; first++)
+			if (t->queue[first] != NULL)
+				break;
+		if (first < TRX_CLASSES)
+			break;
+		if (pthread_cond_wait(&t->cond1, &t->mutex2)) {
+			syslog(LOG_ERR, "trx-queue: pthread_cond_wait");
+			exit(1);
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	class = first;
+	if (first != TRX_CLASS_PTT) {
+		aged = NULL;
+		for (class = first + 1; class < TRX_CLASSES; class++) {
+			r = t->queue[class];
+			if (r == NULL
+			    || elapsed(&r->queued, &now) < max_wait[class] * 1000)
+				continue;
+
+			/* Serve the request that is overdue the longest */
+			if (aged == NULL || r->queued.tv_sec < aged->queued.tv_sec
+			    || (r->queued.tv_sec == aged->queued.tv_sec
+			    && r->queued.tv_nsec < aged->queued.tv_nsec))
+				aged = r;
+		}
+		class = aged != NULL ? aged->class : first;
+	}
+
+	r = t->queue[class];
+	unlink_request(t, r);
+	r->next = NULL;
+	r->started = now;
+
+	wait = elapsed(&r->queued, &now);
+	t->stats[class].requests++;
+	if (class != first)
+		t->stats[class].aged++;
+	t->stats[class].wait_total += wait;
+	if (wait > t->stats[class].wait_max)
+		t->stats[class].wait_max = wait;
+
+	if (pthread_mutex_unlock(&t->mutex2)) {
+		syslog(LOG_ERR, "trx-queue: pthread_mutex_unlock");
+		exit(1);
+	}
+	return r;
+}
+
+/* Hand the response back to the caller, response must be malloc'ed */
+void
+trx_request_done(trx_controller_tag_t *t, trx_request_t *r, char *response)
+{
+	struct timespec now;
+	unsigned long long service;
+
+	if (pthread_mutex_lock(&t->mutex2)) {
+		syslog(LOG_ERR, "trx-queue: pthread_mutex_lock");
+		exit(1);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	service = elapsed(&r->started, &now);
+	t->stats[r->class].service_total += service;
+	if (service > t->stats[r->class].service_max)
+		t->stats[r->class].service_max = service;
+
+	r->response = response;
+	if (r->abandoned)
+		free_request(r);
+	else {
+		r->done = 1;
+		if (pthread_cond_broadcast(&t->cond2)) {
+			syslog(LOG_ERR, "trx-queue: pthread_cond_broadcast");
+			exit(1);
+		}
+	}
+
+	if (pthread_mutex_unlock(&t->mutex2)) {
+		syslog(LOG_ERR, "trx-queue: pthread_mutex_unlock");
+		exit(1);
+	}
+}
+
+/* Add per class queue statistics in JSON format to a buffer */
+void
+trx_queue_statistics(trx_controller_tag_t *t, struct buffer *buf)
+{
+	trx_class_stats_t *s;
+	int class;
+
+	if (pthread_mutex_lock(&t->mutex2)) {
+		syslog(LOG_ERR, "trx-queue: pthread_mutex_lock");
+		exit(1);
+	}
+
+	buf_addstring(buf, "\"queue\":{");
+	for (class = 0; class < TRX_CLASSES; class++) {
+		s = &t->stats[class];
+
+		if (class > 0)
+			buf_addchar(buf, ',');
+		buf_printf(buf, "\"%s\":{\"pending\":%d,\"requests\":%lu,"
+		    "\"aged\":%lu,\"superseded\":%lu,\"averageWait\":%llu,"
+		    "\"maximumWait\":%llu,\"averageService\":%llu,"
+		    "\"maximumService\":%llu}",
+		    class_name[class], t->pending[class], s->requests, s->aged,
+		    s->superseded,
+		    s->requests ? s->wait_total / s->requests : 0,
+		    s->wait_max,
+		    s->requests ? s->service_total / s->requests : 0,
+		    s->service_max);
+	}
+	buf_addchar(buf, '}');
+
+	if (pthread_mutex_unlock(&t->mutex2)) {
+		syslog(LOG_ERR, "trx-queue: pthread_mutex_unlock");
+		exit(1);
+	}
+}
@@ -0,0 +1,334 @@
+/*
+ * Copyright (c) 2023 - 2024 Marc Balmer HB9SSB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+/*
+ * Cache the last known state of a transceiver and publish it in shared
+ * memory for local readers.
+ */
+
+#include <sys/mman.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "buffer.h"
+#include "trxd.h"
+#include "trx-control.h"
+
+static trxd_shm_t *shm;
+
+/* The transceiver each slot belongs to, only used by the main thread */
+static trx_controller_tag_t *owner[TRXD_SHM_SLOTS];
+
+/*
+ * Create the shared memory object.  A new object is created each time,
+ * readers that still map the object of a previous instance see it no longer
+ * being updated and can open it again.
+ */
+void
+trx_state_shm_init(void)
+{
+	int fd;
+
+	shm_unlink(TRXD_SHM_NAME);
+	fd = shm_open(TRXD_SHM_NAME, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd == -1) {
+		syslog(LOG_NOTICE, "trx-state: shm_open: %s", strerror(errno));
+		return;
+	}
+	if (ftruncate(fd, sizeof(trxd_shm_t))) {
+		syslog(LOG_NOTICE, "trx-state: ftruncate: %s",
+		    strerror(errno));
+		close(fd);
+		return;
+	}
+	shm = mmap(NULL, sizeof(trxd_shm_t), PROT_READ | PROT_WRITE,
+	    MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED) {
+		syslog(LOG_NOTICE, "trx-state: mmap: %s", strerror(errno));
+		shm = NULL;
+		return;
+	}
+	shm->version = TRXD_SHM_VERSION;
+	shm->nslots = TRXD_SHM_SLOTS;
+	shm->pid = getpid();
+	__atomic_store_n(&shm->magic, TRXD_SHM_MAGIC, __ATOMIC_RELEASE);
+}
+
+/* The sequence counter is odd while a slot is being written */
+static void
+slot_begin(struct trxd_shm_slot *slot)
+{
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void
+slot_end(struct trxd_shm_slot *slot)
+{
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Assign a slot to a transceiver, called before it is started.  A
+ * transceiver that replaces one of the same name on reload takes over its
+ * slot, so that readers never see the transceiver missing.
+ */
+void
+trx_state_attach(trx_controller_tag_t *t)
+{
+	struct trxd_shm_slot *slot;
+	trx_controller_tag_t *o;
+	int n, unused = -1;
+
+	if (shm == NULL)
+		return;
+
+	for (n = 0; n < TRXD_SHM_SLOTS; n++) {
+		if (owner[n] == NULL) {
+			if (unused == -1)
+				unused = n;
+		} else if (!strcmp(owner[n]->name, t->name))
+			break;
+	}
+
+	if (n < TRXD_SHM_SLOTS) {
+		/* The replaced transceiver no longer writes to the slot */
+		o = owner[n];
+		if (pthread_mutex_lock(&o->state.mutex)) {
+			syslog(LOG_ERR, "trx-state: pthread_mutex_lock");
+			exit(1);
+		}
+		o->state.slot = NULL;
+		if (pthread_mutex_unlock(&o->state.mutex)) {
+			syslog(LOG_ERR, "trx-state: pthread_mutex_unlock");
+			exit(1);
+		}
+	} else if (unused != -1)
+		n = unused;
+	else {
+		syslog(LOG_NOTICE, "trx-state: no shared memory slot for %s",
+		    t->name);
+		return;
+	}
+
+	slot = &shm->slot[n];
+	slot_begin(slot);
+	memset(&slot->state, 0, sizeof(trxd_state_t));
+	strncpy(slot->state.name, t->name, TRXD_NAMELEN - 1);
+	slot->state.flags = TRXD_STATE_USED;
+	slot_end(slot);
+	owner[n] = t;
+	t->state.slot = slot;
+}
+
+/*
+ * Free the slot of a transceiver that has been removed, unless a new
+ * transceiver of the same name has taken it over.
+ */
+void
+trx_state_detach(trx_controller_tag_t *t)
+{
+	if (pthread_mutex_lock(&t->state.mutex)) {
+		syslog(LOG_ERR, "trx-state: pthread_mutex_lock");
+		exit(1);
+	}
+
+	if (t->state.slot != NULL) {
+		slot_begin(t->state.slot);
+		memset(&t->state.slot->state, 0, sizeof(trxd_state_t));
+		slot_end(t->state.slot);
+		owner[t->state.slot - shm->slot] = NULL;
+		t->state.slot = NULL;
+	}
+
+	if (pthread_mutex_unlock(&t->state.mutex)) {
+		syslog(LOG_ERR, "trx-state: pthread_mutex_unlock");
+		exit(1);
+	}
+}
+
+/* Convert a JSON encoded value to the binary representation in the slot */
+static void
+publish(struct trxd_shm_slot *slot, enum TrxStateItem item,
+    const char *value)
+{
+	struct timespec now;
+	trxd_state_t *s = &slot->state;
+	uint32_t flag;
+	int64_t *freq = NULL;
+	size_t len;
+
+	switch (item) {
+	case TRX_STATE_FREQUENCY:
+		flag = TRXD_STATE_FREQUENCY;
+		freq = &s->frequency;
+		break;
+	case TRX_STATE_VFO_A:
+		flag = TRXD_STATE_VFO_A;
+		freq = &s->vfo_a;
+		break;
+	case TRX_STATE_VFO_B:
+		flag = TRXD_STATE_VFO_B;
+		freq = &s->vfo_b;
+		break;
+	case TRX_STATE_MODE:
+		flag = TRXD_STATE_MODE;
+		break;
+	case TRX_STATE_PTT:
+		flag = TRXD_STATE_PTT;
+		break;
+	case TRX_STATE_LOCK:
+		flag = TRXD_STATE_LOCK;
+		break;
+	default:
+		return;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	slot_begin(slot);
+	if (value == NULL)
+		s->flags &= ~flag;
+	else {
+		s->flags |= flag;
+		if (freq != NULL)
+			*freq = strtod(value, NULL);
+		else if (item == TRX_STATE_MODE) {
+			/* A JSON string, without the quotes */
+			len = strlen(value);
+			if (len >= 2 && *value == '"') {
+				value++;
+				len -= 2;
+			}
+			if (len >= TRXD_MODELEN)
+				len = TRXD_MODELEN - 1;
+			memcpy(s->mode, value, len);
+			s->mode[len] = '\0';
+		} else if (item == TRX_STATE_PTT)
+			s->ptt = !strcmp(value, "\"on\"")
+			    || !strcmp(value, "true");
+		else
+			s->lock = !strcmp(value, "true");
+	}
+	s->updated = now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+	slot_end(slot);
+}
+
+/* Store a JSON encoded value, value can be NULL if the state is unknown */
+void
+trx_state_update(trx_controller_tag_t *t, enum TrxStateItem item,
+    const char *value)
+{
+	char *v = NULL;
+
+	if (value != NULL && (v = strdup(value)) == NULL) {
+		syslog(LOG_ERR, "trx-state: strdup");
+		exit(1);
+	}
+
+	if (pthread_mutex_lock(&t->state.mutex)) {
+		syslog(LOG_ERR, "trx-state: pthread_mutex_lock");
+		exit(1);
+	}
+
+	free(t->state.value[item]);
+	t->state.value[item] = v;
+	clock_gettime(CLOCK_MONOTONIC, &t->state.updated[item]);
+
+	if (t->state.slot != NULL)
+		publish(t->state.slot, item, value);
+
+	if (pthread_mutex_unlock(&t->state.mutex)) {
+		syslog(LOG_ERR, "trx-state: pthread_mutex_unlock");
+		exit(1);
+	}
+}
+
+/*
+ * Return a copy of the JSON encoded value if it is not older than
+ * max_age milliseconds, NULL otherwise.  The copy must be freed by the
+ * caller.
+ */
+char *
+trx_state_lookup(trx_controller_tag_t *t, enum TrxStateItem item,
+    int max_age)
+{
+	struct timespec now;
+	long long age;
+	char *value = NULL;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (pthread_mutex_lock(&t->state.mutex)) {
+		syslog(LOG_ERR, "trx-state: pthread_mutex_lock");
+		exit(1);
+	}
+
+	if (t->state.value[item] != NULL) {
+		age = (now.tv_sec - t->state.updated[item].tv_sec) * 1000LL
+		    + (now.tv_nsec - t->state.updated[item].tv_nsec)
+		    / 1000000;
+		if (age <= max_age
+		    && (value = strdup(t->state.value[item])) == NULL) {
+			syslog(LOG_ERR, "trx-state: strdup");
+			exit(1);
+		}
+	}
+	if (value != NULL)
+		t->state.hits++;
+	else
+		t->state.misses++;
+
+	if (pthread_mutex_unlock(&t->state.mutex)) {
+		syslog(LOG_ERR, "trx-state: pthread_mutex_unlock");
+		exit(1);
+	}
+	return value;
+}
+
+/* Add the cache statistics in JSON format to a buffer */
+void
+trx_state_statistics(trx_controller_tag_t *t, struct buffer *buf)
+{
+	if (pthread_mutex_lock(&t->state.mutex)) {
+		syslog(LOG_ERR, "trx-state: pthread_mutex_lock");
+		exit(1);
+	}
+
+	buf_printf(buf, "\"cache\":{\"maxAge\":%d,\"hits\":%lu,"
+	    "\"misses\":%lu}", t->max_age, t->state.hits, t->state.misses);
+
+	if (pthread_mutex_unlock(&t->state.mutex)) {
+		syslog(LOG_ERR, "trx-state: pthread_mutex_unlock");
+		exit(1);
+	}
+}
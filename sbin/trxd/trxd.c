@@ -21,10 +21,12 @@
  */
 
 #include <sys/types.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 #include <errno.h>
@@ -34,6 +36,7 @@
 #include <netdb.h>
 #include <pthread.h>
 #include <pwd.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -48,6 +51,7 @@
 #include <lualib.h>
 #include <lauxlib.h>
 
+#include "cty.h"
 #include "pathnames.h"
 #include "trxd.h"
 
@@ -67,18 +71,45 @@ extern int luaopen_trxd(lua_State *);
 extern int luaopen_trx_controller(lua_State *);
 
 extern void proxy_map(lua_State *, lua_State *, int);
+extern int bytecode_loadfile(lua_State *, const char *);
+extern int bytecode_dofile(lua_State *, const char *);
 extern void *nmea_handler(void *);
+extern void *gpsd_handler(void *);
 extern void *socket_handler(void *);
 extern void *trx_controller(void *);
+extern void *hotplug(void *);
 extern void *sdr_controller(void *);
 extern void *gpio_controller(void *);
 extern void *relay_controller(void *);
+extern int unix_listen(lua_State *, uid_t, gid_t);
+extern int unix_accept(int);
+extern void sender_config(lua_State *);
+extern void ratelimit_config(lua_State *);
+extern void ratelimit_init(token_bucket_t *, lua_State *, const char *);
+extern int client_admit(enum Listener);
+extern void trx_state_shm_init(void);
+extern void trx_state_attach(trx_controller_tag_t *);
 extern void *websocket_listener(void *);
 extern void *extension(void *);
+extern void *trx_poller(void *);
+extern char *config_fingerprint(lua_State *, int);
+extern void reload(const char *);
 
 extern int trx_control_running;
 
+#define DESTINATION_BUCKETS	64
+
 destination_t *destination = NULL;
+static destination_t *destination_hash[DESTINATION_BUCKETS];
+
+/*
+ * The list and the hash table are changed by the main thread on reload,
+ * other threads hold the read lock while they walk them or look up a name.
+ */
+static pthread_rwlock_t destination_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* The callsign prefixes, read-only once loaded */
+cty_t cty;
 
 static void
 usage(void)
@@ -88,15 +119,140 @@ usage(void)
 	exit(1);
 }
 
+/* FNV-1a */
+static unsigned int
+hash(const char *name)
+{
+	unsigned int h = 2166136261U;
+
+	while (*name)
+		h = (h ^ (unsigned char)*name++) * 16777619U;
+	return h % DESTINATION_BUCKETS;
+}
+
+void
+destination_rdlock(void)
+{
+	if (pthread_rwlock_rdlock(&destination_lock)) {
+		syslog(LOG_ERR, "trxd: pthread_rwlock_rdlock");
+		exit(1);
+	}
+}
+
+void
+destination_unlock(void)
+{
+	if (pthread_rwlock_unlock(&destination_lock)) {
+		syslog(LOG_ERR, "trxd: pthread_rwlock_unlock");
+		exit(1);
+	}
+}
+
+static void
+destination_wrlock(void)
+{
+	if (pthread_rwlock_wrlock(&destination_lock)) {
+		syslog(LOG_ERR, "trxd: pthread_rwlock_wrlock");
+		exit(1);
+	}
+}
+
+static destination_t *
+lookup_destination(const char *name)
+{
+	destination_t *d;
+
+	for (d = destination_hash[hash(name)]; d != NULL; d = d->hash_next)
+		if (!strcmp(d->name, name))
+			return d;
+	return NULL;
+}
+
+/*
+ * Look up a destination by name, e.g. for each member of a fan-out.  The
+ * destination is returned with a reference held, the caller releases it
+ * with release_destination().
+ */
+destination_t *
+find_destination(const char *name)
+{
+	destination_t *d;
+
+	destination_rdlock();
+	if ((d = lookup_destination(name)) != NULL)
+		__atomic_add_fetch(&d->refs, 1, __ATOMIC_RELAXED);
+	destination_unlock();
+	return d;
+}
+
+/* Take another reference, the destination lock must be held */
+void
+hold_destination(destination_t *d)
+{
+	__atomic_add_fetch(&d->refs, 1, __ATOMIC_RELAXED);
+}
+
+/* Free a removed destination once the last reference is released */
+void
+release_destination(destination_t *d)
+{
+	group_tag_t *g;
+	int n;
+
+	if (d == NULL || __atomic_sub_fetch(&d->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	if (d->type == DEST_GROUP) {
+		g = d->tag.group;
+		for (n = 0; n < g->nmembers; n++)
+			free(g->member[n]);
+		free(g->member);
+		free(g);
+	}
+	free((char *)d->name);
+	free(d->config);
+	free(d);
+}
+
+/*
+ * Unlink a destination from the list and the hash table.  The reference of
+ * the list passes to the caller, threads that found the destination earlier
+ * notice that it has been removed and release it as well.
+ */
+void
+remove_destination(destination_t *d)
+{
+	destination_t **p;
+
+	destination_wrlock();
+	for (p = &destination; *p != NULL; p = &(*p)->next)
+		if (*p == d) {
+			*p = d->next;
+			break;
+		}
+	for (p = &destination_hash[hash(d->name)]; *p != NULL;
+	    p = &(*p)->hash_next)
+		if (*p == d) {
+			*p = d->hash_next;
+			break;
+		}
+	d->removed = 1;
+	destination_unlock();
+}
+
 int
-add_destination(const char *name, enum DestinationType type, void *arg)
+add_destination(const char *name, enum DestinationType type, void *arg,
+    char *config)
 {
 	destination_t *d;
 
+	destination_wrlock();
+
 	/* Destination names must be unique */
-	for (d = destination; d != NULL; d = d->next)
-		if (d->name == name)
-			return -1;
+	if (lookup_destination(name) != NULL) {
+		destination_unlock();
+		return -1;
+	}
 
 	d = malloc(sizeof(destination_t));
 	if (d == NULL) {
@@ -107,6 +263,9 @@ add_destination(const char *name, enum DestinationType type, void *arg)
 	d->next = NULL;
 	d->name = strdup(name);
 	d->type = type;
+	d->config = config;
+	d->removed = 0;
+	d->refs = 1;		/* The list */
 	switch (type) {
 	case DEST_TRX:
 		d->tag.trx = arg;
@@ -131,8 +290,13 @@ add_destination(const char *name, enum DestinationType type, void *arg)
 	case DEST_EXTENSION:
 		d->tag.extension = arg;
 		break;
+	case DEST_GROUP:
+		d->tag.group = arg;
+		break;
 	}
 
+	d->hash_next = destination_hash[hash(name)];
+	destination_hash[hash(name)] = d;
 
 	if (destination == NULL)
 		destination = d;
@@ -143,7 +307,551 @@ add_destination(const char *name, enum DestinationType type, void *arg)
 			n = n->next;
 		n->next = d;
 	}
+	destination_unlock();
+	return 0;
+}
+
+/*
+ * Setup a transceiver and start its trx-controller.  The configuration is
+ * on top of the stack, the name below it.  Status update listeners are
+ * taken over from a transceiver that has been replaced by a reload.
+ * Returns -1 if the configuration is not valid.
+ */
+int
+setup_transceiver(lua_State *L, sender_list_t *senders)
+{
+	trx_controller_tag_t *t;
+	struct stat sb;
+	char trx_path[PATH_MAX];
+	const char *protocol;
+	char proto_path[PATH_MAX];
+	char *config;
+
+	t = calloc(1, sizeof(trx_controller_tag_t));
+	if (t == NULL) {
+		syslog(LOG_ERR, "memory allocation error");
+		exit(1);
+	}
+	config = config_fingerprint(L, lua_gettop(L));
+	t->name = strdup(lua_tostring(L, -2));
+	t->speed = 9600;
+
+	lua_getfield(L, -1, "device");
+	if (!lua_isstring(L, -1)) {
+		syslog(LOG_ERR, "missing trx device path");
+		goto fail;
+	}
+	t->device = strdup(lua_tostring(L, -1));
+	lua_pop(L, 1);
+
+	lua_getfield(L, -1, "speed");
+	if (lua_isinteger(L, -1))
+		t->speed = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+
+	lua_getfield(L, -1, "channel");
+	if (lua_isinteger(L, -1))
+		t->channel =lua_tointeger(L, -1);
+	lua_pop(L, 1);
+
+	lua_getfield(L, -1, "audio");
+	if (lua_istable(L, -1)) {
+		lua_getfield(L, -1, "input");
+		if (lua_isstring(L, -1))
+			t->audio_input = strdup(lua_tostring(L, -1));
+		lua_pop(L, 1);
+		lua_getfield(L, -1, "output");
+		if (lua_isstring(L, -1))
+			t->audio_output = strdup(lua_tostring(L, -1));
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, -1, "trx");
+	if (!lua_isstring(L, -1)) {
+		syslog(LOG_ERR, "missing trx name");
+		goto fail;
+	}
+	t->trx = strdup(lua_tostring(L, -1));
+	lua_pop(L, 1);
+
+	lua_getfield(L, -1, "default");
+	t->is_default = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+
+	lua_getfield(L, -1, "max-age");
+	if (lua_isinteger(L, -1))
+		t->max_age = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+
+	ratelimit_init(&t->limit, L, t->name);
+
+	/* Setup Lua */
+	t->L = luaL_newstate();
+	if (t->L == NULL) {
+		syslog(LOG_ERR, "cannot create Lua state");
+		exit(1);
+	}
+
+	luaL_openlibs(t->L);
+
+	luaopen_trx(t->L);
+	lua_setglobal(t->L, "trx");
+	luaopen_trx_controller(t->L);
+	lua_setglobal(t->L, "trxController");
+	luaopen_trxd(t->L);
+	lua_setglobal(t->L, "trxd");
+	luaopen_json(t->L);
+	lua_setglobal(t->L, "json");
+	luaopen_yaml(t->L);
+	lua_setglobal(t->L, "yaml");
+
+	/* Load trx description and protocol driver */
+	snprintf(trx_path, sizeof(trx_path), "%s/%s.yaml", _PATH_TRX, t->trx);
+
+	if (stat(trx_path, &sb)) {
+		syslog(LOG_ERR, "%s: file not found", trx_path);
+		goto fail;
+	}
+
+	lua_getglobal(t->L, "yaml");
+	lua_getfield(t->L, -1, "parsefile");
+	lua_pushstring(t->L, trx_path);
+
+	switch (lua_pcall(t->L, 1, 1, 0)) {
+	case LUA_OK:
+		lua_getfield(t->L, -1, "protocol");
+		protocol = lua_tostring(t->L, -1);
+		if (protocol == NULL) {
+			syslog(LOG_ERR, "%s: no protocol specified", trx_path);
+			goto fail;
+		}
+		snprintf(proto_path, sizeof(proto_path), "%s/%s.lua",
+		    _PATH_PROTOCOL, protocol);
+		lua_pop(t->L, 1);
+		lua_setglobal(t->L, "_trx");
+		break;
+	case LUA_ERRRUN:
+	case LUA_ERRMEM:
+	case LUA_ERRERR:
+		syslog(LOG_ERR, "%s: %s", trx_path, lua_tostring(t->L, -1));
+		goto fail;
+	}
+
+	if (stat(proto_path, &sb)) {
+		syslog(LOG_ERR, "protocol not found: %s", proto_path);
+		goto fail;
+	}
+	if (bytecode_dofile(t->L, proto_path)) {
+		syslog(LOG_ERR, "%s", lua_tostring(t->L, -1));
+		goto fail;
+	}
+
+	lua_setglobal(t->L, "_protocol");
+
+	if (luaL_dostring(t->L, "for k, v in pairs(_trx) do "
+	    "_protocol[k] = v end")) {
+		syslog(LOG_ERR, "%s", lua_tostring(t->L, -1));
+		goto fail;
+	}
+
+	if (bytecode_dofile(t->L, _PATH_TRX_CONTROLLER)) {
+		syslog(LOG_ERR, "%s", lua_tostring(t->L, -1));
+		goto fail;
+	}
+	if (lua_type(t->L, -1) != LUA_TTABLE) {
+		syslog(LOG_ERR, "table expected");
+		goto fail;
+	} else
+		t->ref = luaL_ref(t->L, LUA_REGISTRYINDEX);
+
+	/*
+	 * Setup the registerDriver function, but don't call it yet as the
+	 * CAT device is not yet open and it might be needed by the
+	 * initialize function.
+	 */
+	lua_geti(t->L, LUA_REGISTRYINDEX, t->ref);
+	lua_getfield(t->L, -1, "registerDriver");
+	lua_pushstring(t->L, t->name);
+	lua_pushstring(t->L, t->device);
+
+	lua_getglobal(t->L, "_protocol");
+	lua_getfield(t->L, -1, "statusUpdatesRequirePolling");
+	t->poller_required = lua_toboolean(t->L, -1);
+	lua_pop(t->L, 1);
+
+	lua_getfield(L, -1, "configuration");
+	if (lua_istable(L, -1)) {
+		proxy_map(L, t->L, lua_gettop(t->L));
+		lua_setglobal(t->L, "_config");
+		if (luaL_dostring(t->L, "for k, v in "
+		    "pairs(_config) do _protocol[k] = v end "
+		    "_config = nil")) {
+			syslog(LOG_ERR, "%s", lua_tostring(t->L, -1));
+			goto fail;
+		}
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, -1, "audio");
+	if (lua_istable(L, -1))
+		proxy_map(L, t->L, lua_gettop(t->L));
+	else
+		lua_newtable(t->L);
+	lua_setfield(t->L, -2, "audio");
+	lua_pop(L, 1);
+
+	if (pthread_mutex_init(&t->mutex, NULL)
+	    || pthread_mutex_init(&t->mutex2, NULL)
+	    || pthread_cond_init(&t->cond1, NULL)
+	    || pthread_cond_init(&t->cond2, NULL)
+	    || pthread_cond_init(&t->cond3, NULL)
+	    || pthread_mutex_init(&t->state.mutex, NULL)) {
+		syslog(LOG_ERR, "pthread initialization failed");
+		exit(1);
+	}
+
+	if (add_destination(t->name, DEST_TRX, t, config)) {
+		syslog(LOG_ERR, "transceivers: names must be unique");
+		goto fail;
+	}
+	trx_state_attach(t);
+
+	/* A replaced transceiver keeps its listeners */
+	t->senders = senders;
+	if (senders != NULL && t->poller_required) {
+		t->poller_running = 1;
+		pthread_create(&t->trx_poller, NULL, trx_poller, t);
+	}
+
+	/* Create the trx-controller thread */
+	pthread_create(&t->trx_controller, NULL, trx_controller, t);
+	return 0;
+
+fail:
+	if (t->L != NULL)
+		lua_close(t->L);
+	free(t->name);
+	free((void *)t->device);
+	free((void *)t->trx);
+	free(t->audio_input);
+	free(t->audio_output);
+	free(t);
+	free(config);
+	return -1;
+}
+
+/* Setup a gpio and start its gpio-controller, see setup_transceiver() */
+int
+setup_gpio(lua_State *L)
+{
+	gpio_controller_tag_t *t;
+	char *config;
+
+	t = calloc(1, sizeof(gpio_controller_tag_t));
+	if (t == NULL) {
+		syslog(LOG_ERR, "memory allocation error");
+		exit(1);
+	}
+	config = config_fingerprint(L, lua_gettop(L));
+	t->name = strdup(lua_tostring(L, -2));
+	t->speed = 9600;
+
+	lua_getfield(L, -1, "device");
+	if (!lua_isstring(L, -1)) {
+		syslog(LOG_ERR, "missing gpio device path");
+		goto fail;
+	}
+	t->device = strdup(lua_tostring(L, -1));
+	lua_pop(L, 1);
+
+	lua_getfield(L, -1, "speed");
+	if (lua_isinteger(L, -1))
+		t->speed =lua_tointeger(L, -1);
+	lua_pop(L, 1);
+
+	lua_getfield(L, -1, "driver");
+	if (!lua_isstring(L, -1)) {
+		syslog(LOG_ERR, "missing gpio driver name");
+		goto fail;
+	}
+	t->driver = strdup(lua_tostring(L, -1));
+	lua_pop(L, 1);
+
+	if (pthread_mutex_init(&t->mutex, NULL)
+	    || pthread_mutex_init(&t->mutex2, NULL)
+	    || pthread_cond_init(&t->cond1, NULL)
+	    || pthread_cond_init(&t->cond2, NULL)) {
+		syslog(LOG_ERR, "pthread initialization failed");
+		exit(1);
+	}
+
+	if (add_destination(t->name, DEST_GPIO, t, config)) {
+		syslog(LOG_ERR, "gpio: names must be unique");
+		goto fail;
+	}
+
+	/* Create the gpio-controller thread */
+	pthread_create(&t->gpio_controller, NULL, gpio_controller, t);
+	return 0;
+
+fail:
+	free(t->name);
+	free((void *)t->device);
+	free((void *)t->driver);
+	free(t);
+	free(config);
+	return -1;
+}
+
+/* Setup a relay and start its relay-controller */
+int
+setup_relay(lua_State *L)
+{
+	relay_controller_tag_t *t;
+	char *config;
+
+	t = calloc(1, sizeof(relay_controller_tag_t));
+	if (t == NULL) {
+		syslog(LOG_ERR, "memory allocation error");
+		exit(1);
+	}
+	config = config_fingerprint(L, lua_gettop(L));
+	t->name = strdup(lua_tostring(L, -2));
+
+	lua_getfield(L, -1, "driver");
+	if (!lua_isstring(L, -1)) {
+		syslog(LOG_ERR, "missing relay driver name");
+		goto fail;
+	}
+
+	t->driver = strdup(lua_tostring(L, -1));
+	lua_pop(L, 1);
+
+	if (pthread_mutex_init(&t->mutex, NULL)
+	    || pthread_mutex_init(&t->mutex2, NULL)
+	    || pthread_cond_init(&t->cond1, NULL)
+	    || pthread_cond_init(&t->cond2, NULL)) {
+		syslog(LOG_ERR, "pthread initialization failed");
+		exit(1);
+	}
+
+	if (add_destination(t->name, DEST_RELAY, t, config)) {
+		syslog(LOG_ERR, "relays: names must be unique");
+		goto fail;
+	}
+
+	/* Create the relay-controller thread */
+	pthread_create(&t->relay_controller, NULL, relay_controller, t);
+	return 0;
+
+fail:
+	free(t->name);
+	free((void *)t->driver);
+	free(t);
+	free(config);
+	return -1;
+}
+
+/* Setup an extension and start it, listeners are taken over on reload */
+int
+setup_extension(lua_State *L, sender_list_t *listeners)
+{
+	extension_tag_t *t;
+	const char *p, *name;
+	char script[PATH_MAX], *config;
+
+	t = calloc(1, sizeof(extension_tag_t));
+	if (t == NULL) {
+		syslog(LOG_ERR, "memory allocation failure");
+		exit(1);
+	}
+	config = config_fingerprint(L, lua_gettop(L));
+	t->L = luaL_newstate();
+	if (t->L == NULL) {
+		syslog(LOG_ERR, "cannot create Lua state");
+		exit(1);
+	}
+	luaL_openlibs(t->L);
+	luaopen_trxd(t->L);
+	lua_setglobal(t->L, "trxd");
+
+	luaopen_json(t->L);
+	lua_setglobal(t->L, "json");
+
+	name = lua_tostring(L, -2);
+
+	lua_getglobal(t->L, "package");
+	lua_getfield(t->L, -1, "cpath");
+	lua_pushstring(t->L, ";");
+	lua_pushstring(t->L, _PATH_LUA_CPATH);
+	lua_concat(t->L, 3);
+	lua_setfield(t->L, -2, "cpath");
+	lua_pop(t->L, 1);
+
+	lua_getglobal(t->L, "package");
+	lua_getfield(t->L, -1, "path");
+	lua_pushstring(t->L, ";");
+	lua_pushstring(t->L, _PATH_LUA_PATH);
+	lua_concat(t->L, 3);
+	lua_setfield(t->L, -2, "path");
+	lua_pop(t->L, 1);
+
+	lua_getfield(L, -1, "path");
+	if (lua_isstring(L, -1)) {
+		p = lua_tostring(L, -1);
+		lua_getglobal(t->L, "package");
+		lua_getfield(t->L, -1, "path");
+		lua_pushstring(t->L, ";");
+		lua_pushstring(t->L, p);
+		lua_concat(t->L, 3);
+		lua_setfield(t->L, -2, "path");
+		lua_pop(t->L, 1);
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, -1, "cpath");
+	if (lua_isstring(L, -1)) {
+		p = lua_tostring(L, -1);
+		lua_getglobal(t->L, "package");
+		lua_getfield(t->L, -1, "cpath");
+		lua_pushstring(t->L, ";");
+		lua_pushstring(t->L, p);
+		lua_concat(t->L, 3);
+		lua_setfield(t->L, -2, "cpath");
+		lua_pop(t->L, 1);
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, -1, "script");
+	if (!lua_isstring(L, -1)) {
+		syslog(LOG_ERR, "missing extension script name");
+		goto fail;
+	}
+	p = lua_tostring(L, -1);
+
+	if (strchr(p, '/')) {
+		syslog(LOG_ERR, "script name must not contain slashes");
+		goto fail;
+	}
+	snprintf(script, sizeof(script), "%s/%s.lua", _PATH_EXTENSION, p);
+
+	lua_pop(L, 1);
+
+	if (bytecode_loadfile(t->L, script)) {
+		syslog(LOG_ERR, "%s", lua_tostring(t->L, -1));
+		goto fail;
+	}
+
+	lua_getfield(L, -1, "configuration");
+	if (lua_istable(L, -1)) {
+		proxy_map(L, t->L, lua_gettop(t->L));
+		t->has_config = 1;
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, -1, "callable");
+	if (lua_isboolean(L, -1))
+		t->is_callable = lua_toboolean(L, -1);
+	else
+		t->is_callable = 1;
+	lua_pop(L, 1);
+
+	if (pthread_mutex_init(&t->mutex, NULL)
+	    || pthread_mutex_init(&t->mutex2, NULL)
+	    || pthread_cond_init(&t->cond1, NULL)
+	    || pthread_cond_init(&t->cond2, NULL)) {
+		syslog(LOG_ERR, "pthread initialization failed");
+		exit(1);
+	}
+
+	if (add_destination(name, DEST_EXTENSION, t, config)) {
+		syslog(LOG_ERR, "names must be unique");
+		goto fail;
+	}
+
+	/* A replaced extension keeps its listeners */
+	t->listeners = listeners;
+
+	/* Create the extension thread */
+	pthread_create(&t->extension, NULL, extension, t);
 	return 0;
+
+fail:
+	lua_close(t->L);
+	free(t);
+	free(config);
+	return -1;
+}
+
+/*
+ * Setup a group, a list of destination names.  The members are looked up
+ * when a request is sent to the group, so they can be changed by a reload.
+ */
+int
+setup_group(lua_State *L)
+{
+	group_tag_t *g;
+	char *config;
+	int n;
+
+	if (!lua_istable(L, -1)) {
+		syslog(LOG_ERR, "group %s: list of destinations expected",
+		    lua_tostring(L, -2));
+		return -1;
+	}
+
+	g = malloc(sizeof(group_tag_t));
+	if (g == NULL) {
+		syslog(LOG_ERR, "memory allocation error");
+		exit(1);
+	}
+	g->nmembers = luaL_len(L, -1);
+	g->member = calloc(g->nmembers, sizeof(char *));
+	if (g->member == NULL && g->nmembers > 0) {
+		syslog(LOG_ERR, "memory allocation error");
+		exit(1);
+	}
+	config = config_fingerprint(L, lua_gettop(L));
+
+	for (n = 0; n < g->nmembers; n++) {
+		lua_geti(L, -1, n + 1);
+		if (!lua_isstring(L, -1)) {
+			syslog(LOG_ERR, "group %s: destination name expected",
+			    lua_tostring(L, -3));
+			lua_pop(L, 1);
+			goto fail;
+		}
+		g->member[n] = strdup(lua_tostring(L, -1));
+		lua_pop(L, 1);
+	}
+
+	if (add_destination(lua_tostring(L, -2), DEST_GROUP, g, config)) {
+		syslog(LOG_ERR, "groups: names must be unique");
+		goto fail;
+	}
+	return 0;
+
+fail:
+	while (n > 0)
+		free(g->member[--n]);
+	free(g->member);
+	free(g);
+	free(config);
+	return -1;
+}
+
+/* Too many clients are connected, tell the client and close the connection */
+static void
+refuse(int *client_fd)
+{
+	const char *msg = "{\"status\":\"Error\","
+	    "\"reason\":\"Too many connections\"}\n";
+
+	if (write(*client_fd, msg, strlen(msg)) == -1)
+		syslog(LOG_DEBUG, "write: %s", strerror(errno));
+	close(*client_fd);
+	free(client_fd);
 }
 
 int
@@ -157,10 +865,12 @@ main(int argc, char *argv[])
 	struct addrinfo hints, *res, *res0;
 	lua_State *L;
 	pthread_t trx_control_thread, thread;
-	int fd, listen_fd[MAXLISTEN], i, ch, noannounce = 0, nodaemon = 0;
-	int error, val, top;
+	int listen_fd[MAXLISTEN], i, ch, noannounce = 0, nodaemon = 0;
+	int error, val, top, sigfd, unix_fd, line;
 	const char *bind_addr, *listen_port, *user, *group, *homedir, *pidfile;
 	const char *cfg_file;
+	char *cfg_path;
+	sigset_t sigset;
 
 	bind_addr = listen_port = user = group = pidfile = cfg_file = NULL;
 
@@ -240,6 +950,32 @@ main(int argc, char *argv[])
 		LOG_PERROR | LOG_CONS | LOG_PID | LOG_NDELAY
 		: LOG_CONS | LOG_PID | LOG_NDELAY, LOG_USER);
 
+	/*
+	 * SIGHUP reloads the configuration, SIGTERM and SIGINT terminate trxd
+	 * through exit(3), so that the Unix domain socket is removed.  They
+	 * are blocked before any thread is created, so that they are only
+	 * received through the signalfd.
+	 */
+	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGHUP);
+	sigaddset(&sigset, SIGTERM);
+	sigaddset(&sigset, SIGINT);
+	if (pthread_sigmask(SIG_BLOCK, &sigset, NULL)) {
+		syslog(LOG_ERR, "pthread_sigmask");
+		exit(1);
+	}
+
+	/* Writing to a client that has gone away must not terminate trxd */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* The working directory changes, remember where the file is */
+	cfg_path = realpath(cfg_file, NULL);
+	if (cfg_path == NULL) {
+		syslog(LOG_ERR, "configuration file '%s' not accessible",
+		    cfg_file);
+		exit(1);
+	}
+
 	/* Setup Lua */
 	L = luaL_newstate();
 	if (L == NULL) {
@@ -331,6 +1067,29 @@ main(int argc, char *argv[])
 	if (group == NULL)
 		group = TRXD_GROUP;
 
+	/* Output queue limits for slow clients, admission and rate limits */
+	sender_config(L);
+	ratelimit_config(L);
+
+	/* The prefix list used to find the DXCC entity of callsigns */
+	lua_getfield(L, -1, "cty");
+	if (lua_isstring(L, -1)) {
+		if (cty_load(&cty, lua_tostring(L, -1), &line)) {
+			if (line)
+				syslog(LOG_ERR, "%s: invalid entry in line %d",
+				    lua_tostring(L, -1), line);
+			else
+				syslog(LOG_ERR, "can't read %s",
+				    lua_tostring(L, -1));
+			exit(1);
+		}
+		if (verbose)
+			syslog(LOG_NOTICE, "%s: %zu entities, %zu prefixes, "
+			    "%zu callsigns", lua_tostring(L, -1), cty.entities,
+			    cty.prefixes, cty.calls);
+	}
+	lua_pop(L, 1);
+
 	uid = getuid();
 	gid = getgid();
 
@@ -362,6 +1121,16 @@ main(int argc, char *argv[])
 			exit(1);
 		}
 
+		/* The bytecode cache must be writable by the trxd user */
+		if (mkdir(_PATH_CACHE, 0755) && errno != EEXIST)
+			syslog(LOG_NOTICE, "can't create %s", _PATH_CACHE);
+		else if (chown(_PATH_CACHE, uid, gid))
+			syslog(LOG_NOTICE, "can't change owner of %s",
+			    _PATH_CACHE);
+
+		/* The Unix domain socket is created while still root */
+		unix_fd = unix_listen(L, uid, gid);
+
 		if (setgid(gid)) {
 			syslog(LOG_ERR, "can't set group");
 			exit(1);
@@ -375,7 +1144,8 @@ main(int argc, char *argv[])
 			syslog(LOG_ERR, "must not be run as root, exiting");
 			exit(1);
 		}
-	}
+	} else
+		unix_fd = unix_listen(L, uid, gid);
 
 	if (!nodaemon) {
 		if (daemon(0, 0))
@@ -392,293 +1162,37 @@ main(int argc, char *argv[])
 		}
 	}
 
+	/* Publish the transceiver state in shared memory */
+	trx_state_shm_init();
+
 	/* Setup the trx-controllers */
 	lua_getfield(L, -1, "transceivers");
 	if (lua_istable(L, -1)) {
 		top = lua_gettop(L);
 		lua_pushnil(L);
 		while (lua_next(L, top)) {
-			trx_controller_tag_t *t;
-			char trx_path[PATH_MAX];
-			char *protocol;
-			char proto_path[PATH_MAX];
-
-			t = malloc(sizeof(trx_controller_tag_t));
-			t->name = strdup(lua_tostring(L, -2));
-			t->handler = t->response = NULL;
-			t->is_running = 0;
-			t->speed = 9600;
-			t->channel = 0;
-			t->audio_input = t->audio_output = NULL;
-			t->poller_required = 0;
-			t->poller_running = 0;
-			t->handler_running = 0;
-			t->senders = NULL;
-
-			lua_getfield(L, -1, "device");
-			if (!lua_isstring(L, -1)) {
-				syslog(LOG_ERR, "missing trx device path");
-				exit(1);
-			}
-			t->device = strdup(lua_tostring(L, -1));
-			lua_pop(L, 1);
-
-			if (*t->device == '/' && stat(t->device, &sb)) {
-				syslog(LOG_WARNING,
-				    "trxd: file not found %s\n", t->device);
-				free((void *)t->device);
-				free(t->name);
-				free(t);
-				lua_pop(L, 1);
-				continue;
-			}
-
-			lua_getfield(L, -1, "speed");
-			if (lua_isinteger(L, -1))
-				t->speed = lua_tointeger(L, -1);
-			lua_pop(L, 1);
-
-			lua_getfield(L, -1, "channel");
-			if (lua_isinteger(L, -1))
-				t->channel =lua_tointeger(L, -1);
-			lua_pop(L, 1);
-
-			lua_getfield(L, -1, "audio");
-			if (lua_istable(L, -1)) {
-				lua_getfield(L, -1, "input");
-				if (lua_isstring(L, -1))
-					t->audio_input =
-					    strdup(lua_tostring(L, -1));
-				lua_pop(L, 1);
-				lua_getfield(L, -1, "output");
-				if (lua_isstring(L, -1))
-					t->audio_output =
-					    strdup(lua_tostring(L, -1));
-				lua_pop(L, 1);
-			}
-			lua_pop(L, 1);
-
-			lua_getfield(L, -1, "trx");
-			if (!lua_isstring(L, -1)) {
-				syslog(LOG_ERR, "missing trx name");
-				exit(1);
-			}
-			t->trx = strdup(lua_tostring(L, -1));
-			lua_pop(L, 1);
-
-			lua_getfield(L, -1, "default");
-			t->is_default = lua_toboolean(L, -1);
-			lua_pop(L, 1);
-
-			/* Setup Lua */
-			t->L = luaL_newstate();
-			if (t->L == NULL) {
-				syslog(LOG_ERR, "cannot create Lua state");
-				exit(1);
-			}
-
-			luaL_openlibs(t->L);
-
-			luaopen_trx(t->L);
-			lua_setglobal(t->L, "trx");
-			luaopen_trx_controller(t->L);
-			lua_setglobal(t->L, "trxController");
-			luaopen_trxd(t->L);
-			lua_setglobal(t->L, "trxd");
-			luaopen_json(t->L);
-			lua_setglobal(t->L, "json");
-			luaopen_yaml(t->L);
-			lua_setglobal(t->L, "yaml");
-
-			/* Load trx description and protocol driver */
-			snprintf(trx_path, sizeof(trx_path), "%s/%s.yaml",
-			    _PATH_TRX, t->trx);
-
-			if (stat(trx_path, &sb)) {
-				syslog(LOG_ERR, "%s: file not found", trx_path);
-				exit(1);
-			}
-
-			lua_getglobal(t->L, "yaml");
-			lua_getfield(t->L, -1, "parsefile");
-			lua_pushstring(t->L, trx_path);
-
-			switch (lua_pcall(t->L, 1, 1, 0)) {
-			case LUA_OK:
-				lua_getfield(t->L, -1, "protocol");
-				protocol = lua_tostring(t->L, -1);
-				if (protocol == NULL) {
-					syslog(LOG_ERR,
-					    "%s: no protocol specified",
-					    trx_path);
-					exit(1);
-				}
-				lua_pop(t->L, 1);
-				lua_setglobal(t->L, "_trx");
-				break;
-			case LUA_ERRRUN:
-			case LUA_ERRMEM:
-			case LUA_ERRERR:
-				syslog(LOG_ERR, "%s: %s", trx_path,
-				    lua_tostring(t->L, -1));
-				exit(1);
-				break;
-			}
-
-			snprintf(proto_path, sizeof(proto_path), "%s/%s.lua",
-			    _PATH_PROTOCOL, protocol);
-
-			if (stat(proto_path, &sb)) {
-				syslog(LOG_ERR, "protocol not found: %s",
-				    protocol);
-				exit(1);
-			}
-			if (luaL_dofile(t->L, proto_path)) {
-				syslog(LOG_ERR, "%s", lua_tostring(t->L, -1));
-				exit(1);
-			}
-
-			lua_setglobal(t->L, "_protocol");
-
-			if (luaL_dostring(t->L, "for k, v in pairs(_trx) do "
-			    "_protocol[k] = v end")) {
-				syslog(LOG_ERR, "%s", lua_tostring(t->L, -1));
-				exit(1);
-			}
-
-			if (luaL_dofile(t->L, _PATH_TRX_CONTROLLER)) {
-				syslog(LOG_ERR, "%s", lua_tostring(t->L, -1));
-				exit(1);
-			}
-			if (lua_type(t->L, -1) != LUA_TTABLE) {
-				syslog(LOG_ERR, "table expected");
+			if (setup_transceiver(L, NULL))
 				exit(1);
-			} else
-				t->ref = luaL_ref(t->L, LUA_REGISTRYINDEX);
-
-			/*
-			 * Setup the registerDriver function, but don't call
-			 * it yet as the CAT device is not yet open and it
-			 * might be needed by the initialize function.
-			 */
-			lua_geti(t->L, LUA_REGISTRYINDEX, t->ref);
-			lua_getfield(t->L, -1, "registerDriver");
-			lua_pushstring(t->L, t->name);
-			lua_pushstring(t->L, t->device);
-
-			lua_getglobal(t->L, "_protocol");
-			lua_getfield(t->L, -1,
-			    "statusUpdatesRequirePolling");
-			t->poller_required = lua_toboolean(t->L, -1);
-			lua_pop(t->L, 1);
-
-			lua_getfield(L, -1, "configuration");
-			if (lua_istable(L, -1)) {
-				proxy_map(L, t->L, lua_gettop(t->L));
-				lua_setglobal(t->L, "_config");
-				if (luaL_dostring(t->L, "for k, v in "
-				    "pairs(_config) do _G[k] = v end "
-				    "_config = nil")) {
-					syslog(LOG_ERR, "%s",
-					    lua_tostring(t->L, -1));
-					exit(1);
-				}
-			}
-			lua_pop(L, 1);
-
-			lua_getfield(L, -1, "audio");
-			if (lua_istable(L, -1))
-				proxy_map(L, t->L, lua_gettop(t->L));
-			else
-				lua_newtable(t->L);
-			lua_setfield(t->L, -2, "audio");
-			lua_pop(L, 1);
-
-			if (add_destination(t->name, DEST_TRX, t)) {
-				syslog(LOG_ERR,
-				    "transceivers: names must be unique");
-				exit(1);
-			}
-
-			if (pthread_mutex_init(&t->mutex, NULL))
-				goto terminate;
-
-			if (pthread_mutex_init(&t->mutex2, NULL))
-				goto terminate;
-
-			if (pthread_cond_init(&t->cond1, NULL))
-				goto terminate;
-
-			if (pthread_cond_init(&t->cond2, NULL))
-				goto terminate;
-
-			/* Create the trx-controller thread */
-			pthread_create(&t->trx_controller, NULL, trx_controller,
-			    t);
 			lua_pop(L, 1);
 		}
 	} else if (verbose)
 		syslog(LOG_NOTICE, "no transceivers defined\n");
 	lua_pop(L, 1);
 
+	/*
+	 * Attach transceivers as soon as they are plugged in, this is also
+	 * needed for transceivers added by a configuration reload.
+	 */
+	pthread_create(&thread, NULL, hotplug, NULL);
+
 	/* Setup the gpio-controllers */
 	lua_getfield(L, -1, "gpio");
 	if (lua_istable(L, -1)) {
 		top = lua_gettop(L);
 		lua_pushnil(L);
 		while (lua_next(L, top)) {
-			gpio_controller_tag_t *t;
-
-			t = malloc(sizeof(gpio_controller_tag_t));
-			t->name = strdup(lua_tostring(L, -2));
-			t->handler = t->response = NULL;
-			t->is_running = 0;
-			t->speed = 9600;
-			t->poller_required = 0;
-			t->poller_running = 0;
-			t->senders = NULL;
-
-			lua_getfield(L, -1, "device");
-			if (!lua_isstring(L, -1)) {
-				syslog(LOG_ERR, "missing gpio device path");
-				exit(1);
-			}
-			t->device = strdup(lua_tostring(L, -1));
-			lua_pop(L, 1);
-
-			lua_getfield(L, -1, "speed");
-			if (lua_isinteger(L, -1))
-				t->speed =lua_tointeger(L, -1);
-			lua_pop(L, 1);
-
-			lua_getfield(L, -1, "driver");
-			if (!lua_isstring(L, -1)) {
-				syslog(LOG_ERR, "missing gpio driver name");
+			if (setup_gpio(L))
 				exit(1);
-			}
-			t->driver = strdup(lua_tostring(L, -1));
-			lua_pop(L, 1);
-
-			if (add_destination(t->name, DEST_GPIO, t)) {
-				syslog(LOG_ERR, "gpio: names must be unique");
-				exit(1);
-			}
-
-			if (pthread_mutex_init(&t->mutex, NULL))
-				goto terminate;
-
-			if (pthread_mutex_init(&t->mutex2, NULL))
-				goto terminate;
-
-			if (pthread_cond_init(&t->cond1, NULL))
-				goto terminate;
-
-			if (pthread_cond_init(&t->cond2, NULL))
-				goto terminate;
-
-			/* Create the gpio-controller thread */
-			pthread_create(&t->gpio_controller, NULL,
-			    gpio_controller, t);
 			lua_pop(L, 1);
 		}
 	} else if (verbose)
@@ -691,43 +1205,8 @@ main(int argc, char *argv[])
 		top = lua_gettop(L);
 		lua_pushnil(L);
 		while (lua_next(L, top)) {
-			relay_controller_tag_t *t;
-
-			t = malloc(sizeof(relay_controller_tag_t));
-			t->name = strdup(lua_tostring(L, -2));
-			t->handler = t->response = NULL;
-			t->is_running = 0;
-			t->poller_running = 0;
-
-			lua_getfield(L, -1, "driver");
-			if (!lua_isstring(L, -1)) {
-				syslog(LOG_ERR, "missing relay driver name");
+			if (setup_relay(L))
 				exit(1);
-			}
-
-			t->driver = strdup(lua_tostring(L, -1));
-			lua_pop(L, 1);
-
-			if (add_destination(t->name, DEST_RELAY, t)) {
-				syslog(LOG_ERR, "relays: names must be unique");
-				exit(1);
-			}
-
-			if (pthread_mutex_init(&t->mutex, NULL))
-				goto terminate;
-
-			if (pthread_mutex_init(&t->mutex2, NULL))
-				goto terminate;
-
-			if (pthread_cond_init(&t->cond1, NULL))
-				goto terminate;
-
-			if (pthread_cond_init(&t->cond2, NULL))
-				goto terminate;
-
-			/* Create the relay-controller thread */
-			pthread_create(&t->relay_controller, NULL,
-			    relay_controller, t);
 			lua_pop(L, 1);
 		}
 	} else if (verbose)
@@ -740,135 +1219,25 @@ main(int argc, char *argv[])
 		top = lua_gettop(L);
 		lua_pushnil(L);
 		while (lua_next(L, top)) {
-			extension_tag_t *t;
-			const char *p;
-			char script[PATH_MAX], *name;
-
-			t = malloc(sizeof(extension_tag_t));
-			if (t == NULL) {
-				syslog(LOG_ERR, "memory allocation failure");
+			if (setup_extension(L, NULL))
 				exit(1);
-			}
-			t->has_config = 0;
-			t->listeners = NULL;
-			t->L = luaL_newstate();
-			if (t->L == NULL) {
-				syslog(LOG_ERR, "cannot create Lua state");
-				exit(1);
-			}
-			luaL_openlibs(t->L);
-			luaopen_trxd(t->L);
-			lua_setglobal(t->L, "trxd");
-
-			luaL_openlibs(t->L);
-			luaopen_json(t->L);
-			lua_setglobal(t->L, "json");
-
-			t->call = t->done = 0;
-			name = (char *)lua_tostring(L, -2);
-
-			lua_getglobal(t->L, "package");
-			lua_getfield(t->L, -1, "cpath");
-			lua_pushstring(t->L, ";");
-			lua_pushstring(t->L, _PATH_LUA_CPATH);
-			lua_concat(t->L, 3);
-			lua_setfield(t->L, -2, "cpath");
-			lua_pop(t->L, 1);
-
-			lua_getglobal(t->L, "package");
-			lua_getfield(t->L, -1, "path");
-			lua_pushstring(t->L, ";");
-			lua_pushstring(t->L, _PATH_LUA_PATH);
-			lua_concat(t->L, 3);
-			lua_setfield(t->L, -2, "path");
-			lua_pop(t->L, 1);
-
-			lua_getfield(L, -1, "path");
-			if (lua_isstring(L, -1)) {
-				p = lua_tostring(L, -1);
-				lua_getglobal(t->L, "package");
-				lua_getfield(t->L, -1, "path");
-				lua_pushstring(t->L, ";");
-				lua_pushstring(t->L, p);
-				lua_concat(t->L, 3);
-				lua_setfield(t->L, -2, "path");
-				lua_pop(t->L, 1);
-			}
-			lua_pop(L, 1);
-
-			lua_getfield(L, -1, "cpath");
-			if (lua_isstring(L, -1)) {
-				p = lua_tostring(L, -1);
-				lua_getglobal(t->L, "package");
-				lua_getfield(t->L, -1, "cpath");
-				lua_pushstring(t->L, ";");
-				lua_pushstring(t->L, p);
-				lua_concat(t->L, 3);
-				lua_setfield(t->L, -2, "cpath");
-				lua_pop(t->L, 1);
-			}
-			lua_pop(L, 1);
-
-			lua_getfield(L, -1, "script");
-			if (!lua_isstring(L, -1)) {
-				syslog(LOG_ERR,
-				    "missing extension script name");
-				exit(1);
-			}
-			p = lua_tostring(L, -1);
-
-			if (strchr(p, '/')) {
-				syslog(LOG_ERR,
-				    "script name must not contain slashes");
-				exit(1);
-			}
-			snprintf(script, sizeof(script), "%s/%s.lua",
-			    _PATH_EXTENSION, p);
-
-			lua_pop(L, 1);
-
-			if (luaL_loadfile(t->L, script)) {
-				syslog(LOG_ERR, "%s", lua_tostring(t->L, -1));
-				exit(1);
-			}
-
-			lua_getfield(L, -1, "configuration");
-			if (lua_istable(L, -1)) {
-				proxy_map(L, t->L, lua_gettop(t->L));
-				t->has_config = 1;
-			}
-			lua_pop(L, 1);
-
-			lua_getfield(L, -1, "callable");
-			if (lua_isboolean(L, -1))
-				t->is_callable = lua_toboolean(L, -1);
-			else
-				t->is_callable = 1;
 			lua_pop(L, 1);
+		}
+	} else if (verbose)
+		syslog(LOG_NOTICE, "no extensions defined\n");
+	lua_pop(L, 1);
 
-			if (add_destination(name, DEST_EXTENSION, t)) {
-				syslog(LOG_ERR, "names must be unique");
+	/* Setup the groups, after the destinations they refer to */
+	lua_getfield(L, -1, "groups");
+	if (lua_istable(L, -1)) {
+		top = lua_gettop(L);
+		lua_pushnil(L);
+		while (lua_next(L, top)) {
+			if (setup_group(L))
 				exit(1);
-			}
-
-			if (pthread_mutex_init(&t->mutex, NULL))
-				goto terminate;
-
-			if (pthread_mutex_init(&t->mutex2, NULL))
-				goto terminate;
-
-			if (pthread_cond_init(&t->cond1, NULL))
-				goto terminate;
-
-			if (pthread_cond_init(&t->cond2, NULL))
-				goto terminate;
-
-			/* Create the extension thread */
-			pthread_create(&t->extension, NULL, extension, t);
 			lua_pop(L, 1);
 		}
-	} else if (verbose)
-		syslog(LOG_NOTICE, "no extensions defined\n");
+	}
 	lua_pop(L, 1);
 
 	/* Setup WebSocket listening */
@@ -948,13 +1317,44 @@ main(int argc, char *argv[])
 		t->speed = t->course = t->variation = 0.0;
 		t->mode = 'I';
 		t->locator[0] = '\0';
+		t->fix_type = t->sats_used = t->sats_in_view = 0;
+		t->pdop = t->hdop = t->vdop = 0.0;
+		t->senders = NULL;
+		t->interval = 1000;
+		t->last = NULL;
+		t->pending = 0;
+
+		t->fd = -1;
+		t->gpsd_host = t->gpsd_port = NULL;
+
+		/* Either connect to gpsd or read from a device */
+		lua_getfield(L, -1, "gpsd");
+		if (lua_isstring(L, -1)) {
+			t->gpsd_host = strdup(lua_tostring(L, -1));
+			if (t->gpsd_host == NULL) {
+				syslog(LOG_ERR, "memory allocation error");
+				exit(1);
+			}
+		}
+		lua_pop(L, 1);
+
+		lua_getfield(L, -1, "gpsd-port");
+		t->gpsd_port = strdup(lua_isstring(L, -1) ?
+		    lua_tostring(L, -1) : "2947");
+		if (t->gpsd_port == NULL) {
+			syslog(LOG_ERR, "memory allocation error");
+			exit(1);
+		}
+		lua_pop(L, 1);
 
 		lua_getfield(L, -1, "device");
-		if (!lua_isstring(L, -1)) {
+		if (t->gpsd_host != NULL)
+			device = NULL;
+		else if (!lua_isstring(L, -1)) {
 			syslog(LOG_ERR, "missing nmea device");
 			exit(1);
-		}
-		device = lua_tostring(L, -1);
+		} else
+			device = lua_tostring(L, -1);
 		lua_pop(L, 1);
 
 		lua_getfield(L, -1, "speed");
@@ -967,7 +1367,15 @@ main(int argc, char *argv[])
 			channel = lua_tointeger(L, -1);
 		lua_pop(L, 1);
 
-		if (*device == '/') {
+		/* Send fix changes at most every update-interval ms */
+		lua_getfield(L, -1, "update-interval");
+		if (lua_isinteger(L, -1))
+			t->interval = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+
+		if (device == NULL) {
+			/* The gpsd-handler connects to gpsd */
+		} else if (*device == '/') {
 			/* Assume device under /dev */
 			t->fd = open(device, O_RDWR);
 			if (t->fd == -1) {
@@ -996,12 +1404,13 @@ main(int argc, char *argv[])
 			/* Assume Bluetooth RFCOMM */
 			struct sockaddr_rc addr = { 0 };
 
-			fd = socket(AF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM);
+			t->fd = socket(AF_BLUETOOTH, SOCK_STREAM,
+			    BTPROTO_RFCOMM);
 
 			addr.rc_family = AF_BLUETOOTH;
 			addr.rc_channel = (uint8_t) channel;
 			str2ba(device, &addr.rc_bdaddr);
-			if (connect(fd,
+			if (connect(t->fd,
 			    (struct sockaddr *)&addr, sizeof(addr))) {
 				syslog(LOG_ERR, "can't connect to %s",
 				    device);
@@ -1012,7 +1421,7 @@ main(int argc, char *argv[])
 			exit(1);
 		}
 
-		if (add_destination("nmea", DEST_INTERNAL, t)) {
+		if (add_destination("nmea", DEST_INTERNAL, t, NULL)) {
 			syslog(LOG_ERR, "nmea: names must be unique");
 			exit(1);
 		}
@@ -1020,8 +1429,9 @@ main(int argc, char *argv[])
 		if (pthread_mutex_init(&t->mutex, NULL))
 			goto terminate;
 
-		/* Create the nmea-handler thread */
-		pthread_create(&t->nmea_handler, NULL, nmea_handler, t);
+		/* Create the nmea-handler or gpsd-handler thread */
+		pthread_create(&t->nmea_handler, NULL,
+		    device == NULL ? gpsd_handler : nmea_handler, t);
 		lua_pop(L, 1);
 	}
 	lua_pop(L, 1);
@@ -1078,14 +1488,27 @@ main(int argc, char *argv[])
 		i++;
 	}
 
+	sigfd = signalfd(-1, &sigset, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (sigfd == -1) {
+		syslog(LOG_ERR, "signalfd: %s", strerror(errno));
+		exit(1);
+	}
+
 	/* Wait for connections as long as trx_control runs */
 	while (1) {
+		struct signalfd_siginfo si;
 		struct timeval	 tv;
 		fd_set		 readfds;
-		int		 maxfd = -1;
+		int		 maxfd = sigfd;
 		int		 r;
 
 		FD_ZERO(&readfds);
+		FD_SET(sigfd, &readfds);
+		if (unix_fd != -1) {
+			FD_SET(unix_fd, &readfds);
+			if (unix_fd > maxfd)
+				maxfd = unix_fd;
+		}
 		for (i = 0; i < MAXLISTEN; ++i) {
 			if (listen_fd[i] != -1) {
 				FD_SET(listen_fd[i], &readfds);
@@ -1104,10 +1527,39 @@ main(int argc, char *argv[])
 		} else if (r == 0)
 			continue;
 
+		if (FD_ISSET(sigfd, &readfds)
+		    && read(sigfd, &si, sizeof(si)) == sizeof(si)) {
+			if (si.ssi_signo != SIGHUP) {
+				syslog(LOG_INFO, "terminating on signal %d",
+				    si.ssi_signo);
+				break;
+			}
+			reload(cfg_path);
+		}
+
+		/* Local clients are handled like TCP/IP clients */
+		if (unix_fd != -1 && FD_ISSET(unix_fd, &readfds)) {
+			int *client_fd;
+
+			client_fd = malloc(sizeof(int));
+			if (client_fd == NULL) {
+				syslog(LOG_ERR, "memory allocation error");
+				exit(1);
+			}
+			*client_fd = unix_accept(unix_fd);
+			if (*client_fd == -1)
+				free(client_fd);
+			else if (!client_admit(LISTENER_UNIX))
+				refuse(client_fd);
+			else
+				pthread_create(&thread, NULL, socket_handler,
+				    client_fd);
+		}
+
 		for (i = 0; i < MAXLISTEN; ++i) {
 			struct sockaddr_storage	 sa;
 			socklen_t		 len;
-			int			 *client_fd, error;
+			int			 *client_fd, error, nodelay = 1;
 			char			 hbuf[NI_MAXHOST];
 
 			client_fd = malloc(sizeof(int));
@@ -1124,6 +1576,17 @@ main(int argc, char *argv[])
 				free(client_fd);
 				break;
 			}
+			if (!client_admit(LISTENER_SOCKET)) {
+				refuse(client_fd);
+				continue;
+			}
+
+			/* Replies and status updates are sent at once */
+			if (setsockopt(*client_fd, IPPROTO_TCP, TCP_NODELAY,
+			    &nodelay, sizeof(nodelay)))
+				syslog(LOG_ERR, "setsockopt: %s",
+				    strerror(errno));
+
 			error = getnameinfo((struct sockaddr *)&sa, len,
 			    hbuf, sizeof(hbuf), NULL, 0, NI_NUMERICHOST);
 			if (error)
@@ -24,6 +24,8 @@
 #define __TRXD_H__
 
 #include <pthread.h>
+#include <stdint.h>
+#include <time.h>
 
 #include <openssl/ssl.h>
 
@@ -35,21 +37,154 @@
 
 typedef struct sender_tag sender_tag_t;
 
+/*
+ * The notifications of an extension can be filtered per listener.  A
+ * notification that has attributes is only sent to the listeners whose
+ * filter it matches.
+ */
+typedef struct listen_filter {
+	uint32_t		 bands;		/* Bit mask, 0 for any */
+	char			**modes;
+	int			 nmodes;
+	char			**prefixes;	/* Of the callsign */
+	int			 nprefixes;
+	char			**continents;
+	int			 ncontinents;
+	int			 has_position;	/* Filter by distance */
+	double			 latitude;
+	double			 longitude;
+	double			 max_distance;	/* km */
+} listen_filter_t;
+
+typedef struct notify_attr {
+	int			 band;		/* -1 if not known */
+	const char		*mode;
+	const char		*call;
+	const char		*continent;
+	int			 has_position;
+	double			 latitude;
+	double			 longitude;
+} notify_attr_t;
+
 typedef struct sender_list {
 	sender_tag_t		*sender;
+	listen_filter_t		*filter;	/* NULL for no filter */
 	struct sender_list	*next;
 } sender_list_t;
 
-typedef struct trx_controller_tag {
-	/* The first mutex locks the trx-controller */
+/* Clients are admitted per listener, see client_admit() */
+enum Listener {
+	LISTENER_SOCKET,	/* TCP/IP */
+	LISTENER_UNIX,
+	LISTENER_WEBSOCKET,
+	LISTENERS
+};
+
+/*
+ * Requests that are sent to a transceiver are rate limited per client and
+ * per transceiver by token buckets.  A rate of 0 means no limit.
+ */
+typedef struct token_bucket {
 	pthread_mutex_t		 mutex;
+	double			 rate;		/* Requests per second */
+	double			 burst;
+	double			 tokens;	/* Negative if reserved */
+	struct timespec		 updated;
+	unsigned long		 delayed;
+	unsigned long		 refused;
+} token_bucket_t;
 
-	pthread_mutex_t		 mutex2;
-	pthread_cond_t		 cond1;	/* A handler is set */
+/*
+ * Requests to a transceiver are queued by priority class and served by the
+ * trx-controller thread highest class first.  Lower classes are protected
+ * against starvation by aging, except that PTT requests are always served
+ * first.
+ */
+enum TrxRequestClass {
+	TRX_CLASS_PTT,		/* PTT and keying */
+	TRX_CLASS_SET,		/* Interactive set requests */
+	TRX_CLASS_GET,		/* Interactive get requests */
+	TRX_CLASS_POLL,		/* Polling and auto information */
+	TRX_CLASSES
+};
+
+typedef struct trx_request {
 	const char		*handler;
+	char			*data;
+	size_t			 len;
+	int			 client_fd;
+	enum TrxRequestClass	 class;
 
-	pthread_cond_t		 cond2;	/* A response is set */
-	char			*response;
+	struct timespec		 queued;
+	struct timespec		 started;
+
+	char			*key;		/* For write-combining */
+
+	char			*response;	/* Set by the trx-controller */
+	int			 done;
+	int			 abandoned;	/* The caller was cancelled */
+
+	struct trx_request	*next;
+} trx_request_t;
+
+typedef struct trx_class_stats {
+	unsigned long		 requests;
+	unsigned long		 aged;		/* Served to avoid starvation */
+	unsigned long		 superseded;	/* Replaced by a later request */
+	unsigned long long	 wait_total;	/* Microseconds */
+	unsigned long long	 wait_max;
+	unsigned long long	 service_total;
+	unsigned long long	 service_max;
+} trx_class_stats_t;
+
+/*
+ * The last known state of a transceiver, as learned from polling, auto
+ * information and successful requests.  Values are stored JSON encoded.
+ */
+enum TrxStateItem {
+	TRX_STATE_FREQUENCY,
+	TRX_STATE_VFO_A,
+	TRX_STATE_VFO_B,
+	TRX_STATE_MODE,
+	TRX_STATE_PTT,
+	TRX_STATE_LOCK,
+	TRX_STATE_ITEMS
+};
+
+typedef struct trx_state {
+	pthread_mutex_t		 mutex;
+	char			*value[TRX_STATE_ITEMS];
+	struct timespec		 updated[TRX_STATE_ITEMS];
+	unsigned long		 hits;
+	unsigned long		 misses;
+
+	/* Published in shared memory, see trx-control.h */
+	struct trxd_shm_slot	*slot;
+} trx_state_t;
+
+typedef struct trx_controller_tag {
+	/* The first mutex locks the Lua state and the CAT device */
+	pthread_mutex_t		 mutex;
+
+	/* The second mutex locks the request queue */
+	pthread_mutex_t		 mutex2;
+	pthread_cond_t		 cond1;	/* A request has been queued */
+	pthread_cond_t		 cond2;	/* A request has been handled */
+	pthread_cond_t		 cond3;	/* A device has been plugged in */
+	int			 attached;	/* The CAT device is open */
+	int			 plugged;
+	int			 removed;	/* By a configuration reload */
+	trx_request_t		*queue[TRX_CLASSES];
+	trx_request_t		*queue_tail[TRX_CLASSES];
+	int			 pending[TRX_CLASSES];
+	trx_class_stats_t	 stats[TRX_CLASSES];
+
+	/* get-* requests are answered from the state if not too old */
+	trx_state_t		 state;
+	int			 max_age;	/* Milliseconds, 0 is off */
+
+	/* Requests from all clients */
+	token_bucket_t		 limit;
 
 	char			*name;
 	const char		*device;
@@ -63,9 +198,6 @@ typedef struct trx_controller_tag {
 	lua_State		*L;
 	int			 ref;
 
-	char			*data;
-
-	int			 client_fd;
 	int			 cat_device;
 	pthread_t		 trx_controller;
 	pthread_t		 trx_poller;
@@ -122,6 +254,10 @@ typedef struct nmea_tag {
 	int			 fd;
 	pthread_t		 nmea_handler;
 
+	/* If set, the fix is received from gpsd instead of a device */
+	char			*gpsd_host;
+	char			*gpsd_port;
+
 	/* Fix data */
 	int			year, month, day, hour, minute, second;
 	int			status;		/* signal status */
@@ -133,6 +269,19 @@ typedef struct nmea_tag {
 	double			variation;	/* Magnetic variation */
 	char			mode;		/* GPS mode */
 	char			locator[LOCATORMAX + 1];
+
+	/* Satellites and dilution of precision, from GGA, GSA, and GSV */
+	int			fix_type;	/* 1 none, 2 2D, 3 3D */
+	int			sats_used;
+	int			sats_in_view;
+	double			pdop, hdop, vdop;
+
+	/* Fix changes are sent to the senders at most every interval ms */
+	sender_list_t		*senders;
+	int			interval;
+	struct timespec		notified;
+	char			*last;		/* The last update sent */
+	int			pending;	/* A change is held back */
 } nmea_tag_t;
 
 typedef struct gpio_controller_tag {
@@ -161,6 +310,7 @@ typedef struct gpio_controller_tag {
 	pthread_t		 gpio_poller;
 	pthread_t		 gpio_handler;
 	int			 is_running;
+	int			 removed;
 	int			 poller_required;
 	int			 poller_running;
 	int			 poller_suspended;
@@ -191,6 +341,7 @@ typedef struct relay_controller_tag {
 	pthread_t		 relay_poller;
 	pthread_t		 relay_handler;
 	int			 is_running;
+	int			 removed;
 	int			 poller_running;
 	int			 poller_suspended;
 	int			 handler_running;
@@ -208,12 +359,14 @@ typedef struct extension_tag {
 	int			 done;
 	int			 has_config;
 	int			 is_callable;
+	int			 removed;
 
 	lua_State		*L;
 
 	pthread_t		 extension;
 
 	sender_list_t		*listeners;
+	struct signal_input	*inputs;
 } extension_tag_t;
 
 enum DestinationType {
@@ -223,12 +376,27 @@ enum DestinationType {
 	DEST_RELAY,
 	DEST_GPIO,
 	DEST_INTERNAL,
-	DEST_EXTENSION
+	DEST_EXTENSION,
+	DEST_GROUP
 };
 
+/* A group of destinations a request is sent to at once */
+typedef struct group_tag {
+	char			**member;
+	int			 nmembers;
+} group_tag_t;
+
+/*
+ * Destinations are kept in a list and, for lookups by name, in a hash
+ * table.  Destinations removed by a configuration reload are unlinked and
+ * freed when the dispatchers that refer to them have released them.
+ */
 typedef struct destination {
 	const char		*name;
 	enum DestinationType	 type;
+	char			*config;	/* To detect changes */
+	int			 removed;
+	int			 refs;
 
 	union {
 		trx_controller_tag_t	*trx;
@@ -237,16 +405,24 @@ typedef struct destination {
 		nmea_tag_t		*nmea;
 		relay_controller_tag_t	*relay;
 		extension_tag_t		*extension;
+		group_tag_t		*group;
 	} tag;
 
 	struct destination	*next;
+	struct destination	*hash_next;
 } destination_t;
 
+/*
+ * A signal input calls a function of an extension when data arrives on a
+ * file descriptor, or once after a timeout if fd is -1.
+ */
 typedef struct signal_input {
 	extension_tag_t	*extension;
 	int		 fd;
-	const char	*func;
+	int		 timeout;	/* Milliseconds */
+	char		*func;
 	pthread_t	 signal_input;
+	struct signal_input *next;
 } signal_input_t;
 
 typedef struct websocket_listener {
@@ -282,14 +458,26 @@ typedef struct websocket {
  * a socket-handler or websocket-handler and dispatches it to the right
  * controller (or extension).
  */
+typedef struct dispatcher_request {
+	char				*data;
+	struct dispatcher_request	*next;
+} dispatcher_request_t;
+
 typedef struct dispatcher_tag {
 	/* The first mutex locks the dispatcher */
 	pthread_mutex_t		 mutex;
+
+	/* The second mutex locks the inbox */
 	pthread_mutex_t		 mutex2;
 	pthread_cond_t		 cond;	/* data is ready to be dispatched */
 	pthread_cond_t		 cond2;	/* Request has been handled */
 
-	char			*data;
+	char			*data;	/* The request being dispatched */
+
+	/* Requests that have been received, but not yet dispatched */
+	dispatcher_request_t	*inbox;
+	dispatcher_request_t	*inbox_tail;
+	int			 inbox_len;
 
 	sender_tag_t		*sender;
 	pthread_t		 dispatcher;
@@ -301,16 +489,59 @@ typedef struct dispatcher_tag {
  * do not just regular i/o, but need some framing.  The specific
  * sender thread can deal with this.
  */
+typedef struct sender_msg {
+	char			*data;
+	size_t			 len;
+	struct sender_msg	*next;
+} sender_msg_t;
+
 typedef struct sender_tag {
-	/* The first mutex locks the sender */
+	/* The mutex locks the outbox */
 	pthread_mutex_t		 mutex;
-	pthread_mutex_t		 mutex2;
-	pthread_cond_t		 cond;	/* data is ready to be send set */
-	pthread_cond_t		 cond2;	/* data has been sent */
-	char			*data;
+	pthread_cond_t		 cond;	/* data is ready to be sent */
+
+	/*
+	 * Messages that have not yet been sent.  The sender takes all of
+	 * them at once and writes them with as few system calls as possible.
+	 */
+	sender_msg_t		*outbox;
+	sender_msg_t		*outbox_tail;
+
+	/*
+	 * Output that has been queued, but not yet been written, including
+	 * what the sender is currently writing.  A client that falls behind
+	 * is marked slow and does not get status updates until it has caught
+	 * up, if it exceeds its budget it is disconnected.
+	 */
+	size_t			 queued_bytes;
+	size_t			 inflight_bytes;
+	int			 queued;
+	int			 inflight;
+	int			 slow;
+	int			 closed;	/* output is discarded */
+
+	/* Statistics, reported by list-clients */
+	unsigned long		 sent;
+	unsigned long		 sent_bytes;
+	unsigned long		 dropped;
+	unsigned long		 slow_count;
+	time_t			 connected;
+	const char		*protocol;
+	char			 peer[64];
+	int			 privileged;	/* Sees the peers of others */
+
+	/* Requests from this client that are sent to a transceiver */
+	token_bucket_t		 limit;
+
+	/* Freed when both the sender and the dispatcher have terminated */
+	int			 refs;
+	struct sender_tag	*next;
 
 	int			 socket;
 
+	/* Data is sent as length-prefixed CBOR instead of JSON */
+	int			 cbor;
+
 	/* For secure sockets */
 	SSL_CTX			*ctx;
 	SSL			*ssl;
@@ -0,0 +1,295 @@
+/*
+ * Copyright (c) 2024 Marc Balmer HB9SSB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Listen for local clients on a Unix domain socket.  Clients are served by
+ * the same socket-handler as TCP/IP clients, access is controlled by the
+ * file mode of the socket and the credentials of the peer (SO_PEERCRED).
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "trxd.h"
+
+#define UNIX_SOCKET_MODE	"0660"
+#define MAXGROUPS		64
+
+extern int log_connections;
+
+/* Users and groups allowed to connect, if empty everyone is allowed */
+static uid_t *allowed_uid;
+static gid_t *allowed_gid;
+static int nallowed_uid, nallowed_gid;
+
+/* The socket created by unix_listen(), it is removed when trxd exits */
+static char *socket_path;
+static ino_t socket_ino;
+
+static void
+unix_unlink(void)
+{
+	struct stat sb;
+
+	/* Leave a socket alone that another instance has created since */
+	if (!lstat(socket_path, &sb) && S_ISSOCK(sb.st_mode)
+	    && sb.st_ino == socket_ino)
+		unlink(socket_path);
+}
+
+/* Resolve a list of user or group names (or numeric ids) */
+static int
+allow_list(lua_State *L, const char *field, int group)
+{
+	struct passwd *pw;
+	struct group *gr;
+	const char *name;
+	char *end;
+	long id;
+	int n, len;
+
+	lua_getfield(L, -1, field);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		return 0;
+	}
+	if (!lua_istable(L, -1)) {
+		syslog(LOG_ERR, "unix-socket: %s must be a list", field);
+		return -1;
+	}
+
+	len = luaL_len(L, -1);
+	if (group)
+		allowed_gid = calloc(len + 1, sizeof(gid_t));
+	else
+		allowed_uid = calloc(len + 1, sizeof(uid_t));
+	if (group ? allowed_gid == NULL : allowed_uid == NULL) {
+		syslog(LOG_ERR, "unix-socket: memory allocation error");
+		return -1;
+	}
+
+	for (n = 1; n <= len; n++) {
+		lua_geti(L, -1, n);
+		name = lua_tostring(L, -1);
+		if (name == NULL) {
+			syslog(LOG_ERR, "unix-socket: invalid entry in %s",
+			    field);
+			return -1;
+		}
+		id = strtol(name, &end, 10);
+		if (*end != '\0') {
+			if (group && (gr = getgrnam(name)) != NULL)
+				id = gr->gr_gid;
+			else if (!group && (pw = getpwnam(name)) != NULL)
+				id = pw->pw_uid;
+			else {
+				syslog(LOG_ERR, "unix-socket: no such %s '%s'",
+				    group ? "group" : "user", name);
+				return -1;
+			}
+		}
+		if (group)
+			allowed_gid[nallowed_gid++] = id;
+		else
+			allowed_uid[nallowed_uid++] = id;
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+	return 0;
+}
+
+/*
+ * Create the Unix domain socket configured in the configuration table on
+ * top of the stack.  This is done before trxd(8) drops its privileges, the
+ * socket is then handed over to the user trxd(8) runs as.  Returns the
+ * listening socket, or -1 if no socket is configured.
+ */
+int
+unix_listen(lua_State *L, uid_t uid, gid_t gid)
+{
+	struct sockaddr_un sun;
+	struct stat sb;
+	const char *path, *mode;
+	int fd;
+
+	mode = UNIX_SOCKET_MODE;
+
+	lua_getfield(L, -1, "unix-socket");
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		return -1;
+	} else if (lua_isstring(L, -1))
+		path = lua_tostring(L, -1);
+	else if (lua_istable(L, -1)) {
+		lua_getfield(L, -1, "path");
+		path = lua_tostring(L, -1);
+		lua_pop(L, 1);
+
+		/* YAML reads 0660 as decimal 660, the digits are octal */
+		lua_getfield(L, -1, "mode");
+		if (lua_isstring(L, -1))
+			mode = lua_tostring(L, -1);
+		lua_pop(L, 1);
+
+		if (allow_list(L, "allow-users", 0)
+		    || allow_list(L, "allow-groups", 1))
+			exit(1);
+	} else
+		path = NULL;
+
+	if (path == NULL) {
+		syslog(LOG_ERR, "unix-socket: missing path");
+		exit(1);
+	}
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		syslog(LOG_ERR, "unix-socket: path %s too long", path);
+		exit(1);
+	}
+	strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+
+	/* Remove a stale socket left over by a previous instance */
+	if (!lstat(path, &sb) && S_ISSOCK(sb.st_mode))
+		unlink(path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		syslog(LOG_ERR, "unix-socket: socket: %s", strerror(errno));
+		exit(1);
+	}
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun))) {
+		syslog(LOG_ERR, "unix-socket: bind: %s: %s", path,
+		    strerror(errno));
+		exit(1);
+	}
+	if (lstat(path, &sb) || (socket_path = strdup(path)) == NULL) {
+		syslog(LOG_ERR, "unix-socket: %s: %s", path, strerror(errno));
+		exit(1);
+	}
+	socket_ino = sb.st_ino;
+	atexit(unix_unlink);
+
+	if (chmod(path, strtol(mode, NULL, 8))) {
+		syslog(LOG_ERR, "unix-socket: chmod: %s", strerror(errno));
+		exit(1);
+	}
+	if ((uid != getuid() || gid != getgid()) && chown(path, uid, gid)) {
+		syslog(LOG_ERR, "unix-socket: chown: %s", strerror(errno));
+		exit(1);
+	}
+	if (listen(fd, 5)) {
+		syslog(LOG_ERR, "unix-socket: listen: %s", strerror(errno));
+		exit(1);
+	}
+	lua_pop(L, 1);
+	return fd;
+}
+
+/* Check the credentials of a connecting client */
+static int
+peer_allowed(struct ucred *cred)
+{
+	struct passwd *pw;
+	gid_t groups[MAXGROUPS];
+	int n, k, ngroups;
+
+	if (nallowed_uid == 0 && nallowed_gid == 0)
+		return 1;
+
+	/* The user trxd(8) runs as and root are always allowed */
+	if (cred->uid == 0 || cred->uid == getuid())
+		return 1;
+
+	for (n = 0; n < nallowed_uid; n++)
+		if (allowed_uid[n] == cred->uid)
+			return 1;
+
+	if (nallowed_gid == 0)
+		return 0;
+
+	groups[0] = cred->gid;
+	ngroups = 1;
+	if ((pw = getpwuid(cred->uid)) != NULL) {
+		ngroups = MAXGROUPS;
+		if (getgrouplist(pw->pw_name, cred->gid, groups, &ngroups)
+		    == -1)
+			ngroups = MAXGROUPS;
+	}
+
+	for (n = 0; n < nallowed_gid; n++)
+		for (k = 0; k < ngroups; k++)
+			if (allowed_gid[n] == groups[k])
+				return 1;
+	return 0;
+}
+
+/* Accept a client, returns the connected socket or -1 */
+int
+unix_accept(int listen_fd)
+{
+	struct ucred cred;
+	socklen_t len;
+	int fd;
+
+	fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd == -1) {
+		syslog(LOG_ERR, "unix-socket: accept: %s", strerror(errno));
+		return -1;
+	}
+
+	len = sizeof(cred);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len)) {
+		syslog(LOG_ERR, "unix-socket: getsockopt: %s",
+		    strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	if (!peer_allowed(&cred)) {
+		syslog(LOG_NOTICE, "unix-socket: connection from pid %d, "
+		    "uid %d refused", cred.pid, cred.uid);
+		close(fd);
+		return -1;
+	}
+
+	if (log_connections)
+		syslog(LOG_INFO, "unix socket connection from pid %d, uid %d",
+		    cred.pid, cred.uid);
+	return fd;
+}
@@ -40,7 +40,11 @@
 #include "websocket.h"
 
 extern void *websocket_sender(void *);
+extern void sender_init(sender_tag_t *, const char *);
+extern void sender_close(sender_tag_t *);
+extern void client_leave(enum Listener);
 extern void *dispatcher(void *);
+extern void dispatcher_submit(dispatcher_tag_t *, char *);
 
 extern int verbose;
 
@@ -57,6 +61,7 @@ cleanup(void *arg)
 		SSL_free(w->ssl);
 	} else
 		close(w->socket);
+	client_leave(LISTENER_WEBSOCKET);
 
 	free(arg);
 }
@@ -66,6 +71,8 @@ cleanup_sender(void *arg)
 {
 	sender_tag_t *s = (sender_tag_t *)arg;
 
+	/* Nothing is sent to the client once the socket is being closed */
+	sender_close(s);
 	pthread_cancel(s->sender);
 }
 
@@ -105,7 +112,9 @@ websocket_handler(void *arg)
 	websocket_t *w = (websocket_t *)arg;
 	sender_tag_t *s;
 	dispatcher_tag_t *d;
-	char *buf;
+	enum wsFrameType type;
+	char *buf, *json;
+	size_t len;
 
 	if (pthread_detach(pthread_self())) {
 		syslog(LOG_ERR, "websocket-handler: pthread_detach");
@@ -125,32 +134,13 @@ websocket_handler(void *arg)
 		syslog(LOG_ERR, "websocket-handler: malloc");
 		exit(1);
 	}
-	s->data = (char *)1;
 	s->socket = w->socket;
+	s->cbor = 0;
 	s->ssl = w->ssl;
 	s->ctx = w->ctx;
 
 	w->sender = s;
-
-	if (pthread_mutex_init(&s->mutex, NULL)) {
-		syslog(LOG_ERR, "websocket-handler: pthread_mutex_init");
-		exit(1);
-	}
-
-	if (pthread_mutex_init(&s->mutex2, NULL)) {
-		syslog(LOG_ERR, "websocket-handler: pthread_mutex_init");
-		exit(1);
-	}
-
-	if (pthread_cond_init(&s->cond, NULL)) {
-		syslog(LOG_ERR, "websocket-handler: pthread_cond_init");
-		exit(1);
-	}
-
-	if (pthread_cond_init(&s->cond2, NULL)) {
-		syslog(LOG_ERR, "websocket-handler: pthread_cond_init");
-		exit(1);
-	}
+	sender_init(s, "websocket");
 
 	if (pthread_create(&s->sender, NULL, websocket_sender, s)) {
 		syslog(LOG_ERR, "websocket-handler: pthread_create");
@@ -166,6 +156,8 @@ websocket_handler(void *arg)
 		exit(1);
 	}
 	d->data = (char *)1;
+	d->inbox = d->inbox_tail = NULL;
+	d->inbox_len = 0;
 	d->sender = s;
 
 	if (pthread_mutex_init(&d->mutex, NULL)) {
@@ -209,47 +201,54 @@ websocket_handler(void *arg)
 			exit(1);
 		}
 
-	if (pthread_mutex_lock(&s->mutex2)) {
-		syslog(LOG_ERR, "websocket-handler: pthread_mutex_lock");
+	if (pthread_mutex_unlock(&d->mutex2)) {
+		syslog(LOG_ERR, "websocket-handler: pthread_mutex_unlock");
 		exit(1);
 	}
 
-	if (verbose)
-		printf("websocket-handler: wait for sender\n");
-
-	while (s->data != NULL)
-		if (pthread_cond_wait(&s->cond2, &s->mutex2)) {
-			syslog(LOG_ERR, "websocket-handler: pthread_cond_wait");
-			exit(1);
-		}
-
-	if (verbose)
-		printf("websocket-handler: sender is ready\n");
-
 	for (;;) {
 		/* buf will later be freed by the dispatcher */
-		if (wsRead(&buf, NULL, websocket_read, websocket_write, w)) {
+		type = wsRead(&buf, &len, websocket_read, websocket_write, w);
+		if (type == WS_ERROR_FRAME) {
 			if (verbose)
 				printf("websocket-handler: short read: %s\n",
 					strerror(errno));
 			pthread_exit(NULL);
-		} else if (verbose)
-			printf("websocket-handler: <- %s\n", buf);
-
-		d->data = buf;
-
-		if (pthread_cond_signal(&d->cond)) {
-			syslog(LOG_ERR,
-			    "websocket-handler: pthread_cond_signal");
-			exit(1);
 		}
 
-		while (d->data != NULL)
-			if (pthread_cond_wait(&d->cond2, &d->mutex2)) {
-				syslog(LOG_ERR,
-				    "websocket-handler: pthread_cond_wait");
-				exit(1);
+		/*
+		 * Binary messages contain CBOR, once the client sent one it
+		 * receives binary CBOR messages as well.
+		 */
+		if (type == WS_BINARY_FRAME) {
+			json = trxd_cbor_to_json((unsigned char *)buf, len);
+			free(buf);
+			if (json == NULL) {
+				syslog(LOG_NOTICE, "websocket-handler: invalid "
+				    "CBOR data, closing connection");
+				pthread_exit(NULL);
+			}
+			buf = json;
+
+			if (!s->cbor) {
+				if (pthread_mutex_lock(&s->mutex)) {
+					syslog(LOG_ERR, "websocket-handler: "
+					    "pthread_mutex_lock");
+					exit(1);
+				}
+				s->cbor = 1;
+				if (pthread_mutex_unlock(&s->mutex)) {
+					syslog(LOG_ERR, "websocket-handler: "
+					    "pthread_mutex_unlock");
+					exit(1);
+				}
 			}
+		}
+
+		if (verbose)
+			printf("websocket-handler: <- %s\n", buf);
+
+		dispatcher_submit(d, buf);
 	}
 	pthread_cleanup_pop(0);
 	pthread_cleanup_pop(0);
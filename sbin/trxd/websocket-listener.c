@@ -25,6 +25,7 @@
 #include <sys/stat.h>
 
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 #include <openssl/ssl.h>
@@ -59,6 +60,8 @@
 extern void *websocket_handler(void *);
 extern void *avahi_handler(void *);
 extern int log_connections;
+extern int client_admit(enum Listener);
+extern void client_leave(enum Listener);
 
 #define BUFSIZE		65535
 
@@ -237,7 +240,7 @@ websocket_listener(void *arg)
 		for (i = 0; i < MAXLISTEN; ++i) {
 			struct sockaddr_storage	 sa;
 			socklen_t		 len;
-			int			*client_fd;
+			int			*client_fd, nodelay = 1;
 			char			 hbuf[NI_MAXHOST];
 			websocket_t		*w;
 
@@ -255,6 +258,18 @@ websocket_listener(void *arg)
 				free(client_fd);
 				break;
 			}
+			if (!client_admit(LISTENER_WEBSOCKET)) {
+				close(*client_fd);
+				free(client_fd);
+				continue;
+			}
+
+			/* Replies and status updates are sent at once */
+			if (setsockopt(*client_fd, IPPROTO_TCP, TCP_NODELAY,
+			    &nodelay, sizeof(nodelay)))
+				syslog(LOG_ERR, "setsockopt: %s",
+				    strerror(errno));
+
 			error = getnameinfo((struct sockaddr *)&sa, len,
 			    hbuf, sizeof(hbuf), NULL, 0, NI_NUMERICHOST);
 			if (error)
@@ -284,6 +299,7 @@ websocket_listener(void *arg)
 					close(w->socket);
 					free(w->ssl);
 					free(w);
+					client_leave(LISTENER_WEBSOCKET);
 					continue;
 				}
 			}
@@ -295,6 +311,7 @@ websocket_listener(void *arg)
 				close(w->socket);
 				free(w->ssl);
 				free(w);
+				client_leave(LISTENER_WEBSOCKET);
 			}
 		}
 	}
@@ -23,6 +23,7 @@
 /* Send data to networked clients over WebSockets */
 
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #include <openssl/ssl.h>
 
@@ -38,6 +39,11 @@
 #include "trx-control.h"
 #include "websocket.h"
 
+extern sender_msg_t *sender_wait(sender_tag_t *);
+extern void sender_done(sender_tag_t *, int);
+extern void sender_free(sender_msg_t *);
+extern void sender_release(sender_tag_t *);
+
 extern int verbose;
 
 #define MAX_WS_HEADER	10
@@ -45,17 +51,54 @@ extern int verbose;
 static void
 cleanup(void *arg)
 {
-	free(arg);
+	sender_release((sender_tag_t *)arg);
+}
+
+static void
+cleanup_batch(void *arg)
+{
+	sender_free(*(sender_msg_t **)arg);
+}
+
+static void
+cleanup_buf(void *arg)
+{
+	free(*(unsigned char **)arg);
+}
+
+/*
+ * Write all of buf.  SSL_write() can return after a part has been written
+ * if partial writes are enabled.  The send timeout of the socket makes it
+ * fail with SSL_ERROR_WANT_WRITE, which is a failure here.
+ */
+static int
+ssl_writeall(SSL *ssl, const unsigned char *buf, size_t len)
+{
+	size_t nwritten;
+	int n;
+
+	for (nwritten = 0; nwritten < len; nwritten += n) {
+		n = SSL_write(ssl, buf + nwritten, len - nwritten);
+		if (n <= 0)
+			return -1;
+	}
+	return 0;
 }
 
 void *
 websocket_sender(void *arg)
 {
 	sender_tag_t *s = (sender_tag_t *)arg;
-	unsigned char *buf;
-	size_t datasize, framesize;
+	sender_msg_t *batch = NULL, *m;
+	unsigned char *buf = NULL, *data;
+	size_t bufsize, len, datasize, framesize;
+	enum wsFrameType type;
+	struct iovec iov;
+	int failed;
 
 	pthread_cleanup_push(cleanup, arg);
+	pthread_cleanup_push(cleanup_batch, &batch);
+	pthread_cleanup_push(cleanup_buf, &buf);
 
 	if (pthread_detach(pthread_self())) {
 		syslog(LOG_ERR, "websocket-sender: pthread_detach");
@@ -67,51 +110,65 @@ websocket_sender(void *arg)
 		exit(1);
 	}
 
-	if (pthread_mutex_lock(&s->mutex)) {
-		syslog(LOG_ERR, "websocket-sender: pthread_mutex_lock");
-		exit(1);
-	}
-
-	s->data = NULL;
-	if (pthread_cond_signal(&s->cond2)) {
-		syslog(LOG_ERR, "websocket-sender: pthread_cond_signal");
-		exit(1);
-	}
-
+	/*
+	 * All frames queued since the last wake-up are assembled in one
+	 * buffer and sent with a single send(2) or SSL_write(), so that a
+	 * burst of status updates ends up in as few TLS records as possible.
+	 */
+	bufsize = 0;
 	for (;;) {
-		while (s->data == NULL) {
-			if (pthread_cond_wait(&s->cond, &s->mutex)) {
-				syslog(LOG_ERR, "websocket-sender: "
-				    "pthread_cond_wait");
-				exit(1);
+		batch = sender_wait(s);
+
+		for (len = 0, m = batch; m != NULL; m = m->next) {
+			if (verbose)
+				printf("websocket-sender: -> %s\n", m->data);
+			if (s->cbor) {
+				data = trxd_json_to_cbor(m->data, &datasize);
+				if (data == NULL) {
+					syslog(LOG_ERR, "websocket-sender: "
+					    "can't encode %s as CBOR", m->data);
+					continue;
+				}
+				type = WS_BINARY_FRAME;
+			} else {
+				data = (unsigned char *)m->data;
+				datasize = m->len;
+				type = WS_TEXT_FRAME;
+			}
+
+			if (len + datasize + MAX_WS_HEADER > bufsize) {
+				bufsize = len + datasize + MAX_WS_HEADER;
+				buf = realloc(buf, bufsize);
+				if (buf == NULL) {
+					syslog(LOG_ERR,
+					    "websocket-sender: realloc");
+					exit(1);
+				}
 			}
-		}
 
-		if (verbose)
-			printf("websocket-sender: -> %s\n", s->data);
-		datasize = strlen(s->data);
-		buf = malloc(datasize + MAX_WS_HEADER);
-		framesize = datasize;
-		if (buf == NULL) {
-			syslog(LOG_ERR, "websocket-sender: malloc\n");
-			exit(1);
+			wsMakeFrame((const uint8_t *)data, datasize, buf + len,
+			    &framesize, type);
+			len += framesize;
+			if (s->cbor)
+				free(data);
 		}
 
-		wsMakeFrame((const uint8_t *)s->data, datasize,
-		    (unsigned char *)buf, &framesize, WS_TEXT_FRAME);
-
-		if (s->ssl)
-			SSL_write(s->ssl, buf, framesize);
-		else
-			send(s->socket, buf, framesize, 0);
-		free(buf);
-		s->data = NULL;
-		if (pthread_cond_signal(&s->cond2)) {
-			syslog(LOG_ERR, "websocket-sender: "
-			    "pthread_cond_signal");
-			exit(1);
+		/* A failed write ends the connection through sender_done() */
+		failed = 0;
+		if (len > 0 && s->ssl)
+			failed = ssl_writeall(s->ssl, buf, len) == -1;
+		else if (len > 0) {
+			iov.iov_base = buf;
+			iov.iov_len = len;
+			failed = trxd_writev(s->socket, &iov, 1) == -1;
 		}
+
+		sender_free(batch);
+		batch = NULL;
+		sender_done(s, failed);
 	}
 	pthread_cleanup_pop(0);
+	pthread_cleanup_pop(0);
+	pthread_cleanup_pop(0);
 	return NULL;
 }
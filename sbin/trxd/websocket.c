@@ -328,6 +328,10 @@ wsParseInputFrame(uint8_t *inputFrame, size_t inputLength, uint8_t **dataPtr,
 	return WS_ERROR_FRAME;
 }
 
+/*
+ * Read the next text or binary message and return its frame type, or
+ * WS_ERROR_FRAME if the connection was closed.
+ */
 enum wsFrameType
 wsRead(char **dest, size_t *destlen,
     int(*readfunc)(void *, unsigned char *, size_t),
@@ -344,7 +348,7 @@ wsRead(char **dest, size_t *destlen,
 	bufsize = INITIAL_BUFSIZE;
 	buf = malloc(bufsize);
 	if (buf == NULL)
-		return -1;
+		return WS_ERROR_FRAME;
 
 	nread = len = 0;
 	type = WS_INCOMPLETE_FRAME;
@@ -358,7 +362,7 @@ wsRead(char **dest, size_t *destlen,
 			nread = readfunc(client_data, buf, 6);
 			if (nread <= 0) {	/* remote closed */
 				free(buf);
-				return -1;
+				return WS_ERROR_FRAME;
 			}
 			len += nread;
 		} while (len < 2);	/* 2 is the minimum */
@@ -366,7 +370,7 @@ wsRead(char **dest, size_t *destlen,
 		if (((buf[0] & 0x70) != 0x0) || ((buf[0] & 0x80) != 0x80) ||
 		    ((buf[1] & 0x80) != 0x80)) {
 			free(buf);
-			return -1;
+			return WS_ERROR_FRAME;
 		}
 
 		payloadLength = wsGetPayloadLength(buf, len,
@@ -377,10 +381,10 @@ wsRead(char **dest, size_t *destlen,
 			if (6 + payloadFieldExtraBytes + payloadLength >
 			    bufsize) {
 				bufsize = 6 + payloadFieldExtraBytes +
-				    payloadLength;
+				    payloadLength + 1;
 				buf = realloc(buf, bufsize);
 				if (buf == NULL)
-					return -1;
+					return WS_ERROR_FRAME;
 			}
 
 			do {
@@ -388,7 +392,7 @@ wsRead(char **dest, size_t *destlen,
 				    payloadLength + payloadFieldExtraBytes);
 				if (nread <= 0) {
 					free(buf);
-					return -1;
+					return WS_ERROR_FRAME;
 				}
 				len += nread;
 			} while (len < 6 + payloadFieldExtraBytes +
@@ -404,7 +408,7 @@ wsRead(char **dest, size_t *destlen,
 			    WS_CLOSING_FRAME);
 			writefunc(client_data, buf, datasize);
 			free(buf);
-			return -1;
+			return WS_ERROR_FRAME;
 		case WS_PING_FRAME:
 			if (data)
 				data[datasize] = '\0';
@@ -423,17 +427,31 @@ wsRead(char **dest, size_t *destlen,
 					*destlen = datasize;
 				if (*dest == NULL) {
 					free(buf);
-					return -1;
+					return WS_ERROR_FRAME;
 				}
 			}
 			break;
+		case WS_BINARY_FRAME:
+			if (data == NULL) {
+				free(buf);
+				return WS_ERROR_FRAME;
+			}
+			*dest = malloc(datasize);
+			if (*dest == NULL) {
+				free(buf);
+				return WS_ERROR_FRAME;
+			}
+			memcpy(*dest, data, datasize);
+			if (destlen != NULL)
+				*destlen = datasize;
+			break;
 		case WS_INCOMPLETE_FRAME:
 			break;
 		default:
 			free(buf);
-			return -1;
+			return WS_ERROR_FRAME;
 		}
 	} while (type == WS_INCOMPLETE_FRAME);
 	free(buf);
-	return 0;
+	return type;
 }